@@ -19,6 +19,9 @@ int witoabuf(char* buffer, T value, int base, int padDigits = 0);
 int ascii_to_wide(char16_t* bufferOut, const char* bufferIn, int bufferOutBytes);
 int wide_to_ascii(char* bufferOut, const char16_t* bufferIn, int bufferOutBytes);
 
+// Checks the string routines against the plain char at a time versions, then prints MB/s of both to serial
+void BenchmarkStringRoutines();
+
 #define isalpha _isalpha
 #define isupper _isupper
 #define islower _islower
@@ -32,6 +32,7 @@ typedef uint64_t (*VolumeWriteType)(VolumeFileHandle handle, void* context, uint
 typedef uint64_t (*VolumeGetSizeType)(VolumeFileHandle handle, void* context);
 typedef uint64_t (*VolumeSeekType)(VolumeFileHandle handle, void* context, int64_t offset, SeekMode origin);
 typedef uint64_t(*VolumeCommandType)(VolumeFileHandle handle, void* context, uint64_t command, uint64_t data);
+typedef uint64_t (*VolumeGetIdentityType)(VolumeFileHandle handle, void* context);
 
 struct MountPointHash
 {
@@ -51,6 +52,10 @@ struct Volume
 	VolumeGetSizeType GetSize;
 	VolumeSeekType Seek;
 	VolumeCommandType Command;
+
+	// Optional. Non-zero and the same for every handle to the same file on the volume,
+	// files without one can't be shared through the page cache.
+	VolumeGetIdentityType GetIdentity;
 };
 
 // A volume index is a mapping from a mount
@@ -123,6 +128,7 @@ uint64_t VolumeWrite(VolumeFileHandle handle, uint64_t offset, const void* buffe
 uint64_t VolumeGetSize(VolumeFileHandle handle);
 uint64_t VolumeSeek(VolumeFileHandle handle, int64_t offset, SeekMode origin);
 uint64_t VolumeCommand(VolumeFileHandle handle, uint64_t command, uint64_t data);
+uint64_t VolumeGetIdentity(VolumeFileHandle handle);
 
 //Pass in a path like /dev1/thing/abc and get
 //back the supporting volume, and any path remaining
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common/types.h"
+#include "kernel/init/alternatives.h"
 #include "kernel/framebuffer/framebuffer.h"
 #include "font/details/bmfont.h"
 
@@ -51,10 +52,11 @@ void LogPrintNumeric(const char16_t* Start, uint64_t Value, const char16_t* Suff
 
 void ConsoleSetPos(int32_t x, int32_t y, Console* Console = nullptr);
 
+// Always compiled in, whether it prints is decided at boot by STATIC_KEY_VERBOSE_LOGGING
+#define VerboseLog(x) do { if (STATIC_BRANCH(STATIC_KEY_VERBOSE_LOGGING)) { ConsolePrint(x); } } while (0)
+
 #if VERBOSE_LOGGING
-#define VerboseLog(x) ConsolePrint(x)
 #define Verbose(x) x
 #else
-#define VerboseLog(x)
 #define Verbose(x)
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include "common/types.h"
+
+// Static keys are decided once at boot, from CPUID and the build config, and the code
+// testing them is rewritten to match. STATIC_BRANCH sites are a 5 byte NOP while their
+// key is off and a jump into the guarded code once it's on. ALTERNATIVE sites run their
+// original instructions until their key is on, then the replacement is copied over them.
+// Until InitStaticKeys has run every key reads as off, so the off path has to be safe.
+//
+// Keys only ever go from off to on, and only while this is the sole running core.
+
+// Config
+#define STATIC_KEY_VERBOSE_LOGGING 0
+#define STATIC_KEY_DEBUG_CHECKS 1 //Consistency checks too slow for hot paths, see _HOT_ASSERTF
+#define STATIC_KEY_PML4_SET 2 //The kernel's own page tables are live, so there are TLB entries to flush
+
+// CPU features
+#define STATIC_KEY_ERMS 3
+#define STATIC_KEY_FSRM 4
+#define STATIC_KEY_CLFLUSHOPT 5
+#define STATIC_KEY_RDTSCP 6
+
+#define STATIC_KEY_COUNT 7
+
+// One per patch site, in the .alternatives section
+struct AlternativeEntry
+{
+	uint64_t Site;
+	uint64_t Replacement; //Jump target for a branch, new instructions for an alternative
+	uint16_t Key;
+	uint8_t SiteLength;
+	uint8_t ReplacementLength; //0 for a branch
+	uint32_t Reserved;
+};
+
+static_assert(sizeof(AlternativeEntry) == 24, "Entries are laid out by hand in the asm below");
+
+#define STATIC_KEY_STRING(x) #x
+#define STATIC_KEY_EXPAND(x) STATIC_KEY_STRING(x)
+
+// True once key is on. Usable at -O0, where an inline function's key wouldn't be a constant
+#define STATIC_BRANCH(key) \
+	({ \
+		__label__ enabled, done; \
+		bool staticKeyResult = false; \
+		asm goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t" \
+			".pushsection .alternatives, \"a\"\n\t" \
+			".balign 8\n\t" \
+			".quad 1b, %l[enabled]\n\t" \
+			".short %c0\n\t" \
+			".byte 5, 0\n\t" \
+			".long 0\n\t" \
+			".popsection" \
+			: : "i"(key) : : enabled); \
+		goto done; \
+	enabled: \
+		staticKeyResult = true; \
+	done: \
+		staticKeyResult; \
+	})
+
+// For use inside an asm statement. The replacement is copied elsewhere before it runs,
+// so it mustn't contain anything relative to its own address. A shorter one is padded with NOPs
+#define ALTERNATIVE(oldInstructions, newInstructions, key) \
+	"661:\n\t" \
+	oldInstructions "\n" \
+	"662:\n\t" \
+	".skip -(((665f-664f)-(662b-661b)) > 0) * ((665f-664f)-(662b-661b)), 0x90\n" \
+	"663:\n\t" \
+	".pushsection .alternatives, \"a\"\n\t" \
+	".balign 8\n\t" \
+	".quad 661b, 664f\n\t" \
+	".short " STATIC_KEY_EXPAND(key) "\n\t" \
+	".byte 663b-661b, 665f-664f\n\t" \
+	".long 0\n\t" \
+	".popsection\n\t" \
+	".pushsection .altinstr_replacement, \"ax\"\n" \
+	"664:\n\t" \
+	newInstructions "\n" \
+	"665:\n\t" \
+	".popsection\n\t"
+
+// _ASSERTF and _ASSERTFV that are a NOP unless debug checks were turned on at boot
+#define _HOT_ASSERTF(x, message) if (STATIC_BRANCH(STATIC_KEY_DEBUG_CHECKS)) { _ASSERTF(x, message); }
+#define _HOT_ASSERTFV(x, message, v1, v2, v3) if (STATIC_BRANCH(STATIC_KEY_DEBUG_CHECKS)) { _ASSERTFV(x, message, v1, v2, v3); }
+
+// Called first thing at boot, sets the config and CPU feature keys and patches their sites
+void InitStaticKeys();
+
+// For keys that turn on later in boot, before the APs are started
+void EnableStaticKey(uint32_t key);
+
+bool IsStaticKeyEnabled(uint32_t key);
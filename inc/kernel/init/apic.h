@@ -18,6 +18,8 @@
 #include "IndustryStandard/Acpi61.h"
 #include "Protocol/AcpiSystemDescriptionTable.h"
 
+const unsigned int MaxProcessors = 256;
+
 enum class LocalApicOffsets : uint32_t
 {
     LocalApicIdRegister = 0x020,
@@ -50,3 +52,13 @@ enum class LocalApicOffsets : uint32_t
 
 
 void InitApic(EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER* Rsdt, EFI_ACPI_DESCRIPTION_HEADER* Xsdt);
+
+// Dense index of the executing core (0..ProcessorCount-1). Always 0 until the MADT has been parsed.
+unsigned int GetCurrentCpuIndex();
+
+// InitApic only enables the BSP's local APIC, an AP that wants IPIs calls this for its own
+void EnableLocalApic();
+
+// Fixed interrupt to the core with the given index, its handler must call EndOfInterrupt
+void SendIpi(unsigned int cpu, uint8_t vector);
+void EndOfInterrupt();
@@ -66,6 +66,8 @@ struct KernelMemoryLayout
 	uint32_t Entries;
 	uint32_t DescriptorSize;
 	uint32_t DescriptorVersion;
+
+	uint32_t* SortedEntries; //Room for an index per entry, after the map in the same allocation
 };
 
 struct KernelBootData
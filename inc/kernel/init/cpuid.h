@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#define CPUID_LEAF_FEATURES 0x1
+#define CPUID_LEAF_STRUCTURED_FEATURES 0x7
+#define CPUID_LEAF_XSAVE 0xD
+#define CPUID_LEAF_EXTENDED_MAX 0x80000000
+#define CPUID_LEAF_EXTENDED_FEATURES 0x80000001
+
+#define CPUID_FEATURES_ECX_MONITOR (1U << 3) //monitor/mwait
+#define CPUID_FEATURES_ECX_XSAVE (1U << 26)
+#define CPUID_FEATURES_EDX_PAT (1U << 16)
+
+#define CPUID_STRUCTURED_EBX_ERMS (1U << 9) //Enhanced rep movsb/stosb
+#define CPUID_STRUCTURED_EBX_CLFLUSHOPT (1U << 23)
+#define CPUID_STRUCTURED_EDX_FSRM (1U << 4) //Fast short rep movsb
+
+#define CPUID_XSAVE_EAX_XSAVEOPT (1U << 0) //Sub-leaf 1
+
+#define CPUID_EXTENDED_EDX_PAGE_1GB (1U << 26)
+#define CPUID_EXTENDED_EDX_RDTSCP (1U << 27)
+
+struct CpuIdResult
+{
+	uint32_t Eax;
+	uint32_t Ebx;
+	uint32_t Ecx;
+	uint32_t Edx;
+};
+
+inline CpuIdResult CpuId(uint32_t leaf, uint32_t subLeaf = 0)
+{
+	CpuIdResult result;
+	asm volatile("cpuid" : "=a"(result.Eax), "=b"(result.Ebx), "=c"(result.Ecx), "=d"(result.Edx) : "a"(leaf), "c"(subLeaf));
+	return result;
+}
+
+// Reading a leaf above the maximum returns junk, so check it first
+inline bool CpuIdHasLeaf(uint32_t leaf)
+{
+	uint32_t maxLeaf = CpuId(leaf & CPUID_LEAF_EXTENDED_MAX).Eax;
+	return leaf <= maxLeaf;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// The kernel is built general registers only, so whatever is in the x87/SSE/AVX registers
+// while it runs belongs to the current process. Processes each keep an XSAVE area
+// (FXSAVE without XSAVE) that holds their registers while another process runs, and
+// kernel code that wants vector registers borrows them with KernelFpuBegin/End.
+
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+#define XCR0_OPMASK (1ULL << 5)
+#define XCR0_ZMM_HI256 (1ULL << 6)
+#define XCR0_HI16_ZMM (1ULL << 7)
+#define XCR0_AVX512 (XCR0_OPMASK | XCR0_ZMM_HI256 | XCR0_HI16_ZMM) //Only valid all together
+
+// Per core, from InitCpuExtensions. Enables XSAVE and programs XCR0 with every state
+// component user programs can use that the CPU has, up to AVX-512
+void InitFpu();
+
+// Gives every core its KernelFpuBegin save area, needs ProcessorCount
+void InitKernelFpu();
+
+// Bytes needed to save the state components enabled in XCR0
+uint64_t GetExtendedStateSize();
+
+// Zeroed and suitably aligned for XSAVE
+void* AllocateExtendedState();
+void FreeExtendedState(void* area);
+
+void SaveExtendedState(void* area);
+void RestoreExtendedState(const void* area);
+
+// Puts every register back to its power on state, so nothing leaks into a new process
+void ResetExtendedState();
+
+// Saves the current process's registers so kernel code can use them. Returns false if
+// they can't be used right now, before InitKernelFpu or when this core is already in a
+// region (an interrupt or fault taken inside one), and the caller must use a path that
+// leaves them alone. Only call KernelFpuEnd after a true, and never switch process between the two.
+bool KernelFpuBegin();
+void KernelFpuEnd();
@@ -6,3 +6,6 @@ void InitInterrupts(KernelBootData* bootData);
 void InitVirtualMemory(KernelBootData* bootData);
 void InitRPMalloc();
 void InitCpuExtensions();
+
+// True once the PAT has an entry for write-combining, see PageFlags_WriteCombining
+bool HasWriteCombining();
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "kernel/memory/state.h"
+
+// Power of two buddy allocator with the same interface as MemoryState.
+// Selected for PhysicalMemoryState with ENABLE_BUDDY_ALLOCATOR=1.
+//
+// Free memory isn't mapped so the free lists can't live in the free pages
+// themselves, instead every page frame gets a slot in FreeNext/FreePrev.
+// Memory above BUDDY_MAX_PHYSICAL_BITS is treated as reserved.
+
+#ifndef BUDDY_MAX_PHYSICAL_BITS
+#define BUDDY_MAX_PHYSICAL_BITS 33 //8GiB
+#endif
+
+#define BUDDY_MAX_ORDER 18 //1GiB blocks
+
+constexpr uint64_t BuddyMaxPages = 1ULL << (BUDDY_MAX_PHYSICAL_BITS - PAGE_BITS);
+
+static_assert(BuddyMaxPages <= 0xFFFFFFFFULL, "Buddy links are 32 bit");
+
+constexpr uint64_t BuddyBitmapWords(int order)
+{
+	return ((BuddyMaxPages >> order) + 63) / 64;
+}
+
+constexpr uint64_t BuddyBitmapOffset(int order)
+{
+	return order == 0 ? 0 : BuddyBitmapOffset(order - 1) + BuddyBitmapWords(order - 1);
+}
+
+class BuddyMemoryState
+{
+public:
+
+	typedef MemoryState::RangeState RangeState;
+
+	void Init(int SystemIndex, const uint64_t HighestAddress);
+	void InitDynamic() {}
+
+	void TagRange(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State);
+	uintptr_t FindMinimumSizeFreeBlock(uint64_t MinSize);
+	uintptr_t FindAlignedFreeBlock(uint64_t MinSize, uint64_t Alignment);
+	RangeState GetPageState(const uint64_t Address);
+
+	uint64_t GetFreeBytes() const
+	{
+		return FreePages * PAGE_SIZE;
+	}
+
+	// Size of the largest buddy block, neighbouring blocks may form a larger run
+	uint64_t GetLargestFreeBlock() const;
+
+	uint64_t GetFreeBlockCount(int order) const
+	{
+		return FreeCounts[order];
+	}
+
+	// Bucket n counts free blocks of 2^n pages, anything larger goes in the last bucket
+	void GetFreeRunHistogram(uint64_t* Buckets, int BucketCount) const
+	{
+		memset(Buckets, 0, BucketCount * sizeof(uint64_t));
+
+		for(int order = 0; order <= BUDDY_MAX_ORDER; order++)
+		{
+			Buckets[order < BucketCount ? order : BucketCount - 1] += FreeCounts[order];
+		}
+	}
+
+private:
+
+	const static uint32_t InvalidFrame = 0xFFFFFFFF;
+
+	RangeState GetState(uint64_t frame) const
+	{
+		return (RangeState)((PageStates[frame >> 2] >> ((frame & 3) * 2)) & 3);
+	}
+
+	void SetState(uint64_t frame, RangeState state)
+	{
+		uint8_t shift = (frame & 3) * 2;
+		PageStates[frame >> 2] = (PageStates[frame >> 2] & ~(3 << shift)) | ((uint8_t)state << shift);
+	}
+
+	bool IsFreeHead(uint64_t frame, int order) const
+	{
+		uint64_t index = frame >> order;
+		return (FreeBitmap[BuddyBitmapOffset(order) + (index / 64)] & (1ULL << (index % 64))) != 0;
+	}
+
+	void InsertFree(uint64_t frame, int order);
+	void RemoveFree(uint64_t frame, int order);
+	void ReleaseBlock(uint64_t frame, int order);
+	void ReleaseRange(uint64_t startFrame, uint64_t endFrame);
+	void CarveRange(uint64_t startFrame, uint64_t endFrame);
+	int FindFreeBlockContaining(uint64_t frame, uint64_t& head) const;
+	uintptr_t FindFreeRun(uint64_t pages, uint64_t alignPages);
+
+	uint8_t PageStates[BuddyMaxPages / 4];
+	uint64_t FreeBitmap[BuddyBitmapOffset(BUDDY_MAX_ORDER + 1)];
+
+	uint32_t FreeNext[BuddyMaxPages];
+	uint32_t FreePrev[BuddyMaxPages];
+	uint32_t FreeHeads[BUDDY_MAX_ORDER + 1];
+	uint64_t FreeCounts[BUDDY_MAX_ORDER + 1];
+
+	uint64_t HighestFrame;
+	uint64_t FreePages;
+
+	int SystemIndex; //This is for identifying what system were in when debugging
+};
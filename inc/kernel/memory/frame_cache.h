@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Per-core magazines of free 4KiB physical frames sitting in front of PhysicalMemoryState.
+// Frames held by a magazine are tagged Used in the tree, so the tree is only touched
+// when a magazine runs dry (refill) or overflows (drain), and then in batches.
+
+#define FRAME_CACHE_SIZE 64
+#define FRAME_CACHE_BATCH 32
+
+static_assert(FRAME_CACHE_BATCH * 2 <= FRAME_CACHE_SIZE, "Frame cache must hold at least two batches");
+
+struct FrameCacheStats
+{
+	uint64_t AllocHits;
+	uint64_t AllocMisses;
+	uint64_t FreeHits;
+	uint64_t FreeMisses;
+	uint64_t Refills;
+	uint64_t Drains;
+	uint64_t CachedFrames;
+};
+
+// Returns 0 if no physical memory is available
+uint64_t AllocatePhysicalFrame();
+void FreePhysicalFrame(uint64_t physicalAddress);
+
+// Return every frame held by the calling core's magazine to the tree
+void DrainPhysicalFrameCache();
+
+// Sum of the stats across all cores
+void GetPhysicalFrameCacheStats(FrameCacheStats& stats);
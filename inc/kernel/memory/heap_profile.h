@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+// Records kernel heap use per call site (build with HEAP_PROFILER=1). The linker wraps
+// rpmalloc's entry points, so every allocation is tagged with the call stack that made
+// it and every free is charged back to that stack along with how long the memory lived.
+// Stacks are walked through RBP, so call sites are only as good as the frame pointers.
+//
+// Records come from slab caches rather than rpmalloc so the profiler never sees itself.
+
+#define HEAP_PROFILE_FRAMES 8
+#define HEAP_PROFILE_SITE_BUCKETS 1024
+#define HEAP_PROFILE_ALLOCATION_BUCKETS 16384
+
+struct HeapProfileSiteStats
+{
+	uint64_t Frames[HEAP_PROFILE_FRAMES]; //Return addresses, innermost first
+	uint32_t FrameCount;
+	uint64_t Allocations;
+	uint64_t Frees;
+	uint64_t LiveBytes;
+	uint64_t TotalBytes;
+	uint64_t LifetimeTicks; //TSC ticks summed over the allocations that have been freed
+};
+
+struct HeapProfileSummary
+{
+	bool Enabled;
+	uint64_t Sites;
+	uint64_t Allocations;
+	uint64_t Frees;
+	uint64_t LiveAllocations;
+	uint64_t LiveBytes;
+	uint64_t UntrackedFrees; //Memory allocated before the profile started
+	uint64_t Dropped; //Allocations that couldn't get a record
+};
+
+enum class HeapProfileOrder
+{
+	LiveBytes, //Growth
+	Allocations, //Churn
+};
+
+void GetHeapProfileSummary(HeapProfileSummary& summary);
+
+// Fills up to maxSites entries with the top sites in the given order, returns how many were filled
+uint32_t GetHeapProfileSites(HeapProfileSiteStats* sites, uint32_t maxSites, HeapProfileOrder order);
+
+// Forgets every site, only allocations made from here on are tracked
+void ResetHeapProfile();
+
+// Prints the summary and the top sites by both orders to serial
+void DumpHeapProfile();
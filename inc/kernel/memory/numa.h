@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+// NUMA topology from the ACPI SRAT (which memory and cores live in which proximity
+// domain) and SLIT (how far apart the domains are). Proximity domains are renumbered
+// into dense node indices in the order the SRAT lists them. Without an SRAT everything
+// is node 0. Memory the SRAT doesn't mention also belongs to node 0.
+
+#ifndef NUMA_MAX_NODES
+#define NUMA_MAX_NODES 4 //Each node costs a full MemoryState worth of static nodes
+#endif
+
+#define NUMA_MAX_MEMORY_RANGES 64
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+#define NUMA_UNREACHABLE_DISTANCE 0xFF
+
+struct KernelBootData;
+
+struct NumaMemoryRange
+{
+	uint64_t Base;
+	uint64_t End;
+	uint32_t Node;
+};
+
+// Called from BuildPML4 before the physical memory state is set up, while the
+// firmware's identity mapping still covers the ACPI tables
+void InitNumaTopology(KernelBootData* bootData);
+
+uint32_t GetNumaNodeCount();
+
+// Sorted by base and non-overlapping
+uint32_t GetNumaMemoryRangeCount();
+const NumaMemoryRange& GetNumaMemoryRange(uint32_t index);
+
+// Node owning address, spanEnd is set to where that ownership ends
+uint32_t GetNumaNodeSpan(uint64_t address, uint64_t& spanEnd);
+
+uint8_t GetNumaDistance(uint32_t fromNode, uint32_t toNode);
+
+// Nodes reachable from node, nearest first (node itself is always first)
+uint32_t GetNumaFallbackOrder(uint32_t node, const uint32_t*& order);
+
+// Called from InitMADT for each core
+void SetCpuNumaNode(unsigned int cpuIndex, uint32_t apicId);
+
+uint32_t GetCurrentNumaNode();
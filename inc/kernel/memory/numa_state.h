@@ -0,0 +1,56 @@
+#pragma once
+
+#include "kernel/memory/state.h"
+#include "kernel/memory/numa.h"
+
+// One range tree per NUMA node with the same interface as MemoryState.
+// Selected for PhysicalMemoryState with ENABLE_NUMA=1.
+//
+// Every node's tree covers the whole physical range with the memory owned by
+// other nodes tagged Reserved, so a block found in a node's tree is always local
+// to that node. Tags are split at node boundaries and sent to the owning tree.
+// Searches start at the calling core's node and fall back in SLIT distance order.
+
+class NumaMemoryState
+{
+public:
+
+	typedef MemoryState::RangeState RangeState;
+
+	// Must come after InitNumaTopology
+	void Init(int SystemIndex, const uint64_t HighestAddress);
+	void InitDynamic();
+
+	void TagRange(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State);
+	uintptr_t FindMinimumSizeFreeBlock(uint64_t MinSize);
+	uintptr_t FindAlignedFreeBlock(uint64_t MinSize, uint64_t Alignment);
+	RangeState GetPageState(const uint64_t Address);
+
+	uint64_t GetFreeBytes();
+	uint64_t GetLargestFreeBlock();
+
+	// Runs never cross a node boundary, so a run split between nodes counts twice
+	void GetFreeRunHistogram(uint64_t* Buckets, int BucketCount);
+	void GetNodeUsage(uint64_t& usedBranches, uint64_t& usedLeaves, uint64_t& freeBranches, uint64_t& freeLeaves) const;
+
+	uint32_t GetNodeCount() const
+	{
+		return NodeCount;
+	}
+
+	MemoryState& GetNode(uint32_t node)
+	{
+		return Nodes[node];
+	}
+
+private:
+
+	void ReserveForeignRanges(uint32_t node);
+
+	MemoryState Nodes[NUMA_MAX_NODES];
+
+	uint64_t HighestAddress;
+	uint32_t NodeCount;
+
+	int SystemIndex;
+};
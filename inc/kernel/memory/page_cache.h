@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include "common/types.h"
+#include "fs/volume.h"
+
+// Pages of mapped files, shared by every mapping of the same file. A file mapping
+// only reserves its range, each page is read into the cache the first time any
+// mapping touches it and mapped read-only from there. The first write to a page
+// gives that mapping a private copy, nothing is ever written back to the file.
+// Only files on volumes with GetIdentity can be cached, the rest are read eagerly.
+//
+// Cached pages live until reboot, they're never evicted.
+
+#define PAGE_CACHE_BUCKETS 1024
+
+struct PageCacheStats
+{
+	uint64_t Hits;
+	uint64_t Misses; //Each one is a read from the volume
+	uint64_t CachedPages;
+	uint64_t Mappings;
+};
+
+// Maps [address, address + size) onto the file from fileOffset, the range must already be reserved.
+// Writes are private to the mapping and only allowed if writable.
+// Returns false if the file can't be cached, in which case nothing has changed.
+bool MapFileLazily(VolumeFileHandle handle, void* address, uint64_t size, uint64_t fileOffset, bool writable, bool executable);
+
+// The list of mappings as it is now, for a copy on write snapshot to put back when it closes.
+// Restoring forgets every mapping made since and takes ownership of the copy.
+struct FileMapping;
+FileMapping* CopyFileMappings();
+void RestoreFileMappings(FileMapping* mappings);
+
+// Forgets any mappings overlapping the range, returns true if there were some.
+// The caller is expected to clear the page table entries with ClearFileBackedPages.
+bool ReleaseFileMappings(uint64_t virtualAddress, uint64_t size);
+
+// Called from the fault handler. Frame holding the file page behind the mapped address,
+// read in from the volume on a miss, or 0 if the address isn't part of a file mapping.
+// Asserts if a miss is taken while this core holds the memory state lock.
+uint64_t GetFileMappingFrame(uint64_t virtualAddress);
+
+// Keeps a handle open for its mappings after the owner closes it, returns true if the close has been deferred
+bool DeferCloseWhileMapped(VolumeFileHandle handle);
+
+// Copies freshly written file data into any cached pages it overlaps
+void UpdatePageCache(VolumeFileHandle handle, uint64_t offset, const void* buffer, uint64_t size);
+
+void GetPageCacheStats(PageCacheStats& stats);
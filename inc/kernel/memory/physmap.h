@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+// Every byte of RAM is permanently mapped at PHYSMAP_BASE + its physical address, using the
+// largest pages that fit. It's write-back and kernel only. MMIO is left out as it needs to be
+// uncached, so devices still go through PhysicalAlloc. Only valid once our PML4 is loaded.
+
+#define PHYSMAP_BASE 0xFFFF800000000000ULL
+#define PHYSMAP_SIZE (1ULL << 46)
+#define PHYSMAP_FIRST_PML4_INDEX ((PHYSMAP_BASE >> 39) & 0x1FF)
+#define PHYSMAP_PML4_ENTRIES (PHYSMAP_SIZE >> 39)
+
+#define PHYSMAP_MAX_RUNS 128
+
+struct KernelBootData;
+
+// Called from BuildPML4 once the memory map has been walked
+void InitPhysmap(KernelBootData* bootData);
+
+// True if the whole range is RAM that's reachable through PhysToVirt
+bool IsPhysmapped(uint64_t physicalAddress, uint64_t size);
+
+inline bool IsPhysmapAddress(const volatile void* virtualAddress)
+{
+	return (uint64_t)virtualAddress - PHYSMAP_BASE < PHYSMAP_SIZE;
+}
+
+inline void* PhysToVirt(uint64_t physicalAddress)
+{
+	return (void*)(PHYSMAP_BASE + physicalAddress);
+}
+
+// Pointer arithmetic for physmap addresses, anything else needs a page table walk
+uint64_t VirtToPhys(const volatile void* virtualAddress);
@@ -6,7 +6,55 @@ struct KernelBootData;
 
 void AllocateNextFreePageTableEntries();
 
-void MapPages(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel, MemoryState::RangeState newState, PageFlags pageFlags = PageFlags_None);
+// tagPhysical = false leaves PhysicalMemoryState alone, for frames owned by the frame cache
+void MapPages(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel, MemoryState::RangeState newState, PageFlags pageFlags = PageFlags_None, bool tagPhysical = true);
+
+// Maps RAM into the physmap, see kernel/memory/physmap.h
+void MapPhysmapRange(uint64_t physicalAddress, uint64_t size);
+
+// Reserves the range without backing it, each page gets a zeroed frame the first time it's touched.
+// The range must not already be mapped, Keep takes the privilege from demand zero pages already there.
+void MapDemandZeroPages(uint64_t virtualAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel);
+bool IsDemandZeroPage(uint64_t virtualAddress);
+// Called from the page fault handler, returns false if the address isn't demand zero memory
+bool HandleDemandZeroFault(uint64_t virtualAddress);
+
+// While a snapshot is open every writable user page is read-only and shared. The first write to
+// a page gives it a private copy, and closing the snapshot puts back every page as it was when it
+// was opened, along with the file mappings. Anything mapped in the meantime is released.
+// Snapshots nest and must be closed innermost first.
+struct CopyOnWriteSnapshot;
+CopyOnWriteSnapshot* BeginCopyOnWriteSnapshot();
+void EndCopyOnWriteSnapshot(CopyOnWriteSnapshot* snapshot);
+// Called from the page fault handler for writes to present pages
+bool HandleCopyOnWriteFault(uint64_t virtualAddress);
+// True while a snapshot is open and the range has user pages in it. The snapshot undoes every
+// user mapping and unmapping made while it's open, so their frames and virtual range have to
+// stay reserved until it closes, it frees whatever is left over then.
+bool IsUnmapDeferred(uint64_t virtualAddress, uint64_t size);
+
+// Reserves the range for a file mapping, see kernel/memory/page_cache.h. Pages are read into the
+// page cache on first touch and mapped read-only, writing to one gives this mapping a private copy.
+void MapFileBackedPages(uint64_t virtualAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel);
+// Drops file backed entries without freeing their page cache frames, private copies are left to UnmapRange
+void ClearFileBackedPages(uint64_t virtualAddress, uint64_t size);
+bool IsFileBackedPage(uint64_t virtualAddress);
+// Called from the page fault handler, returns false if the address isn't part of a file mapping
+bool HandleFileBackedFault(uint64_t virtualAddress, bool write);
+
+struct PageTablePoolStats
+{
+	uint64_t StaticPages; //In the kernel image, never released
+	uint64_t DynamicBlocks;
+	uint64_t ReservePages; //Mapped ahead of time for when the free list runs dry
+	uint64_t FreePages;
+	uint64_t UsedPages;
+};
+
+void GetPageTablePoolStats(PageTablePoolStats& stats);
+
+// Free memory in the UEFI map at boot, less the framebuffer
+uint64_t GetTotalUsableMemory();
 
 void BuildAndLoadPML4(KernelBootData* bootData);
 void MemCheck(KernelBootData* bootData);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+// Caches of fixed size objects. Each cache carves power of two sized, naturally aligned
+// slabs into objects, so the slab an object came from is found by masking its address.
+// Every core keeps a small magazine of free objects in front of the slabs, so the
+// cache lock is only taken to refill or flush a magazine, and then in batches.
+//
+// Slab memory never comes from rpmalloc, so a cache works on any core.
+
+#define SLAB_MAGAZINE_SIZE 10
+#define SLAB_MAGAZINE_BATCH 5
+#define SLAB_MIN_OBJECTS 8 //Slabs grow in powers of two pages until they hold this many
+#define SLAB_MAX_SIZE (64 * 1024)
+
+static_assert(SLAB_MAGAZINE_BATCH * 2 <= SLAB_MAGAZINE_SIZE, "Magazine must hold at least two batches");
+
+// Run once per object when its slab is created rather than on every allocation.
+// Objects are expected to be freed back in their constructed state.
+typedef void (*SlabConstructor)(void* object);
+
+struct SlabCache;
+
+struct SlabCacheStats
+{
+	const char* Name;
+	uint64_t ObjectSize;
+	uint64_t ActiveObjects;
+	uint64_t TotalObjects;
+	uint64_t Slabs;
+	uint64_t SlabSize;
+	uint64_t AllocHits; //Served from the core's magazine
+	uint64_t AllocMisses;
+	uint64_t FreeHits;
+	uint64_t FreeMisses;
+};
+
+// maxFree is how many free objects the cache keeps before it starts handing empty slabs back,
+// 0 keeps a slab's worth
+SlabCache* CreateSlabCache(const char* name, uint64_t objectSize, SlabConstructor constructor = nullptr, uint64_t maxFree = 0);
+// Every object must have been freed and no other core may be using the cache
+void DestroySlabCache(SlabCache* cache);
+
+uint64_t GetSlabObjectSize(SlabCache* cache);
+
+// Returns nullptr if out of memory
+void* SlabAlloc(SlabCache* cache);
+void SlabFree(SlabCache* cache, void* object);
+
+// Empties the calling core's magazine and hands back every empty slab
+void PurgeSlabCache(SlabCache* cache);
+
+// Fills up to maxCaches entries, returns how many caches there are
+uint32_t GetSlabCacheStats(SlabCacheStats* stats, uint32_t maxCaches);
+
+// Creates the cache in cacheSlot on first use, for caches that live in globals
+SlabCache* GetOrCreateSlabCache(SlabCache*& cacheSlot, const char* name, uint64_t objectSize, SlabConstructor constructor);
+
+// A cache of T, usable as a global as it's only created on first use
+template<typename T>
+class TypedSlabCache
+{
+public:
+	constexpr TypedSlabCache(const char* name, SlabConstructor constructor = nullptr)
+	: Name(name)
+	, Constructor(constructor)
+	, Cache(nullptr)
+	{}
+
+	T* Alloc()
+	{
+		return (T*)SlabAlloc(GetCache());
+	}
+
+	void Free(T* object)
+	{
+		SlabFree(GetCache(), object);
+	}
+
+private:
+
+	SlabCache* GetCache()
+	{
+		SlabCache* cache = __atomic_load_n(&Cache, __ATOMIC_ACQUIRE);
+		return cache ? cache : GetOrCreateSlabCache(Cache, Name, sizeof(T), Constructor);
+	}
+
+	const char* Name;
+	SlabConstructor Constructor;
+	SlabCache* Cache;
+};
@@ -9,8 +9,13 @@
 #define PAGE_BITS 12
 #define PAGE_SIZE 4096
 #define PAGE_SIZE_2MB 0x200000
+#define PAGE_SIZE_1GB 0x40000000
 #define PAGE_MASK 0xFFFFFFFFF000
 
+#if ENABLE_MEMORY_STATE_TRACE
+#include "kernel/memory/state_trace.h"
+#endif
+
 class MemoryState
 {
 public:
@@ -26,7 +31,7 @@ public:
 	struct AddressMask
 	{
 		RangeState State : 2;
-		uintptr_t Unused : 10;
+		uintptr_t Height : 10; //Branches only, leaves are always height 0
 		uintptr_t Address : 52;
 	};
 
@@ -46,6 +51,12 @@ public:
 		{
 			return Address & PAGE_MASK;
 		}
+
+		//Like SetAddress but keeps the state and height
+		void UpdateAddress(const uintptr_t AddressIn)
+		{
+			Address = (AddressIn & PAGE_MASK) | (Address & ~PAGE_MASK);
+		}
 	};
 
 	struct BranchStateNode : StateNode
@@ -72,36 +83,77 @@ public:
 	void AllocateNewLeafPage();
 	void AllocateNewBranchPage();
 
-	void TagRange(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State)
+	void TagRange(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State);
+
+	// Lowest addressed free block of at least MinSize
+	uintptr_t FindMinimumSizeFreeBlock(uint64_t MinSize);
+
+	// Smallest free block of at least MinSize, lowest address on ties
+	uintptr_t FindBestFitFreeBlock(uint64_t MinSize);
+
+	// Lowest Alignment aligned address with MinSize free bytes after it. Alignment must be a power of two.
+	uintptr_t FindAlignedFreeBlock(uint64_t MinSize, uint64_t Alignment);
+
+	RangeState GetPageState(const uint64_t Address);
+
+	uint64_t GetFreeBytes()
 	{
-		StateRoot = TagRangeInternal(StateRoot, LowAddress, HighAddress, State, 0ULL, HighestAddress);
+		return GetRemaining(StateRoot, 0ULL, HighestAddress);
 	}
 
-	uintptr_t FindMinimumSizeFreeBlock(uint64_t MinSize)
+	uint64_t GetLargestFreeBlock()
 	{
-		return FindMinimumSizeFreeBlockInternal(StateRoot, MinSize, 0ULL, HighestAddress);
+		return GetLargestFree(StateRoot, 0ULL, HighestAddress);
 	}
 
-	RangeState GetPageState(const uint64_t Address);
+	// Bucket n counts free runs of [2^n, 2^(n+1)) pages, anything larger goes in the last bucket
+	void GetFreeRunHistogram(uint64_t* Buckets, int BucketCount);
+
+	void GetNodeUsage(uint64_t& usedBranches, uint64_t& usedLeaves, uint64_t& freeBranches, uint64_t& freeLeaves) const
+	{
+		usedBranches = UsedBranches;
+		usedLeaves = UsedLeaves;
+		freeBranches = FreeBranches;
+		freeLeaves = FreeLeaves;
+	}
 
 private:
 
-	StateNode* TagRangeInternal(StateNode* CurrentState, const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress);
-	uintptr_t FindMinimumSizeFreeBlockInternal(StateNode* CurrentState, uint64_t MinSize, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress);
-	RangeState GetPageStateInternal(StateNode* CurrentState, const uint64_t Address);
+	// AVL height is at most 1.44 log2(n), 48 levels is billions of ranges
+	const static int MaxTreeDepth = 48;
+
+	struct PathEntry
+	{
+		BranchStateNode* Node;
+		uintptr_t LowAddress;
+		uintptr_t HighAddress;
+		bool WentLeft;
+	};
+
+	StateNode* FindLeaf(const uintptr_t Address, PathEntry* Path, int& Depth, uintptr_t& LeafLow, uintptr_t& LeafHigh);
+	void SplitAt(const uintptr_t Address);
+	void SetRangeState(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State);
+	bool MergeAt(const uintptr_t Address);
+	void Retrace(PathEntry* Path, int Depth);
+	StateNode** GetChildSlot(PathEntry* Path, int Depth);
+
+	StateNode* Rebalance(BranchStateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress);
+	BranchStateNode* RotateLeft(BranchStateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress);
+	BranchStateNode* RotateRight(BranchStateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress);
+
+	void EnsureNodeReserve();
+
+	void CountFreeRuns(StateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress, uint64_t* Buckets, int BucketCount);
 
 	BranchStateNode* GetFreeBranchState()
 	{
-		if(StateBranchFreeHead == nullptr)
-		{
-			StateBranchFreeHead = NextStateBranchFreeHead;
-			AllocateNewBranchPage();
-		}
+		_ASSERTFV(StateBranchFreeHead != nullptr, "Out of branch nodes", UsedBranches, 0, SystemIndex);
 
 		BranchStateNode* Result = StateBranchFreeHead;
 		StateBranchFreeHead = (BranchStateNode*)StateBranchFreeHead->Address;
 
 		UsedBranches++;
+		FreeBranches--;
 
 		return Result;
 	}
@@ -114,20 +166,18 @@ private:
 		StateBranchFreeHead = State;
 
 		UsedBranches--;
+		FreeBranches++;
 	}
 
 	StateNode* GetFreeLeafState()
 	{
-		if(StateLeafFreeHead == nullptr)
-		{
-			StateLeafFreeHead = NextStateLeafFreeHead;
-			AllocateNewLeafPage();
-		}
+		_ASSERTFV(StateLeafFreeHead != nullptr, "Out of leaf nodes", UsedLeaves, 0, SystemIndex);
 
 		StateNode* Result = StateLeafFreeHead;
 		StateLeafFreeHead = (StateNode*)StateLeafFreeHead->Address;
 
 		UsedLeaves++;
+		FreeLeaves--;
 
 		return Result;
 	}
@@ -140,6 +190,12 @@ private:
 		StateLeafFreeHead = State;
 
 		UsedLeaves--;
+		FreeLeaves++;
+	}
+
+	static uint64_t GetHeight(StateNode* Node)
+	{
+		return Node->State.State == RangeState::Branch ? Node->State.Height : 0;
 	}
 
 	uint64_t GetRemaining(StateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
@@ -178,43 +234,35 @@ private:
 		}
 	}
 
-	//We call this after tagging a block in a descendant to update the current state of this node based on the new descendants.
-	StateNode* UpdateNode(BranchStateNode* BranchState, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
+	//Recalculate the cached height and free sizes of a branch from its children.
+	//Neighbouring leaves never share a state so the largest free block never straddles two children.
+	void UpdateNode(BranchStateNode* BranchState, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
 	{
-		if(BranchState->Right->State.State != RangeState::Branch && BranchState->Left->State.State == BranchState->Right->State.State)
-		{
-			StateNode* Left = BranchState->Left;
-			StateNode* Right = BranchState->Right;
-
-			StateNode* NewNode = GetFreeLeafState();
-			NewNode->SetAddress(OuterHighAddress);
-			NewNode->State.State = BranchState->Left->State.State;
-
-			FreeStateBranch(BranchState);
-			FreeLeafState(Left);
-			FreeLeafState(Right);
+		uintptr_t Mid = BranchState->GetAddress();
 
-			return NewNode;
-		}
+		_ASSERTF(OuterHighAddress - OuterLowAddress > 0, "Encountered empty block");
 
-		uintptr_t Mid = BranchState->GetAddress();
 		uint64_t LargestLeft = GetLargestFree(BranchState->Left, OuterLowAddress, Mid);
 		uint64_t LargestRight = GetLargestFree(BranchState->Right, Mid, OuterHighAddress);
 
-		_ASSERTF(OuterHighAddress - OuterLowAddress > 0, "Encountered empty block");
-
 		uint64_t RemainingLeft = GetRemaining(BranchState->Left, OuterLowAddress, Mid);
 		uint64_t RemainingRight = GetRemaining(BranchState->Right, Mid, OuterHighAddress);
 
 		BranchState->Largest = LargestLeft > LargestRight ? LargestLeft : LargestRight;
 		BranchState->Remaining = RemainingLeft + RemainingRight;
 
-		return BranchState;
+		uint64_t HeightLeft = GetHeight(BranchState->Left);
+		uint64_t HeightRight = GetHeight(BranchState->Right);
+		BranchState->State.Height = 1 + (HeightLeft > HeightRight ? HeightLeft : HeightRight);
 	}
 
 	const static int InitialLeafTableEntries = 4096;
 	const static int InitialBranchTableEntries = 4096;
 
+	//A TagRange needs at most two of each node type, the spare covers nested calls
+	//made while the next block is being allocated
+	const static int NodeReserveLowWater = 16;
+
 	StateNode* StateRoot;
 	StateNode* StateLeafFreeHead;
 	BranchStateNode* StateBranchFreeHead;
@@ -228,9 +276,38 @@ private:
 	uint64_t HighestAddress;
 	uint64_t UsedBranches;
 	uint64_t UsedLeaves;
+	uint64_t FreeBranches;
+	uint64_t FreeLeaves;
+
+	bool DynamicNodes; //Set once rpmalloc can supply more nodes
+	bool AllocatingNodes;
 
 	int SystemIndex; //This is for identifying what system were in when debugging
 
 	static_assert(sizeof(StateNode) == 8, "Leaf state not expected size");
 	static_assert(sizeof(BranchStateNode) == 40, "Branch state not expected size");
 };
+
+// The physical backend is picked at build time, virtual is always the range tree
+// as a buddy allocator can't cover the whole 48-bit address space.
+// The buddy allocator has no NUMA support so it wins over ENABLE_NUMA.
+#if ENABLE_BUDDY_ALLOCATOR
+class BuddyMemoryState;
+typedef BuddyMemoryState PhysicalMemoryStateType;
+#include "kernel/memory/buddy_state.h"
+#elif ENABLE_NUMA
+class NumaMemoryState;
+typedef NumaMemoryState PhysicalMemoryStateType;
+#include "kernel/memory/numa_state.h"
+#else
+typedef MemoryState PhysicalMemoryStateType;
+#endif
+
+// Serialises access to PhysicalMemoryState, VirtualMemoryState and the page tables.
+// Re-entrant on the owning core as tagging can recurse into VirtualAlloc via rpmalloc
+// or the page table pool. Interrupts are disabled while held.
+void AcquireMemoryStateLock();
+void ReleaseMemoryStateLock();
+
+// True if this core holds the lock, at any depth
+bool IsMemoryStateLockHeld();
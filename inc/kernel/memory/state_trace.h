@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+// Records every operation on PhysicalMemoryState so it can be replayed against
+// both the range tree and buddy backends (ENABLE_MEMORY_STATE_TRACE=1).
+
+void RecordMemoryStateInit(uint64_t highestAddress);
+void RecordMemoryStateTag(uint64_t lowAddress, uint64_t highAddress, uint8_t state);
+void RecordMemoryStateFind(uint64_t minSize);
+
+// Replays the trace so far against fresh instances of each backend and prints ns/op and fragmentation to serial.
+// Each backend is VirtualAlloc'd for the replay, the buddy one is ~17MB.
+void ReplayMemoryStateTrace();
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Batches TLB invalidations so a burst of page table edits pays for a single flush.
+// Batches nest and hold the memory state lock while open, so they stay on one core.
+// Closing the outermost batch runs targeted invlpgs, or reloads CR3 once there are
+// more pages than it's worth invalidating one at a time.
+
+#define TLB_FLUSH_BATCH_RANGES 16
+#define TLB_FLUSH_FULL_THRESHOLD 32 //Past this many invlpgs refilling the TLB is cheaper
+
+struct TlbFlushStats
+{
+	uint64_t Batches;
+	uint64_t PageFlushes;
+	uint64_t FullFlushes;
+	uint64_t GlobalFlushes;
+};
+
+// Turns on global pages, called once the kernel page tables are loaded. Processes run on
+// the kernel's page tables, so there's a single address space and no PCIDs to tag it with.
+void InitTlbFeatures();
+
+void BeginTlbFlushBatch();
+void EndTlbFlushBatch();
+
+// Queue a single invlpg, also covers a whole large page when given any address inside it.
+// Global must be set if the old entry was global so a full flush knows to drop those too.
+void FlushTlbPage(uint64_t virtualAddress, bool global = false);
+
+// Queue every 4KiB page in the range, for when small pages from the range may be cached
+void FlushTlbRange(uint64_t virtualAddress, uint64_t size, bool global = false);
+
+// Flushes straight away rather than at the end of the batch, which also covers anything
+// already queued. Needed before handing back page table pages the CPU may still be caching.
+void FlushTlbAll();
+
+// Sum of the stats across all cores
+void GetTlbFlushStats(TlbFlushStats& stats);
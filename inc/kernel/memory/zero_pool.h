@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+// A pool of physical frames that are already zero, so handing out zeroed memory
+// doesn't have to pay for clearing it. Cores allocating from the pool top it up with
+// fresh frames, and an otherwise idle AP clears them through the physmap with
+// non-temporal stores.
+
+#define ZERO_POOL_SIZE 256
+#define ZERO_POOL_REFILL_BATCH 32 //Frames handed out are replaced this many at a time
+
+struct ZeroPoolStats
+{
+	uint64_t Hits;
+	uint64_t Misses;
+	uint64_t Refills;
+	uint64_t FramesZeroed;
+	uint64_t ZeroedFrames; //Ready to hand out right now
+};
+
+// Called on the BSP once virtual memory is up
+void InitZeroPool();
+
+// Never returns, run by the AP that looks after the pool
+void __attribute__((noreturn)) RunZeroPoolWorker();
+
+// Returns a frame that's all zero, or 0 if none are ready and the caller has to clear its own.
+// Frames are owned by the caller and go back with FreePhysicalFrame.
+uint64_t AllocateZeroedFrame();
+
+void GetZeroPoolStats(ZeroPoolStats& stats);
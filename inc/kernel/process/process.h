@@ -37,6 +37,9 @@ struct ElfBinary
 	uint64_t ProgramBreakHigh;
 };
 
+#define SYSCALL_STACK_SIZE (16 * 1024)
+#define MAX_UNREAPED_CHILDREN 16
+
 struct Process
 {
 	uint64_t DefaultThreadStackStart;
@@ -51,9 +54,33 @@ struct Process
 	TLSAllocation* TLS;
 
 	uint64_t ProgramBreak;
+
+	uint64_t SyscallStackBase;
+
+	void* ExtendedState; //XSAVE area, holds the vector registers while another process runs
+
+	uint64_t Pid;
+	int64_t ExitCode;
+
+	Process* Parent;
+	bool SharesParentMemory; //Forked children run in their parent's memory rather than owning any
+
+	//Children that have exited but not been waited on yet
+	uint64_t ExitedChildPids[MAX_UNREAPED_CHILDREN];
+	int64_t ExitedChildCodes[MAX_UNREAPED_CHILDREN];
+	uint32_t ExitedChildCount;
 };
 
 void InitializeUserMode();
 void ScheduleProcess(Process* process);
 Process* CreateProcess(const char16_t* programName, const char16_t** argv, const char16_t** envp);
 int RunProgram(const char16_t* programName, const char16_t** argv, const char16_t** envp);
+
+// Runs a copy of the calling process from the syscall it's in until it exits, then returns its pid.
+// There's no scheduler to run the two side by side so the child always goes first. copyOnWrite
+// gives the child its own view of memory, otherwise it borrows the parent's as vfork does.
+// childStackPointer of 0 resumes the child on the parent's stack.
+int64_t ForkProcess(bool copyOnWrite, uint64_t childStackPointer, int* parentTid, int* childTid);
+
+// Pops an exited child, pid of -1 takes any. Returns false if there isn't one.
+bool ReapExitedChild(Process* process, int64_t pid, uint64_t& childPid, int64_t& exitCode);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// Anything taking a lock that an interrupt handler may also want must disable
+// interrupts first, otherwise the handler can spin on a lock its own core holds.
+inline uint64_t SaveAndDisableInterrupts()
+{
+	uint64_t flags;
+	asm volatile("pushfq\n\tpop %0\n\tcli" : "=r"(flags) :: "memory");
+	return flags;
+}
+
+inline void RestoreInterrupts(uint64_t flags)
+{
+	asm volatile("push %0\n\tpopfq" :: "r"(flags) : "memory", "cc");
+}
+
+class SpinLock
+{
+public:
+	// constexpr so globals are ready before CRTInit runs constructors
+	constexpr SpinLock()
+	: Locked(0)
+	{}
+
+	void Lock()
+	{
+		while(__atomic_exchange_n(&Locked, 1, __ATOMIC_ACQUIRE) != 0)
+		{
+			// Spin on a plain load so we don't bounce the cache line between cores
+			while(__atomic_load_n(&Locked, __ATOMIC_RELAXED) != 0)
+			{
+				asm volatile("pause");
+			}
+		}
+	}
+
+	bool TryLock()
+	{
+		return __atomic_exchange_n(&Locked, 1, __ATOMIC_ACQUIRE) == 0;
+	}
+
+	void Unlock()
+	{
+		__atomic_store_n(&Locked, 0, __ATOMIC_RELEASE);
+	}
+
+	bool IsLocked() const
+	{
+		return __atomic_load_n(&Locked, __ATOMIC_RELAXED) != 0;
+	}
+
+private:
+	volatile uint32_t Locked;
+};
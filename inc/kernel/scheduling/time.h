@@ -4,6 +4,8 @@
 
 extern "C" KERNEL_API uint64_t _rdtsc();
 
+uint64_t HpetGetNanoseconds();
+
 void HpetSleepNS(uint64_t nanoseconds);
 void HpetSleepUS(uint64_t microseconds);
 void HpetSleepMS(uint64_t milliseconds);
@@ -1,3 +1,27 @@
 #pragma once
 
+#include <stdint.h>
+
 // https://blog.rchapman.org/posts/Linux_System_Call_Table_for_x86_64/
+
+// User registers pushed by SyscallDispatcher, lowest address first. The frame sits
+// at the top of the syscall stack.
+struct SyscallFrame
+{
+	uint64_t R13;
+	uint64_t Rbx;
+	uint64_t R15;
+	uint64_t R14;
+	uint64_t R12;
+	uint64_t R11;
+	uint64_t R9;
+	uint64_t R8;
+	uint64_t Rdi;
+	uint64_t Rsi;
+	uint64_t Rdx;
+	uint64_t Rbp;
+	uint64_t Rflags;
+	uint64_t Rsp; //Points at the return address SyscallDispatcher pushed onto the user stack
+};
+
+static_assert(sizeof(SyscallFrame) % 16 == 0, "SyscallDispatcher keeps the stack 16 byte aligned");
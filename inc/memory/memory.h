@@ -11,3 +11,30 @@ void* memset64(void* s, uint64_t value, size_t n);
 void* memmove(void* dest, const void* src, size_t n);
 int memcmp(const void* s1, const void* s2, size_t n);
 void FillUnique(void* address, uint64_t baseValue, uint64_t byteCount);
+
+// memcpy and memset variants, picked per call from the CPU features (static keys) and the size
+enum class MemoryStrategy : uint8_t
+{
+	Bytes, //The plain loops, kept for comparison
+	Words, //8 bytes at a time, also used for short runs unless rep movsb is fast for them
+	FastStrings, //rep movsb/stosb, with ERMS
+	Vector, //SSE2 inside a kernel FPU region, for long runs without ERMS
+	NonTemporal, //movnti past the caches, for runs of at least MEMORY_NON_TEMPORAL_THRESHOLD
+};
+
+#define MEMORY_SHORT_RUN 64
+#define MEMORY_VECTOR_THRESHOLD (4 * 1024) //Has to cover saving and restoring the vector registers
+#define MEMORY_NON_TEMPORAL_THRESHOLD (1024 * 1024)
+
+// Force a variant, for benchmarking. Neither handles overlapping ranges
+void CopyWithStrategy(MemoryStrategy strategy, void* dest, const void* src, size_t n);
+void SetWithStrategy(MemoryStrategy strategy, void* s, uint8_t value, size_t n);
+
+bool HasFastStrings();
+
+// The SSE2 loops behind MemoryStrategy::Vector, only valid between KernelFpuBegin and KernelFpuEnd
+void CopyVectors(uint8_t* dest, const uint8_t* src, size_t n);
+void SetVectors(uint8_t* p, uint8_t value, size_t n);
+
+// Prints MB/s of every variant per size to serial
+void BenchmarkMemoryRoutines();
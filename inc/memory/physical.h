@@ -6,4 +6,4 @@
 void* PhysicalAlloc(uint64_t PhysicalAddress, uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags = PageFlags_None);
 void* PhysicalAllocLowestAddress(uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags = PageFlags_None);
 uint64_t GetPhysicalAddress(uint64_t virtualAddress, bool live = true); //Defined in pml4.cpp
-#define PhysicalFree VirtualFree
+bool PhysicalFree(void* Address, uint64_t ByteSize);
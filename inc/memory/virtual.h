@@ -18,6 +18,7 @@ enum PageFlags
 	PageFlags_None,
 	PageFlags_Cache_WriteThrough,
 	PageFlags_Cache_Disable,
+	PageFlags_WriteCombining = 4, //Falls back to the default type if there's no PAT
 };
 
 enum class MemoryProtection
@@ -27,8 +28,22 @@ enum class MemoryProtection
     Execute,
 };
 
+// Backed by any free frames, the physical pages are not contiguous
 void* VirtualAlloc(uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags = PageFlags_None);
+// Physically contiguous, for anything handed to a device
+void* VirtualAllocContiguous(uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags = PageFlags_None);
+// Back a caller chosen virtual range, returns false if out of memory
+bool VirtualAllocAt(void* Address, uint64_t ByteSize, bool executable, PrivilegeLevel privilegeLevel, PageFlags pageFlags = PageFlags_None);
+// Reserve address space whose pages are only backed, with zeroes, when first touched
+void* VirtualAllocOnDemand(uint64_t ByteSize, PrivilegeLevel privilegeLevel);
+// As above at a caller chosen address, anything already mapped there is released first
+void VirtualAllocOnDemandAt(void* Address, uint64_t ByteSize, bool executable, PrivilegeLevel privilegeLevel);
+// Address space only, nothing is mapped until it's committed. Alignment is a power of two
+void* VirtualReserve(uint64_t ByteSize, uint64_t Alignment = PAGE_SIZE);
+// Back part of a reserved range, returns false if out of memory in which case it stays reserved
+bool VirtualCommit(void* Address, uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags = PageFlags_None);
+// Give the backing back but keep the range reserved, touching it afterwards faults
+void VirtualDecommit(void* Address, uint64_t ByteSize);
+// Releases committed, reserved and on demand ranges alike
 bool VirtualFree(void* Address, uint64_t ByteSize);
 void VirtualProtect(void* Address, uint64_t ByteSize, MemoryProtection ProtectFlags, PageFlags pageFlags = PageFlags_None, PrivilegeLevel privilegeLevel = PrivilegeLevel::Keep);
-
-#define PhysicalFree VirtualFree
@@ -12,6 +12,10 @@ struct StackFrame
 extern "C" KERNEL_API StackFrame* GetCurrentStackFrame();
 void __attribute__((used, noinline)) PrintStackTrace(int maxFrames, uint64_t stackRIP = 0, uint64_t stackRBP = 0);
 
+// Fills frames with return addresses, the first being in the caller, after skipping skipFrames.
+// Returns how many were captured, stops early on a frame that isn't mapped.
+int __attribute__((noinline)) CaptureStackTrace(uint64_t* frames, int maxFrames, int skipFrames = 0);
+
 void Halt(void);
 void KERNEL_NORETURN AssertionFailed(const char* expression, const char* message, const char* filename, size_t lineNumber, uint64_t v1, uint64_t v2, uint64_t v3);
 ACPI_STATUS Shutdown(void);
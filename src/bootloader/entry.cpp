@@ -148,7 +148,11 @@ void __attribute__((__noreturn__)) ExitToKernel(EFI_BOOT_SERVICES* bootServices,
 
 	EFI_MEMORY_DESCRIPTOR* memoryMap = nullptr;
 	memoryMapSizeAllocated = memoryMapSize + (8 * descriptorSize);
-	Allocation memoryMapAlloc = AllocatePages(EfiMemoryMapType_MemoryMap, memoryMapSizeAllocated);
+
+	//The kernel sorts the map by index without allocating, so each descriptor gets one after the map
+	#define MEMORY_MAP_ALLOCATION_SIZE (memoryMapSizeAllocated + (memoryMapSizeAllocated / descriptorSize) * sizeof(uint32_t))
+
+	Allocation memoryMapAlloc = AllocatePages(EfiMemoryMapType_MemoryMap, MEMORY_MAP_ALLOCATION_SIZE);
 	memoryMap = (EFI_MEMORY_DESCRIPTOR*)memoryMapAlloc.Data;
 
 	int retries = 5;
@@ -179,7 +183,7 @@ void __attribute__((__noreturn__)) ExitToKernel(EFI_BOOT_SERVICES* bootServices,
 			//Add a bit of a buffer
 			memoryMapSizeAllocated = memoryMapSize + (8 * descriptorSize);
 
-			memoryMapAlloc = AllocatePages(EfiMemoryMapType_MemoryMap, memoryMapSizeAllocated);
+			memoryMapAlloc = AllocatePages(EfiMemoryMapType_MemoryMap, MEMORY_MAP_ALLOCATION_SIZE);
 			memoryMap = (EFI_MEMORY_DESCRIPTOR*)memoryMapAlloc.Data;
 		}
 	} while (gmmResult == EFI_BUFFER_TOO_SMALL && retries-- > 0);
@@ -233,6 +237,7 @@ void __attribute__((__noreturn__)) ExitToKernel(EFI_BOOT_SERVICES* bootServices,
 	bootData.MemoryLayout.Entries = memoryMapSize / descriptorSize;
 	bootData.MemoryLayout.DescriptorSize = descriptorSize;
 	bootData.MemoryLayout.DescriptorVersion = descriptorVersion;
+	bootData.MemoryLayout.SortedEntries = (uint32_t*)((uint8_t*)memoryMap + memoryMapSizeAllocated);
 
 	//Now we need to find the page mapping for the framebuffer
 	const KernelMemoryLayout& memoryLayout = bootData.MemoryLayout;
@@ -157,6 +157,8 @@
 #include "kernel/console/console.h"
 #include "kernel/devices/pci.h"
 #include "memory/physical.h"
+#include "kernel/memory/physmap.h"
+#include "kernel/memory/slab.h"
 #include "kernel/scheduling/time.h"
 #include "utilities/termination.h"
 
@@ -817,6 +819,12 @@ AcpiOsMapMemory (
 {
     LOG_DBG ("");
 
+	//Tables live in RAM, there's nothing to map
+	if(IsPhysmapped(Where, Length))
+	{
+		return PhysToVirt(Where);
+	}
+
 	uint64_t offset = (Where - (Where & PAGE_MASK));
 	return (uint8_t*)PhysicalAlloc(Where & PAGE_MASK, ((Length + offset) + PAGE_SIZE) & PAGE_MASK, PrivilegeLevel::Kernel, PageFlags_Cache_Disable) + offset;
 }
@@ -844,6 +852,11 @@ AcpiOsUnmapMemory (
 {
     LOG_DBG ("");
 
+	if(IsPhysmapAddress(Where))
+	{
+		return;
+	}
+
 	uint64_t whereAddr = (uint64_t)Where;
 	
 	uint64_t offset = (whereAddr - (whereAddr & PAGE_MASK));
@@ -1228,8 +1241,7 @@ ACPI_STATUS
 AcpiOsPurgeCache (
     ACPI_CACHE_T            *Cache)
 {
-	//NOT_IMPLEMENTED();
-
+    PurgeSlabCache ((SlabCache *) Cache);
     return (AE_OK);
 }
 
@@ -1365,20 +1377,16 @@ AcpiOsCreateCache (
     UINT16                  MaxDepth,
     ACPI_CACHE_T            **ReturnCache)
 {
-    ACPI_MEMORY_LIST        *NewCache;
+    SlabCache               *NewCache;
 
 
-    NewCache = (ACPI_MEMORY_LIST*)rpmalloc (sizeof (ACPI_MEMORY_LIST));
+    //MaxDepth is how many released objects ACPICA wants kept around for reuse
+    NewCache = CreateSlabCache (CacheName, ObjectSize, nullptr, MaxDepth);
     if (!NewCache)
     {
         return (AE_NO_MEMORY);
     }
 
-    memset(NewCache, (uint8_t)0, sizeof (ACPI_MEMORY_LIST));
-    NewCache->ListName = CacheName;
-    NewCache->ObjectSize = ObjectSize;
-    NewCache->MaxDepth = MaxDepth;
-
     *ReturnCache = (ACPI_CACHE_T*)NewCache;
     return (AE_OK);
 }
@@ -1387,7 +1395,7 @@ ACPI_STATUS
 AcpiOsDeleteCache (
     ACPI_CACHE_T            *Cache)
 {
-    rpfree (Cache);
+    DestroySlabCache ((SlabCache *) Cache);
     return (AE_OK);
 }
 
@@ -1397,8 +1405,12 @@ AcpiOsAcquireObject (
 {
     void                    *NewObject;
 
-    NewObject = rpmalloc (((ACPI_MEMORY_LIST *) Cache)->ObjectSize);
-    memset (NewObject, 0, ((ACPI_MEMORY_LIST *) Cache)->ObjectSize);
+    NewObject = SlabAlloc ((SlabCache *) Cache);
+    if (NewObject)
+    {
+        //ACPICA expects objects zeroed, as its own cache does
+        memset (NewObject, 0, GetSlabObjectSize ((SlabCache *) Cache));
+    }
 
     return (NewObject);
 }
@@ -1408,7 +1420,7 @@ AcpiOsReleaseObject (
     ACPI_CACHE_T            *Cache,
     void                    *Object)
 {
-    rpfree (Object);
+    SlabFree ((SlabCache *) Cache, Object);
     return (AE_OK);
 }
 
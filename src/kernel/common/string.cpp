@@ -1,5 +1,68 @@
 #include "common/string.h"
 
+// Word at a time helpers, kernel code can't use vector registers. An aligned 8 byte
+// load never crosses a page, so reading past a terminator within it is safe.
+typedef uint64_t __attribute__((may_alias, aligned(1))) UnalignedWord;
+typedef uint32_t __attribute__((may_alias, aligned(1))) UnalignedHalfWord;
+
+#define BYTE_LANES 0x0101010101010101ULL
+#define BYTE_HIGH_BITS 0x8080808080808080ULL
+#define WIDE_LANES 0x0001000100010001ULL
+#define WIDE_HIGH_BITS 0x8000800080008000ULL
+
+// Non-zero if any byte is zero, the lowest set bit marks the first one
+static inline uint64_t ZeroBytes(uint64_t word)
+{
+	return (word - BYTE_LANES) & ~word & BYTE_HIGH_BITS;
+}
+
+static inline uint64_t ZeroWideChars(uint64_t word)
+{
+	return (word - WIDE_LANES) & ~word & WIDE_HIGH_BITS;
+}
+
+static inline bool IsWordAligned(const void* pointer)
+{
+	return ((uintptr_t)pointer & (sizeof(uint64_t) - 1)) == 0;
+}
+
+static inline bool CrossesPage(const void* pointer)
+{
+	return ((uintptr_t)pointer & 4095) > 4096 - sizeof(uint64_t);
+}
+
+// Adds 0x20 to every byte from 'A' to 'Z', anything outside ASCII is left alone like _tolower does
+static inline uint64_t LowerCaseBytes(uint64_t word)
+{
+	uint64_t ascii = word & ~BYTE_HIGH_BITS;
+	uint64_t atLeastA = ascii + (0x80 - 'A') * BYTE_LANES;
+	uint64_t aboveZ = ascii + (0x80 - 'Z' - 1) * BYTE_LANES;
+	uint64_t upper = atLeastA & ~aboveZ & ~word & BYTE_HIGH_BITS;
+
+	return word | (upper >> 2);
+}
+
+// Four chars to four char16_ts, char is signed so bytes above 0x7F become 0xFFxx as they would one at a time
+static inline uint64_t WidenBytes(uint32_t bytes)
+{
+	uint64_t wide = bytes;
+	wide = (wide | (wide << 16)) & 0x0000FFFF0000FFFFULL;
+	wide = (wide | (wide << 8)) & 0x00FF00FF00FF00FFULL;
+	wide |= ((wide >> 7) & WIDE_LANES) * 0xFF00;
+
+	return wide;
+}
+
+// Four char16_ts to their low bytes
+static inline uint32_t NarrowWideChars(uint64_t wide)
+{
+	wide &= 0x00FF00FF00FF00FFULL;
+	wide = (wide | (wide >> 8)) & 0x0000FFFF0000FFFFULL;
+	wide = (wide | (wide >> 16)) & 0xFFFFFFFFULL;
+
+	return (uint32_t)wide;
+}
+
 size_t IndexOfWhitespace(const char* input, size_t offset)
 {
 	uint32_t index = offset;
@@ -30,9 +93,26 @@ size_t IndexOfWhitespace(const char16_t* input, size_t offset)
 
 size_t IndexOfChar(const char* input, char c)
 {
+    const uint64_t pattern = (uint8_t)c * BYTE_LANES;
+
     uint32_t index = 0;
-    while (input[index] != '\0')
+    while (true)
     {
+        if (IsWordAligned(input + index))
+        {
+            uint64_t word = *(const UnalignedWord*)(input + index);
+            if (ZeroBytes(word) == 0 && ZeroBytes(word ^ pattern) == 0)
+            {
+                index += sizeof(word);
+                continue;
+            }
+        }
+
+        if (input[index] == '\0')
+        {
+            break;
+        }
+
         if (input[index] == c)
         {
             return index;
@@ -199,6 +279,22 @@ int ascii_to_wide(char16_t* bufferOut, const char* bufferIn, int bufferOutBytes)
 	int index = 0;
 	while (bufferIn[index] != '\0' && index < bufferOutBytes)
 	{
+		//Eight at a time once the input is aligned, until a word holds the terminator
+		if (IsWordAligned(bufferIn + index) && index + 8 <= bufferOutBytes)
+		{
+			uint64_t word = *(const UnalignedWord*)(bufferIn + index);
+			if (ZeroBytes(word) == 0)
+			{
+				if (bufferOut)
+				{
+					*(UnalignedWord*)(bufferOut + index) = WidenBytes((uint32_t)word);
+					*(UnalignedWord*)(bufferOut + index + 4) = WidenBytes((uint32_t)(word >> 32));
+				}
+				index += 8;
+				continue;
+			}
+		}
+
 		if (bufferOut)
 		{
 			bufferOut[index] = bufferIn[index];
@@ -218,6 +314,21 @@ int wide_to_ascii(char* bufferOut, const char16_t* bufferIn, int bufferOutBytes)
 	int index = 0;
 	while (bufferIn[index] != '\0' && index < bufferOutBytes)
 	{
+		//Four at a time once the input is aligned, until a word holds the terminator
+		if (IsWordAligned(bufferIn + index) && index + 4 <= bufferOutBytes)
+		{
+			uint64_t word = *(const UnalignedWord*)(bufferIn + index);
+			if (ZeroWideChars(word) == 0)
+			{
+				if (bufferOut)
+				{
+					*(UnalignedHalfWord*)(bufferOut + index) = NarrowWideChars(word);
+				}
+				index += 4;
+				continue;
+			}
+		}
+
 		if (bufferOut)
 		{
 			bufferOut[index] = bufferIn[index];
@@ -238,15 +349,41 @@ extern "C"
 size_t _strlen(const char* str)
 {
 	const char* s = str;
-	while (*s)
+	while (!IsWordAligned(s))
+	{
+		if (!*s)
+			return s - str;
 		++s;
-	return s - str;
+	}
+
+	uint64_t zeroes;
+	while ((zeroes = ZeroBytes(*(const UnalignedWord*)s)) == 0)
+		s += sizeof(uint64_t);
+
+	return s - str + __builtin_ctzll(zeroes) / 8;
 }
 
+// Whole words are compared while str1 is aligned, str2 is read unaligned so it
+// mustn't be at the end of a page. A word that differs or ends is redone a char at a time.
 int _strcmp(const char* str1, const char* str2)
 {
-	while (*str1 && (*str1 == *str2))
+	while (true)
 	{
+		if (IsWordAligned(str1) && !CrossesPage(str2))
+		{
+			uint64_t word1 = *(const UnalignedWord*)str1;
+			uint64_t word2 = *(const UnalignedWord*)str2;
+			if (word1 == word2 && ZeroBytes(word1) == 0)
+			{
+				str1 += sizeof(uint64_t);
+				str2 += sizeof(uint64_t);
+				continue;
+			}
+		}
+
+		if (!*str1 || (*str1 != *str2))
+			break;
+
 		str1++;
 		str2++;
 	}
@@ -255,8 +392,23 @@ int _strcmp(const char* str1, const char* str2)
 
 int _stricmp(const char* str1, const char* str2)
 {
-	while (*str1 && (tolower(*str1) == tolower(*str2)))
+	while (true)
 	{
+		if (IsWordAligned(str1) && !CrossesPage(str2))
+		{
+			uint64_t word1 = *(const UnalignedWord*)str1;
+			uint64_t word2 = *(const UnalignedWord*)str2;
+			if (ZeroBytes(word1) == 0 && LowerCaseBytes(word1) == LowerCaseBytes(word2))
+			{
+				str1 += sizeof(uint64_t);
+				str2 += sizeof(uint64_t);
+				continue;
+			}
+		}
+
+		if (!*str1 || (tolower(*str1) != tolower(*str2)))
+			break;
+
 		str1++;
 		str2++;
 	}
@@ -395,9 +547,18 @@ int _strcmp(const char16_t* str1, const char16_t* str2)
 size_t _strlen(const char16_t* str)
 {
 	const char16_t* s = str;
-	while (*s)
+	while (!IsWordAligned(s))
+	{
+		if (!*s)
+			return s - str;
 		++s;
-	return s - str;
+	}
+
+	uint64_t zeroes;
+	while ((zeroes = ZeroWideChars(*(const UnalignedWord*)s)) == 0)
+		s += sizeof(uint64_t) / sizeof(char16_t);
+
+	return s - str + __builtin_ctzll(zeroes) / 16;
 }
 
 char16_t* _strcat(char16_t* dest, const char16_t* src)
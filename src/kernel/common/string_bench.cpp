@@ -0,0 +1,305 @@
+#include "common/string.h"
+#include "kernel/console/console.h"
+#include "kernel/scheduling/time.h"
+
+//Summary of the system
+//---------------------
+// The string routines read a word at a time, the originals one char at a time are
+// kept here as the reference. Every routine is first checked against its reference
+// over lengths and alignments on both sides, with mixed case and bytes above 0x7F,
+// then both are timed on a long string. Results are MB/s of input.
+
+#define STRING_CHECK_MAX_LENGTH 80
+#define STRING_BENCH_LENGTH 4000
+#define STRING_BENCH_REPEATS 2000
+#define STRING_BENCH_COLUMN_WIDTH 10
+
+static char TextA[STRING_BENCH_LENGTH + 16];
+static char TextB[STRING_BENCH_LENGTH + 16];
+static char16_t WideA[STRING_BENCH_LENGTH + 16];
+static char16_t WideB[STRING_BENCH_LENGTH + 16];
+static char16_t WideC[STRING_BENCH_LENGTH + 16];
+static char NarrowA[STRING_BENCH_LENGTH + 16];
+static char NarrowB[STRING_BENCH_LENGTH + 16];
+
+static size_t ReferenceStrlen(const char* str)
+{
+	const char* s = str;
+	while (*s)
+		++s;
+	return s - str;
+}
+
+static size_t ReferenceStrlen(const char16_t* str)
+{
+	const char16_t* s = str;
+	while (*s)
+		++s;
+	return s - str;
+}
+
+static int ReferenceStrcmp(const char* str1, const char* str2)
+{
+	while (*str1 && (*str1 == *str2))
+	{
+		str1++;
+		str2++;
+	}
+	return *(char*)str1 - *(char*)str2;
+}
+
+static int ReferenceStricmp(const char* str1, const char* str2)
+{
+	while (*str1 && (tolower(*str1) == tolower(*str2)))
+	{
+		str1++;
+		str2++;
+	}
+
+	return tolower(*str1) - tolower(*str2);
+}
+
+static size_t ReferenceIndexOfChar(const char* input, char c)
+{
+	uint32_t index = 0;
+	while (input[index] != '\0')
+	{
+		if (input[index] == c)
+		{
+			return index;
+		}
+		index++;
+	}
+	return -1;
+}
+
+static int ReferenceAsciiToWide(char16_t* bufferOut, const char* bufferIn, int bufferOutBytes)
+{
+	int index = 0;
+	while (bufferIn[index] != '\0' && index < bufferOutBytes)
+	{
+		if (bufferOut)
+		{
+			bufferOut[index] = bufferIn[index];
+		}
+		index++;
+	}
+	if (bufferOut)
+	{
+		bufferOut[index] = '\0';
+	}
+
+	return index;
+}
+
+static int ReferenceWideToAscii(char* bufferOut, const char16_t* bufferIn, int bufferOutBytes)
+{
+	int index = 0;
+	while (bufferIn[index] != '\0' && index < bufferOutBytes)
+	{
+		if (bufferOut)
+		{
+			bufferOut[index] = bufferIn[index];
+		}
+		index++;
+	}
+	if (bufferOut)
+	{
+		bufferOut[index] = '\0';
+	}
+
+	return index;
+}
+
+static uint32_t CheckSeed = 1;
+
+static char NextCheckChar()
+{
+	//Mostly letters of both cases, with the odd byte above 0x7F
+	CheckSeed = CheckSeed * 1103515245 + 12345;
+	uint32_t value = (CheckSeed >> 16) & 0xFF;
+	if (value >= 0xF0)
+	{
+		return (char)value;
+	}
+	return (char)((value & 0x20) | ('A' + (value % 26)));
+}
+
+static uint64_t CheckFailures = 0;
+
+static void CheckResult(const char16_t* name, int64_t result, int64_t expected, uint64_t length)
+{
+	if (result != expected)
+	{
+		if (CheckFailures < 16)
+		{
+			SerialPrint(name);
+			LogPrintNumeric(u" mismatch at length ", length, u"\n", 10);
+		}
+		CheckFailures++;
+	}
+}
+
+static void CheckStringRoutines()
+{
+	CheckFailures = 0;
+
+	for (uint64_t length = 0; length < STRING_CHECK_MAX_LENGTH; length++)
+	{
+		for (uint64_t offsetA = 0; offsetA < 8; offsetA++)
+		{
+			for (uint64_t offsetB = 0; offsetB < 8; offsetB++)
+			{
+				char* a = TextA + offsetA;
+				char* b = TextB + offsetB;
+				for (uint64_t index = 0; index < length; index++)
+				{
+					a[index] = NextCheckChar();
+					b[index] = a[index];
+				}
+				a[length] = '\0';
+				b[length] = '\0';
+
+				CheckResult(u"strlen", _strlen(a), ReferenceStrlen(a), length);
+				CheckResult(u"strcmp", _strcmp(a, b), ReferenceStrcmp(a, b), length);
+
+				//Flip the case of one char, then make it differ outright
+				if (length > 0)
+				{
+					uint64_t changed = (offsetA * 8 + offsetB) % length;
+					b[changed] ^= _isalpha(b[changed]) ? 0x20 : 0;
+					CheckResult(u"strcmp", _strcmp(a, b), ReferenceStrcmp(a, b), length);
+					CheckResult(u"stricmp", _stricmp(a, b), ReferenceStricmp(a, b), length);
+
+					b[changed] = NextCheckChar();
+					CheckResult(u"strcmp", _strcmp(a, b), ReferenceStrcmp(a, b), length);
+					CheckResult(u"stricmp", _stricmp(a, b), ReferenceStricmp(a, b), length);
+					CheckResult(u"IndexOfChar", IndexOfChar(a, b[changed]), ReferenceIndexOfChar(a, b[changed]), length);
+				}
+
+				b[length / 2] = '\0';
+				CheckResult(u"strcmp", _strcmp(a, b), ReferenceStrcmp(a, b), length);
+				CheckResult(u"stricmp", _stricmp(a, b), ReferenceStricmp(a, b), length);
+				CheckResult(u"IndexOfChar", IndexOfChar(a, 'z'), ReferenceIndexOfChar(a, 'z'), length);
+
+				//Limits both above and below the length
+				for (int limit = (int)length - 9; limit <= (int)length + 1; limit += 5)
+				{
+					char16_t* wide = WideA + offsetB;
+					char16_t* expectedWide = WideB + offsetB;
+					CheckResult(u"ascii_to_wide", ascii_to_wide(wide, a, limit), ReferenceAsciiToWide(expectedWide, a, limit), length);
+					CheckResult(u"ascii_to_wide", ascii_to_wide(nullptr, a, limit), ReferenceAsciiToWide(nullptr, a, limit), length);
+
+					int written = limit < (int)length ? (limit < 0 ? 0 : limit) : (int)length;
+					for (int index = 0; index <= written; index++)
+					{
+						CheckResult(u"ascii_to_wide", wide[index], expectedWide[index], length);
+					}
+
+					CheckResult(u"strlen16", _strlen(wide), ReferenceStrlen(wide), length);
+
+					char* narrow = NarrowA + offsetA;
+					char* expectedNarrow = NarrowB + offsetA;
+					CheckResult(u"wide_to_ascii", wide_to_ascii(narrow, wide, limit), ReferenceWideToAscii(expectedNarrow, wide, limit), length);
+					for (int index = 0; index <= written; index++)
+					{
+						CheckResult(u"wide_to_ascii", narrow[index], expectedNarrow[index], length);
+					}
+				}
+			}
+		}
+	}
+
+	LogPrintNumeric(u"String routine check failures: ", CheckFailures, u"\n", 10);
+}
+
+static void PrintBenchColumn(const char16_t* text)
+{
+	int length = (int)_strlen(text);
+	for (; length < STRING_BENCH_COLUMN_WIDTH; length++)
+	{
+		SerialPrint(u" ");
+	}
+	SerialPrint(text);
+}
+
+static void PrintBenchRow(const char16_t* name, uint64_t referenceNanoseconds, uint64_t nanoseconds)
+{
+	const uint64_t bytes = (uint64_t)STRING_BENCH_LENGTH * STRING_BENCH_REPEATS;
+
+	char16_t buffer[24];
+	PrintBenchColumn(name);
+	witoabuf(buffer, referenceNanoseconds == 0 ? 0 : (bytes * 1000) / referenceNanoseconds, 10);
+	PrintBenchColumn(buffer);
+	witoabuf(buffer, nanoseconds == 0 ? 0 : (bytes * 1000) / nanoseconds, 10);
+	PrintBenchColumn(buffer);
+	SerialPrint(u"\n");
+}
+
+#define TIME_REPEATS(elapsed, expression) \
+	{ \
+		uint64_t start = HpetGetNanoseconds(); \
+		for (int repeat = 0; repeat < STRING_BENCH_REPEATS; repeat++) \
+		{ \
+			sink = sink + (uint64_t)(expression); \
+		} \
+		elapsed = HpetGetNanoseconds() - start; \
+	}
+
+static void BenchmarkStrings()
+{
+	for (int index = 0; index < STRING_BENCH_LENGTH; index++)
+	{
+		TextA[index] = 'a' + (index % 26);
+		TextB[index] = 'A' + (index % 26);
+	}
+	TextA[STRING_BENCH_LENGTH] = '\0';
+	TextB[STRING_BENCH_LENGTH] = '\0';
+	ascii_to_wide(WideC, TextA, STRING_BENCH_LENGTH);
+	_strcpy(NarrowB, TextA);
+
+	//Keeps the calls from being dropped
+	volatile uint64_t sink = 0;
+	uint64_t reference;
+	uint64_t current;
+
+	SerialPrint(u"String MB/s\n");
+	PrintBenchColumn(u"routine");
+	PrintBenchColumn(u"reference");
+	PrintBenchColumn(u"current");
+	SerialPrint(u"\n");
+
+	TIME_REPEATS(reference, ReferenceStrlen(TextA));
+	TIME_REPEATS(current, _strlen(TextA));
+	PrintBenchRow(u"strlen", reference, current);
+
+	TIME_REPEATS(reference, ReferenceStrlen(WideC));
+	TIME_REPEATS(current, _strlen(WideC));
+	PrintBenchRow(u"strlen16", reference, current);
+
+	TIME_REPEATS(reference, ReferenceStrcmp(TextA, NarrowB));
+	TIME_REPEATS(current, _strcmp(TextA, NarrowB));
+	PrintBenchRow(u"strcmp", reference, current);
+
+	TIME_REPEATS(reference, ReferenceStricmp(TextA, TextB));
+	TIME_REPEATS(current, _stricmp(TextA, TextB));
+	PrintBenchRow(u"stricmp", reference, current);
+
+	TIME_REPEATS(reference, ReferenceIndexOfChar(TextA, '!'));
+	TIME_REPEATS(current, IndexOfChar(TextA, '!'));
+	PrintBenchRow(u"indexof", reference, current);
+
+	TIME_REPEATS(reference, ReferenceAsciiToWide(WideA, TextA, STRING_BENCH_LENGTH));
+	TIME_REPEATS(current, ascii_to_wide(WideA, TextA, STRING_BENCH_LENGTH));
+	PrintBenchRow(u"widen", reference, current);
+
+	TIME_REPEATS(reference, ReferenceWideToAscii(NarrowA, WideC, STRING_BENCH_LENGTH));
+	TIME_REPEATS(current, wide_to_ascii(NarrowA, WideC, STRING_BENCH_LENGTH));
+	PrintBenchRow(u"narrow", reference, current);
+}
+
+void BenchmarkStringRoutines()
+{
+	CheckStringRoutines();
+	BenchmarkStrings();
+}
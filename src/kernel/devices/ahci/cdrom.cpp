@@ -62,11 +62,12 @@ VolumeReadType CdromVolume_Read =
 	{
 		if(GTempCDRomBuffer)
 		{
-			rpfree(GTempCDRomBuffer);
+			VirtualFree(GTempCDRomBuffer, GTempCDRomBufferSize);
 		}
 
-		GTempCDRomBufferSize = sectorUpperBoundSize;
-		GTempCDRomBuffer = (uint8_t*)rpmalloc(sectorUpperBoundSize);
+		//DMA target with a single PRDT entry, so it must be physically contiguous
+		GTempCDRomBufferSize = AlignSize(sectorUpperBoundSize, PAGE_SIZE);
+		GTempCDRomBuffer = (uint8_t*)VirtualAllocContiguous(GTempCDRomBufferSize, PrivilegeLevel::Kernel);
 	}
 
 	uint64_t readSize = cdrom->ReadSectors(startSector, sectorCountUpperBound, GTempCDRomBuffer);
@@ -257,7 +258,7 @@ bool CdromPort::Initialize(SataBus* sataBus, uint32_t portNumber)
 	CommandTableAllocSize = AlignSize(CommandTableAllocSize, PAGE_SIZE);
 
 	//TODO: Free me
-	CommandTableAlloc = (volatile uint8_t*)VirtualAlloc(CommandTableAllocSize, PrivilegeLevel::Kernel, PageFlags_Cache_Disable);
+	CommandTableAlloc = (volatile uint8_t*)VirtualAllocContiguous(CommandTableAllocSize, PrivilegeLevel::Kernel, PageFlags_Cache_Disable);
 	memset(CommandTableAlloc, 0, CommandTableAllocSize);
 
 	volatile uint8_t* fis = CommandTableAlloc;
@@ -378,7 +379,7 @@ bool CdromPort::IdentifyDrive()
 	}
 
     // Prepare the IDENTIFY command (ATA Command)
-    uint8_t* identifyBuffer = (uint8_t*)VirtualAlloc(4096, PrivilegeLevel::Kernel, PageFlags_Cache_WriteThrough);
+    uint8_t* identifyBuffer = (uint8_t*)VirtualAllocContiguous(4096, PrivilegeLevel::Kernel, PageFlags_Cache_WriteThrough);
     memset(identifyBuffer, 0, 512);
 
 	uint64_t identifyBufferPhysical = GetPhysicalAddress((uint64_t)identifyBuffer);
@@ -130,7 +130,7 @@ bool SataBus::Initialize(EFI_DEV_PATH* devicePath)
 	Memory->GlobalHostControl |= HBA_AE_BIT;
 
 	uint64_t commandListSize = ((Memory->PortsImplemented * 1024) + (PAGE_SIZE-1)) & PAGE_MASK;
-	CommandList = (uint8_t*)VirtualAlloc(commandListSize, PrivilegeLevel::Kernel, PageFlags_Cache_Disable);
+	CommandList = (uint8_t*)VirtualAllocContiguous(commandListSize, PrivilegeLevel::Kernel, PageFlags_Cache_Disable);
 
 	//memset(CommandList, 0, commandListSize);
 
@@ -19,6 +19,7 @@
 #include <ff.h>
 #include <diskio.h>
 #include <rpmalloc.h>
+#include "kernel/memory/slab.h"
 #include <errno.h>
 
 #include <fcntl.h>
@@ -43,6 +44,7 @@ uint64_t MountedFatDrives = 0;
 
 #define MAX_FILE_HANDLES 512
 FIL* FileHandles[MAX_FILE_HANDLES];
+TypedSlabCache<FIL> FileObjectCache("FIL");
 
 
 extern "C"
@@ -153,7 +155,7 @@ VolumeOpenHandleType FatVolume_OpenHandle =
 	{
 		if(FileHandles[i] == nullptr)
 		{
-			FileHandles[i] = (FIL*)rpmalloc(sizeof(FIL));
+			FileHandles[i] = FileObjectCache.Alloc();
 
 			FRESULT fr = f_open(FileHandles[i], (const TCHAR*)adjustedPath, FA_READ); //TODO: mode
 			if(fr == FR_OK)
@@ -166,7 +168,7 @@ VolumeOpenHandleType FatVolume_OpenHandle =
 			}
 			else
 			{
-				rpfree(FileHandles[i]);
+				FileObjectCache.Free(FileHandles[i]);
 				FileHandles[i] = nullptr;
 				return (VolumeFileHandle)0ULL;
 			}
@@ -184,7 +186,7 @@ VolumeCloseHandleType FatVolume_CloseHandle =
 
 	if(FileHandles[FH.S.FileHandle] != nullptr)
 	{
-		rpfree(FileHandles[FH.S.FileHandle]);
+		FileObjectCache.Free(FileHandles[FH.S.FileHandle]);
 		FileHandles[FH.S.FileHandle] = nullptr;
 	}
 };
@@ -319,6 +321,16 @@ VolumeCommandType FatVolume_Command =
 	return -EINVAL;
 };
 
+VolumeGetIdentityType FatVolume_GetIdentity =
+[](VolumeFileHandle handle, void* context) -> uint64_t
+{
+	FileHandleMask FH;
+	FH.FileHandle = handle;
+
+	//A file's first cluster never changes while it exists, empty files don't have one
+	return FileHandles[FH.S.FileHandle]->obj.sclust;
+};
+
 Volume FatVolume
 {
 	OpenHandle: FatVolume_OpenHandle,
@@ -328,6 +340,7 @@ Volume FatVolume
 	GetSize: FatVolume_GetSize,
 	Seek: FatVolume_Seek,
 	Command: FatVolume_Command,
+	GetIdentity: FatVolume_GetIdentity,
 };
 
 VolumeHandle MountFatVolume(const char16_t* mountPoint, VolumeHandle volume)
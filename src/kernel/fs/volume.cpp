@@ -3,6 +3,7 @@
 #include "memory/virtual.h"
 #include "memory/memory.h"
 #include "fs/volume.h"
+#include "kernel/memory/page_cache.h"
 
 #include "xxhash.h"
 #include <errno.h>
@@ -124,6 +125,12 @@ void VolumeCloseHandle(VolumeFileHandle handle)
 		return;
 	}
 
+	//Mapped files are read lazily, the handle stays open until the last mapping goes
+	if (DeferCloseWhileMapped(handle))
+	{
+		return;
+	}
+
 	return volumeIndex->VolumeImplementation->CloseHandle(handle, volumeIndex->Context);
 }
 
@@ -148,7 +155,21 @@ uint64_t VolumeWrite(VolumeFileHandle handle, uint64_t offset, const void* buffe
 		return -EINVAL;
 	}
 
-	return volumeIndex->VolumeImplementation->Write(handle, volumeIndex->Context, offset, buffer, size);
+	//Cached pages of the file have to see the write, so find out where it lands
+	uint64_t position = offset;
+	if (position == ~0ULL && volumeIndex->VolumeImplementation->GetIdentity && volumeIndex->VolumeImplementation->Seek)
+	{
+		position = volumeIndex->VolumeImplementation->Seek(handle, volumeIndex->Context, 0, SeekMode::Current);
+	}
+
+	uint64_t written = volumeIndex->VolumeImplementation->Write(handle, volumeIndex->Context, offset, buffer, size);
+
+	if ((int64_t)written > 0 && position != ~0ULL)
+	{
+		UpdatePageCache(handle, position, buffer, written);
+	}
+
+	return written;
 }
 
 uint64_t VolumeGetSize(VolumeFileHandle handle)
@@ -183,6 +204,18 @@ uint64_t VolumeSeek(VolumeFileHandle handle, int64_t offset, SeekMode origin)
 	}
 }
 
+uint64_t VolumeGetIdentity(VolumeFileHandle handle)
+{
+	VolumeIndex* volumeIndex = GetVolumeIndex(handle);
+
+	if (!(volumeIndex && volumeIndex->VolumeImplementation && volumeIndex->VolumeImplementation->GetIdentity))
+	{
+		return 0;
+	}
+
+	return volumeIndex->VolumeImplementation->GetIdentity(handle, volumeIndex->Context);
+}
+
 uint64_t VolumeCommand(VolumeFileHandle handle, uint64_t command, uint64_t data)
 {
 	VolumeIndex* volumeIndex = GetVolumeIndex(handle);
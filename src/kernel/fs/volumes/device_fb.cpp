@@ -36,7 +36,7 @@ VolumeOpenHandleType FramebufferVolume_OpenHandle =
 		GBootData.Framebuffer.Base, 
 		AlignSize(GBootData.Framebuffer.Pitch * GBootData.Framebuffer.Height, PAGE_SIZE),
 		MemoryProtection::ReadWrite,
-		PageFlags_None,
+		PageFlags_WriteCombining,
 		PrivilegeLevel::User);
 
 
@@ -191,4 +191,5 @@ Volume FramebufferVolume
 	GetSize : FramebufferVolume_GetSize,
 	Seek : FramebufferVolume_Seek,
 	Command: FramebufferVolume_Command,
+	GetIdentity: nullptr,
 };
@@ -4,23 +4,363 @@
 #include "memory/memory.h"
 #include "fs/volume.h"
 #include "kernel/console/console.h"
+#include "kernel/memory/state.h"
+#include "kernel/memory/pml4.h"
+#include "kernel/memory/frame_cache.h"
+#include "kernel/memory/zero_pool.h"
+#include "kernel/memory/page_cache.h"
+#include "kernel/memory/slab.h"
+#include "kernel/memory/heap_profile.h"
+#include "rpmalloc.h"
 #include "errno.h"
 
 extern const char16_t* KernelBuildId;
 
+extern PhysicalMemoryStateType PhysicalMemoryState;
+extern MemoryState VirtualMemoryState;
+
+#define FREE_RUN_ORDERS 19 //Up to 1GiB runs
+#define MAX_SLABINFO_CACHES 32
+#define MAX_HEAPPROFILE_SITES 8 //Per order, each site is two lines
+
+#if ENABLE_NUMA && !ENABLE_BUDDY_ALLOCATOR
+static_assert(NUMA_MAX_NODES <= 10, "Per node rows are labelled with a single digit");
+#endif
+
+struct ProcWriter
+{
+	char* Buffer;
+	uint64_t Size;
+	uint64_t Length;
+
+	void Append(const char* text)
+	{
+		while(*text && Length < Size - 1)
+		{
+			Buffer[Length++] = *text++;
+		}
+		Buffer[Length] = '\0';
+	}
+
+	// Right aligned decimal, so columns line up like the Linux files
+	void AppendNumber(uint64_t value, int width)
+	{
+		char digits[24];
+		int count = 0;
+		do
+		{
+			digits[count++] = '0' + (value % 10);
+			value /= 10;
+		} while(value != 0);
+
+		for(int pad = count; pad < width; pad++)
+		{
+			Append(" ");
+		}
+
+		char text[24];
+		for(int digit = 0; digit < count; digit++)
+		{
+			text[digit] = digits[count - digit - 1];
+		}
+		text[count] = '\0';
+
+		Append(text);
+	}
+
+	void AppendKilobytes(const char* name, uint64_t bytes)
+	{
+		Append(name);
+		AppendNumber(bytes / 1024, 16 - (int)strlen(name) + 8);
+		Append(" kB\n");
+	}
+
+	void AppendHistogram(const char* name, const uint64_t* buckets)
+	{
+		Append(name);
+		for(int order = 0; order < FREE_RUN_ORDERS; order++)
+		{
+			AppendNumber(buckets[order], 7);
+		}
+		Append("\n");
+	}
+};
+
+static uint64_t GenerateMemInfo(char* buffer, uint64_t size)
+{
+	ProcWriter writer { buffer, size, 0 };
+
+	FrameCacheStats frameCache;
+	GetPhysicalFrameCacheStats(frameCache);
+
+	ZeroPoolStats zeroPool;
+	GetZeroPoolStats(zeroPool);
+
+	PageTablePoolStats pageTables;
+	GetPageTablePoolStats(pageTables);
+
+	PageCacheStats pageCache;
+	GetPageCacheStats(pageCache);
+
+	AcquireMemoryStateLock();
+	uint64_t physicalFree = PhysicalMemoryState.GetFreeBytes();
+	uint64_t physicalLargest = PhysicalMemoryState.GetLargestFreeBlock();
+	uint64_t virtualFree = VirtualMemoryState.GetFreeBytes();
+	uint64_t virtualLargest = VirtualMemoryState.GetLargestFreeBlock();
+
+#if ENABLE_NUMA && !ENABLE_BUDDY_ALLOCATOR
+	uint32_t nodeCount = PhysicalMemoryState.GetNodeCount();
+	uint64_t nodeFree[NUMA_MAX_NODES];
+	for(uint32_t node = 0; node < nodeCount; node++)
+	{
+		nodeFree[node] = PhysicalMemoryState.GetNode(node).GetFreeBytes();
+	}
+#endif
+	ReleaseMemoryStateLock();
+
+	//Cached and pre-zeroed frames are tagged used but can be handed out without touching the trees
+	uint64_t cachedBytes = frameCache.CachedFrames * PAGE_SIZE;
+	uint64_t zeroedBytes = zeroPool.ZeroedFrames * PAGE_SIZE;
+
+	writer.AppendKilobytes("MemTotal:", GetTotalUsableMemory());
+	writer.AppendKilobytes("MemFree:", physicalFree);
+	writer.AppendKilobytes("MemAvailable:", physicalFree + cachedBytes + zeroedBytes);
+	writer.AppendKilobytes("MemLargestFree:", physicalLargest);
+#if ENABLE_NUMA && !ENABLE_BUDDY_ALLOCATOR
+	for(uint32_t node = 0; node < nodeCount; node++)
+	{
+		char name[] = "Node0Free:";
+		name[4] = '0' + node;
+		writer.AppendKilobytes(name, nodeFree[node]);
+	}
+#endif
+	writer.AppendKilobytes("FrameCache:", cachedBytes);
+	writer.AppendKilobytes("ZeroPool:", zeroedBytes);
+	writer.AppendKilobytes("Cached:", pageCache.CachedPages * PAGE_SIZE); //Never evicted, so not available
+	writer.AppendKilobytes("PageTables:", pageTables.UsedPages * PAGE_SIZE);
+	writer.AppendKilobytes("PageTablesFree:", (pageTables.FreePages + pageTables.ReservePages) * PAGE_SIZE);
+	writer.AppendKilobytes("VirtualFree:", virtualFree);
+	writer.AppendKilobytes("VirtualLargestFree:", virtualLargest);
+
+	return writer.Length;
+}
+
+static uint64_t GeneratePageTypeInfo(char* buffer, uint64_t size)
+{
+	ProcWriter writer { buffer, size, 0 };
+
+	uint64_t physicalRuns[FREE_RUN_ORDERS];
+	uint64_t virtualRuns[FREE_RUN_ORDERS];
+
+	AcquireMemoryStateLock();
+	PhysicalMemoryState.GetFreeRunHistogram(physicalRuns, FREE_RUN_ORDERS);
+	VirtualMemoryState.GetFreeRunHistogram(virtualRuns, FREE_RUN_ORDERS);
+
+#if ENABLE_NUMA && !ENABLE_BUDDY_ALLOCATOR
+	uint32_t nodeCount = PhysicalMemoryState.GetNodeCount();
+	uint64_t nodeRuns[NUMA_MAX_NODES][FREE_RUN_ORDERS];
+	for(uint32_t node = 0; node < nodeCount; node++)
+	{
+		PhysicalMemoryState.GetNode(node).GetFreeRunHistogram(nodeRuns[node], FREE_RUN_ORDERS);
+	}
+#endif
+
+#if !ENABLE_BUDDY_ALLOCATOR
+	uint64_t physicalNodes[4];
+	PhysicalMemoryState.GetNodeUsage(physicalNodes[0], physicalNodes[1], physicalNodes[2], physicalNodes[3]);
+#endif
+	uint64_t virtualNodes[4];
+	VirtualMemoryState.GetNodeUsage(virtualNodes[0], virtualNodes[1], virtualNodes[2], virtualNodes[3]);
+	ReleaseMemoryStateLock();
+
+	PageTablePoolStats pageTables;
+	GetPageTablePoolStats(pageTables);
+
+	writer.Append("Free runs by order, order n holds runs of 2^n to 2^(n+1)-1 pages\n");
+	writer.Append("Order    ");
+	for(int order = 0; order < FREE_RUN_ORDERS; order++)
+	{
+		writer.AppendNumber(order, 7);
+	}
+	writer.Append("\n");
+	writer.AppendHistogram("Physical ", physicalRuns);
+	writer.AppendHistogram("Virtual  ", virtualRuns);
+#if ENABLE_NUMA && !ENABLE_BUDDY_ALLOCATOR
+	for(uint32_t node = 0; node < nodeCount; node++)
+	{
+		char name[] = "Node 0   ";
+		name[5] = '0' + node;
+		writer.AppendHistogram(name, nodeRuns[node]);
+	}
+#endif
+
+	writer.Append("\nState nodes   used branches    used leaves  free branches    free leaves\n");
+#if !ENABLE_BUDDY_ALLOCATOR
+	writer.Append("Physical     ");
+	for(int node = 0; node < 4; node++)
+	{
+		writer.AppendNumber(physicalNodes[node], 15);
+	}
+	writer.Append("\n");
+#endif
+	writer.Append("Virtual      ");
+	for(int node = 0; node < 4; node++)
+	{
+		writer.AppendNumber(virtualNodes[node], 15);
+	}
+	writer.Append("\n");
+
+	writer.Append("\nPage table pool   static blocks reserve   free   used\n");
+	writer.Append("Pages            ");
+	writer.AppendNumber(pageTables.StaticPages, 7);
+	writer.AppendNumber(pageTables.DynamicBlocks, 7);
+	writer.AppendNumber(pageTables.ReservePages, 8);
+	writer.AppendNumber(pageTables.FreePages, 7);
+	writer.AppendNumber(pageTables.UsedPages, 7);
+	writer.Append("\n");
+
+	return writer.Length;
+}
+
+static uint64_t GenerateSlabInfo(char* buffer, uint64_t size)
+{
+	ProcWriter writer { buffer, size, 0 };
+
+	SlabCacheStats caches[MAX_SLABINFO_CACHES];
+	uint32_t cacheCount = GetSlabCacheStats(caches, MAX_SLABINFO_CACHES);
+	if(cacheCount > MAX_SLABINFO_CACHES)
+	{
+		cacheCount = MAX_SLABINFO_CACHES;
+	}
+
+	writer.Append("Name              active   total objsize  slabs slabsize  alloc hit miss   free hit miss\n");
+	for(uint32_t index = 0; index < cacheCount; index++)
+	{
+		const SlabCacheStats& cache = caches[index];
+
+		//Names are padded or cut to line up with the header
+		char name[17];
+		uint32_t length = 0;
+		for(; length < 16 && cache.Name[length]; length++)
+		{
+			name[length] = cache.Name[length];
+		}
+		for(; length < 16; length++)
+		{
+			name[length] = ' ';
+		}
+		name[16] = '\0';
+
+		writer.Append(name);
+		writer.AppendNumber(cache.ActiveObjects, 8);
+		writer.AppendNumber(cache.TotalObjects, 8);
+		writer.AppendNumber(cache.ObjectSize, 8);
+		writer.AppendNumber(cache.Slabs, 7);
+		writer.AppendNumber(cache.SlabSize, 9);
+		writer.AppendNumber(cache.AllocHits, 11);
+		writer.AppendNumber(cache.AllocMisses, 5);
+		writer.AppendNumber(cache.FreeHits, 11);
+		writer.AppendNumber(cache.FreeMisses, 5);
+		writer.Append("\n");
+	}
+
+	return writer.Length;
+}
+
+static void AppendHeapProfileSites(ProcWriter& writer, const char* title, HeapProfileOrder order)
+{
+	HeapProfileSiteStats sites[MAX_HEAPPROFILE_SITES];
+	uint32_t siteCount = GetHeapProfileSites(sites, MAX_HEAPPROFILE_SITES, order);
+
+	writer.Append(title);
+	writer.Append("   live kB   live   allocs    frees  total kB   avg life\n");
+	for(uint32_t index = 0; index < siteCount; index++)
+	{
+		const HeapProfileSiteStats& site = sites[index];
+
+		writer.AppendNumber(site.LiveBytes / 1024, 10);
+		writer.AppendNumber(site.Allocations - site.Frees, 7);
+		writer.AppendNumber(site.Allocations, 9);
+		writer.AppendNumber(site.Frees, 9);
+		writer.AppendNumber(site.TotalBytes / 1024, 10);
+		writer.AppendNumber(site.Frees == 0 ? 0 : site.LifetimeTicks / site.Frees, 11);
+		writer.Append("\n          ");
+
+		char address[24];
+		for(uint32_t frame = 0; frame < site.FrameCount; frame++)
+		{
+			witoabuf(address, site.Frames[frame], 16);
+			writer.Append(" ");
+			writer.Append(address);
+		}
+		writer.Append("\n");
+	}
+}
+
+static uint64_t GenerateHeapProfile(char* buffer, uint64_t size)
+{
+	ProcWriter writer { buffer, size, 0 };
+
+	rpmalloc_global_statistics_t heapStats;
+	rpmalloc_global_statistics(&heapStats);
+
+	writer.AppendKilobytes("HeapMapped:", heapStats.mapped);
+	writer.AppendKilobytes("HeapMappedPeak:", heapStats.mapped_peak);
+	writer.AppendKilobytes("HeapMappedTotal:", heapStats.mapped_total);
+	writer.AppendKilobytes("HeapUnmappedTotal:", heapStats.unmapped_total);
+	writer.AppendKilobytes("HeapCached:", heapStats.cached);
+	writer.AppendKilobytes("HeapHuge:", heapStats.huge_alloc);
+
+	HeapProfileSummary summary;
+	GetHeapProfileSummary(summary);
+	if(!summary.Enabled)
+	{
+		writer.Append("Call sites aren't recorded, build with HEAP_PROFILER=1\n");
+		return writer.Length;
+	}
+
+	writer.AppendKilobytes("ProfiledLive:", summary.LiveBytes);
+	writer.Append("ProfiledCounts:  sites");
+	writer.AppendNumber(summary.Sites, 8);
+	writer.Append(" live");
+	writer.AppendNumber(summary.LiveAllocations, 8);
+	writer.Append(" allocs");
+	writer.AppendNumber(summary.Allocations, 10);
+	writer.Append(" frees");
+	writer.AppendNumber(summary.Frees, 10);
+	writer.Append(" untracked");
+	writer.AppendNumber(summary.UntrackedFrees, 8);
+	writer.Append(" dropped");
+	writer.AppendNumber(summary.Dropped, 8);
+	writer.Append("\n");
+
+	AppendHeapProfileSites(writer, "\nTop sites by live bytes, lifetimes in TSC ticks\n", HeapProfileOrder::LiveBytes);
+	AppendHeapProfileSites(writer, "\nTop sites by allocations\n", HeapProfileOrder::Allocations);
+
+	return writer.Length;
+}
+
 struct SpecialPathEntry
 {
 	const char16_t* Path;
 	const char* Data;
+	uint64_t (*Generate)(char* buffer, uint64_t size); //Rebuilt on every read when set
 };
 
 static const SpecialPathEntry SpecialPaths[] =
 {
-	{ u"/sys/kernel/osrelease", "dev" },
+	{ u"/sys/kernel/osrelease", "dev", nullptr },
+	{ u"/meminfo", nullptr, GenerateMemInfo },
+	{ u"/pagetypeinfo", nullptr, GeneratePageTypeInfo },
+	{ u"/slabinfo", nullptr, GenerateSlabInfo },
+	{ u"/heapprofile", nullptr, GenerateHeapProfile },
 
-	{ nullptr, nullptr }
+	{ nullptr, nullptr, nullptr }
 };
 
+// Syscalls only run on one core, so one buffer is enough
+static char GeneratedData[4096];
+
 Volume SpecialProcVolume
 {
 	OpenHandle: [](VolumeFileHandle volumeHandle, void* context, const char16_t* path, uint8_t mode)
@@ -49,10 +389,24 @@ Volume SpecialProcVolume
 		Mask.FileHandle = handle;
 		
 		//TODO Range check
-		const char* data = SpecialPaths[Mask.S.FileHandle].Data;
+		const SpecialPathEntry& entry = SpecialPaths[Mask.S.FileHandle];
+
+		if(entry.Generate)
+		{
+			uint64_t length = entry.Generate(GeneratedData, sizeof(GeneratedData));
+			if(offset >= length)
+			{
+				return 0;
+			}
+
+			uint64_t toCopy = min(length - offset, size);
+			memcpy(buffer, GeneratedData + offset, toCopy);
+
+			return toCopy;
+		}
 
 		//TODO Range check
-		data += offset;
+		const char* data = entry.Data + offset;
 
 		uint64_t bytesLeft = strlen(data);
 		uint64_t toCopy = min(bytesLeft, size);
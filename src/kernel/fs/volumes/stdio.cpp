@@ -183,6 +183,7 @@ Volume StandardIOVolume
 	GetSize: [](VolumeFileHandle handle, void* context) -> uint64_t { return -EINVAL; },
 	Seek: [](VolumeFileHandle handle, void* context, int64_t offset, SeekMode origin) -> uint64_t { return -EINVAL; },
 	Command: nullptr,
+	GetIdentity: nullptr,
 };
 
 void InitializeStdioVolumes()
@@ -0,0 +1,153 @@
+#include "common/types.h"
+#include "kernel/init/alternatives.h"
+#include "kernel/init/cpuid.h"
+#include "kernel/init/long_mode.h"
+#include "kernel/scheduling/spinlock.h"
+#include "memory/memory.h"
+#include "utilities/termination.h"
+
+//Summary of the system
+//---------------------
+// The linker gathers every patch site into .alternatives, between AlternativesStart and
+// AlternativesEnd. Enabling a key walks the table and rewrites that key's sites: branches
+// get a jmp rel32 in place of their NOP, alternatives get their replacement copied in and
+// the rest of the site filled with NOPs. Kernel text may be mapped read-only so CR0.WP is
+// dropped while writing, and CPUID afterwards makes sure no stale instructions are used.
+//
+// Nothing stops another core running the code mid-rewrite, so keys are frozen once the
+// APs are started.
+
+#define CR0_WRITE_PROTECT (1ULL << 16)
+
+#define JMP_REL32 0xE9
+#define JMP_REL32_LENGTH 5
+
+extern "C" AlternativeEntry AlternativesStart[];
+extern "C" AlternativeEntry AlternativesEnd[];
+
+extern unsigned int ProcessorCount;
+
+bool StaticKeys[STATIC_KEY_COUNT];
+
+// Recommended multi-byte NOPs, indexed by length
+static const uint8_t Nops[][8] =
+{
+	{ },
+	{ 0x90 },
+	{ 0x66, 0x90 },
+	{ 0x0F, 0x1F, 0x00 },
+	{ 0x0F, 0x1F, 0x40, 0x00 },
+	{ 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+	{ 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+	{ 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+	{ 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+static void FillWithNops(uint8_t* code, uint64_t length)
+{
+	while (length > 0)
+	{
+		uint64_t chunk = min(length, (uint64_t)(sizeof(Nops) / sizeof(Nops[0]) - 1));
+		for (uint64_t index = 0; index < chunk; index++)
+		{
+			code[index] = Nops[chunk][index];
+		}
+		code += chunk;
+		length -= chunk;
+	}
+}
+
+static void PatchSite(const AlternativeEntry& entry)
+{
+	uint8_t* site = (uint8_t*)entry.Site;
+
+	if (entry.ReplacementLength == 0)
+	{
+		_ASSERTF(entry.SiteLength == JMP_REL32_LENGTH, "Static branch site isn't a 5 byte NOP");
+
+		int64_t offset = (int64_t)(entry.Replacement - (entry.Site + JMP_REL32_LENGTH));
+		_ASSERTF(offset == (int32_t)offset, "Static branch target out of range");
+
+		site[0] = JMP_REL32;
+		*(int32_t*)(site + 1) = (int32_t)offset;
+	}
+	else
+	{
+		_ASSERTF(entry.ReplacementLength <= entry.SiteLength, "Alternative longer than its site");
+
+		const uint8_t* replacement = (const uint8_t*)entry.Replacement;
+		for (uint64_t index = 0; index < entry.ReplacementLength; index++)
+		{
+			site[index] = replacement[index];
+		}
+		FillWithNops(site + entry.ReplacementLength, entry.SiteLength - entry.ReplacementLength);
+	}
+}
+
+// key of STATIC_KEY_COUNT patches every key that's on
+static void PatchSites(uint32_t key)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+	uint64_t cr0 = GetCR0();
+	SetCR0(cr0 & ~CR0_WRITE_PROTECT);
+
+	for (AlternativeEntry* entry = AlternativesStart; entry < AlternativesEnd; entry++)
+	{
+		if ((key == STATIC_KEY_COUNT || entry->Key == key) && StaticKeys[entry->Key])
+		{
+			PatchSite(*entry);
+		}
+	}
+
+	SetCR0(cr0);
+
+	//Serializing, so nothing fetched before the rewrite gets run
+	CpuId(CPUID_LEAF_FEATURES);
+
+	RestoreInterrupts(flags);
+}
+
+void InitStaticKeys()
+{
+#if VERBOSE_LOGGING
+	StaticKeys[STATIC_KEY_VERBOSE_LOGGING] = true;
+#endif
+
+#ifdef _DEBUG
+	StaticKeys[STATIC_KEY_DEBUG_CHECKS] = true;
+#endif
+
+	if (CpuIdHasLeaf(CPUID_LEAF_STRUCTURED_FEATURES))
+	{
+		CpuIdResult features = CpuId(CPUID_LEAF_STRUCTURED_FEATURES);
+		StaticKeys[STATIC_KEY_ERMS] = (features.Ebx & CPUID_STRUCTURED_EBX_ERMS) != 0;
+		StaticKeys[STATIC_KEY_FSRM] = (features.Edx & CPUID_STRUCTURED_EDX_FSRM) != 0;
+		StaticKeys[STATIC_KEY_CLFLUSHOPT] = (features.Ebx & CPUID_STRUCTURED_EBX_CLFLUSHOPT) != 0;
+	}
+
+	if (CpuIdHasLeaf(CPUID_LEAF_EXTENDED_FEATURES))
+	{
+		StaticKeys[STATIC_KEY_RDTSCP] = (CpuId(CPUID_LEAF_EXTENDED_FEATURES).Edx & CPUID_EXTENDED_EDX_RDTSCP) != 0;
+	}
+
+	PatchSites(STATIC_KEY_COUNT);
+}
+
+void EnableStaticKey(uint32_t key)
+{
+	_ASSERTF(key < STATIC_KEY_COUNT, "Invalid static key");
+	_ASSERTF(ProcessorCount <= 1, "Static keys are frozen once the APs are running");
+
+	if (StaticKeys[key])
+	{
+		return;
+	}
+
+	StaticKeys[key] = true;
+	PatchSites(key);
+}
+
+bool IsStaticKeyEnabled(uint32_t key)
+{
+	return key < STATIC_KEY_COUNT && StaticKeys[key];
+}
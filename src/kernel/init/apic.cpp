@@ -1,5 +1,6 @@
 #include "kernel/init/bootload.h"
 #include "kernel/init/apic.h"
+#include "kernel/init/init.h"
 #include "kernel/init/gdt.h"
 #include "kernel/init/pic.h"
 #include "kernel/init/msr.h"
@@ -7,6 +8,9 @@
 #include "common/string.h"
 #include "memory/physical.h"
 #include "kernel/scheduling/time.h"
+#include "kernel/memory/zero_pool.h"
+#include "kernel/memory/numa.h"
+#include "kernel/scheduling/spinlock.h"
 #include "utilities/termination.h"
 
 #include "IndustryStandard/MemoryMappedConfigurationSpaceAccessTable.h"
@@ -47,6 +51,7 @@ const uint32_t MSR_BSP_MASK = 0x100;
 const uint32_t APIC_ENABLE = 0x100;
 const uint32_t MSR_ENABLE_MASK = 0x800;
 
+const uint32_t  DELIVERY_MODE_FIXED = 0x000;
 const uint32_t  DELIVERY_MODE_INIT = 0x500;
 const uint32_t  DELIVERY_MODE_STARTUP = 0x600;
 
@@ -65,8 +70,8 @@ const uint32_t  STARTUP_ADDRESS_SEGMENT = 0x1000;
 uint64_t LocalApicPhysical;
 volatile uint8_t* LocalApicVirtual;
 
-const unsigned int MaxProcessors = 256;
 uint8_t ProcessorIds[MaxProcessors];
+uint8_t ApicIdToCpuIndex[MaxProcessors];
 unsigned int BSPId;
 unsigned int ProcessorCount;
 
@@ -90,12 +95,21 @@ extern "C" void KERNEL_API __attribute__((__noreturn__, used)) APEntryFunction()
 
 	int NewCoreIndex = CoreIndex++;
 
+	//Same CR0/CR4 bits and PAT as the BSP, the page tables are shared so the memory types must agree
+	InitCpuExtensions();
+
 	APSignal = true;
 
 	int32_t X = 700;
 	int32_t Y = 40 * NewCoreIndex;
 	//ConsolePrintAtPos(u"CORE ONLINE!\n", X, Y, 0, nullptr);
 
+	//The first AP has nothing better to do than keep the pool of zeroed frames topped up
+	if(NewCoreIndex == 0)
+	{
+		RunZeroPoolWorker();
+	}
+
 	while(true)
 	{
 		asm("hlt");
@@ -136,6 +150,18 @@ uint32_t ReadLocalApic(uint32_t Offset)
 	return Result;
 }
 
+unsigned int GetCurrentCpuIndex()
+{
+	//Only the BSP is running before the APIC is mapped
+	if(LocalApicVirtual == nullptr)
+	{
+		return 0;
+	}
+
+	uint32_t ApicId = ReadLocalApic((uint32_t)LocalApicOffsets::LocalApicIdRegister) >> 24;
+	return ApicIdToCpuIndex[ApicId];
+}
+
 void CheckLAPICErrorStatus()
 {
 	uint32_t ErrorStatus;
@@ -165,20 +191,35 @@ void WaitForIdleIPI()
 	} while(!IsFinished);
 }
 
-void InitAPs()
+void EnableLocalApic()
 {
-	char16_t Buffer[16];
+	WriteLocalApic( (uint32_t)LocalApicOffsets::SpuriousInterruptVectorRegister, APIC_ENABLE | 0xFF, 0x1FF);
+}
 
-	const int APStackSize = 16 * 1024;
-	uint64_t APStackFinal = (uint64_t)VirtualAlloc(APStackSize, PrivilegeLevel::Kernel);
-	uint64_t APStackHighFinal = APStackFinal + APStackSize;
+void SendIpi(unsigned int cpu, uint8_t vector)
+{
+	//The command register is two writes, nothing on this core can send one in between
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	WaitForIdleIPI();
+
+	WriteLocalApic( (uint32_t)LocalApicOffsets::InterruptCommandRegisterHigh, ProcessorIds[cpu] << 24, 0xFF << 24);
+	WriteLocalApic( (uint32_t)LocalApicOffsets::InterruptCommandRegisterLow, LEVEL_ASSERT | DELIVERY_MODE_FIXED | vector, 0xFFFFF);
 
-	uint64_t Value = *(uint64_t*)APStackFinal;
+	RestoreInterrupts(flags);
+}
+
+void EndOfInterrupt()
+{
+	//Write only, WriteLocalApic would read it first
+	*(volatile uint32_t*)(LocalApicVirtual + (uint32_t)LocalApicOffsets::EoiRegister) = 0;
+}
 
-	//memset((void*)(APStackHighFinal-0x200), 0xCD, 0x200);
-	memset((void*)(APStackFinal), 0xC1, 4096);
+void InitAPs()
+{
+	char16_t Buffer[16];
 
-	uint64_t Value2 = *(uint64_t*)APStackFinal;
+	const int APStackSize = 16 * 1024;
 
 	uint8_t* APTrampoline = (uint8_t*)GBootData.MemoryLayout.SpecialLocations[SpecialMemoryLocation_APBootstrap].VirtualStart;
 
@@ -193,6 +234,13 @@ void InitAPs()
 			continue;
 		}
 
+		//Each AP gets its own stack, they don't all sit in hlt any more
+		uint64_t APStackFinal = (uint64_t)VirtualAlloc(APStackSize, PrivilegeLevel::Kernel);
+		uint64_t APStackHighFinal = APStackFinal + APStackSize;
+
+		//memset((void*)(APStackHighFinal-0x200), 0xCD, 0x200);
+		memset((void*)(APStackFinal), 0xC1, 4096);
+
 		VirtualProtect(APTrampoline, PAGE_SIZE, MemoryProtection::ReadWrite, PageFlags_Cache_WriteThrough);
 		_ASSERTF(GetPhysicalAddress((uint64_t)APTrampoline) == (uint64_t)APTrampoline, "Expected identity address");
 
@@ -304,6 +352,8 @@ void InitMADT(EFI_ACPI_2_0_MULTIPLE_APIC_DESCRIPTION_TABLE_HEADER* MADT)
 					EFI_ACPI_2_0_PROCESSOR_LOCAL_APIC_STRUCTURE* LocalAPIC = (EFI_ACPI_2_0_PROCESSOR_LOCAL_APIC_STRUCTURE*)Data;
 
 					ProcessorIds[ProcessorCount] = LocalAPIC->ApicId;
+					ApicIdToCpuIndex[LocalAPIC->ApicId] = ProcessorCount;
+					SetCpuNumaNode(ProcessorCount, LocalAPIC->ApicId);
 					ProcessorCount++;
 
 					break;
@@ -1,5 +1,53 @@
 #include "common/types.h"
 #include "kernel/init/long_mode.h"
+#include "kernel/init/msr.h"
+#include "kernel/init/cpuid.h"
+#include "kernel/init/fpu.h"
+
+const uint32_t IA32_PAT_MSR = 0x277;
+
+#define PAT_TYPE_UC 0x00ULL
+#define PAT_TYPE_WC 0x01ULL
+#define PAT_TYPE_WT 0x04ULL
+#define PAT_TYPE_WB 0x06ULL
+#define PAT_TYPE_UC_MINUS 0x07ULL
+
+#define PAT_ENTRY(index, type) ((type) << ((index) * 8))
+
+bool PatWriteCombining = false;
+
+// The PAT entry for a page is picked by its PAT:PCD:PWT bits. Entries 0-3 keep their
+// power on values so PCD and PWT mean what they always have, entry 4 (PAT bit alone)
+// becomes write-combining. Every core has to be given the same table.
+static void InitPat()
+{
+	if(!(CpuId(CPUID_LEAF_FEATURES).Edx & CPUID_FEATURES_EDX_PAT))
+	{
+		return;
+	}
+
+	uint64_t pat =
+		PAT_ENTRY(0, PAT_TYPE_WB) |
+		PAT_ENTRY(1, PAT_TYPE_WT) |
+		PAT_ENTRY(2, PAT_TYPE_UC_MINUS) |
+		PAT_ENTRY(3, PAT_TYPE_UC) |
+		PAT_ENTRY(4, PAT_TYPE_WC) |
+		PAT_ENTRY(5, PAT_TYPE_WT) |
+		PAT_ENTRY(6, PAT_TYPE_UC_MINUS) |
+		PAT_ENTRY(7, PAT_TYPE_UC);
+
+	SetMSR(IA32_PAT_MSR, pat);
+
+	//Nothing can be mapped through entry 4 yet, this just drops lines cached under the old table
+	asm volatile("wbinvd" ::: "memory");
+
+	PatWriteCombining = true;
+}
+
+bool HasWriteCombining()
+{
+	return PatWriteCombining;
+}
 
 void InitCpuExtensions()
 {
@@ -11,6 +59,9 @@ void InitCpuExtensions()
 
 	uint64_t cr4 = GetCR4();
 	cr4 |= (1 << 10); //Set OSXMMEXCPT
-	cr4 |= (1 << 9); //Set OSXSAVE
+	cr4 |= (1 << 9); //Set OSFXSR
 	SetCR4(cr4);
-}
\ No newline at end of file
+
+	InitFpu();
+	InitPat();
+}
@@ -0,0 +1,196 @@
+#include "common/types.h"
+#include "kernel/init/fpu.h"
+#include "kernel/init/apic.h"
+#include "kernel/init/cpuid.h"
+#include "kernel/init/long_mode.h"
+#include "memory/memory.h"
+#include "memory/virtual.h"
+#include "utilities/termination.h"
+
+//Summary of the system
+//---------------------
+// There's no scheduler, a process only stops running when it starts another one or
+// exits back into the one that started it. EnterProcess saves the previous process's
+// registers to its area and LeaveProcess restores them. Rather than trapping the first
+// use after a switch with CR0.TS, saves go through XSAVEOPT, which skips components
+// that are still in their initial state or haven't changed since they were restored.
+//
+// Kernel regions save into an area per core. They don't nest, anything that wants a
+// region while one is open (an interrupt handler, or a page fault taken in the middle
+// of a vector memcpy) is told no and takes its general register path instead, so
+// regions never have to disable interrupts.
+
+#define CR4_OSXSAVE (1ULL << 18)
+
+#define FXSAVE_AREA_SIZE 512
+#define XSAVE_HEADER_SIZE 64
+#define XSAVE_AREA_ALIGNMENT 64
+
+#define FXSAVE_FCW_OFFSET 0
+#define FXSAVE_MXCSR_OFFSET 24
+
+#define DEFAULT_FCW 0x037F
+#define DEFAULT_MXCSR 0x1F80
+
+struct KernelFpuCore
+{
+	void* Area;
+	volatile bool Active;
+};
+
+bool UseXSave = false;
+bool UseXSaveOpt = false;
+uint64_t ExtendedStateMask = 0; //XCR0
+uint64_t ExtendedStateSize = FXSAVE_AREA_SIZE;
+
+KernelFpuCore KernelFpuCores[MaxProcessors];
+
+extern unsigned int ProcessorCount;
+
+// Legacy area with the power on control words and an empty header, so XRSTOR puts
+// every component into its initial state and FXRSTOR loads the same values
+static uint8_t InitialExtendedState[FXSAVE_AREA_SIZE + XSAVE_HEADER_SIZE] __attribute__((aligned(XSAVE_AREA_ALIGNMENT)));
+
+static inline void SetXCR(uint32_t index, uint64_t value)
+{
+	asm volatile("xsetbv" :: "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+void InitFpu()
+{
+	if (CpuId(CPUID_LEAF_FEATURES).Ecx & CPUID_FEATURES_ECX_XSAVE)
+	{
+		SetCR4(GetCR4() | CR4_OSXSAVE);
+
+		//MPX is gone from compilers, protection keys would need CR4.PKE, and AMX's 8KiB
+		//of tiles is something Linux makes programs ask for, so none of those are enabled
+		CpuIdResult components = CpuId(CPUID_LEAF_XSAVE, 0);
+		uint64_t supported = components.Eax | ((uint64_t)components.Edx << 32);
+
+		ExtendedStateMask = XCR0_X87 | XCR0_SSE;
+		if (supported & XCR0_AVX)
+		{
+			ExtendedStateMask |= XCR0_AVX;
+
+			if ((supported & XCR0_AVX512) == XCR0_AVX512)
+			{
+				ExtendedStateMask |= XCR0_AVX512;
+			}
+		}
+
+		SetXCR(0, ExtendedStateMask);
+
+		//EBX of sub-leaf 0 follows whatever XCR0 currently enables
+		ExtendedStateSize = CpuId(CPUID_LEAF_XSAVE, 0).Ebx;
+		UseXSaveOpt = (CpuId(CPUID_LEAF_XSAVE, 1).Eax & CPUID_XSAVE_EAX_XSAVEOPT) != 0;
+		UseXSave = true;
+	}
+
+	*(uint16_t*)(InitialExtendedState + FXSAVE_FCW_OFFSET) = DEFAULT_FCW;
+	*(uint32_t*)(InitialExtendedState + FXSAVE_MXCSR_OFFSET) = DEFAULT_MXCSR;
+}
+
+void InitKernelFpu()
+{
+	for (unsigned int cpu = 0; cpu < ProcessorCount; cpu++)
+	{
+		KernelFpuCores[cpu].Area = AllocateExtendedState();
+	}
+}
+
+uint64_t GetExtendedStateSize()
+{
+	return ExtendedStateSize;
+}
+
+static uint64_t GetExtendedStateAllocationSize()
+{
+	return AlignSize(ExtendedStateSize, PAGE_SIZE);
+}
+
+void* AllocateExtendedState()
+{
+	//Whole pages keep the area aligned, and XRSTOR faults on a header that isn't zeroed
+	void* area = VirtualAlloc(GetExtendedStateAllocationSize(), PrivilegeLevel::Kernel);
+	_ASSERTF(area, "Out of memory for extended state");
+
+	memset(area, 0, GetExtendedStateAllocationSize());
+	return area;
+}
+
+void FreeExtendedState(void* area)
+{
+	if (area)
+	{
+		VirtualFree(area, GetExtendedStateAllocationSize());
+	}
+}
+
+void SaveExtendedState(void* area)
+{
+	uint32_t maskLow = (uint32_t)ExtendedStateMask;
+	uint32_t maskHigh = (uint32_t)(ExtendedStateMask >> 32);
+
+	if (UseXSaveOpt)
+	{
+		asm volatile("xsaveopt64 (%0)" :: "r"(area), "a"(maskLow), "d"(maskHigh) : "memory");
+	}
+	else if (UseXSave)
+	{
+		asm volatile("xsave64 (%0)" :: "r"(area), "a"(maskLow), "d"(maskHigh) : "memory");
+	}
+	else
+	{
+		asm volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+	}
+}
+
+void RestoreExtendedState(const void* area)
+{
+	uint32_t maskLow = (uint32_t)ExtendedStateMask;
+	uint32_t maskHigh = (uint32_t)(ExtendedStateMask >> 32);
+
+	if (UseXSave)
+	{
+		asm volatile("xrstor64 (%0)" :: "r"(area), "a"(maskLow), "d"(maskHigh) : "memory");
+	}
+	else
+	{
+		asm volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+	}
+}
+
+void ResetExtendedState()
+{
+	RestoreExtendedState(InitialExtendedState);
+}
+
+bool KernelFpuBegin()
+{
+	KernelFpuCore& core = KernelFpuCores[GetCurrentCpuIndex()];
+	if (core.Area == nullptr || core.Active)
+	{
+		return false;
+	}
+
+	//Claimed before saving, an interrupt from here on sees the region as open and stays out
+	core.Active = true;
+	SaveExtendedState(core.Area);
+
+	//Dirty upper halves left by the process would slow down every SSE instruction in the region
+	if (ExtendedStateMask & XCR0_AVX)
+	{
+		asm volatile("vzeroupper" ::: "memory");
+	}
+
+	return true;
+}
+
+void KernelFpuEnd()
+{
+	KernelFpuCore& core = KernelFpuCores[GetCurrentCpuIndex()];
+	_ASSERTF(core.Active, "KernelFpuEnd without KernelFpuBegin");
+
+	RestoreExtendedState(core.Area);
+	core.Active = false;
+}
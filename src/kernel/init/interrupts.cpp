@@ -8,6 +8,7 @@
 #include "kernel/init/gdt.h"
 #include "kernel/init/interrupts.h"
 #include "kernel/init/msr.h"
+#include "kernel/memory/pml4.h"
 #include "common/string.h"
 
 #define IDT_SIZE 256
@@ -167,7 +168,23 @@ void __attribute__((used,noinline)) AccessViolationException(uint64_t interruptN
 
 DEFINE_NAMED_INTERRUPT(PageFault)(uint64_t interruptNumber, uint64_t rip, uint64_t cr2, uint64_t errorCode, uint64_t codeSegment, uint64_t triggeringRBP)
 {
-	//Paging will go here eventually
+	//Demand zero memory is only backed the first time it's touched, retry the access once it is
+	if (!(errorCode & PAGE_FAULT_PRESENT) && HandleDemandZeroFault(cr2))
+	{
+		return;
+	}
+
+	//Likewise shared pages are only copied on their first write
+	if ((errorCode & PAGE_FAULT_PRESENT) && (errorCode & PAGE_FAULT_WRITE) && HandleCopyOnWriteFault(cr2))
+	{
+		return;
+	}
+
+	//Mapped files are read in a page at a time, and written pages get a private copy
+	if (HandleFileBackedFault(cr2, (errorCode & PAGE_FAULT_WRITE) != 0))
+	{
+		return;
+	}
 
 	AccessViolationException(interruptNumber, rip, cr2, errorCode, codeSegment, triggeringRBP);
 
@@ -254,7 +271,11 @@ DEFINE_NAMED_INTERRUPT(InterruptHandlerWithContext)(uint64_t interruptNumber, ui
 {
 	ISR_Callbacks[interruptNumber](ISR_Contexts[interruptNumber]);
 
-	OutPort(0x20, 0x20);
+	//Only the PIC's vectors, anything above is an IPI that acknowledges its local APIC itself
+	if(interruptNumber >= 0x20 && interruptNumber < 0x30)
+	{
+		OutPort(0x20, 0x20);
+	}
 }
 
 void SetInterruptHandler(int InterruptNumber, InterruptWithContext Handler, void* Context)
@@ -5,6 +5,7 @@
 #include "kernel/memory/state.h"
 #include "memory/virtual.h"
 #include "rpmalloc.h"
+#include "kernel/memory/slab.h"
 
 extern "C" void* __tdata_start;
 extern "C" void* __tdata_end;
@@ -133,9 +134,11 @@ void InitializeKernelTLS()
 	SetKernelGSBase((uint64_t)GKernelEnvironment);
 }
 
+TypedSlabCache<TLSAllocation> TLSAllocationCache("TLSAllocation");
+
 TLSAllocation* CreateUserModeTLS(uint64_t tdataSize, uint64_t tbssSize, uint8_t* tdataStart, uint64_t tlsAlign)
 {
-	TLSAllocation* allocation = (TLSAllocation*)rpmalloc(sizeof(TLSAllocation));
+	TLSAllocation* allocation = TLSAllocationCache.Alloc();
 
 	CreateTLS(allocation, false, tdataSize, tbssSize, tdataStart, tlsAlign);
 
@@ -145,5 +148,5 @@ TLSAllocation* CreateUserModeTLS(uint64_t tdataSize, uint64_t tbssSize, uint8_t*
 void DestroyTLS(TLSAllocation* allocation)
 {
 	VirtualFree((void*)allocation->Memory, allocation->Size);
-	rpfree(allocation);
+	TLSAllocationCache.Free(allocation);
 }
@@ -4,6 +4,8 @@
 #include "kernel/init/apic.h"
 #include "kernel/init/bootload.h"
 #include "kernel/init/init.h"
+#include "kernel/init/fpu.h"
+#include "kernel/init/alternatives.h"
 #include "kernel/init/pic.h"
 #include "kernel/init/tls.h"
 #include "kernel/init/msr.h"
@@ -12,6 +14,9 @@
 #include "kernel/texture/render.h"
 #include "memory/memory.h"
 #include "memory/virtual.h"
+#include "kernel/memory/state.h"
+#include "kernel/memory/zero_pool.h"
+#include "kernel/memory/heap_profile.h"
 #include "rpmalloc.h"
 #include "../../assets/SplashLogo.h"
 #include "kernel/init/acpi.h"
@@ -181,6 +186,31 @@ void Shell()
 				const char16_t* argvDoom[] = { programName, u"-iwad", u"/doom.wad", nullptr};
 				RunProgram(programName, argvDoom, envp);
 			}
+			else if (strcmp((const char*)buffer, "membench") == 0)
+			{
+				BenchmarkMemoryRoutines();
+			}
+			else if (strcmp((const char*)buffer, "strbench") == 0)
+			{
+				BenchmarkStringRoutines();
+			}
+#if ENABLE_MEMORY_STATE_TRACE
+			else if (strcmp((const char*)buffer, "memtrace") == 0)
+			{
+				//Briefly takes ~17MB for a scratch buddy backend to replay against
+				ReplayMemoryStateTrace();
+			}
+#endif
+#if ENABLE_HEAP_PROFILER
+			else if (strcmp((const char*)buffer, "heapprofile") == 0)
+			{
+				DumpHeapProfile();
+			}
+			else if (strcmp((const char*)buffer, "heapreset") == 0)
+			{
+				ResetHeapProfile();
+			}
+#endif
 			else
 			{
 				ascii_to_wide(bufferWide, (const char*)buffer, bufferSize);
@@ -203,6 +233,8 @@ extern "C" void __attribute__((sysv_abi, __noreturn__)) KernelMain(KernelBootDat
 
 	GBootData = *BootData;
 
+	InitStaticKeys();
+
 	DefaultConsoleInit(GBootData.Framebuffer, BMFontColor{ 0x10, 0x20, 0x40 }, BMFontColor{ 0xDF, 0xDF, 0xDF });
 
 	RenderTGA(&GBootData.Framebuffer, SplashLogo_tga_data, GBootData.Framebuffer.Width, 0, AlignImage::Right, AlignImage::Top, true);
@@ -234,10 +266,18 @@ extern "C" void __attribute__((sysv_abi, __noreturn__)) KernelMain(KernelBootDat
 
 	InitPIC();
 
+	VerboseLog(u"Initializing zero pool.\n");
+
+	InitZeroPool();
+
 	VerboseLog(u"Initializing APIC.\n");
 
 	InitApic(GBootData.Rsdt, GBootData.Xsdt);
 
+	VerboseLog(u"Initializing kernel FPU regions.\n");
+
+	InitKernelFpu();
+
 	VerboseLog(u"Initializing Keyboard.\n");
 
 	InitKeyboard();
@@ -0,0 +1,358 @@
+#include "kernel/memory/buddy_state.h"
+#include "kernel/console/console.h"
+#include "memory/memory.h"
+#include "utilities/termination.h"
+
+//Summary of the system
+//---------------------
+// Free memory is held as naturally aligned power of two blocks of pages, one
+// free list per order. A block's buddy is the neighbouring block of the same
+// order that it was split from, freeing a block merges it with its buddy for
+// as long as the buddy is also free. The per-order bitmaps answer "is the
+// block at this frame a free head of this order" without walking any lists.
+//
+// Every page also carries its 2-bit RangeState so Reserved pages stay reserved
+// and GetPageState is a single lookup.
+
+void BuddyMemoryState::Init(int systemIndex, const uint64_t highestAddress)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(systemIndex == 0)
+	{
+		RecordMemoryStateInit(highestAddress);
+	}
+#endif
+
+	SystemIndex = systemIndex;
+	FreePages = 0;
+
+	HighestFrame = highestAddress >> PAGE_BITS;
+	if(HighestFrame > BuddyMaxPages)
+	{
+		VerboseLog(u"Buddy allocator ignoring memory above BUDDY_MAX_PHYSICAL_BITS\n");
+		HighestFrame = BuddyMaxPages;
+	}
+
+	memset(PageStates, 0, sizeof(PageStates));
+	memset(FreeBitmap, 0, sizeof(FreeBitmap));
+
+	for(int order = 0; order <= BUDDY_MAX_ORDER; order++)
+	{
+		FreeHeads[order] = InvalidFrame;
+		FreeCounts[order] = 0;
+	}
+
+	//Frame 0 is never handed out, 0 is the failure value for FindMinimumSizeFreeBlock
+	SetState(0, RangeState::Reserved);
+
+	ReleaseRange(1, HighestFrame);
+}
+
+void BuddyMemoryState::InsertFree(uint64_t frame, int order)
+{
+	uint64_t index = frame >> order;
+	FreeBitmap[BuddyBitmapOffset(order) + (index / 64)] |= 1ULL << (index % 64);
+
+	FreePrev[frame] = InvalidFrame;
+	FreeNext[frame] = FreeHeads[order];
+	if(FreeHeads[order] != InvalidFrame)
+	{
+		FreePrev[FreeHeads[order]] = (uint32_t)frame;
+	}
+	FreeHeads[order] = (uint32_t)frame;
+
+	FreeCounts[order]++;
+	FreePages += 1ULL << order;
+}
+
+void BuddyMemoryState::RemoveFree(uint64_t frame, int order)
+{
+	_ASSERTFV(IsFreeHead(frame, order), "Removing block that isn't free", frame, order, SystemIndex);
+
+	uint64_t index = frame >> order;
+	FreeBitmap[BuddyBitmapOffset(order) + (index / 64)] &= ~(1ULL << (index % 64));
+
+	uint32_t next = FreeNext[frame];
+	uint32_t prev = FreePrev[frame];
+
+	if(prev != InvalidFrame)
+	{
+		FreeNext[prev] = next;
+	}
+	else
+	{
+		FreeHeads[order] = next;
+	}
+
+	if(next != InvalidFrame)
+	{
+		FreePrev[next] = prev;
+	}
+
+	FreeCounts[order]--;
+	FreePages -= 1ULL << order;
+}
+
+void BuddyMemoryState::ReleaseBlock(uint64_t frame, int order)
+{
+	while(order < BUDDY_MAX_ORDER)
+	{
+		uint64_t buddy = frame ^ (1ULL << order);
+		if(buddy + (1ULL << order) > HighestFrame || !IsFreeHead(buddy, order))
+		{
+			break;
+		}
+
+		RemoveFree(buddy, order);
+		frame &= ~(1ULL << order);
+		order++;
+	}
+
+	InsertFree(frame, order);
+}
+
+// Adds [startFrame, endFrame) as the largest aligned blocks that fit, merging with free neighbours
+void BuddyMemoryState::ReleaseRange(uint64_t startFrame, uint64_t endFrame)
+{
+	while(startFrame < endFrame)
+	{
+		int order = startFrame == 0 ? BUDDY_MAX_ORDER : __builtin_ctzll(startFrame);
+		if(order > BUDDY_MAX_ORDER)
+		{
+			order = BUDDY_MAX_ORDER;
+		}
+
+		while(startFrame + (1ULL << order) > endFrame)
+		{
+			order--;
+		}
+
+		ReleaseBlock(startFrame, order);
+		startFrame += 1ULL << order;
+	}
+}
+
+int BuddyMemoryState::FindFreeBlockContaining(uint64_t frame, uint64_t& head) const
+{
+	for(int order = 0; order <= BUDDY_MAX_ORDER; order++)
+	{
+		uint64_t candidate = frame & ~((1ULL << order) - 1);
+		if(IsFreeHead(candidate, order))
+		{
+			head = candidate;
+			return order;
+		}
+	}
+
+	return -1;
+}
+
+// Removes [startFrame, endFrame) from the free lists, splitting any block that straddles the edges
+void BuddyMemoryState::CarveRange(uint64_t startFrame, uint64_t endFrame)
+{
+	uint64_t frame = startFrame;
+	while(frame < endFrame)
+	{
+		if(GetState(frame) != RangeState::Free)
+		{
+			frame++;
+			continue;
+		}
+
+		uint64_t head = 0;
+		int order = FindFreeBlockContaining(frame, head);
+		_ASSERTFV(order >= 0, "Free page not in any free block", frame, 0, SystemIndex);
+
+		uint64_t blockEnd = head + (1ULL << order);
+		RemoveFree(head, order);
+
+		//Hand back the parts of the block outside the range
+		if(head < startFrame)
+		{
+			ReleaseRange(head, startFrame);
+		}
+		if(blockEnd > endFrame)
+		{
+			ReleaseRange(endFrame, blockEnd);
+		}
+
+		frame = blockEnd;
+	}
+}
+
+void BuddyMemoryState::TagRange(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(SystemIndex == 0)
+	{
+		RecordMemoryStateTag(LowAddress, HighAddress, (uint8_t)State);
+	}
+#endif
+
+	uint64_t startFrame = LowAddress >> PAGE_BITS;
+	uint64_t endFrame = (HighAddress + PAGE_SIZE - 1) >> PAGE_BITS;
+
+	if(endFrame > HighestFrame)
+	{
+		endFrame = HighestFrame;
+	}
+
+	if(startFrame >= endFrame)
+	{
+		return;
+	}
+
+	if(State == RangeState::Free)
+	{
+		//Only Used pages become free, Reserved stays put and Free must not be added twice
+		uint64_t runStart = InvalidFrame;
+		for(uint64_t frame = startFrame; frame < endFrame; frame++)
+		{
+			if(GetState(frame) == RangeState::Used)
+			{
+				SetState(frame, RangeState::Free);
+				if(runStart == InvalidFrame)
+				{
+					runStart = frame;
+				}
+			}
+			else if(runStart != InvalidFrame)
+			{
+				ReleaseRange(runStart, frame);
+				runStart = InvalidFrame;
+			}
+		}
+
+		if(runStart != InvalidFrame)
+		{
+			ReleaseRange(runStart, endFrame);
+		}
+
+		return;
+	}
+
+	CarveRange(startFrame, endFrame);
+
+	for(uint64_t frame = startFrame; frame < endFrame; frame++)
+	{
+		if(GetState(frame) != RangeState::Reserved)
+		{
+			SetState(frame, State);
+		}
+	}
+}
+
+// Slow path for sizes that aren't a whole buddy block, walks forward from every free head
+uintptr_t BuddyMemoryState::FindFreeRun(uint64_t pages, uint64_t alignPages)
+{
+	for(int order = BUDDY_MAX_ORDER; order >= 0; order--)
+	{
+		for(uint32_t head = FreeHeads[order]; head != InvalidFrame; head = FreeNext[head])
+		{
+			uint64_t start = (head + alignPages - 1) & ~(alignPages - 1);
+
+			uint64_t frame = head;
+			while(frame < HighestFrame && frame < start + pages && GetState(frame) == RangeState::Free)
+			{
+				frame++;
+			}
+
+			if(frame >= start + pages)
+			{
+				return (uintptr_t)start << PAGE_BITS;
+			}
+		}
+	}
+
+	return 0;
+}
+
+uintptr_t BuddyMemoryState::FindMinimumSizeFreeBlock(uint64_t MinSize)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(SystemIndex == 0)
+	{
+		RecordMemoryStateFind(MinSize);
+	}
+#endif
+
+	uint64_t pages = (MinSize + PAGE_SIZE - 1) >> PAGE_BITS;
+	if(pages == 0)
+	{
+		pages = 1;
+	}
+
+	int order = 63 - __builtin_clzll(pages);
+	if((1ULL << order) < pages)
+	{
+		order++;
+	}
+
+	for(int searchOrder = order; searchOrder <= BUDDY_MAX_ORDER; searchOrder++)
+	{
+		if(FreeHeads[searchOrder] != InvalidFrame)
+		{
+			return (uintptr_t)FreeHeads[searchOrder] << PAGE_BITS;
+		}
+	}
+
+	return FindFreeRun(pages, 1);
+}
+
+uintptr_t BuddyMemoryState::FindAlignedFreeBlock(uint64_t MinSize, uint64_t Alignment)
+{
+	_ASSERTFV((Alignment & (Alignment - 1)) == 0, "Alignment must be a power of two", Alignment, 0, SystemIndex);
+
+	uint64_t pages = (MinSize + PAGE_SIZE - 1) >> PAGE_BITS;
+	uint64_t alignPages = Alignment >> PAGE_BITS;
+	if(pages == 0)
+	{
+		pages = 1;
+	}
+	if(alignPages == 0)
+	{
+		alignPages = 1;
+	}
+
+	//Blocks are naturally aligned, so any block at least as big as the alignment will do
+	uint64_t blockPages = pages > alignPages ? pages : alignPages;
+	int order = 63 - __builtin_clzll(blockPages);
+	if((1ULL << order) < blockPages)
+	{
+		order++;
+	}
+
+	for(int searchOrder = order; searchOrder <= BUDDY_MAX_ORDER; searchOrder++)
+	{
+		if(FreeHeads[searchOrder] != InvalidFrame)
+		{
+			return (uintptr_t)FreeHeads[searchOrder] << PAGE_BITS;
+		}
+	}
+
+	return FindFreeRun(pages, alignPages);
+}
+
+MemoryState::RangeState BuddyMemoryState::GetPageState(const uint64_t Address)
+{
+	uint64_t frame = Address >> PAGE_BITS;
+	if(frame >= HighestFrame)
+	{
+		return RangeState::Reserved;
+	}
+
+	return GetState(frame);
+}
+
+uint64_t BuddyMemoryState::GetLargestFreeBlock() const
+{
+	for(int order = BUDDY_MAX_ORDER; order >= 0; order--)
+	{
+		if(FreeCounts[order] != 0)
+		{
+			return (1ULL << order) * PAGE_SIZE;
+		}
+	}
+
+	return 0;
+}
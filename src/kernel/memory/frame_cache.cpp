@@ -0,0 +1,211 @@
+#include "kernel/memory/frame_cache.h"
+#include "kernel/memory/state.h"
+#include "kernel/init/apic.h"
+#include "kernel/scheduling/spinlock.h"
+#include "utilities/termination.h"
+
+extern PhysicalMemoryStateType PhysicalMemoryState;
+
+struct FrameCache
+{
+	uint64_t Frames[FRAME_CACHE_SIZE];
+	uint64_t Count;
+
+	FrameCacheStats Stats;
+} __attribute__((aligned(64))); //Keep each core on its own cache lines
+
+FrameCache FrameCaches[MaxProcessors];
+
+// Caller must have interrupts disabled so the magazine can't be swapped out from under it
+static FrameCache& GetLocalFrameCache()
+{
+	return FrameCaches[GetCurrentCpuIndex()];
+}
+
+static void PushFrame(FrameCache& cache, uint64_t frame)
+{
+	if(cache.Count < FRAME_CACHE_SIZE)
+	{
+		cache.Frames[cache.Count++] = frame;
+	}
+	else
+	{
+		//Only reachable if a refill recursed into another refill, just hand it back
+		PhysicalMemoryState.TagRange(frame, frame + PAGE_SIZE, MemoryState::RangeState::Free);
+	}
+}
+
+static void RefillFrameCache(FrameCache& cache)
+{
+	AcquireMemoryStateLock();
+
+	const uint64_t batchSize = FRAME_CACHE_BATCH * PAGE_SIZE;
+
+	//Prefer a single contiguous run, it costs one tree walk for the whole batch
+	uint64_t run = PhysicalMemoryState.FindMinimumSizeFreeBlock(batchSize);
+	if(run != 0)
+	{
+		PhysicalMemoryState.TagRange(run, run + batchSize, MemoryState::RangeState::Used);
+
+		//Push in reverse so the lowest address is handed out first
+		for(int frame = FRAME_CACHE_BATCH - 1; frame >= 0; frame--)
+		{
+			PushFrame(cache, run + (frame * PAGE_SIZE));
+		}
+	}
+	else
+	{
+		//Fragmented, pick up whatever single pages are left
+		for(int frame = 0; frame < FRAME_CACHE_BATCH; frame++)
+		{
+			uint64_t page = PhysicalMemoryState.FindMinimumSizeFreeBlock(PAGE_SIZE);
+			if(page == 0)
+			{
+				break;
+			}
+
+			PhysicalMemoryState.TagRange(page, page + PAGE_SIZE, MemoryState::RangeState::Used);
+			PushFrame(cache, page);
+		}
+	}
+
+	cache.Stats.Refills++;
+
+	ReleaseMemoryStateLock();
+}
+
+// Returns the bottom (coldest) count frames to the tree
+static void DrainFrameCache(FrameCache& cache, uint64_t count)
+{
+	if(count > cache.Count)
+	{
+		count = cache.Count;
+	}
+
+	if(count == 0)
+	{
+		return;
+	}
+
+	//Take the frames out of the magazine first, tagging can recurse back into us
+	uint64_t frames[FRAME_CACHE_SIZE];
+	memcpy(frames, cache.Frames, count * sizeof(uint64_t));
+	memmove(cache.Frames, cache.Frames + count, (cache.Count - count) * sizeof(uint64_t));
+	cache.Count -= count;
+
+	cache.Stats.Drains++;
+
+	//Sort so neighbouring frames can be returned as a single range
+	for(uint64_t i = 1; i < count; i++)
+	{
+		uint64_t value = frames[i];
+		uint64_t j = i;
+		while(j > 0 && frames[j-1] > value)
+		{
+			frames[j] = frames[j-1];
+			j--;
+		}
+		frames[j] = value;
+	}
+
+	AcquireMemoryStateLock();
+
+	uint64_t runStart = frames[0];
+	uint64_t runEnd = runStart + PAGE_SIZE;
+	for(uint64_t i = 1; i < count; i++)
+	{
+		if(frames[i] == runEnd)
+		{
+			runEnd += PAGE_SIZE;
+			continue;
+		}
+
+		PhysicalMemoryState.TagRange(runStart, runEnd, MemoryState::RangeState::Free);
+		runStart = frames[i];
+		runEnd = runStart + PAGE_SIZE;
+	}
+	PhysicalMemoryState.TagRange(runStart, runEnd, MemoryState::RangeState::Free);
+
+	ReleaseMemoryStateLock();
+}
+
+uint64_t AllocatePhysicalFrame()
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	FrameCache& cache = GetLocalFrameCache();
+
+	if(cache.Count == 0)
+	{
+		cache.Stats.AllocMisses++;
+		RefillFrameCache(cache);
+
+		if(cache.Count == 0)
+		{
+			RestoreInterrupts(flags);
+			return 0;
+		}
+	}
+	else
+	{
+		cache.Stats.AllocHits++;
+	}
+
+	uint64_t frame = cache.Frames[--cache.Count];
+
+	RestoreInterrupts(flags);
+
+	return frame;
+}
+
+void FreePhysicalFrame(uint64_t physicalAddress)
+{
+	_ASSERTF((physicalAddress & (PAGE_SIZE-1)) == 0, "Misaligned frame");
+	_ASSERTF(physicalAddress != 0 && physicalAddress != INVALID_ADDRESS, "Invalid frame");
+
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	FrameCache& cache = GetLocalFrameCache();
+
+	if(cache.Count == FRAME_CACHE_SIZE)
+	{
+		cache.Stats.FreeMisses++;
+		DrainFrameCache(cache, FRAME_CACHE_BATCH);
+	}
+	else
+	{
+		cache.Stats.FreeHits++;
+	}
+
+	PushFrame(cache, physicalAddress);
+
+	RestoreInterrupts(flags);
+}
+
+void DrainPhysicalFrameCache()
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	FrameCache& cache = GetLocalFrameCache();
+	DrainFrameCache(cache, cache.Count);
+
+	RestoreInterrupts(flags);
+}
+
+void GetPhysicalFrameCacheStats(FrameCacheStats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	for(unsigned int cpu = 0; cpu < MaxProcessors; cpu++)
+	{
+		const FrameCache& cache = FrameCaches[cpu];
+
+		stats.AllocHits += cache.Stats.AllocHits;
+		stats.AllocMisses += cache.Stats.AllocMisses;
+		stats.FreeHits += cache.Stats.FreeHits;
+		stats.FreeMisses += cache.Stats.FreeMisses;
+		stats.Refills += cache.Stats.Refills;
+		stats.Drains += cache.Stats.Drains;
+		stats.CachedFrames += cache.Count;
+	}
+}
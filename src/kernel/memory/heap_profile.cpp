@@ -0,0 +1,484 @@
+#include "kernel/memory/heap_profile.h"
+#include "kernel/memory/slab.h"
+#include "kernel/console/console.h"
+#include "kernel/init/apic.h"
+#include "kernel/scheduling/spinlock.h"
+#include "kernel/scheduling/time.h"
+#include "memory/memory.h"
+#include "utilities/termination.h"
+#include "rpmalloc.h"
+
+//Summary of the system
+//---------------------
+// --wrap=rpmalloc makes every call to rpmalloc from another object land in
+// __wrap_rpmalloc instead, which calls through to __real_rpmalloc and records the
+// result. Each allocation gets a record in an address hash pointing at the site that
+// made it, sites are hashed by their captured frames.
+//
+// Records are taken from their slab caches before the profile lock and handed back
+// after it, as the caller may already hold the memory state lock. Each core also has a
+// recording flag so anything the profiler itself ends up allocating isn't recorded.
+//
+// Frees of memory allocated before a reset, or whose record was dropped, are only counted.
+
+#define HEAP_PROFILE_TOP_SITES 16
+
+#if ENABLE_HEAP_PROFILER
+
+struct HeapProfileSite
+{
+	HeapProfileSite* Next;
+	uint64_t Hash;
+	HeapProfileSiteStats Stats;
+};
+
+struct HeapProfileAllocation
+{
+	HeapProfileAllocation* Next;
+	uint64_t Address;
+	uint64_t Size;
+	uint64_t AllocatedAt; //TSC
+	HeapProfileSite* Site;
+};
+
+TypedSlabCache<HeapProfileSite> HeapProfileSiteCache("HeapProfileSite");
+TypedSlabCache<HeapProfileAllocation> HeapProfileAllocationCache("HeapProfileAlloc");
+
+SpinLock HeapProfileLock;
+HeapProfileSite* HeapProfileSites[HEAP_PROFILE_SITE_BUCKETS];
+HeapProfileAllocation* HeapProfileAllocations[HEAP_PROFILE_ALLOCATION_BUCKETS];
+HeapProfileSummary HeapProfileTotals;
+
+bool HeapProfileRecording[MaxProcessors];
+
+static_assert((HEAP_PROFILE_SITE_BUCKETS & (HEAP_PROFILE_SITE_BUCKETS - 1)) == 0, "Bucket counts must be powers of two");
+static_assert((HEAP_PROFILE_ALLOCATION_BUCKETS & (HEAP_PROFILE_ALLOCATION_BUCKETS - 1)) == 0, "Bucket counts must be powers of two");
+
+static uint64_t HashFrames(const uint64_t* frames, uint32_t frameCount)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for(uint32_t frame = 0; frame < frameCount; frame++)
+	{
+		hash = (hash ^ frames[frame]) * 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static uint64_t GetAllocationBucket(uint64_t address)
+{
+	//Allocations are at least 16 byte aligned
+	return ((address >> 4) * 0x9E3779B97F4A7C15ULL) >> 50;
+}
+
+static_assert(HEAP_PROFILE_ALLOCATION_BUCKETS == (1 << (64 - 50)), "GetAllocationBucket shift must match the bucket count");
+
+static HeapProfileSite* FindSite(uint64_t hash, const uint64_t* frames, uint32_t frameCount)
+{
+	HeapProfileSite* site = HeapProfileSites[hash & (HEAP_PROFILE_SITE_BUCKETS - 1)];
+	for(; site; site = site->Next)
+	{
+		if(site->Hash != hash || site->Stats.FrameCount != frameCount)
+		{
+			continue;
+		}
+
+		if(memcmp(site->Stats.Frames, frames, frameCount * sizeof(uint64_t)) == 0)
+		{
+			return site;
+		}
+	}
+
+	return nullptr;
+}
+
+// Returns false if the core is already recording, in which case interrupts are left as they were
+static bool BeginRecording(uint64_t& flags, unsigned int& cpu)
+{
+	flags = SaveAndDisableInterrupts();
+	cpu = GetCurrentCpuIndex();
+
+	if(HeapProfileRecording[cpu])
+	{
+		RestoreInterrupts(flags);
+		return false;
+	}
+
+	HeapProfileRecording[cpu] = true;
+	return true;
+}
+
+static void EndRecording(uint64_t flags, unsigned int cpu)
+{
+	HeapProfileRecording[cpu] = false;
+	RestoreInterrupts(flags);
+}
+
+static void __attribute__((noinline)) RecordAllocation(void* address, uint64_t size)
+{
+	if(address == nullptr)
+	{
+		return;
+	}
+
+	uint64_t flags;
+	unsigned int cpu;
+	if(!BeginRecording(flags, cpu))
+	{
+		return;
+	}
+
+	//Skip ourself and the wrapper
+	uint64_t frames[HEAP_PROFILE_FRAMES];
+	uint32_t frameCount = CaptureStackTrace(frames, HEAP_PROFILE_FRAMES, 2);
+	uint64_t hash = HashFrames(frames, frameCount);
+
+	HeapProfileAllocation* allocation = HeapProfileAllocationCache.Alloc();
+	HeapProfileSite* newSite = nullptr;
+
+	HeapProfileLock.Lock();
+
+	HeapProfileSite* site = FindSite(hash, frames, frameCount);
+	if(site == nullptr)
+	{
+		HeapProfileLock.Unlock();
+		newSite = HeapProfileSiteCache.Alloc();
+		HeapProfileLock.Lock();
+
+		//Someone else may have added it meanwhile
+		site = FindSite(hash, frames, frameCount);
+		if(site == nullptr && newSite != nullptr)
+		{
+			memset(newSite, 0, sizeof(HeapProfileSite));
+			newSite->Hash = hash;
+			newSite->Stats.FrameCount = frameCount;
+			memcpy(newSite->Stats.Frames, frames, frameCount * sizeof(uint64_t));
+
+			HeapProfileSite*& bucket = HeapProfileSites[hash & (HEAP_PROFILE_SITE_BUCKETS - 1)];
+			newSite->Next = bucket;
+			bucket = newSite;
+
+			HeapProfileTotals.Sites++;
+
+			site = newSite;
+			newSite = nullptr;
+		}
+	}
+
+	if(site == nullptr || allocation == nullptr)
+	{
+		HeapProfileTotals.Dropped++;
+	}
+	else
+	{
+		allocation->Address = (uint64_t)address;
+		allocation->Size = size;
+		allocation->AllocatedAt = _rdtsc();
+		allocation->Site = site;
+
+		HeapProfileAllocation*& bucket = HeapProfileAllocations[GetAllocationBucket((uint64_t)address)];
+		allocation->Next = bucket;
+		bucket = allocation;
+		allocation = nullptr;
+
+		site->Stats.Allocations++;
+		site->Stats.LiveBytes += size;
+		site->Stats.TotalBytes += size;
+
+		HeapProfileTotals.Allocations++;
+		HeapProfileTotals.LiveAllocations++;
+		HeapProfileTotals.LiveBytes += size;
+	}
+
+	HeapProfileLock.Unlock();
+
+	if(allocation)
+	{
+		HeapProfileAllocationCache.Free(allocation);
+	}
+
+	if(newSite)
+	{
+		HeapProfileSiteCache.Free(newSite);
+	}
+
+	EndRecording(flags, cpu);
+}
+
+static void RecordFree(void* address)
+{
+	if(address == nullptr)
+	{
+		return;
+	}
+
+	uint64_t flags;
+	unsigned int cpu;
+	if(!BeginRecording(flags, cpu))
+	{
+		return;
+	}
+
+	uint64_t now = _rdtsc();
+
+	HeapProfileLock.Lock();
+
+	HeapProfileAllocation** link = &HeapProfileAllocations[GetAllocationBucket((uint64_t)address)];
+	while(*link && (*link)->Address != (uint64_t)address)
+	{
+		link = &(*link)->Next;
+	}
+
+	HeapProfileAllocation* allocation = *link;
+	if(allocation)
+	{
+		*link = allocation->Next;
+
+		HeapProfileSiteStats& stats = allocation->Site->Stats;
+		stats.Frees++;
+		stats.LiveBytes -= allocation->Size;
+		stats.LifetimeTicks += now - allocation->AllocatedAt;
+
+		HeapProfileTotals.Frees++;
+		HeapProfileTotals.LiveAllocations--;
+		HeapProfileTotals.LiveBytes -= allocation->Size;
+	}
+	else
+	{
+		HeapProfileTotals.UntrackedFrees++;
+	}
+
+	HeapProfileLock.Unlock();
+
+	if(allocation)
+	{
+		HeapProfileAllocationCache.Free(allocation);
+	}
+
+	EndRecording(flags, cpu);
+}
+
+extern "C"
+{
+	void* __real_rpmalloc(size_t size);
+	void* __real_rpcalloc(size_t num, size_t size);
+	void* __real_rprealloc(void* ptr, size_t size);
+	void* __real_rpaligned_alloc(size_t alignment, size_t size);
+	void __real_rpfree(void* ptr);
+
+	void* __attribute__((noinline)) __wrap_rpmalloc(size_t size)
+	{
+		void* result = __real_rpmalloc(size);
+		RecordAllocation(result, size);
+		return result;
+	}
+
+	void* __attribute__((noinline)) __wrap_rpcalloc(size_t num, size_t size)
+	{
+		void* result = __real_rpcalloc(num, size);
+		RecordAllocation(result, num * size);
+		return result;
+	}
+
+	void* __attribute__((noinline)) __wrap_rprealloc(void* ptr, size_t size)
+	{
+		void* result = __real_rprealloc(ptr, size);
+		if(result)
+		{
+			//Charged as a free and a fresh allocation, so the site that grew it gets the bytes
+			RecordFree(ptr);
+			RecordAllocation(result, size);
+		}
+		return result;
+	}
+
+	void* __attribute__((noinline)) __wrap_rpaligned_alloc(size_t alignment, size_t size)
+	{
+		void* result = __real_rpaligned_alloc(alignment, size);
+		RecordAllocation(result, size);
+		return result;
+	}
+
+	void __attribute__((noinline)) __wrap_rpfree(void* ptr)
+	{
+		RecordFree(ptr);
+		__real_rpfree(ptr);
+	}
+}
+
+void GetHeapProfileSummary(HeapProfileSummary& summary)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+	HeapProfileLock.Lock();
+
+	summary = HeapProfileTotals;
+	summary.Enabled = true;
+
+	HeapProfileLock.Unlock();
+	RestoreInterrupts(flags);
+}
+
+static uint64_t GetOrderKey(const HeapProfileSiteStats& stats, HeapProfileOrder order)
+{
+	return order == HeapProfileOrder::LiveBytes ? stats.LiveBytes : stats.Allocations;
+}
+
+uint32_t GetHeapProfileSites(HeapProfileSiteStats* sites, uint32_t maxSites, HeapProfileOrder order)
+{
+	uint32_t count = 0;
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	HeapProfileLock.Lock();
+
+	//Insertion into a short sorted list, maxSites is expected to be small
+	for(uint32_t bucket = 0; bucket < HEAP_PROFILE_SITE_BUCKETS; bucket++)
+	{
+		for(HeapProfileSite* site = HeapProfileSites[bucket]; site; site = site->Next)
+		{
+			uint64_t key = GetOrderKey(site->Stats, order);
+			if(count == maxSites && (count == 0 || key <= GetOrderKey(sites[count - 1], order)))
+			{
+				continue;
+			}
+
+			uint32_t index = count < maxSites ? count++ : count - 1;
+			while(index > 0 && GetOrderKey(sites[index - 1], order) < key)
+			{
+				sites[index] = sites[index - 1];
+				index--;
+			}
+			sites[index] = site->Stats;
+		}
+	}
+
+	HeapProfileLock.Unlock();
+	RestoreInterrupts(flags);
+
+	return count;
+}
+
+void ResetHeapProfile()
+{
+	uint64_t flags;
+	unsigned int cpu;
+	bool recording = BeginRecording(flags, cpu);
+	_ASSERTF(recording, "Heap profile reset from inside the profiler");
+
+	HeapProfileSite* sites = nullptr;
+	HeapProfileAllocation* allocations = nullptr;
+
+	//Unlink everything under the lock, hand it back after
+	HeapProfileLock.Lock();
+
+	for(uint32_t bucket = 0; bucket < HEAP_PROFILE_SITE_BUCKETS; bucket++)
+	{
+		while(HeapProfileSite* site = HeapProfileSites[bucket])
+		{
+			HeapProfileSites[bucket] = site->Next;
+			site->Next = sites;
+			sites = site;
+		}
+	}
+
+	for(uint32_t bucket = 0; bucket < HEAP_PROFILE_ALLOCATION_BUCKETS; bucket++)
+	{
+		while(HeapProfileAllocation* allocation = HeapProfileAllocations[bucket])
+		{
+			HeapProfileAllocations[bucket] = allocation->Next;
+			allocation->Next = allocations;
+			allocations = allocation;
+		}
+	}
+
+	memset(&HeapProfileTotals, 0, sizeof(HeapProfileTotals));
+
+	HeapProfileLock.Unlock();
+
+	while(sites)
+	{
+		HeapProfileSite* next = sites->Next;
+		HeapProfileSiteCache.Free(sites);
+		sites = next;
+	}
+
+	while(allocations)
+	{
+		HeapProfileAllocation* next = allocations->Next;
+		HeapProfileAllocationCache.Free(allocations);
+		allocations = next;
+	}
+
+	EndRecording(flags, cpu);
+}
+
+static void PrintTopSites(const char16_t* title, HeapProfileOrder order)
+{
+	HeapProfileSiteStats sites[HEAP_PROFILE_TOP_SITES];
+	uint32_t count = GetHeapProfileSites(sites, HEAP_PROFILE_TOP_SITES, order);
+
+	SerialPrint(title);
+	for(uint32_t index = 0; index < count; index++)
+	{
+		const HeapProfileSiteStats& site = sites[index];
+
+		LogPrintNumeric(u"  live ", site.LiveBytes, u"", 10);
+		LogPrintNumeric(u" bytes in ", site.Allocations - site.Frees, u"", 10);
+		LogPrintNumeric(u", allocs ", site.Allocations, u"", 10);
+		LogPrintNumeric(u" frees ", site.Frees, u"", 10);
+		LogPrintNumeric(u" total ", site.TotalBytes, u" bytes", 10);
+		LogPrintNumeric(u", avg life ", site.Frees == 0 ? 0 : site.LifetimeTicks / site.Frees, u" ticks\n   ", 10);
+
+		for(uint32_t frame = 0; frame < site.FrameCount; frame++)
+		{
+			LogPrintNumeric(u" 0x", site.Frames[frame], u"", 16);
+		}
+		SerialPrint(u"\n");
+	}
+}
+
+void DumpHeapProfile()
+{
+	HeapProfileSummary summary;
+	GetHeapProfileSummary(summary);
+
+	LogPrintNumeric(u"Heap profile, sites: ", summary.Sites, u"", 10);
+	LogPrintNumeric(u" live: ", summary.LiveBytes, u" bytes", 10);
+	LogPrintNumeric(u" in ", summary.LiveAllocations, u"\n", 10);
+	LogPrintNumeric(u"  allocs: ", summary.Allocations, u"", 10);
+	LogPrintNumeric(u" frees: ", summary.Frees, u"", 10);
+	LogPrintNumeric(u" untracked frees: ", summary.UntrackedFrees, u"", 10);
+	LogPrintNumeric(u" dropped: ", summary.Dropped, u"\n", 10);
+
+	rpmalloc_global_statistics_t heapStats;
+	rpmalloc_global_statistics(&heapStats);
+
+	LogPrintNumeric(u"  rpmalloc mapped: ", heapStats.mapped / 1024, u"KB", 10);
+	LogPrintNumeric(u" peak: ", heapStats.mapped_peak / 1024, u"KB", 10);
+	LogPrintNumeric(u" cached: ", heapStats.cached / 1024, u"KB\n", 10);
+
+	PrintTopSites(u"Top sites by live bytes:\n", HeapProfileOrder::LiveBytes);
+	PrintTopSites(u"Top sites by allocations:\n", HeapProfileOrder::Allocations);
+}
+
+#else
+
+void GetHeapProfileSummary(HeapProfileSummary& summary)
+{
+	memset(&summary, 0, sizeof(summary));
+}
+
+uint32_t GetHeapProfileSites(HeapProfileSiteStats* sites, uint32_t maxSites, HeapProfileOrder order)
+{
+	return 0;
+}
+
+void ResetHeapProfile()
+{
+}
+
+void DumpHeapProfile()
+{
+	SerialPrint(u"Heap profiler disabled, build with HEAP_PROFILER=1\n");
+}
+
+#endif
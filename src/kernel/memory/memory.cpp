@@ -1,4 +1,236 @@
 #include "common/types.h"
+#include "memory/memory.h"
+#include "kernel/init/alternatives.h"
+#include "kernel/init/fpu.h"
+
+// Without this GCC may turn the loops below back into calls to memcpy and memset
+#pragma GCC optimize("no-tree-loop-distribute-patterns")
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) UnalignedWord;
+
+bool HasFastStrings()
+{
+    return IsStaticKeyEnabled(STATIC_KEY_ERMS);
+}
+
+static inline uint64_t RepeatByte(uint8_t value)
+{
+    return value * 0x0101010101010101ULL;
+}
+
+static void CopyBytes(uint8_t* dest, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        dest[i] = src[i];
+    }
+}
+
+static void CopyWords(uint8_t* dest, const uint8_t* src, size_t n)
+{
+    for (; n >= 8; n -= 8) {
+        *(UnalignedWord*)dest = *(const UnalignedWord*)src;
+        dest += 8;
+        src += 8;
+    }
+
+    CopyBytes(dest, src, n);
+}
+
+static void CopyFastStrings(uint8_t* dest, const uint8_t* src, size_t n)
+{
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) :: "memory");
+}
+
+static void CopyNonTemporal(uint8_t* dest, const uint8_t* src, size_t n)
+{
+    //movnti needs an aligned destination, the source can be anywhere
+    size_t head = min((size_t)(-(uintptr_t)dest & 7), n);
+    CopyBytes(dest, src, head);
+    dest += head;
+    src += head;
+    n -= head;
+
+    for (; n >= 32; n -= 32) {
+        uint64_t a = ((const UnalignedWord*)src)[0];
+        uint64_t b = ((const UnalignedWord*)src)[1];
+        uint64_t c = ((const UnalignedWord*)src)[2];
+        uint64_t d = ((const UnalignedWord*)src)[3];
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)dest)[0]) : "r"(a));
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)dest)[1]) : "r"(b));
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)dest)[2]) : "r"(c));
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)dest)[3]) : "r"(d));
+        dest += 32;
+        src += 32;
+    }
+
+    //Non-temporal stores are weakly ordered, make them visible before anything after the copy
+    asm volatile("sfence" ::: "memory");
+
+    CopyWords(dest, src, n);
+}
+
+// pattern is the first 8 bytes to write, repeating
+static void SetBytes(uint8_t* p, uint64_t pattern, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        p[i] = (uint8_t)(pattern >> ((i & 7) * 8));
+    }
+}
+
+static void SetWords(uint8_t* p, uint64_t pattern, size_t n)
+{
+    size_t words = n / 8;
+    for (size_t i = 0; i < words; i++)
+    {
+        ((UnalignedWord*)p)[i] = pattern;
+    }
+
+    SetBytes(p + words * 8, pattern, n & 7);
+}
+
+static void SetFastStrings(uint8_t* p, uint8_t value, size_t n)
+{
+    asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(value) : "memory");
+}
+
+static void SetNonTemporal(uint8_t* p, uint64_t pattern, size_t n)
+{
+    size_t head = min((size_t)(-(uintptr_t)p & 7), n);
+    SetBytes(p, pattern, head);
+    p += head;
+    n -= head;
+
+    //Keep the pattern in phase with the bytes already written
+    if (head != 0)
+    {
+        pattern = (pattern >> (head * 8)) | (pattern << (64 - head * 8));
+    }
+
+    for (; n >= 32; n -= 32)
+    {
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)p)[0]) : "r"(pattern));
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)p)[1]) : "r"(pattern));
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)p)[2]) : "r"(pattern));
+        asm volatile("movnti %1, %0" : "=m"(((uint64_t*)p)[3]) : "r"(pattern));
+        p += 32;
+    }
+
+    asm volatile("sfence" ::: "memory");
+
+    SetWords(p, pattern, n);
+}
+
+void CopyWithStrategy(MemoryStrategy strategy, void* dest, const void* src, size_t n)
+{
+    uint8_t* pdest = (uint8_t*)dest;
+    const uint8_t* psrc = (const uint8_t*)src;
+
+    switch (strategy)
+    {
+    case MemoryStrategy::Bytes:
+        CopyBytes(pdest, psrc, n);
+        break;
+    case MemoryStrategy::Words:
+        CopyWords(pdest, psrc, n);
+        break;
+    case MemoryStrategy::FastStrings:
+        CopyFastStrings(pdest, psrc, n);
+        break;
+    case MemoryStrategy::Vector:
+        if (KernelFpuBegin()) {
+            CopyVectors(pdest, psrc, n);
+            KernelFpuEnd();
+        }
+        else {
+            CopyWords(pdest, psrc, n);
+        }
+        break;
+    case MemoryStrategy::NonTemporal:
+        CopyNonTemporal(pdest, psrc, n);
+        break;
+    }
+}
+
+void SetWithStrategy(MemoryStrategy strategy, void* s, uint8_t value, size_t n)
+{
+    uint8_t* p = (uint8_t*)s;
+
+    switch (strategy)
+    {
+    case MemoryStrategy::Bytes:
+        SetBytes(p, RepeatByte(value), n);
+        break;
+    case MemoryStrategy::Words:
+        SetWords(p, RepeatByte(value), n);
+        break;
+    case MemoryStrategy::FastStrings:
+        SetFastStrings(p, value, n);
+        break;
+    case MemoryStrategy::Vector:
+        if (KernelFpuBegin())
+        {
+            SetVectors(p, value, n);
+            KernelFpuEnd();
+        }
+        else
+        {
+            SetWords(p, RepeatByte(value), n);
+        }
+        break;
+    case MemoryStrategy::NonTemporal:
+        SetNonTemporal(p, RepeatByte(value), n);
+        break;
+    }
+}
+
+// The CPU checks are static branches, so this is just the size compares
+static MemoryStrategy PickStrategy(size_t n)
+{
+    if (n >= MEMORY_NON_TEMPORAL_THRESHOLD)
+    {
+        return MemoryStrategy::NonTemporal;
+    }
+
+    if (STATIC_BRANCH(STATIC_KEY_ERMS))
+    {
+        //rep movsb has a startup cost that only FSRM parts hide on short runs
+        if (n < MEMORY_SHORT_RUN && !STATIC_BRANCH(STATIC_KEY_FSRM))
+        {
+            return MemoryStrategy::Words;
+        }
+
+        return MemoryStrategy::FastStrings;
+    }
+
+    return n >= MEMORY_VECTOR_THRESHOLD ? MemoryStrategy::Vector : MemoryStrategy::Words;
+}
+
+// Fills with a repeating 8 byte pattern, for memset32 and memset64
+static void SetPattern(uint8_t* p, uint64_t pattern, size_t n)
+{
+    MemoryStrategy strategy = PickStrategy(n);
+    bool byteRepeats = pattern == RepeatByte((uint8_t)pattern);
+    if ((strategy == MemoryStrategy::FastStrings || strategy == MemoryStrategy::Vector) && !byteRepeats)
+    {
+        strategy = MemoryStrategy::Words;
+    }
+
+    switch (strategy)
+    {
+    case MemoryStrategy::Bytes:
+    case MemoryStrategy::Words:
+        SetWords(p, pattern, n);
+        break;
+    case MemoryStrategy::FastStrings:
+    case MemoryStrategy::Vector:
+        SetWithStrategy(strategy, p, (uint8_t)pattern, n);
+        break;
+    case MemoryStrategy::NonTemporal:
+        SetNonTemporal(p, pattern, n);
+        break;
+    }
+}
 
 // GCC and Clang reserve the right to generate calls to the following
 // 4 functions even if they are not directly called.
@@ -6,19 +238,14 @@
 // DO NOT remove or rename these functions, or stuff will eventually break!
 // They CAN be moved to a different .c file.
 
-void* memcpy(void* dest, const void* src, size_t n) 
+void* memcpy(void* dest, const void* src, size_t n)
 {
-    uint8_t* pdest = (uint8_t*)dest;
-    const uint8_t* psrc = (const uint8_t*)src;
-
-    for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
-    }
+    CopyWithStrategy(PickStrategy(n), dest, src, n);
 
     return dest;
 }
 
-volatile void* memcpy(volatile void* dest, const void* src, size_t n) 
+volatile void* memcpy(volatile void* dest, const void* src, size_t n)
 {
     volatile uint8_t* pdest = (volatile uint8_t*)dest;
     const uint8_t* psrc = (const uint8_t*)src;
@@ -32,12 +259,7 @@ volatile void* memcpy(volatile void* dest, const void* src, size_t n)
 
 void* memset(void* s, uint8_t value, size_t n)
 {
-    uint8_t* p = (uint8_t*)s;
-
-    for (size_t i = 0; i < n; i++)
-    {
-        p[i] = value;
-    }
+    SetWithStrategy(PickStrategy(n), s, value, n);
 
     return s;
 }
@@ -56,43 +278,36 @@ volatile void* memset(volatile void* s, uint8_t value, size_t n)
 
 void* memset32(void* s, uint32_t value, size_t n)
 {
-    uint32_t* p = (uint32_t*)s;
-
     size_t count = n / sizeof(value);
-    for (size_t i = 0; i < count; i++)
-    {
-        p[i] = value;
-    }
+    SetPattern((uint8_t*)s, value | ((uint64_t)value << 32), count * sizeof(value));
 
     return s;
 }
 
 void* memset64(void* s, uint64_t value, size_t n)
 {
-    uint64_t* p = (uint64_t*)s;
-
     size_t count = n / sizeof(value);
-    for (size_t i = 0; i < count; i++)
-    {
-        p[i] = value;
-    }
+    SetPattern((uint8_t*)s, value, count * sizeof(value));
 
     return s;
 }
 
-void* memmove(void* dest, const void* src, size_t n) 
+void* memmove(void* dest, const void* src, size_t n)
 {
     uint8_t* pdest = (uint8_t*)dest;
     const uint8_t* psrc = (const uint8_t*)src;
 
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
+    //Copying forwards is safe whenever the destination starts below the source
+    if (pdest < psrc || pdest >= psrc + n) {
+        CopyWithStrategy(PickStrategy(n), pdest, psrc, n);
     }
-    else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i - 1] = psrc[i - 1];
+    else if (pdest > psrc) {
+        //Backwards rep movsb isn't a fast string operation, words are quicker
+        for (; n >= 8; n -= 8) {
+            *(UnalignedWord*)(pdest + n - 8) = *(const UnalignedWord*)(psrc + n - 8);
+        }
+        for (; n > 0; n--) {
+            pdest[n - 1] = psrc[n - 1];
         }
     }
 
@@ -0,0 +1,134 @@
+#include "memory/memory.h"
+#include "memory/virtual.h"
+#include "common/string.h"
+#include "kernel/console/console.h"
+#include "kernel/scheduling/time.h"
+
+//Summary of the system
+//---------------------
+// Times each memcpy and memset variant, and the one memcpy/memset would pick, over
+// power of four sizes. Each size is repeated until roughly BENCH_BYTES_PER_SIZE has
+// been moved so the small sizes aren't lost in timer resolution. Results are MB/s.
+
+#define BENCH_MAX_SIZE (4 * 1024 * 1024)
+#define BENCH_BYTES_PER_SIZE (64 * 1024 * 1024)
+#define BENCH_COLUMN_WIDTH 9
+
+static const MemoryStrategy BenchStrategies[] =
+{
+	MemoryStrategy::Bytes,
+	MemoryStrategy::Words,
+	MemoryStrategy::FastStrings,
+	MemoryStrategy::Vector,
+	MemoryStrategy::NonTemporal,
+};
+
+static void PrintColumn(const char16_t* text)
+{
+	int length = 0;
+	while(text[length])
+	{
+		length++;
+	}
+
+	for(; length < BENCH_COLUMN_WIDTH; length++)
+	{
+		SerialPrint(u" ");
+	}
+	SerialPrint(text);
+}
+
+static void PrintNumberColumn(uint64_t value)
+{
+	char16_t buffer[24];
+	witoabuf(buffer, value, 10);
+	PrintColumn(buffer);
+}
+
+static uint64_t ToMegabytesPerSecond(uint64_t bytes, uint64_t nanoseconds)
+{
+	return nanoseconds == 0 ? 0 : (bytes * 1000) / nanoseconds;
+}
+
+static void BenchmarkTable(bool copy, uint8_t* dest, const uint8_t* src)
+{
+	SerialPrint(copy ? u"memcpy MB/s\n" : u"memset MB/s\n");
+	PrintColumn(u"size");
+	PrintColumn(u"bytes");
+	PrintColumn(u"words");
+	PrintColumn(u"erms");
+	PrintColumn(u"sse2");
+	PrintColumn(u"nt");
+	PrintColumn(u"picked");
+	SerialPrint(u"\n");
+
+	for(uint64_t size = 64; size <= BENCH_MAX_SIZE; size *= 4)
+	{
+		uint64_t repeats = BENCH_BYTES_PER_SIZE / size;
+
+		PrintNumberColumn(size);
+
+		//The last column is whatever memcpy/memset pick for this size
+		for(uint64_t column = 0; column <= sizeof(BenchStrategies) / sizeof(BenchStrategies[0]); column++)
+		{
+			bool picked = column == sizeof(BenchStrategies) / sizeof(BenchStrategies[0]);
+			MemoryStrategy strategy = picked ? MemoryStrategy::Bytes : BenchStrategies[column];
+
+			if(!picked && strategy == MemoryStrategy::FastStrings && !HasFastStrings())
+			{
+				PrintColumn(u"-");
+				continue;
+			}
+
+			uint64_t start = HpetGetNanoseconds();
+			for(uint64_t repeat = 0; repeat < repeats; repeat++)
+			{
+				if(picked)
+				{
+					copy ? memcpy(dest, src, size) : memset(dest, (uint8_t)repeat, size);
+				}
+				else if(copy)
+				{
+					CopyWithStrategy(strategy, dest, src, size);
+				}
+				else
+				{
+					SetWithStrategy(strategy, dest, (uint8_t)repeat, size);
+				}
+			}
+			uint64_t elapsed = HpetGetNanoseconds() - start;
+
+			PrintNumberColumn(ToMegabytesPerSecond(size * repeats, elapsed));
+		}
+
+		SerialPrint(u"\n");
+	}
+}
+
+void BenchmarkMemoryRoutines()
+{
+	uint8_t* dest = (uint8_t*)VirtualAlloc(BENCH_MAX_SIZE, PrivilegeLevel::Kernel);
+	uint8_t* src = (uint8_t*)VirtualAlloc(BENCH_MAX_SIZE, PrivilegeLevel::Kernel);
+	if(dest == nullptr || src == nullptr)
+	{
+		SerialPrint(u"Not enough memory to benchmark memory routines\n");
+	}
+	else
+	{
+		FillUnique(src, 0, BENCH_MAX_SIZE);
+		memset(dest, 0, BENCH_MAX_SIZE);
+
+		BenchmarkTable(true, dest, src);
+		BenchmarkTable(false, dest, src);
+	}
+
+	if(dest)
+	{
+		VirtualFree(dest, BENCH_MAX_SIZE);
+	}
+
+	if(src)
+	{
+		VirtualFree(src, BENCH_MAX_SIZE);
+	}
+}
@@ -0,0 +1,83 @@
+#include "common/types.h"
+#include "memory/memory.h"
+
+// Built with SSE2 (VECTOR_CPPFILES in the makefile), nothing here may run outside KernelFpuBegin/End
+
+#pragma GCC optimize("no-tree-loop-distribute-patterns")
+
+typedef long long Vector __attribute__((vector_size(16), may_alias));
+typedef long long UnalignedVector __attribute__((vector_size(16), may_alias, aligned(1)));
+
+void CopyVectors(uint8_t* dest, const uint8_t* src, size_t n)
+{
+	//Stores are aligned, loads take the source wherever it is
+	size_t head = min((size_t)(-(uintptr_t)dest & 15), n);
+	for (size_t i = 0; i < head; i++)
+	{
+		dest[i] = src[i];
+	}
+	dest += head;
+	src += head;
+	n -= head;
+
+	//All four loads come before the stores, which keeps forward overlapping moves safe
+	for (; n >= 64; n -= 64)
+	{
+		Vector a = ((const UnalignedVector*)src)[0];
+		Vector b = ((const UnalignedVector*)src)[1];
+		Vector c = ((const UnalignedVector*)src)[2];
+		Vector d = ((const UnalignedVector*)src)[3];
+		((Vector*)dest)[0] = a;
+		((Vector*)dest)[1] = b;
+		((Vector*)dest)[2] = c;
+		((Vector*)dest)[3] = d;
+		dest += 64;
+		src += 64;
+	}
+
+	for (; n >= 16; n -= 16)
+	{
+		*(Vector*)dest = *(const UnalignedVector*)src;
+		dest += 16;
+		src += 16;
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		dest[i] = src[i];
+	}
+}
+
+void SetVectors(uint8_t* p, uint8_t value, size_t n)
+{
+	size_t head = min((size_t)(-(uintptr_t)p & 15), n);
+	for (size_t i = 0; i < head; i++)
+	{
+		p[i] = value;
+	}
+	p += head;
+	n -= head;
+
+	long long word = (long long)(value * 0x0101010101010101ULL);
+	Vector pattern = { word, word };
+
+	for (; n >= 64; n -= 64)
+	{
+		((Vector*)p)[0] = pattern;
+		((Vector*)p)[1] = pattern;
+		((Vector*)p)[2] = pattern;
+		((Vector*)p)[3] = pattern;
+		p += 64;
+	}
+
+	for (; n >= 16; n -= 16)
+	{
+		*(Vector*)p = pattern;
+		p += 16;
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		p[i] = value;
+	}
+}
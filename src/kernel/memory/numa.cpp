@@ -0,0 +1,390 @@
+#include "kernel/memory/numa.h"
+#include "kernel/memory/state.h"
+#include "kernel/init/bootload.h"
+#include "kernel/init/apic.h"
+#include "kernel/console/console.h"
+#include "memory/memory.h"
+#include "utilities/termination.h"
+
+//Summary of the system
+//---------------------
+// The SRAT is walked once at boot. Every proximity domain it mentions gets the next
+// free node index, up to NUMA_MAX_NODES, anything past that is folded into node 0.
+// Memory affinity entries become a sorted list of ranges so the owner of an address
+// is a binary search. Processor entries fill in a node per APIC ID which InitMADT
+// turns into a node per dense CPU index.
+//
+// The SLIT gives the distance between domains, without one local is 10 and remote
+// is 20 as the spec suggests. Each node gets a fallback order sorted by distance
+// so allocation can spill to the nearest node that still has memory.
+
+uint32_t NumaNodeCount = 1;
+uint32_t NumaNodeDomains[NUMA_MAX_NODES];
+uint32_t NumaDroppedDomains = 0;
+
+NumaMemoryRange NumaMemoryRanges[NUMA_MAX_MEMORY_RANGES];
+uint32_t NumaMemoryRangeCount = 0;
+
+uint8_t NumaDistances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+uint32_t NumaFallbackOrders[NUMA_MAX_NODES][NUMA_MAX_NODES];
+uint32_t NumaFallbackCounts[NUMA_MAX_NODES];
+
+uint8_t ApicIdNumaNodes[MaxProcessors];
+uint8_t CpuNumaNodes[MaxProcessors];
+
+static uint32_t GetNodeForDomain(uint32_t domain)
+{
+	for(uint32_t node = 0; node < NumaNodeCount; node++)
+	{
+		if(NumaNodeDomains[node] == domain)
+		{
+			return node;
+		}
+	}
+
+	if(NumaNodeCount == NUMA_MAX_NODES)
+	{
+		NumaDroppedDomains++;
+		return 0;
+	}
+
+	NumaNodeDomains[NumaNodeCount] = domain;
+	return NumaNodeCount++;
+}
+
+static void AddMemoryRange(uint64_t base, uint64_t length, uint32_t node)
+{
+	uint64_t end = (base + length) & PAGE_MASK;
+	base = (base + PAGE_SIZE - 1) & PAGE_MASK;
+
+	if(base >= end)
+	{
+		return;
+	}
+
+	if(NumaMemoryRangeCount == NUMA_MAX_MEMORY_RANGES)
+	{
+		VerboseLog(u"Too many SRAT memory ranges, the rest belong to node 0\n");
+		return;
+	}
+
+	//Keep the list sorted by base
+	uint32_t index = NumaMemoryRangeCount++;
+	while(index > 0 && NumaMemoryRanges[index - 1].Base > base)
+	{
+		NumaMemoryRanges[index] = NumaMemoryRanges[index - 1];
+		index--;
+	}
+
+	NumaMemoryRanges[index] = { base, end, node };
+}
+
+// Clips overlapping ranges (first one wins) and joins neighbours on the same node
+static void CleanMemoryRanges()
+{
+	uint32_t count = 0;
+	for(uint32_t range = 0; range < NumaMemoryRangeCount; range++)
+	{
+		NumaMemoryRange current = NumaMemoryRanges[range];
+
+		if(count > 0)
+		{
+			NumaMemoryRange& previous = NumaMemoryRanges[count - 1];
+			if(current.Base < previous.End)
+			{
+				current.Base = previous.End;
+			}
+
+			if(current.Base >= current.End)
+			{
+				continue;
+			}
+
+			if(current.Base == previous.End && current.Node == previous.Node)
+			{
+				previous.End = current.End;
+				continue;
+			}
+		}
+
+		NumaMemoryRanges[count++] = current;
+	}
+
+	NumaMemoryRangeCount = count;
+}
+
+static void ParseSrat(EFI_ACPI_6_1_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat)
+{
+	NumaNodeCount = 0;
+
+	int LengthRemaining = Srat->Header.Length - sizeof(EFI_ACPI_6_1_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER);
+	uint8_t* Data = (uint8_t*)(Srat+1);
+	while(LengthRemaining > 0)
+	{
+		uint8_t Type = *Data;
+		uint8_t Length = *(Data+1);
+
+		if(Length == 0)
+		{
+			break;
+		}
+
+		switch(Type)
+		{
+			case EFI_ACPI_6_1_PROCESSOR_LOCAL_APIC_SAPIC_AFFINITY:
+				{
+					EFI_ACPI_6_1_PROCESSOR_LOCAL_APIC_SAPIC_AFFINITY_STRUCTURE* Affinity = (EFI_ACPI_6_1_PROCESSOR_LOCAL_APIC_SAPIC_AFFINITY_STRUCTURE*)Data;
+					if(Affinity->Flags & EFI_ACPI_6_1_PROCESSOR_LOCAL_APIC_SAPIC_ENABLED)
+					{
+						uint32_t Domain = Affinity->ProximityDomain7To0 |
+							(Affinity->ProximityDomain31To8[0] << 8) |
+							(Affinity->ProximityDomain31To8[1] << 16) |
+							(Affinity->ProximityDomain31To8[2] << 24);
+
+						ApicIdNumaNodes[Affinity->ApicId] = (uint8_t)GetNodeForDomain(Domain);
+					}
+					break;
+				}
+
+			case EFI_ACPI_6_1_PROCESSOR_LOCAL_X2APIC_AFFINITY:
+				{
+					EFI_ACPI_6_1_PROCESSOR_LOCAL_X2APIC_AFFINITY_STRUCTURE* Affinity = (EFI_ACPI_6_1_PROCESSOR_LOCAL_X2APIC_AFFINITY_STRUCTURE*)Data;
+
+					//We only run in xAPIC mode so larger IDs can't be ours
+					if((Affinity->Flags & EFI_ACPI_6_1_PROCESSOR_LOCAL_X2APIC_ENABLED) && Affinity->X2ApicId < MaxProcessors)
+					{
+						ApicIdNumaNodes[Affinity->X2ApicId] = (uint8_t)GetNodeForDomain(Affinity->ProximityDomain);
+					}
+					break;
+				}
+
+			case EFI_ACPI_6_1_MEMORY_AFFINITY:
+				{
+					EFI_ACPI_6_1_MEMORY_AFFINITY_STRUCTURE* Affinity = (EFI_ACPI_6_1_MEMORY_AFFINITY_STRUCTURE*)Data;
+					if(Affinity->Flags & EFI_ACPI_6_1_MEMORY_ENABLED)
+					{
+						uint64_t Base = ((uint64_t)Affinity->AddressBaseHigh << 32) | Affinity->AddressBaseLow;
+						uint64_t Length = ((uint64_t)Affinity->LengthHigh << 32) | Affinity->LengthLow;
+
+						AddMemoryRange(Base, Length, GetNodeForDomain(Affinity->ProximityDomain));
+					}
+					break;
+				}
+		}
+
+		LengthRemaining -= Length;
+		Data += Length;
+	}
+
+	if(NumaNodeCount == 0)
+	{
+		NumaNodeDomains[0] = 0;
+		NumaNodeCount = 1;
+	}
+
+	CleanMemoryRanges();
+}
+
+static void ParseSlit(EFI_ACPI_6_1_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_HEADER* Slit)
+{
+	uint64_t Localities = Slit->NumberOfSystemLocalities;
+	if(Slit->Header.Length < sizeof(EFI_ACPI_6_1_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_HEADER) + (Localities * Localities))
+	{
+		VerboseLog(u"SLIT is truncated, ignoring it\n");
+		return;
+	}
+
+	const uint8_t* Matrix = (const uint8_t*)(Slit+1);
+
+	for(uint32_t from = 0; from < NumaNodeCount; from++)
+	{
+		for(uint32_t to = 0; to < NumaNodeCount; to++)
+		{
+			uint32_t FromDomain = NumaNodeDomains[from];
+			uint32_t ToDomain = NumaNodeDomains[to];
+
+			if(FromDomain < Localities && ToDomain < Localities)
+			{
+				NumaDistances[from][to] = Matrix[(FromDomain * Localities) + ToDomain];
+			}
+		}
+	}
+}
+
+static void BuildFallbackOrders()
+{
+	for(uint32_t node = 0; node < NumaNodeCount; node++)
+	{
+		uint32_t* order = NumaFallbackOrders[node];
+		uint32_t count = 0;
+
+		order[count++] = node;
+
+		for(uint32_t other = 0; other < NumaNodeCount; other++)
+		{
+			uint8_t distance = NumaDistances[node][other];
+			if(other == node || distance == NUMA_UNREACHABLE_DISTANCE)
+			{
+				continue;
+			}
+
+			//Insertion sort, ties stay in node order
+			uint32_t index = count++;
+			while(index > 1 && NumaDistances[node][order[index - 1]] > distance)
+			{
+				order[index] = order[index - 1];
+				index--;
+			}
+			order[index] = other;
+		}
+
+		NumaFallbackCounts[node] = count;
+	}
+}
+
+void InitNumaTopology(KernelBootData* bootData)
+{
+	memset(ApicIdNumaNodes, 0, sizeof(ApicIdNumaNodes));
+	memset(CpuNumaNodes, 0, sizeof(CpuNumaNodes));
+
+	NumaNodeCount = 1;
+	NumaNodeDomains[0] = 0;
+	NumaMemoryRangeCount = 0;
+
+	EFI_ACPI_6_1_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat = nullptr;
+	EFI_ACPI_6_1_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_HEADER* Slit = nullptr;
+
+	EFI_ACPI_DESCRIPTION_HEADER* Xsdt = bootData->Xsdt;
+	if(Xsdt)
+	{
+		int XsdtEntries = (Xsdt->Length - sizeof(EFI_ACPI_DESCRIPTION_HEADER)) / sizeof(EFI_ACPI_DESCRIPTION_HEADER*);
+		for(int XsdtEntry = 0; XsdtEntry < XsdtEntries; XsdtEntry++)
+		{
+			EFI_ACPI_DESCRIPTION_HEADER* Header = ((EFI_ACPI_DESCRIPTION_HEADER**)(Xsdt+1))[XsdtEntry];
+
+			if(Header->Signature == EFI_ACPI_6_1_SYSTEM_RESOURCE_AFFINITY_TABLE_SIGNATURE)
+			{
+				Srat = (EFI_ACPI_6_1_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER*)Header;
+			}
+			else if(Header->Signature == EFI_ACPI_6_1_SYSTEM_LOCALITY_INFORMATION_TABLE_SIGNATURE)
+			{
+				Slit = (EFI_ACPI_6_1_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_HEADER*)Header;
+			}
+		}
+	}
+
+	if(Srat)
+	{
+		ParseSrat(Srat);
+	}
+
+	for(uint32_t from = 0; from < NUMA_MAX_NODES; from++)
+	{
+		for(uint32_t to = 0; to < NUMA_MAX_NODES; to++)
+		{
+			NumaDistances[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+		}
+	}
+
+	if(Srat && Slit)
+	{
+		ParseSlit(Slit);
+	}
+
+	BuildFallbackOrders();
+
+#if VERBOSE_LOGGING
+	LogPrintNumeric(u"NUMA nodes: ", NumaNodeCount, u"\n", 10);
+	if(NumaDroppedDomains != 0)
+	{
+		LogPrintNumeric(u"Proximity domains folded into node 0: ", NumaDroppedDomains, u"\n", 10);
+	}
+
+	for(uint32_t range = 0; range < NumaMemoryRangeCount; range++)
+	{
+		const NumaMemoryRange& memoryRange = NumaMemoryRanges[range];
+		LogPrintNumeric(u"Node ", memoryRange.Node, u": ", 10);
+		LogPrintNumeric(u"", memoryRange.Base, u" - ");
+		LogPrintNumeric(u"", memoryRange.End, u"\n");
+	}
+#endif
+}
+
+uint32_t GetNumaNodeCount()
+{
+	return NumaNodeCount;
+}
+
+uint32_t GetNumaMemoryRangeCount()
+{
+	return NumaMemoryRangeCount;
+}
+
+const NumaMemoryRange& GetNumaMemoryRange(uint32_t index)
+{
+	_ASSERTF(index < NumaMemoryRangeCount, "NUMA range out of bounds");
+	return NumaMemoryRanges[index];
+}
+
+uint32_t GetNumaNodeSpan(uint64_t address, uint64_t& spanEnd)
+{
+	//Find the first range that ends after the address
+	uint32_t low = 0;
+	uint32_t high = NumaMemoryRangeCount;
+	while(low < high)
+	{
+		uint32_t mid = (low + high) / 2;
+		if(NumaMemoryRanges[mid].End <= address)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	if(low == NumaMemoryRangeCount)
+	{
+		spanEnd = ~0ULL;
+		return 0;
+	}
+
+	const NumaMemoryRange& range = NumaMemoryRanges[low];
+	if(address >= range.Base)
+	{
+		spanEnd = range.End;
+		return range.Node;
+	}
+
+	//In a gap before the range, gaps belong to node 0
+	spanEnd = range.Base;
+	return 0;
+}
+
+uint8_t GetNumaDistance(uint32_t fromNode, uint32_t toNode)
+{
+	return NumaDistances[fromNode][toNode];
+}
+
+uint32_t GetNumaFallbackOrder(uint32_t node, const uint32_t*& order)
+{
+	order = NumaFallbackOrders[node];
+	return NumaFallbackCounts[node];
+}
+
+void SetCpuNumaNode(unsigned int cpuIndex, uint32_t apicId)
+{
+	CpuNumaNodes[cpuIndex] = apicId < MaxProcessors ? ApicIdNumaNodes[apicId] : 0;
+}
+
+uint32_t GetCurrentNumaNode()
+{
+	//Skip the APIC read on the common single node machine
+	if(NumaNodeCount == 1)
+	{
+		return 0;
+	}
+
+	return CpuNumaNodes[GetCurrentCpuIndex()];
+}
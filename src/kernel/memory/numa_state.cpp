@@ -0,0 +1,222 @@
+#include "kernel/memory/numa_state.h"
+#include "kernel/console/console.h"
+#include "memory/memory.h"
+#include "utilities/termination.h"
+
+//Summary of the system
+//---------------------
+// Node 0 owns every address the SRAT doesn't give to another node, so its tree only
+// reserves the other nodes' ranges. The other trees reserve everything but their own
+// ranges. Reserved never changes once set, so after Init each tree can only ever
+// hand out or track memory that belongs to its node.
+//
+// The node trees use SystemIndex 16 + node so only this wrapper is recorded in the
+// memory state trace.
+
+#define NUMA_NODE_SYSTEM_INDEX 16
+
+void NumaMemoryState::Init(int systemIndex, const uint64_t highestAddress)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(systemIndex == 0)
+	{
+		RecordMemoryStateInit(highestAddress);
+	}
+#endif
+
+	SystemIndex = systemIndex;
+	HighestAddress = highestAddress;
+	NodeCount = GetNumaNodeCount();
+
+	for(uint32_t node = 0; node < NodeCount; node++)
+	{
+		Nodes[node].Init(NUMA_NODE_SYSTEM_INDEX + node, highestAddress);
+		ReserveForeignRanges(node);
+	}
+}
+
+void NumaMemoryState::ReserveForeignRanges(uint32_t node)
+{
+	MemoryState& state = Nodes[node];
+
+	uint64_t ownedTo = 0;
+	for(uint32_t index = 0; index < GetNumaMemoryRangeCount(); index++)
+	{
+		const NumaMemoryRange& range = GetNumaMemoryRange(index);
+		if(range.Base >= HighestAddress)
+		{
+			break;
+		}
+
+		uint64_t end = range.End < HighestAddress ? range.End : HighestAddress;
+
+		if(node == 0)
+		{
+			if(range.Node != 0)
+			{
+				state.TagRange(range.Base, end, RangeState::Reserved);
+			}
+			continue;
+		}
+
+		if(range.Node != node)
+		{
+			continue;
+		}
+
+		if(range.Base > ownedTo)
+		{
+			state.TagRange(ownedTo, range.Base, RangeState::Reserved);
+		}
+		ownedTo = end;
+	}
+
+	if(node != 0 && ownedTo < HighestAddress)
+	{
+		state.TagRange(ownedTo, HighestAddress, RangeState::Reserved);
+	}
+}
+
+void NumaMemoryState::InitDynamic()
+{
+	for(uint32_t node = 0; node < NodeCount; node++)
+	{
+		Nodes[node].InitDynamic();
+	}
+}
+
+void NumaMemoryState::TagRange(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(SystemIndex == 0)
+	{
+		RecordMemoryStateTag(LowAddress, HighAddress, (uint8_t)State);
+	}
+#endif
+
+	if(NodeCount == 1)
+	{
+		Nodes[0].TagRange(LowAddress, HighAddress, State);
+		return;
+	}
+
+	uintptr_t address = LowAddress;
+	while(address < HighAddress)
+	{
+		uint64_t spanEnd;
+		uint32_t node = GetNumaNodeSpan(address, spanEnd);
+		if(spanEnd > HighAddress)
+		{
+			spanEnd = HighAddress;
+		}
+
+		Nodes[node].TagRange(address, spanEnd, State);
+		address = spanEnd;
+	}
+}
+
+uintptr_t NumaMemoryState::FindMinimumSizeFreeBlock(uint64_t MinSize)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(SystemIndex == 0)
+	{
+		RecordMemoryStateFind(MinSize);
+	}
+#endif
+
+	const uint32_t* order;
+	uint32_t count = GetNumaFallbackOrder(GetCurrentNumaNode(), order);
+
+	for(uint32_t index = 0; index < count; index++)
+	{
+		uintptr_t address = Nodes[order[index]].FindMinimumSizeFreeBlock(MinSize);
+		if(address != 0)
+		{
+			return address;
+		}
+	}
+
+	return 0;
+}
+
+uintptr_t NumaMemoryState::FindAlignedFreeBlock(uint64_t MinSize, uint64_t Alignment)
+{
+	const uint32_t* order;
+	uint32_t count = GetNumaFallbackOrder(GetCurrentNumaNode(), order);
+
+	for(uint32_t index = 0; index < count; index++)
+	{
+		uintptr_t address = Nodes[order[index]].FindAlignedFreeBlock(MinSize, Alignment);
+		if(address != 0)
+		{
+			return address;
+		}
+	}
+
+	return 0;
+}
+
+MemoryState::RangeState NumaMemoryState::GetPageState(const uint64_t Address)
+{
+	uint64_t spanEnd;
+	return Nodes[GetNumaNodeSpan(Address, spanEnd)].GetPageState(Address);
+}
+
+uint64_t NumaMemoryState::GetFreeBytes()
+{
+	uint64_t freeBytes = 0;
+	for(uint32_t node = 0; node < NodeCount; node++)
+	{
+		freeBytes += Nodes[node].GetFreeBytes();
+	}
+
+	return freeBytes;
+}
+
+uint64_t NumaMemoryState::GetLargestFreeBlock()
+{
+	uint64_t largest = 0;
+	for(uint32_t node = 0; node < NodeCount; node++)
+	{
+		uint64_t nodeLargest = Nodes[node].GetLargestFreeBlock();
+		if(nodeLargest > largest)
+		{
+			largest = nodeLargest;
+		}
+	}
+
+	return largest;
+}
+
+void NumaMemoryState::GetFreeRunHistogram(uint64_t* Buckets, int BucketCount)
+{
+	memset(Buckets, 0, BucketCount * sizeof(uint64_t));
+
+	uint64_t nodeBuckets[64];
+	_ASSERTF(BucketCount <= 64, "Too many histogram buckets");
+
+	for(uint32_t node = 0; node < NodeCount; node++)
+	{
+		Nodes[node].GetFreeRunHistogram(nodeBuckets, BucketCount);
+		for(int bucket = 0; bucket < BucketCount; bucket++)
+		{
+			Buckets[bucket] += nodeBuckets[bucket];
+		}
+	}
+}
+
+void NumaMemoryState::GetNodeUsage(uint64_t& usedBranches, uint64_t& usedLeaves, uint64_t& freeBranches, uint64_t& freeLeaves) const
+{
+	usedBranches = usedLeaves = freeBranches = freeLeaves = 0;
+
+	for(uint32_t node = 0; node < NodeCount; node++)
+	{
+		uint64_t nodeUsage[4];
+		Nodes[node].GetNodeUsage(nodeUsage[0], nodeUsage[1], nodeUsage[2], nodeUsage[3]);
+
+		usedBranches += nodeUsage[0];
+		usedLeaves += nodeUsage[1];
+		freeBranches += nodeUsage[2];
+		freeLeaves += nodeUsage[3];
+	}
+}
@@ -0,0 +1,642 @@
+#include "kernel/memory/page_cache.h"
+#include "kernel/memory/frame_cache.h"
+#include "kernel/memory/pml4.h"
+#include "kernel/memory/physmap.h"
+#include "kernel/memory/state.h"
+#include "kernel/scheduling/spinlock.h"
+#include "memory/memory.h"
+#include "memory/virtual.h"
+#include "utilities/termination.h"
+
+#include <rpmalloc.h>
+
+//Summary of the system
+//---------------------
+// Cached pages are keyed by volume, file identity and page index, so two handles to
+// the same file share frames. Entries are carved out of whole frames rather than
+// rpmalloc as misses are taken from the fault handler, which can run on an AP.
+//
+// Each mapping records the handle it reads through. A MappedFile counts the mappings
+// (plus any read in flight) per handle, so closing the handle while it's still mapped
+// only marks it, and the real close happens when the count drops to zero.
+//
+// The lock is never held across VolumeRead. A miss reads into a fresh frame unlocked,
+// then checks nobody else cached the page in the meantime before inserting it. Nor is
+// the memory state lock, every other core would wait on the disk, so a miss taken by
+// code that holds it is a bug.
+
+struct PageCacheEntry
+{
+	uint64_t Volume; //Handle with the file bits cleared
+	uint64_t Identity;
+	uint64_t PageIndex;
+	uint64_t Frame;
+	PageCacheEntry* Next;
+};
+
+struct MappedFile
+{
+	VolumeFileHandle Handle;
+	uint64_t Volume;
+	uint64_t Identity;
+	uint64_t References;
+	bool ClosePending;
+	MappedFile* Next;
+};
+
+struct FileMapping
+{
+	uint64_t Start;
+	uint64_t End;
+	uint64_t FileOffset; //Of Start
+	MappedFile* File;
+	FileMapping* Next;
+};
+
+SpinLock PageCacheLock;
+
+PageCacheEntry* PageCacheBuckets[PAGE_CACHE_BUCKETS];
+PageCacheEntry* FreePageCacheEntries = nullptr;
+
+MappedFile* MappedFiles = nullptr;
+FileMapping* FileMappings = nullptr;
+
+PageCacheStats PageCacheCounters;
+
+static uint64_t GetVolumeKey(VolumeFileHandle handle)
+{
+	FileHandleMask FH;
+	FH.FileHandle = handle;
+	FH.S.FileHandle = 0;
+
+	return FH.FileHandle;
+}
+
+static PageCacheEntry** GetBucket(uint64_t volume, uint64_t identity, uint64_t pageIndex)
+{
+	uint64_t hash = (identity * 0x9E3779B97F4A7C15ULL) ^ (pageIndex * 0xC2B2AE3D27D4EB4FULL) ^ volume;
+	return &PageCacheBuckets[(hash >> 32) % PAGE_CACHE_BUCKETS];
+}
+
+static PageCacheEntry* FindEntry(uint64_t volume, uint64_t identity, uint64_t pageIndex)
+{
+	for(PageCacheEntry* entry = *GetBucket(volume, identity, pageIndex); entry; entry = entry->Next)
+	{
+		if(entry->Volume == volume && entry->Identity == identity && entry->PageIndex == pageIndex)
+		{
+			return entry;
+		}
+	}
+
+	return nullptr;
+}
+
+// Lock must be held
+static PageCacheEntry* AllocateEntry()
+{
+	if(FreePageCacheEntries == nullptr)
+	{
+		uint64_t frame = AllocatePhysicalFrame();
+		if(frame == 0)
+		{
+			return nullptr;
+		}
+
+		PageCacheEntry* entries = (PageCacheEntry*)PhysToVirt(frame);
+		for(uint64_t index = 0; index < PAGE_SIZE / sizeof(PageCacheEntry); index++)
+		{
+			entries[index].Next = FreePageCacheEntries;
+			FreePageCacheEntries = &entries[index];
+		}
+	}
+
+	PageCacheEntry* entry = FreePageCacheEntries;
+	FreePageCacheEntries = entry->Next;
+	return entry;
+}
+
+// Lock must be held
+static MappedFile* FindMappedFile(VolumeFileHandle handle)
+{
+	for(MappedFile* file = MappedFiles; file; file = file->Next)
+	{
+		if(file->Handle == handle)
+		{
+			return file;
+		}
+	}
+
+	return nullptr;
+}
+
+// Lock must be held. Returns the record once the last reference is gone, the caller
+// frees it unlocked and closes the handle if ClosePending is set.
+static MappedFile* ReleaseMappedFile(MappedFile* file)
+{
+	_ASSERTF(file->References > 0, "Mapped file released too many times");
+
+	if(--file->References > 0)
+	{
+		return nullptr;
+	}
+
+	for(MappedFile** link = &MappedFiles; *link; link = &(*link)->Next)
+	{
+		if(*link == file)
+		{
+			*link = file->Next;
+			break;
+		}
+	}
+
+	return file;
+}
+
+static void FinishReleasedFile(MappedFile* file)
+{
+	VolumeFileHandle handle = file->Handle;
+	bool closePending = file->ClosePending;
+	rpfree(file);
+
+	if(closePending)
+	{
+		VolumeCloseHandle(handle);
+	}
+}
+
+bool MapFileLazily(VolumeFileHandle handle, void* address, uint64_t size, uint64_t fileOffset, bool writable, bool executable)
+{
+	if((fileOffset & (PAGE_SIZE - 1)) != 0 || ((uint64_t)address & (PAGE_SIZE - 1)) != 0 || size == 0)
+	{
+		return false;
+	}
+
+	uint64_t identity = VolumeGetIdentity(handle);
+	if(identity == 0)
+	{
+		return false;
+	}
+
+	//Allocated up front so nothing is allocated with the lock held
+	FileMapping* mapping = (FileMapping*)rpmalloc(sizeof(FileMapping));
+	MappedFile* newFile = (MappedFile*)rpmalloc(sizeof(MappedFile));
+	if(mapping == nullptr || newFile == nullptr)
+	{
+		//Nothing has been recorded yet
+		if(mapping)
+		{
+			rpfree(mapping);
+		}
+		if(newFile)
+		{
+			rpfree(newFile);
+		}
+		return false;
+	}
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	MappedFile* file = FindMappedFile(handle);
+	if(file == nullptr)
+	{
+		file = newFile;
+		newFile = nullptr;
+
+		file->Handle = handle;
+		file->Volume = GetVolumeKey(handle);
+		file->Identity = identity;
+		file->References = 0;
+		file->ClosePending = false;
+		file->Next = MappedFiles;
+		MappedFiles = file;
+	}
+
+	file->References++;
+
+	mapping->Start = (uint64_t)address;
+	mapping->End = (uint64_t)address + AlignSize(size, PAGE_SIZE);
+	mapping->FileOffset = fileOffset;
+	mapping->File = file;
+	mapping->Next = FileMappings;
+	FileMappings = mapping;
+
+	PageCacheCounters.Mappings++;
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+
+	if(newFile)
+	{
+		rpfree(newFile);
+	}
+
+	MapFileBackedPages((uint64_t)address, AlignSize(size, PAGE_SIZE), writable, executable, PrivilegeLevel::User);
+
+	return true;
+}
+
+FileMapping* CopyFileMappings()
+{
+	FileMapping* spares = nullptr;
+	uint64_t spareCount = 0;
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	//Allocate unlocked and count again until there are enough, the list may have grown
+	for(;;)
+	{
+		uint64_t count = 0;
+		for(FileMapping* mapping = FileMappings; mapping; mapping = mapping->Next)
+		{
+			count++;
+		}
+
+		if(count <= spareCount)
+		{
+			break;
+		}
+
+		PageCacheLock.Unlock();
+		RestoreInterrupts(flags);
+
+		for(; spareCount < count; spareCount++)
+		{
+			FileMapping* spare = (FileMapping*)rpmalloc(sizeof(FileMapping));
+			spare->Next = spares;
+			spares = spare;
+		}
+
+		flags = SaveAndDisableInterrupts();
+		PageCacheLock.Lock();
+	}
+
+	//The copies hold their own references, so nothing closes under them
+	FileMapping* copies = nullptr;
+	FileMapping** tail = &copies;
+	for(FileMapping* mapping = FileMappings; mapping; mapping = mapping->Next)
+	{
+		FileMapping* copy = spares;
+		spares = spares->Next;
+
+		*copy = *mapping;
+		copy->Next = nullptr;
+		copy->File->References++;
+
+		*tail = copy;
+		tail = &copy->Next;
+	}
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+
+	while(spares)
+	{
+		FileMapping* next = spares->Next;
+		rpfree(spares);
+		spares = next;
+	}
+
+	return copies;
+}
+
+void RestoreFileMappings(FileMapping* mappings)
+{
+	MappedFile* releasedFiles = nullptr;
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	FileMapping* released = FileMappings;
+	for(FileMapping* mapping = released; mapping; mapping = mapping->Next)
+	{
+		PageCacheCounters.Mappings--;
+
+		MappedFile* file = ReleaseMappedFile(mapping->File);
+		if(file)
+		{
+			file->Next = releasedFiles;
+			releasedFiles = file;
+		}
+	}
+
+	FileMappings = mappings;
+	for(FileMapping* mapping = mappings; mapping; mapping = mapping->Next)
+	{
+		PageCacheCounters.Mappings++;
+	}
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+
+	while(released)
+	{
+		FileMapping* next = released->Next;
+		rpfree(released);
+		released = next;
+	}
+
+	while(releasedFiles)
+	{
+		MappedFile* next = releasedFiles->Next;
+		FinishReleasedFile(releasedFiles);
+		releasedFiles = next;
+	}
+}
+
+bool ReleaseFileMappings(uint64_t virtualAddress, uint64_t size)
+{
+	uint64_t start = virtualAddress & ~(PAGE_SIZE - 1);
+	uint64_t end = AlignSize(virtualAddress + size, PAGE_SIZE);
+
+	//Unmapping the middle of a mapping splits it in two
+	FileMapping* spare = nullptr;
+	FileMapping* released = nullptr;
+	MappedFile* releasedFiles = nullptr;
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	bool overlapped = false;
+	for(FileMapping** link = &FileMappings; *link;)
+	{
+		FileMapping* mapping = *link;
+		if(mapping->End <= start || mapping->Start >= end)
+		{
+			link = &mapping->Next;
+			continue;
+		}
+
+		if(mapping->Start < start && mapping->End > end)
+		{
+			if(spare == nullptr)
+			{
+				//Allocate unlocked and look again, the list may have changed
+				PageCacheLock.Unlock();
+				RestoreInterrupts(flags);
+
+				spare = (FileMapping*)rpmalloc(sizeof(FileMapping));
+
+				flags = SaveAndDisableInterrupts();
+				PageCacheLock.Lock();
+				link = &FileMappings;
+				continue;
+			}
+
+			spare->Start = end;
+			spare->End = mapping->End;
+			spare->FileOffset = mapping->FileOffset + (end - mapping->Start);
+			spare->File = mapping->File;
+			spare->Next = mapping->Next;
+			mapping->End = start;
+			mapping->Next = spare;
+			mapping->File->References++;
+			PageCacheCounters.Mappings++;
+			spare = nullptr;
+
+			//Mappings never overlap, so nothing else can be in the range
+			overlapped = true;
+			break;
+		}
+
+		overlapped = true;
+
+		if(mapping->Start < start)
+		{
+			mapping->End = start;
+			link = &mapping->Next;
+			continue;
+		}
+
+		if(mapping->End > end)
+		{
+			mapping->FileOffset += end - mapping->Start;
+			mapping->Start = end;
+			link = &mapping->Next;
+			continue;
+		}
+
+		//Entirely covered
+		*link = mapping->Next;
+		PageCacheCounters.Mappings--;
+
+		MappedFile* file = ReleaseMappedFile(mapping->File);
+		if(file)
+		{
+			file->Next = releasedFiles;
+			releasedFiles = file;
+		}
+
+		mapping->Next = released;
+		released = mapping;
+	}
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+
+	if(spare)
+	{
+		rpfree(spare);
+	}
+
+	while(released)
+	{
+		FileMapping* next = released->Next;
+		rpfree(released);
+		released = next;
+	}
+
+	while(releasedFiles)
+	{
+		MappedFile* next = releasedFiles->Next;
+		FinishReleasedFile(releasedFiles);
+		releasedFiles = next;
+	}
+
+	return overlapped;
+}
+
+uint64_t GetFileMappingFrame(uint64_t virtualAddress)
+{
+	uint64_t page = virtualAddress & ~(PAGE_SIZE - 1);
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	FileMapping* mapping = FileMappings;
+	for(; mapping; mapping = mapping->Next)
+	{
+		if(page >= mapping->Start && page < mapping->End)
+		{
+			break;
+		}
+	}
+
+	if(mapping == nullptr)
+	{
+		PageCacheLock.Unlock();
+		RestoreInterrupts(flags);
+		return 0;
+	}
+
+	MappedFile* file = mapping->File;
+	uint64_t pageIndex = (mapping->FileOffset + (page - mapping->Start)) / PAGE_SIZE;
+
+	PageCacheEntry* entry = FindEntry(file->Volume, file->Identity, pageIndex);
+	if(entry)
+	{
+		uint64_t frame = entry->Frame;
+		PageCacheCounters.Hits++;
+
+		PageCacheLock.Unlock();
+		RestoreInterrupts(flags);
+		return frame;
+	}
+
+	//Re-entrant, so a fault under an outer acquire would keep it held for the whole read
+	_ASSERTF(!IsMemoryStateLockHeld(), "File page read in with the memory state lock held");
+
+	//Keeps the handle open while we read through it unlocked
+	file->References++;
+	VolumeFileHandle handle = file->Handle;
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+
+	uint64_t frame = AllocatePhysicalFrame();
+	if(frame != 0)
+	{
+		uint8_t* data = (uint8_t*)PhysToVirt(frame);
+		uint64_t bytesRead = VolumeRead(handle, pageIndex * PAGE_SIZE, data, PAGE_SIZE);
+		if((int64_t)bytesRead < 0)
+		{
+			bytesRead = 0;
+		}
+
+		//Past the end of the file reads as zero
+		memset(data + bytesRead, 0, PAGE_SIZE - bytesRead);
+	}
+
+	uint64_t duplicate = 0;
+
+	flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	if(frame != 0)
+	{
+		entry = FindEntry(file->Volume, file->Identity, pageIndex);
+		if(entry)
+		{
+			//Someone else read it while we were
+			duplicate = frame;
+			frame = entry->Frame;
+			PageCacheCounters.Hits++;
+		}
+		else if((entry = AllocateEntry()) != nullptr)
+		{
+			PageCacheEntry** bucket = GetBucket(file->Volume, file->Identity, pageIndex);
+			entry->Volume = file->Volume;
+			entry->Identity = file->Identity;
+			entry->PageIndex = pageIndex;
+			entry->Frame = frame;
+			entry->Next = *bucket;
+			*bucket = entry;
+
+			PageCacheCounters.Misses++;
+			PageCacheCounters.CachedPages++;
+		}
+		else
+		{
+			duplicate = frame;
+			frame = 0;
+		}
+	}
+
+	MappedFile* releasedFile = ReleaseMappedFile(file);
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+
+	if(duplicate)
+	{
+		FreePhysicalFrame(duplicate);
+	}
+
+	if(releasedFile)
+	{
+		FinishReleasedFile(releasedFile);
+	}
+
+	return frame;
+}
+
+bool DeferCloseWhileMapped(VolumeFileHandle handle)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	MappedFile* file = FindMappedFile(handle);
+	if(file)
+	{
+		file->ClosePending = true;
+	}
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+
+	return file != nullptr;
+}
+
+void UpdatePageCache(VolumeFileHandle handle, uint64_t offset, const void* buffer, uint64_t size)
+{
+	uint64_t identity = VolumeGetIdentity(handle);
+	if(identity == 0)
+	{
+		return;
+	}
+
+	uint64_t volume = GetVolumeKey(handle);
+	const uint8_t* source = (const uint8_t*)buffer;
+	uint64_t end = offset + size;
+
+	while(offset < end)
+	{
+		uint64_t pageIndex = offset / PAGE_SIZE;
+		uint64_t pageOffset = offset & (PAGE_SIZE - 1);
+		uint64_t bytes = PAGE_SIZE - pageOffset;
+		if(bytes > end - offset)
+		{
+			bytes = end - offset;
+		}
+
+		uint64_t flags = SaveAndDisableInterrupts();
+		PageCacheLock.Lock();
+
+		PageCacheEntry* entry = FindEntry(volume, identity, pageIndex);
+		uint64_t frame = entry ? entry->Frame : 0;
+
+		PageCacheLock.Unlock();
+		RestoreInterrupts(flags);
+
+		//Frames are never evicted, so it's safe to copy unlocked
+		if(frame)
+		{
+			memcpy((uint8_t*)PhysToVirt(frame) + pageOffset, source, bytes);
+		}
+
+		source += bytes;
+		offset += bytes;
+	}
+}
+
+void GetPageCacheStats(PageCacheStats& stats)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+	PageCacheLock.Lock();
+
+	stats = PageCacheCounters;
+
+	PageCacheLock.Unlock();
+	RestoreInterrupts(flags);
+}
@@ -3,24 +3,43 @@
 #include "kernel/memory/pml4.h"
 #include "utilities/termination.h"
 
-extern MemoryState PhysicalMemoryState;
+extern PhysicalMemoryStateType PhysicalMemoryState;
 extern MemoryState VirtualMemoryState;
 
 void* PhysicalAlloc(uint64_t PhysicalAddress, uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags)
 {
+	AcquireMemoryStateLock();
+
     uint64_t VirtualAddress = VirtualMemoryState.FindMinimumSizeFreeBlock(ByteSize);
 
     MapPages(VirtualAddress, PhysicalAddress, ByteSize, true, false, privilegeLevel, MemoryState::RangeState::Used, pageFlags);
 
+	ReleaseMemoryStateLock();
+
     return (void*)VirtualAddress;
 }
 
 void* PhysicalAllocLowestAddress(uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags)
 {
+	AcquireMemoryStateLock();
+
 	uint64_t PhysicalAddress = PhysicalMemoryState.FindMinimumSizeFreeBlock(ByteSize);
     uint64_t VirtualAddress = VirtualMemoryState.FindMinimumSizeFreeBlock(ByteSize);
 
     MapPages(VirtualAddress, PhysicalAddress, ByteSize, true, false, privilegeLevel, MemoryState::RangeState::Used, pageFlags);
 
+	ReleaseMemoryStateLock();
+
     return (void*)VirtualAddress;
 }
+
+bool PhysicalFree(void* Address, uint64_t ByteSize)
+{
+	//Unlike VirtualFree this never goes through the frame cache, the range may be MMIO or firmware owned
+    uint64_t PhysicalAddress = GetPhysicalAddress((uint64_t)Address);
+    uint64_t VirtualAddress = (uint64_t)Address;
+
+    MapPages(VirtualAddress, PhysicalAddress, ByteSize, false, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Free);
+
+	return true;
+}
@@ -0,0 +1,151 @@
+#include "kernel/memory/physmap.h"
+#include "kernel/memory/pml4.h"
+#include "kernel/init/bootload.h"
+#include "kernel/console/console.h"
+#include "memory/memory.h"
+#include "utilities/termination.h"
+
+// Sorted and merged, so neighbouring descriptors share large pages
+struct PhysmapRun
+{
+	uint64_t Start;
+	uint64_t End;
+};
+
+PhysmapRun PhysmapRuns[PHYSMAP_MAX_RUNS];
+int PhysmapRunCount = 0;
+
+static bool IsRamDescriptor(const EFI_MEMORY_DESCRIPTOR& Desc)
+{
+	//Anything that can't be cached write-back isn't RAM we want to touch through the physmap
+	if((Desc.Attribute & EFI_MEMORY_WB) == 0)
+	{
+		return false;
+	}
+
+	switch(Desc.Type)
+	{
+		case EfiLoaderCode:
+		case EfiLoaderData:
+		case EfiBootServicesCode:
+		case EfiBootServicesData:
+		case EfiRuntimeServicesCode:
+		case EfiRuntimeServicesData:
+		case EfiConventionalMemory:
+		case EfiACPIReclaimMemory:
+		case EfiACPIMemoryNVS:
+		case EfiPersistentMemory:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static bool AddPhysmapRun(uint64_t start, uint64_t end)
+{
+	int index = 0;
+	while(index < PhysmapRunCount && PhysmapRuns[index].Start < start)
+	{
+		index++;
+	}
+
+	//Join the run before and/or after us if they touch
+	bool joinsPrevious = index > 0 && PhysmapRuns[index-1].End == start;
+	bool joinsNext = index < PhysmapRunCount && PhysmapRuns[index].Start == end;
+
+	if(joinsPrevious && joinsNext)
+	{
+		PhysmapRuns[index-1].End = PhysmapRuns[index].End;
+		memmove(&PhysmapRuns[index], &PhysmapRuns[index+1], (PhysmapRunCount - index - 1) * sizeof(PhysmapRun));
+		PhysmapRunCount--;
+		return true;
+	}
+
+	if(joinsPrevious)
+	{
+		PhysmapRuns[index-1].End = end;
+		return true;
+	}
+
+	if(joinsNext)
+	{
+		PhysmapRuns[index].Start = start;
+		return true;
+	}
+
+	if(PhysmapRunCount == PHYSMAP_MAX_RUNS)
+	{
+		return false;
+	}
+
+	memmove(&PhysmapRuns[index+1], &PhysmapRuns[index], (PhysmapRunCount - index) * sizeof(PhysmapRun));
+	PhysmapRuns[index] = { start, end };
+	PhysmapRunCount++;
+
+	return true;
+}
+
+void InitPhysmap(KernelBootData* bootData)
+{
+	KernelMemoryLayout& memoryLayout = bootData->MemoryLayout;
+
+	for (uint32_t entry = 0; entry < memoryLayout.Entries; entry++)
+	{
+		const EFI_MEMORY_DESCRIPTOR& Desc = *((EFI_MEMORY_DESCRIPTOR*)((UINT8*)memoryLayout.Map + (entry * memoryLayout.DescriptorSize)));
+		if(!IsRamDescriptor(Desc) || Desc.NumberOfPages == 0)
+		{
+			continue;
+		}
+
+		uint64_t start = Desc.PhysicalStart;
+		uint64_t end = start + (Desc.NumberOfPages * EFI_PAGE_SIZE);
+
+		if(end > PHYSMAP_SIZE)
+		{
+			VerboseLog(u"Physmap ignoring memory above PHYSMAP_SIZE\n");
+			continue;
+		}
+
+		if(!AddPhysmapRun(start, end))
+		{
+			//Still reachable the slow way, through PhysicalAlloc
+			VerboseLog(u"Physmap out of runs\n");
+		}
+	}
+
+	for(int run = 0; run < PhysmapRunCount; run++)
+	{
+		MapPhysmapRange(PhysmapRuns[run].Start, PhysmapRuns[run].End - PhysmapRuns[run].Start);
+	}
+}
+
+bool IsPhysmapped(uint64_t physicalAddress, uint64_t size)
+{
+	int low = 0;
+	int high = PhysmapRunCount;
+	while(low < high)
+	{
+		int middle = (low + high) / 2;
+		if(PhysmapRuns[middle].End <= physicalAddress)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low < PhysmapRunCount && PhysmapRuns[low].Start <= physicalAddress && physicalAddress + size <= PhysmapRuns[low].End;
+}
+
+uint64_t VirtToPhys(const volatile void* virtualAddress)
+{
+	if(IsPhysmapAddress(virtualAddress))
+	{
+		return (uint64_t)virtualAddress - PHYSMAP_BASE;
+	}
+
+	return GetPhysicalAddress((uint64_t)virtualAddress);
+}
@@ -5,10 +5,20 @@
 #include "memory/memory.h"
 #include "kernel/memory/pml4.h"
 #include "kernel/memory/state.h"
+#include "kernel/memory/tlb.h"
+#include "kernel/memory/frame_cache.h"
+#include "kernel/memory/zero_pool.h"
+#include "kernel/memory/physmap.h"
+#include "kernel/memory/numa.h"
+#include "kernel/memory/page_cache.h"
 #include "common/string.h"
 #include "utilities/termination.h"
 #include "kernel/init/tls.h"
 #include "utilities/qrdump.h"
+#include "kernel/init/cpuid.h"
+#include "kernel/init/alternatives.h"
+#include "kernel/scheduling/time.h"
+#include <rpmalloc.h>
 
 #define PRINT_MEMORY_MAP 0
 
@@ -46,6 +56,11 @@ struct SPagingStructurePage
 
 #define WRITE_THROUGH (1ULL << 3)
 #define CACHE_DISABLE (1ULL << 4)
+#define CACHE_ATTRIBUTE_MASK (WRITE_THROUGH | CACHE_DISABLE)
+
+#define CACHE_LINE_SIZE 64
+
+#define CR0_WRITE_PROTECT (1ULL << 16)
 
 #define PRESENT (1ULL<<0)
 #define WRITABLE (1ULL<<1)
@@ -56,13 +71,19 @@ struct SPagingStructurePage
 #define PAGE_IS_DIRTY (1ULL<<6)
 #define PAGE_PAT (1ULL<<7)
 #define PAGE_2MB (1ULL<<7)
+#define PAGE_1GB (1ULL<<7)
+#define PAGE_LARGE_PAT (1ULL<<12)
 #define PAGE_GLOBAL (1ULL<<8)
+#define PAGE_DEMAND_ZERO (1ULL<<9) //Software bit, only meaningful on entries that aren't present
+#define PAGE_COPY_ON_WRITE (1ULL<<10) //Software bit, read-only because the frame is shared with a snapshot
+#define PAGE_FILE_BACKED (1ULL<<11) //Software bit, part of a file mapping. Present means the frame belongs to the page cache
+#define PAGE_FILE_WRITABLE (1ULL<<52) //Software bit, a file mapping that may be written. WRITABLE stays clear so writes fault in a private copy
 #define NOT_EXECUTABLE (1ULL << 63)
 
 #define PM_RESERVED_MASK 0xF000000000000
 #define PML4_RESERVED_MASK 0xF000000000000 | 0x80
 
-#define CHECK_PML4_RESERVED_BITS(entry, mask) _ASSERTF(((entry) & (mask)) == 0, "Reserved bits set")
+#define CHECK_PML4_RESERVED_BITS(entry, mask) _HOT_ASSERTF(((entry) & (mask)) == 0, "Reserved bits set")
 
 static_assert(1 << PAGE_BITS == PAGE_SIZE, "Page size and page bits not consistent.");
 static_assert(EFI_PAGE_SIZE == PAGE_SIZE, "Page sizes between kernel and EFI should match.");
@@ -70,6 +91,9 @@ static_assert(sizeof(SPagingStructurePage) == PAGE_SIZE, "Paging structure shoul
 
 constexpr uint64_t PML4AddressMask = (((1ULL << 52) - 1) & ~((1ULL << 12) - 1));
 
+// 2MiB and 1GiB entries keep their PAT bit where a 4KiB entry has its lowest address bit
+constexpr uint64_t LargePageAddressMask = PML4AddressMask & ~PAGE_LARGE_PAT;
+
 #define STATIC_PAGE_ENTRIES 2048
 
 SPagingStructurePage* PagingFreePageHead = nullptr;
@@ -80,19 +104,55 @@ extern "C"
 	SPagingStructurePage PML4 __attribute__((aligned(4096)));
 }
 SPagingStructurePage InitialPageTableEntries[STATIC_PAGE_ENTRIES] __attribute__((aligned(4096)));
-bool PML4Set = false;
+// Until the kernel's own tables are loaded there's nothing of ours in the TLB to flush
+#define IsPML4Set() STATIC_BRANCH(STATIC_KEY_PML4_SET)
+bool Use1GBPages = false;
+uint64_t TotalUsableMemory = 0;
 
-extern MemoryState PhysicalMemoryState;
+extern PhysicalMemoryStateType PhysicalMemoryState;
 extern MemoryState VirtualMemoryState;
 void* NextFreePageTableEntriesBlock = nullptr;
 
-const int NextPagingBlockSize = 0x1000;
+// One 2MiB page's worth, small enough to hand back once it's all free again
+const int NextPagingBlockSize = 0x200;
+
+#define MAX_PAGE_TABLE_BLOCKS 512
+
+// The dynamic part of the pool, tracked so empty blocks can go back to PhysicalMemoryState
+struct PageTableBlock
+{
+	uint64_t Base;
+	uint64_t FreePages;
+};
+
+PageTableBlock PageTableBlocks[MAX_PAGE_TABLE_BLOCKS];
+int PageTableBlockCount = 0;
+uint64_t PagingFreePageCount = 0;
+bool ReleasingPageTableBlock = false;
 
 void AllocateNextFreePageTableEntries()
 {
-	NextFreePageTableEntriesBlock = VirtualAlloc(sizeof(SPagingStructurePage) * NextPagingBlockSize, PrivilegeLevel::Kernel);
+	const uint64_t blockSize = sizeof(SPagingStructurePage) * NextPagingBlockSize;
+
+	AcquireMemoryStateLock();
 
-	memset(NextFreePageTableEntriesBlock, 0, sizeof(SPagingStructurePage) * NextPagingBlockSize);
+	//Entries store the table pointer as its physical address, so the pool has to be identity mapped
+	//Keep the pool 2MiB aligned so it's mapped with large pages
+	uint64_t PhysicalAddress = PhysicalMemoryState.FindAlignedFreeBlock(blockSize, PAGE_SIZE_2MB);
+	if(PhysicalAddress == 0)
+	{
+		PhysicalAddress = PhysicalMemoryState.FindMinimumSizeFreeBlock(blockSize);
+	}
+	_ASSERTF(PhysicalAddress != 0, "Out of memory for page tables");
+	_ASSERTF(VirtualMemoryState.GetPageState(PhysicalAddress) == MemoryState::RangeState::Free
+		&& VirtualMemoryState.GetPageState(PhysicalAddress + blockSize - PAGE_SIZE) == MemoryState::RangeState::Free, "Page table pool identity range in use");
+
+	MapPages(PhysicalAddress, PhysicalAddress, blockSize, true, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Used);
+	NextFreePageTableEntriesBlock = (void*)PhysicalAddress;
+
+	ReleaseMemoryStateLock();
+
+	//No need to clear the block, GetPML4FreePage zeroes each page as it's handed out
 
 	PhysicalMemoryState.InitDynamic();
 
@@ -109,6 +169,53 @@ void PreparePML4FreeList(void* NextBlock)
         InitialPageTableEntries[i].Next = PagingFreePageHead;
         PagingFreePageHead = &InitialPageTableEntries[i];
     }
+
+	PagingFreePageCount += STATIC_PAGE_ENTRIES;
+}
+
+// Returns nullptr for the static pages in the kernel image, they're never released
+static PageTableBlock* FindPageTableBlock(SPagingStructurePage* Page)
+{
+	const uint64_t blockSize = sizeof(SPagingStructurePage) * NextPagingBlockSize;
+
+	for(int block = 0; block < PageTableBlockCount; block++)
+	{
+		if((uint64_t)Page - PageTableBlocks[block].Base < blockSize)
+		{
+			return &PageTableBlocks[block];
+		}
+	}
+
+	return nullptr;
+}
+
+// Unlinks every page of a block that's entirely free and gives the memory back
+static void ReleasePageTableBlock(PageTableBlock* Block)
+{
+	const uint64_t blockSize = sizeof(SPagingStructurePage) * NextPagingBlockSize;
+	uint64_t Base = Block->Base;
+
+	*Block = PageTableBlocks[--PageTableBlockCount];
+
+	SPagingStructurePage** Link = &PagingFreePageHead;
+	while(*Link != nullptr)
+	{
+		if((uint64_t)*Link - Base < blockSize)
+		{
+			*Link = (*Link)->Next;
+		}
+		else
+		{
+			Link = &(*Link)->Next;
+		}
+	}
+
+	PagingFreePageCount -= NextPagingBlockSize;
+
+	//Unmapping can free tables of its own, they mustn't start another release under us
+	ReleasingPageTableBlock = true;
+	MapPages(Base, Base, blockSize, false, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Free);
+	ReleasingPageTableBlock = false;
 }
 
 SPagingStructurePage* GetPML4FreePage()
@@ -124,6 +231,10 @@ SPagingStructurePage* GetPML4FreePage()
 			PagingFreePageHead = &NextPageSet[i];
 		}
 
+		_ASSERTF(PageTableBlockCount < MAX_PAGE_TABLE_BLOCKS, "Too many page table blocks");
+		PageTableBlocks[PageTableBlockCount++] = { (uint64_t)NextPageSet, NextPagingBlockSize };
+		PagingFreePageCount += NextPagingBlockSize;
+
 		//Make sure we've got another ready to go
 		//this will likely immediately consume several of the entries we've just created.
 		AllocateNextFreePageTableEntries();
@@ -132,17 +243,55 @@ SPagingStructurePage* GetPML4FreePage()
 	SPagingStructurePage* Result = PagingFreePageHead;
 	PagingFreePageHead = PagingFreePageHead->Next;
 
+	PagingFreePageCount--;
+	if(PageTableBlock* Block = FindPageTableBlock(Result))
+	{
+		Block->FreePages--;
+	}
+
     Result->Entries[0] = 0;
 
+	//Not from the zero pool, tables come out of the identity mapped PageTableBlocks, and
+	//refilling the pool from here would allocate frames while the caller is mid mapping
 	memset(Result, 0, sizeof(SPagingStructurePage));
 
 	return Result;
 }
 
+// The caller must have flushed any TLB entries that could still be walking through the page
 void FreePML4Page(SPagingStructurePage* Page)
 {
 	Page->Next = PagingFreePageHead;
 	PagingFreePageHead = Page;
+
+	PagingFreePageCount++;
+
+	PageTableBlock* Block = FindPageTableBlock(Page);
+	if(Block == nullptr)
+	{
+		return;
+	}
+
+	Block->FreePages++;
+
+	//Keep a block's worth spare so a map/unmap loop doesn't keep bouncing a block in and out
+	if(Block->FreePages == NextPagingBlockSize && !ReleasingPageTableBlock && PagingFreePageCount >= 2 * NextPagingBlockSize)
+	{
+		ReleasePageTableBlock(Block);
+	}
+}
+
+void GetPageTablePoolStats(PageTablePoolStats& stats)
+{
+	AcquireMemoryStateLock();
+
+	stats.StaticPages = STATIC_PAGE_ENTRIES;
+	stats.DynamicBlocks = PageTableBlockCount;
+	stats.ReservePages = NextFreePageTableEntriesBlock != nullptr ? NextPagingBlockSize : 0;
+	stats.FreePages = PagingFreePageCount;
+	stats.UsedPages = STATIC_PAGE_ENTRIES + (PageTableBlockCount * NextPagingBlockSize) - PagingFreePageCount;
+
+	ReleaseMemoryStateLock();
 }
 
 uint64_t GetPhysicalAddress(uint64_t virtualAddress, bool live)
@@ -171,6 +320,12 @@ uint64_t GetPhysicalAddress(uint64_t virtualAddress, bool live)
         return INVALID_ADDRESS;
     }
 
+	if(PDPTEntry & PAGE_1GB)
+	{
+		// Get the physical address and add the offset within the page
+		return (PDPTEntry & LargePageAddressMask) + (virtualAddress & (PAGE_SIZE_1GB-1));
+	}
+
     SPagingStructurePage* PD = (SPagingStructurePage*)(PDPTEntry & PML4AddressMask);
 
     // Access PD
@@ -183,167 +338,1230 @@ uint64_t GetPhysicalAddress(uint64_t virtualAddress, bool live)
 	if(PDEntry & PAGE_2MB)
 	{
 		// Get the physical address
-		uint64_t physicalAddress = PDEntry & PML4AddressMask;
+		uint64_t physicalAddress = PDEntry & LargePageAddressMask;
 
 		// Add the offset within the page
 		physicalAddress += (virtualAddress & (PAGE_SIZE_2MB-1));
 
-		return physicalAddress;
+		return physicalAddress;
+	}
+	else
+	{
+		SPagingStructurePage* PT = (SPagingStructurePage*)(PDEntry & PML4AddressMask);
+
+		// Access PT
+		uint64_t PTEntry = PT->Entries[ptIndex];
+		if (!(PTEntry & PRESENT))
+		{
+			return INVALID_ADDRESS;
+		}
+
+		// Get the physical address
+		uint64_t physicalAddress = PTEntry & PML4AddressMask;
+
+		// Add the offset within the page
+		physicalAddress += (virtualAddress & (PAGE_SIZE-1));
+
+		return physicalAddress;
+	}
+}
+
+uint64_t GetTotalUsableMemory()
+{
+	return TotalUsableMemory;
+}
+
+static SPagingStructurePage* GetOrCreatePDPT(uint64_t pml4Index)
+{
+	if (PML4.Entries[pml4Index] & PRESENT)
+	{
+		return (SPagingStructurePage*)(PML4.Entries[pml4Index] & PML4AddressMask);
+	}
+
+	SPagingStructurePage* PDPT = GetPML4FreePage();
+	PML4.Entries[pml4Index] = ((uint64_t)PDPT) | PRESENT | WRITABLE | USER_CPL;
+	CHECK_PML4_RESERVED_BITS(PML4.Entries[pml4Index], PML4_RESERVED_MASK);
+
+	return PDPT;
+}
+
+// Hands back a table that's being replaced by a single large entry, along with any tables under it
+static void FreePageTableTree(SPagingStructurePage* Table, int levels)
+{
+	if(levels > 1)
+	{
+		for(int i = 0; i < 512; i++)
+		{
+			uint64_t Entry = Table->Entries[i];
+			if((Entry & PRESENT) && !(Entry & PAGE_2MB))
+			{
+				FreePageTableTree((SPagingStructurePage*)(Entry & PML4AddressMask), levels - 1);
+			}
+		}
+	}
+
+	FreePML4Page(Table);
+}
+
+// Returns the table an entry points to, creating it if needed. If the entry is a large page
+// it's split into 512 entries of childSize with the same attributes, so nothing changes until
+// the caller starts rewriting them.
+static SPagingStructurePage* GetOrSplitTable(uint64_t* Entry, uint64_t virtualAddress, uint64_t childSize)
+{
+	if((*Entry & PRESENT) && !(*Entry & PAGE_2MB))
+	{
+		return (SPagingStructurePage*)(*Entry & PML4AddressMask);
+	}
+
+	SPagingStructurePage* Table = GetPML4FreePage();
+
+	//Getting a page can map more page tables, which may have filled this entry in for us
+	if((*Entry & PRESENT) && !(*Entry & PAGE_2MB))
+	{
+		FreePML4Page(Table);
+		return (SPagingStructurePage*)(*Entry & PML4AddressMask);
+	}
+
+	uint64_t OldEntry = *Entry;
+	bool wasLarge = (OldEntry & PRESENT) != 0;
+	if(wasLarge)
+	{
+		uint64_t Base = *Entry & LargePageAddressMask;
+		uint64_t Flags = *Entry & ~PML4AddressMask;
+
+		//The PAT bit lives in bit 12 for large pages but bit 7 for 4KiB ones
+		if(childSize == PAGE_SIZE)
+		{
+			Flags &= ~PAGE_2MB;
+			if(*Entry & PAGE_LARGE_PAT)
+			{
+				Flags |= PAGE_PAT;
+			}
+		}
+		else
+		{
+			Flags |= *Entry & PAGE_LARGE_PAT;
+		}
+
+		for(int i = 0; i < 512; i++)
+		{
+			Table->Entries[i] = (Base + (i * childSize)) | Flags;
+		}
+	}
+	else if(OldEntry & PAGE_DEMAND_ZERO)
+	{
+		//Nothing under an untouched demand zero entry has been backed yet, so neither is any part of it
+		for(int i = 0; i < 512; i++)
+		{
+			Table->Entries[i] = OldEntry;
+		}
+	}
+
+	*Entry = ((uint64_t)Table) | PRESENT | WRITABLE | USER_CPL;
+	CHECK_PML4_RESERVED_BITS(*Entry, PM_RESERVED_MASK);
+
+	//Drop the large TLB entry, the 4KiB ones get picked up from the new table as needed
+	if(wasLarge && IsPML4Set())
+	{
+		FlushTlbPage(virtualAddress, (OldEntry & PAGE_GLOBAL) != 0);
+	}
+
+	return Table;
+}
+
+struct CopyOnWritePage
+{
+	uint64_t VirtualAddress;
+	uint64_t Entry; //What the entry was before this change
+};
+
+struct CopyOnWriteSnapshot
+{
+	CopyOnWriteSnapshot* Previous;
+
+	//Pages this snapshot made read-only
+	uint64_t* SharedPages;
+	uint64_t SharedCount;
+	uint64_t SharedCapacity;
+
+	//Every change to a user entry since it was opened, oldest first. Frames mapped by the
+	//old entries aren't freed until the snapshot closes and puts them back
+	CopyOnWritePage* ChangedPages;
+	uint64_t ChangedCount;
+	uint64_t ChangedCapacity;
+
+	FileMapping* SavedFileMappings;
+};
+
+// Innermost open snapshot, it owns any page copied, mapped or unmapped while it's open
+CopyOnWriteSnapshot* ActiveSnapshot = nullptr;
+
+template<typename T>
+static void AppendToArray(T*& array, uint64_t& count, uint64_t& capacity, const T& value)
+{
+	if(count == capacity)
+	{
+		uint64_t newCapacity = capacity == 0 ? 256 : capacity * 2;
+		T* newArray = (T*)rpmalloc(newCapacity * sizeof(T));
+		_ASSERTF(newArray != nullptr, "Out of memory for copy on write snapshot");
+
+		if(array != nullptr)
+		{
+			memcpy(newArray, array, count * sizeof(T));
+			rpfree(array);
+		}
+
+		array = newArray;
+		capacity = newCapacity;
+	}
+
+	array[count++] = value;
+}
+
+// Call after the entry is written, growing the log can allocate and map pages
+static void RecordSnapshotEntry(uint64_t virtualAddress, uint64_t OldEntry, uint64_t NewEntry)
+{
+	//Kernel memory isn't the child's, whatever it allocates has to outlive the snapshot
+	if(ActiveSnapshot != nullptr && ((OldEntry | NewEntry) & USER_CPL))
+	{
+		AppendToArray(ActiveSnapshot->ChangedPages, ActiveSnapshot->ChangedCount, ActiveSnapshot->ChangedCapacity, { virtualAddress, OldEntry });
+	}
+}
+
+// PageFlags are bits, so Cache_Disable | Cache_WriteThrough is strong uncached.
+// Write-combining is PAT entry 4, see InitPat.
+static uint64_t GetCacheAttributeBits(PageFlags pageFlags, uint64_t pageSize)
+{
+	uint64_t Bits = 0;
+
+	if(pageFlags & PageFlags_Cache_Disable)
+	{
+		Bits |= CACHE_DISABLE;
+	}
+
+	if(pageFlags & PageFlags_Cache_WriteThrough)
+	{
+		Bits |= WRITE_THROUGH;
+	}
+
+	if((pageFlags & PageFlags_WriteCombining) && HasWriteCombining())
+	{
+		Bits |= pageSize > PAGE_SIZE ? PAGE_LARGE_PAT : PAGE_PAT;
+	}
+
+	return Bits;
+}
+
+// Caches are physically tagged so remapping alone doesn't need a flush, but lines cached
+// under the old memory type must be written back before it changes
+static void FlushCacheForTypeChange(uint64_t OldEntry, uint64_t NewEntry, uint64_t virtualAddress, uint64_t pageSize)
+{
+	uint64_t TypeMask = CACHE_ATTRIBUTE_MASK | (pageSize > PAGE_SIZE ? PAGE_LARGE_PAT : PAGE_PAT);
+	if(!(OldEntry & PRESENT) || (OldEntry & TypeMask) == (NewEntry & TypeMask))
+	{
+		return;
+	}
+
+	if(pageSize > PAGE_SIZE)
+	{
+		asm volatile("wbinvd" ::: "memory");
+		return;
+	}
+
+	for(uint64_t line = 0; line < pageSize; line += CACHE_LINE_SIZE)
+	{
+		asm volatile(ALTERNATIVE("clflush (%0)", "clflushopt (%0)", STATIC_KEY_CLFLUSHOPT) ::"r"(virtualAddress + line) : "memory");
+	}
+
+	//clflushopt is only ordered by fences, clflush needs nothing
+	asm volatile(ALTERNATIVE("", "sfence", STATIC_KEY_CLFLUSHOPT) ::: "memory");
+}
+
+static bool CanMapLargePage(uint64_t Entry, uint64_t virtualAddress, uint64_t physicalAddress, uint64_t endVirtualAddress, uint64_t pageSize, PrivilegeLevel privilegeLevel, MemoryState::RangeState newState)
+{
+	if((virtualAddress & (pageSize-1)) != 0 || endVirtualAddress - virtualAddress < pageSize)
+	{
+		return false;
+	}
+
+	//Free entries aren't present so it doesn't matter where they point
+	if(newState != MemoryState::RangeState::Free && (physicalAddress & (pageSize-1)) != 0)
+	{
+		return false;
+	}
+
+	//Keep takes the privilege from the old entries, a table doesn't tell us what they were
+	if(privilegeLevel == PrivilegeLevel::Keep && (Entry & PRESENT) && !(Entry & PAGE_2MB))
+	{
+		return false;
+	}
+
+	//An open snapshot logs user entries a page at a time, and freeing could be dropping a table of them
+	if(ActiveSnapshot != nullptr && (privilegeLevel != PrivilegeLevel::Kernel || newState == MemoryState::RangeState::Free))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static void MapLargePage(uint64_t* Entry, int levelsBelow, uint64_t virtualAddress, uint64_t physicalAddress, uint64_t pageSize, bool writable, bool executable, PrivilegeLevel privilegeLevel, MemoryState::RangeState newState, PageFlags pageFlags)
+{
+	uint64_t OldEntry = *Entry;
+	bool wasPresent = (OldEntry & PRESENT) != 0;
+	bool wasTable = wasPresent && !(OldEntry & PAGE_2MB);
+
+	uint64_t NewEntry = (physicalAddress & PML4AddressMask);
+	if(newState != MemoryState::RangeState::Free)
+	{
+		uint64_t userModeFlag = (privilegeLevel == PrivilegeLevel::User || (wasPresent && !wasTable && privilegeLevel == PrivilegeLevel::Keep && ((OldEntry & USER_CPL) == USER_CPL))) ? USER_CPL : 0;
+
+		//Global, so a full flush of user mappings by reloading CR3 keeps the kernel's TLB entries
+		uint64_t globalFlag = userModeFlag == 0 ? PAGE_GLOBAL : 0;
+
+		NewEntry |= PRESENT | PAGE_2MB | userModeFlag | globalFlag;
+		if (writable)
+		{
+			NewEntry |= WRITABLE;
+		}
+		if (!executable)
+		{
+#if ENABLE_NX
+			NewEntry |= NOT_EXECUTABLE;
+#endif
+		}
+
+		NewEntry |= GetCacheAttributeBits(pageFlags, pageSize);
+
+		CHECK_PML4_RESERVED_BITS(NewEntry, PM_RESERVED_MASK);
+
+		if(!wasTable)
+		{
+			FlushCacheForTypeChange(OldEntry, NewEntry, virtualAddress, pageSize);
+		}
+	}
+
+	*Entry = NewEntry;
+
+	if(wasTable)
+	{
+		//The CPU may still be caching the old tables, they have to be gone before we reuse them
+		if(IsPML4Set())
+		{
+			FlushTlbAll();
+		}
+
+		FreePageTableTree((SPagingStructurePage*)(OldEntry & PML4AddressMask), levelsBelow);
+	}
+	else if(wasPresent && IsPML4Set())
+	{
+		FlushTlbPage(virtualAddress, (OldEntry & PAGE_GLOBAL) != 0);
+	}
+}
+
+static bool IsTableEmpty(const SPagingStructurePage* Table)
+{
+	for(int i = 0; i < 512; i++)
+	{
+		//Demand zero and file backed entries aren't present but still hold a reservation
+		if(Table->Entries[i] & (PRESENT | PAGE_DEMAND_ZERO | PAGE_FILE_BACKED))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Clears the entry pointing at Table if it's empty, queueing the table up to be freed
+static void DetachTableIfEmpty(uint64_t* Entry, SPagingStructurePage*& Detached)
+{
+	SPagingStructurePage* Table = (SPagingStructurePage*)(*Entry & PML4AddressMask);
+	if(!IsTableEmpty(Table))
+	{
+		return;
+	}
+
+	*Entry = 0;
+
+	Table->Next = Detached;
+	Detached = Table;
+}
+
+// Hands back every table under [virtualAddress, endVirtualAddress) that no longer maps anything, caller holds the lock
+static void ReclaimEmptyTables(uint64_t virtualAddress, uint64_t endVirtualAddress)
+{
+	SPagingStructurePage* Detached = nullptr;
+
+	uint64_t lastAddress = endVirtualAddress - 1;
+	uint64_t firstPml4 = (virtualAddress >> 39) & 0x1FF;
+	uint64_t lastPml4 = (lastAddress >> 39) & 0x1FF;
+
+	for(uint64_t pml4Index = firstPml4; pml4Index <= lastPml4; pml4Index++)
+	{
+		if (!(PML4.Entries[pml4Index] & PRESENT))
+		{
+			continue;
+		}
+
+		SPagingStructurePage* PDPT = (SPagingStructurePage*)(PML4.Entries[pml4Index] & PML4AddressMask);
+
+		uint64_t firstPdpt = pml4Index == firstPml4 ? (virtualAddress >> 30) & 0x1FF : 0;
+		uint64_t lastPdpt = pml4Index == lastPml4 ? (lastAddress >> 30) & 0x1FF : 511;
+
+		for(uint64_t pdptIndex = firstPdpt; pdptIndex <= lastPdpt; pdptIndex++)
+		{
+			uint64_t* PDPTEntry = &PDPT->Entries[pdptIndex];
+			if (!(*PDPTEntry & PRESENT) || (*PDPTEntry & PAGE_1GB))
+			{
+				continue;
+			}
+
+			SPagingStructurePage* PD = (SPagingStructurePage*)(*PDPTEntry & PML4AddressMask);
+
+			bool firstInRange = pml4Index == firstPml4 && pdptIndex == firstPdpt;
+			bool lastInRange = pml4Index == lastPml4 && pdptIndex == lastPdpt;
+			uint64_t firstPd = firstInRange ? (virtualAddress >> 21) & 0x1FF : 0;
+			uint64_t lastPd = lastInRange ? (lastAddress >> 21) & 0x1FF : 511;
+
+			for(uint64_t pdIndex = firstPd; pdIndex <= lastPd; pdIndex++)
+			{
+				uint64_t* PDEntry = &PD->Entries[pdIndex];
+				if ((*PDEntry & PRESENT) && !(*PDEntry & PAGE_2MB))
+				{
+					DetachTableIfEmpty(PDEntry, Detached);
+				}
+			}
+
+			DetachTableIfEmpty(PDPTEntry, Detached);
+		}
+
+		if (Detached != nullptr && (PML4.Entries[pml4Index] & PRESENT))
+		{
+			DetachTableIfEmpty(&PML4.Entries[pml4Index], Detached);
+		}
+	}
+
+	if(Detached == nullptr)
+	{
+		return;
+	}
+
+	//The paging structure caches may still hold the tables, they have to be gone before we reuse them
+	if(IsPML4Set())
+	{
+		FlushTlbAll();
+	}
+
+	while(Detached != nullptr)
+	{
+		SPagingStructurePage* Next = Detached->Next;
+		FreePML4Page(Detached);
+		Detached = Next;
+	}
+}
+
+// Writes the entries for a range without touching the memory state trees, caller holds the lock
+static void MapPageTableRange(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t endVirtualAddress, bool writable, bool executable, PrivilegeLevel privilegeLevel, MemoryState::RangeState newState, PageFlags pageFlags)
+{
+    uint64_t startVirtualAddress = virtualAddress;
+    uint64_t originalVirtualAddress = virtualAddress;
+    uint64_t originalPhysicalAddress = physicalAddress;
+
+	BeginTlbFlushBatch();
+
+	while (virtualAddress < endVirtualAddress)
+    {
+		// Calculate indices
+		uint64_t pml4Index = (virtualAddress >> 39) & 0x1FF;
+		uint64_t pdptIndex = (virtualAddress >> 30) & 0x1FF;
+		uint64_t pdIndex = (virtualAddress >> 21) & 0x1FF;
+        uint64_t ptIndex = (virtualAddress >> 12) & 0x1FF;
+
+        SPagingStructurePage* PDPT = nullptr;
+        SPagingStructurePage* PD = nullptr;
+        SPagingStructurePage* PT = nullptr;
+
+		// Set up PML4
+		PDPT = GetOrCreatePDPT(pml4Index);
+
+		// Set up PDPT, mapping whole 1GiB pages where we can
+		uint64_t* PDPTEntry = &PDPT->Entries[pdptIndex];
+		if (Use1GBPages && CanMapLargePage(*PDPTEntry, virtualAddress, physicalAddress, endVirtualAddress, PAGE_SIZE_1GB, privilegeLevel, newState))
+		{
+			MapLargePage(PDPTEntry, 2, virtualAddress, physicalAddress, PAGE_SIZE_1GB, writable, executable, privilegeLevel, newState, pageFlags);
+
+			virtualAddress += PAGE_SIZE_1GB;
+			physicalAddress += PAGE_SIZE_1GB;
+			originalVirtualAddress += PAGE_SIZE_1GB;
+			originalPhysicalAddress += PAGE_SIZE_1GB;
+			continue;
+		}
+
+		PD = GetOrSplitTable(PDPTEntry, virtualAddress, PAGE_SIZE_2MB);
+
+		// Set up the PD, mapping whole 2MiB pages where we can
+		uint64_t* PDEntry = &PD->Entries[pdIndex];
+		if (CanMapLargePage(*PDEntry, virtualAddress, physicalAddress, endVirtualAddress, PAGE_SIZE_2MB, privilegeLevel, newState))
+		{
+			MapLargePage(PDEntry, 1, virtualAddress, physicalAddress, PAGE_SIZE_2MB, writable, executable, privilegeLevel, newState, pageFlags);
+
+			virtualAddress += PAGE_SIZE_2MB;
+			physicalAddress += PAGE_SIZE_2MB;
+			originalVirtualAddress += PAGE_SIZE_2MB;
+			originalPhysicalAddress += PAGE_SIZE_2MB;
+			continue;
+		}
+
+		PT = GetOrSplitTable(PDEntry, virtualAddress, PAGE_SIZE);
+
+		uint64_t OldEntry = PT->Entries[ptIndex];
+
+		//A page shared with a snapshot still belongs to whoever opened it, the snapshot puts it back
+		//when it closes and UnmapRange leaves its frame alone until then
+        if(newState == MemoryState::RangeState::Free)
+        {
+            PT->Entries[ptIndex] = (physicalAddress & PAGE_MASK);
+			RecordSnapshotEntry(virtualAddress, OldEntry, PT->Entries[ptIndex]);
+        }
+        else
+        {
+			bool wasPresent = (OldEntry & PRESENT) != 0;
+
+			uint64_t userModeFlag = (privilegeLevel == PrivilegeLevel::User || (wasPresent && privilegeLevel == PrivilegeLevel::Keep && ((OldEntry & USER_CPL) == USER_CPL))) ? USER_CPL : 0;
+
+			//Global, so a full flush of user mappings by reloading CR3 keeps the kernel's TLB entries
+			uint64_t globalFlag = userModeFlag == 0 ? PAGE_GLOBAL : 0;
+
+            uint64_t NewEntry = (physicalAddress & PAGE_MASK) | PRESENT | userModeFlag | globalFlag;
+            if (writable)
+            {
+                NewEntry |= WRITABLE;
+            }
+            if (!executable)
+            {
+#if ENABLE_NX
+                NewEntry |= NOT_EXECUTABLE;
+#endif
+            }
+
+			NewEntry |= GetCacheAttributeBits(pageFlags, PAGE_SIZE);
+
+			//Remapping a shared frame where it is keeps it shared, the first write still has to copy it
+			if((OldEntry & (PRESENT | PAGE_COPY_ON_WRITE)) == (PRESENT | PAGE_COPY_ON_WRITE) && (NewEntry & PML4AddressMask) == (OldEntry & PML4AddressMask) && (NewEntry & WRITABLE))
+			{
+				NewEntry = (NewEntry & ~WRITABLE) | PAGE_COPY_ON_WRITE;
+			}
+
+			CHECK_PML4_RESERVED_BITS(NewEntry, PM_RESERVED_MASK);
+
+			//We're about to change how the memory is cached, flush it out under the old type
+			FlushCacheForTypeChange(OldEntry, NewEntry, virtualAddress, PAGE_SIZE);
+
+			PT->Entries[ptIndex] = NewEntry;
+			RecordSnapshotEntry(virtualAddress, OldEntry, NewEntry);
+
+			//Walking the tables again per page is the expensive one
+			_HOT_ASSERTF(physicalAddress == GetPhysicalAddress(virtualAddress, false), "Physical address mismatch.");
+
+			_HOT_ASSERTF(originalVirtualAddress == virtualAddress, "Virtual address mismatch.");
+			_HOT_ASSERTF(originalPhysicalAddress == physicalAddress, "Physical address mismatch.");
+
+			originalVirtualAddress += PAGE_SIZE;
+			originalPhysicalAddress += PAGE_SIZE;
+        }
+
+		//Tell the CPU we've just invalidated that address.
+		//Not present entries are never cached, so there's nothing to flush if it wasn't mapped before.
+		if(IsPML4Set() && (OldEntry & PRESENT))
+        {
+            FlushTlbPage(virtualAddress, (OldEntry & PAGE_GLOBAL) != 0);
+        }
+
+		// Move to the next page
+		virtualAddress += PAGE_SIZE;
+		physicalAddress += PAGE_SIZE;
+	}
+
+	if(newState == MemoryState::RangeState::Free)
+	{
+		ReclaimEmptyTables(startVirtualAddress, endVirtualAddress);
+	}
+
+	EndTlbFlushBatch();
+}
+
+void MapPages(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel, MemoryState::RangeState newState, PageFlags pageFlags, bool tagPhysical)
+{
+    uint64_t originalVirtualAddress = virtualAddress;
+    uint64_t originalPhysicalAddress = physicalAddress;
+
+	_HOT_ASSERTF((size & (PAGE_SIZE-1)) == 0, "Misaligned page size");
+
+    uint64_t endVirtualAddress = virtualAddress + size;
+
+    virtualAddress &= PAGE_MASK;
+    physicalAddress &= PAGE_MASK;
+
+	_HOT_ASSERTF(originalVirtualAddress == virtualAddress, "Virtual address mismatch.");
+	_HOT_ASSERTF(originalPhysicalAddress == physicalAddress, "Physical address mismatch.");
+
+    uint64_t pageAlignedSize = (size + (PAGE_SIZE-1)) & PAGE_MASK;
+
+    uint64_t physicalAddressEnd = physicalAddress + pageAlignedSize;
+
+	AcquireMemoryStateLock();
+
+	if(tagPhysical)
+	{
+		PhysicalMemoryState.TagRange(physicalAddress, physicalAddressEnd, newState);
+	}
+	VirtualMemoryState.TagRange(virtualAddress, endVirtualAddress, newState);
+
+	MapPageTableRange(virtualAddress, physicalAddress, endVirtualAddress, writable, executable, privilegeLevel, newState, pageFlags);
+
+	ReleaseMemoryStateLock();
+}
+
+void MapPhysmapRange(uint64_t physicalAddress, uint64_t size)
+{
+	_ASSERTF((physicalAddress & (PAGE_SIZE-1)) == 0 && (size & (PAGE_SIZE-1)) == 0, "Misaligned physmap range");
+	_ASSERTF(physicalAddress + size <= PHYSMAP_SIZE, "Physical memory beyond the end of the physmap");
+
+	uint64_t virtualAddress = (uint64_t)PhysToVirt(physicalAddress);
+
+	//The physmap sits above the range VirtualMemoryState tracks, so only the tables change
+	AcquireMemoryStateLock();
+	MapPageTableRange(virtualAddress, physicalAddress, virtualAddress + size, true, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Used, PageFlags_None);
+	ReleaseMemoryStateLock();
+}
+
+// Non-present entries are ignored by the CPU, so a demand zero entry keeps the permissions the
+// page will get in the usual bits and is told apart from an unmapped one by PAGE_DEMAND_ZERO
+static uint64_t MakeDemandZeroEntry(uint64_t OldEntry, bool writable, bool executable, PrivilegeLevel privilegeLevel)
+{
+	uint64_t Entry = PAGE_DEMAND_ZERO;
+
+	if(privilegeLevel == PrivilegeLevel::User || (privilegeLevel == PrivilegeLevel::Keep && (OldEntry & PAGE_DEMAND_ZERO) && (OldEntry & USER_CPL)))
+	{
+		Entry |= USER_CPL;
+	}
+	if (writable)
+	{
+		Entry |= WRITABLE;
+	}
+	if (!executable)
+	{
+#if ENABLE_NX
+		Entry |= NOT_EXECUTABLE;
+#endif
+	}
+
+	return Entry;
+}
+
+void MapDemandZeroPages(uint64_t virtualAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel)
+{
+	_ASSERTF((virtualAddress & (PAGE_SIZE-1)) == 0 && (size & (PAGE_SIZE-1)) == 0, "Misaligned demand zero range");
+	uint64_t endVirtualAddress = virtualAddress + size;
+
+	AcquireMemoryStateLock();
+
+	VirtualMemoryState.TagRange(virtualAddress, endVirtualAddress, MemoryState::RangeState::Used);
+
+	//An open snapshot logs user entries a page at a time
+	bool allowLarge = ActiveSnapshot == nullptr || privilegeLevel == PrivilegeLevel::Kernel;
+
+	while (virtualAddress < endVirtualAddress)
+	{
+		uint64_t pml4Index = (virtualAddress >> 39) & 0x1FF;
+		uint64_t pdptIndex = (virtualAddress >> 30) & 0x1FF;
+		uint64_t pdIndex = (virtualAddress >> 21) & 0x1FF;
+		uint64_t ptIndex = (virtualAddress >> 12) & 0x1FF;
+
+		SPagingStructurePage* PDPT = GetOrCreatePDPT(pml4Index);
+
+		//A whole aligned 1GiB or 2MiB that isn't mapped takes a single entry, its tables are only built on first touch
+		uint64_t* PDPTEntry = &PDPT->Entries[pdptIndex];
+		if (allowLarge && !(*PDPTEntry & PRESENT) && (virtualAddress & (PAGE_SIZE_1GB-1)) == 0 && endVirtualAddress - virtualAddress >= PAGE_SIZE_1GB)
+		{
+			*PDPTEntry = MakeDemandZeroEntry(*PDPTEntry, writable, executable, privilegeLevel);
+			virtualAddress += PAGE_SIZE_1GB;
+			continue;
+		}
+
+		_ASSERTF(!(*PDPTEntry & PRESENT) || !(*PDPTEntry & PAGE_1GB), "Demand zero range overlaps a mapped page");
+		SPagingStructurePage* PD = GetOrSplitTable(PDPTEntry, virtualAddress, PAGE_SIZE_2MB);
+
+		uint64_t* PDEntry = &PD->Entries[pdIndex];
+		if (allowLarge && !(*PDEntry & PRESENT) && (virtualAddress & (PAGE_SIZE_2MB-1)) == 0 && endVirtualAddress - virtualAddress >= PAGE_SIZE_2MB)
+		{
+			*PDEntry = MakeDemandZeroEntry(*PDEntry, writable, executable, privilegeLevel);
+			virtualAddress += PAGE_SIZE_2MB;
+			continue;
+		}
+
+		_ASSERTF(!(*PDEntry & PRESENT) || !(*PDEntry & PAGE_2MB), "Demand zero range overlaps a mapped page");
+		SPagingStructurePage* PT = GetOrSplitTable(PDEntry, virtualAddress, PAGE_SIZE);
+
+		uint64_t OldEntry = PT->Entries[ptIndex];
+		_ASSERTF(!(OldEntry & PRESENT), "Demand zero range overlaps a mapped page");
+		PT->Entries[ptIndex] = MakeDemandZeroEntry(OldEntry, writable, executable, privilegeLevel);
+		RecordSnapshotEntry(virtualAddress, OldEntry, PT->Entries[ptIndex]);
+
+		virtualAddress += PAGE_SIZE;
+	}
+
+	ReleaseMemoryStateLock();
+}
+
+// Returns the entry mapping the address at whichever level it sits, large or 4KiB, present or not
+static uint64_t FindMappingEntry(uint64_t virtualAddress)
+{
+	uint64_t indices[4] = { (virtualAddress >> 39) & 0x1FF, (virtualAddress >> 30) & 0x1FF, (virtualAddress >> 21) & 0x1FF, (virtualAddress >> 12) & 0x1FF };
+
+	uint64_t Entry = PML4.Entries[indices[0]];
+	for(int level = 1; level < 4; level++)
+	{
+		if (!(Entry & PRESENT) || (level > 1 && (Entry & PAGE_2MB)))
+		{
+			return Entry;
+		}
+
+		Entry = ((SPagingStructurePage*)(Entry & PML4AddressMask))->Entries[indices[level]];
+	}
+
+	return Entry;
+}
+
+// Returns the demand zero entry covering the address at whichever level it sits, or 0 if there isn't one
+static uint64_t FindDemandZeroEntry(uint64_t virtualAddress)
+{
+	//Large pages are already backed
+	uint64_t Entry = FindMappingEntry(virtualAddress);
+	return (!(Entry & PRESENT) && (Entry & PAGE_DEMAND_ZERO)) ? Entry : 0;
+}
+
+bool IsDemandZeroPage(uint64_t virtualAddress)
+{
+	AcquireMemoryStateLock();
+	bool result = FindDemandZeroEntry(virtualAddress) != 0;
+	ReleaseMemoryStateLock();
+
+	return result;
+}
+
+bool HandleDemandZeroFault(uint64_t virtualAddress)
+{
+	uint64_t page = virtualAddress & PAGE_MASK;
+
+	AcquireMemoryStateLock();
+
+	//Another core may have backed the page while we were waiting for the lock
+	if (GetPhysicalAddress(page, false) != INVALID_ADDRESS)
+	{
+		ReleaseMemoryStateLock();
+		return true;
+	}
+
+	uint64_t Entry = FindDemandZeroEntry(page);
+	if (Entry == 0)
+	{
+		ReleaseMemoryStateLock();
+		return false;
+	}
+
+	bool writable = (Entry & WRITABLE) != 0;
+	bool executable = (Entry & NOT_EXECUTABLE) == 0;
+	PrivilegeLevel privilegeLevel = (Entry & USER_CPL) ? PrivilegeLevel::User : PrivilegeLevel::Kernel;
+
+	uint64_t frame = AllocateZeroedFrame();
+	if (frame == 0)
+	{
+		frame = AllocatePhysicalFrame();
+		if (frame == 0)
+		{
+			ReleaseMemoryStateLock();
+			return false;
+		}
+
+		//Clear it through the physmap so it only needs mapping once
+		memset(PhysToVirt(frame), 0, PAGE_SIZE);
+	}
+
+	//An open snapshot logs the change and puts the page back to untouched when it closes
+	MapPages(page, frame, PAGE_SIZE, writable, executable, privilegeLevel, MemoryState::RangeState::Used, PageFlags_None, /*tagPhysical*/ false);
+
+	ReleaseMemoryStateLock();
+
+	return true;
+}
+
+// Returns the 4KiB entry mapping the address, or nullptr if there's no page table for it
+static uint64_t* FindPageTableEntry(uint64_t virtualAddress)
+{
+	uint64_t indices[4] = { (virtualAddress >> 39) & 0x1FF, (virtualAddress >> 30) & 0x1FF, (virtualAddress >> 21) & 0x1FF, (virtualAddress >> 12) & 0x1FF };
+
+	SPagingStructurePage* Table = &PML4;
+	for(int level = 0; level < 3; level++)
+	{
+		uint64_t Entry = Table->Entries[indices[level]];
+		if (!(Entry & PRESENT) || (level > 0 && (Entry & PAGE_2MB)))
+		{
+			return nullptr;
+		}
+
+		Table = (SPagingStructurePage*)(Entry & PML4AddressMask);
+	}
+
+	return &Table->Entries[indices[3]];
+}
+
+static bool IsWritableUserEntry(uint64_t Entry)
+{
+	return (Entry & (PRESENT | WRITABLE | USER_CPL)) == (PRESENT | WRITABLE | USER_CPL);
+}
+
+// Processes all run on the kernel's page tables, so this walks all of them
+static void ShareWritableUserPages(CopyOnWriteSnapshot* snapshot)
+{
+	for(uint64_t pml4Index = 0; pml4Index < 512; pml4Index++)
+	{
+		if (!(PML4.Entries[pml4Index] & PRESENT))
+		{
+			continue;
+		}
+
+		//The physmap is kernel only and large, don't bother walking it
+		if (pml4Index >= PHYSMAP_FIRST_PML4_INDEX && pml4Index < PHYSMAP_FIRST_PML4_INDEX + PHYSMAP_PML4_ENTRIES)
+		{
+			continue;
+		}
+
+		//Upper half addresses are sign extended
+		uint64_t pml4Base = (pml4Index << 39) | ((pml4Index & 0x100) ? 0xFFFF000000000000ULL : 0);
+
+		SPagingStructurePage* PDPT = (SPagingStructurePage*)(PML4.Entries[pml4Index] & PML4AddressMask);
+		for(uint64_t pdptIndex = 0; pdptIndex < 512; pdptIndex++)
+		{
+			uint64_t* PDPTEntry = &PDPT->Entries[pdptIndex];
+			uint64_t pdptBase = pml4Base | (pdptIndex << 30);
+
+			if (!(*PDPTEntry & PRESENT) || ((*PDPTEntry & PAGE_1GB) && !IsWritableUserEntry(*PDPTEntry)))
+			{
+				continue;
+			}
+
+			//Copies are made a page at a time, so shared large pages are split first
+			SPagingStructurePage* PD = GetOrSplitTable(PDPTEntry, pdptBase, PAGE_SIZE_2MB);
+			for(uint64_t pdIndex = 0; pdIndex < 512; pdIndex++)
+			{
+				uint64_t* PDEntry = &PD->Entries[pdIndex];
+				uint64_t pdBase = pdptBase | (pdIndex << 21);
+
+				if (!(*PDEntry & PRESENT) || ((*PDEntry & PAGE_2MB) && !IsWritableUserEntry(*PDEntry)))
+				{
+					continue;
+				}
+
+				SPagingStructurePage* PT = GetOrSplitTable(PDEntry, pdBase, PAGE_SIZE);
+				for(uint64_t ptIndex = 0; ptIndex < 512; ptIndex++)
+				{
+					uint64_t Entry = PT->Entries[ptIndex];
+					if (!IsWritableUserEntry(Entry))
+					{
+						continue;
+					}
+
+					uint64_t virtualAddress = pdBase | (ptIndex << 12);
+
+					PT->Entries[ptIndex] = (Entry & ~WRITABLE) | PAGE_COPY_ON_WRITE;
+					AppendToArray(snapshot->SharedPages, snapshot->SharedCount, snapshot->SharedCapacity, virtualAddress);
+
+					FlushTlbPage(virtualAddress);
+				}
+			}
+		}
+	}
+}
+
+CopyOnWriteSnapshot* BeginCopyOnWriteSnapshot()
+{
+	CopyOnWriteSnapshot* snapshot = (CopyOnWriteSnapshot*)rpmalloc(sizeof(CopyOnWriteSnapshot));
+	memset(snapshot, 0, sizeof(CopyOnWriteSnapshot));
+
+	//Unmapping a file drops its mapping record, so the whole list goes back when the snapshot closes
+	snapshot->SavedFileMappings = CopyFileMappings();
+
+	AcquireMemoryStateLock();
+	BeginTlbFlushBatch();
+
+	ShareWritableUserPages(snapshot);
+
+	snapshot->Previous = ActiveSnapshot;
+	ActiveSnapshot = snapshot;
+
+	EndTlbFlushBatch();
+	ReleaseMemoryStateLock();
+
+	return snapshot;
+}
+
+// Like FindPageTableEntry, but builds or splits whatever tables are in the way
+static uint64_t* GetOrCreatePageTableEntry(uint64_t virtualAddress)
+{
+	SPagingStructurePage* PDPT = GetOrCreatePDPT((virtualAddress >> 39) & 0x1FF);
+	SPagingStructurePage* PD = GetOrSplitTable(&PDPT->Entries[(virtualAddress >> 30) & 0x1FF], virtualAddress, PAGE_SIZE_2MB);
+	SPagingStructurePage* PT = GetOrSplitTable(&PD->Entries[(virtualAddress >> 21) & 0x1FF], virtualAddress, PAGE_SIZE);
+
+	return &PT->Entries[(virtualAddress >> 12) & 0x1FF];
+}
+
+static bool IsReservedEntry(const uint64_t* Entry)
+{
+	return Entry != nullptr && (*Entry & (PRESENT | PAGE_DEMAND_ZERO | PAGE_FILE_BACKED));
+}
+
+// Brings VirtualMemoryState back in line with a run of pages the snapshot restored
+static void RetagRestoredRange(uint64_t virtualAddress, uint64_t endVirtualAddress, bool reserved)
+{
+	if (virtualAddress == endVirtualAddress)
+	{
+		return;
+	}
+
+	VirtualMemoryState.TagRange(virtualAddress, endVirtualAddress, reserved ? MemoryState::RangeState::Used : MemoryState::RangeState::Free);
+
+	if (!reserved)
+	{
+		ReclaimEmptyTables(virtualAddress, endVirtualAddress);
+	}
+}
+
+void EndCopyOnWriteSnapshot(CopyOnWriteSnapshot* snapshot)
+{
+	_ASSERTF(snapshot == ActiveSnapshot, "Copy on write snapshots must be closed innermost first");
+
+	AcquireMemoryStateLock();
+	BeginTlbFlushBatch();
+
+	//Nothing done here is logged, only undone
+	ActiveSnapshot = snapshot->Previous;
+
+	//Newest first, so each frame mapped since the snapshot opened is freed by the change that replaced it
+	for(uint64_t changed = snapshot->ChangedCount; changed > 0; changed--)
+	{
+		const CopyOnWritePage& page = snapshot->ChangedPages[changed - 1];
+
+		//Unmapping may have taken the tables with it
+		uint64_t* Entry = FindPageTableEntry(page.VirtualAddress);
+		if (Entry == nullptr)
+		{
+			if (!IsReservedEntry(&page.Entry))
+			{
+				continue;
+			}
+
+			Entry = GetOrCreatePageTableEntry(page.VirtualAddress);
+		}
+
+		if (*Entry & PRESENT)
+		{
+			//Page cache frames are shared with every other mapping of the file, and a page
+			//that was only remapped (a protection change) is getting its own frame back
+			bool remapped = (page.Entry & PRESENT) && (page.Entry & PML4AddressMask) == (*Entry & PML4AddressMask);
+			if (!(*Entry & PAGE_FILE_BACKED) && !remapped)
+			{
+				FreePhysicalFrame(*Entry & PML4AddressMask);
+			}
+			FlushTlbPage(page.VirtualAddress, (*Entry & PAGE_GLOBAL) != 0);
+		}
+
+		*Entry = page.Entry;
+	}
+
+	//Whatever wasn't written never stopped pointing at the original frame
+	for(uint64_t shared = 0; shared < snapshot->SharedCount; shared++)
+	{
+		uint64_t* Entry = FindPageTableEntry(snapshot->SharedPages[shared]);
+		if (Entry != nullptr && (*Entry & PRESENT) && (*Entry & PAGE_COPY_ON_WRITE))
+		{
+			*Entry = (*Entry & ~PAGE_COPY_ON_WRITE) | WRITABLE;
+			FlushTlbPage(snapshot->SharedPages[shared]);
+		}
 	}
-	else
+
+	//Ranges reserved since it opened are free again, and unmapped ones were kept reserved until now.
+	//Oldest first, as pages tend to be logged in the order they were mapped
+	uint64_t runStart = 0;
+	uint64_t runEnd = 0;
+	bool runReserved = false;
+	for(uint64_t changed = 0; changed < snapshot->ChangedCount; changed++)
 	{
-		SPagingStructurePage* PT = (SPagingStructurePage*)(PDEntry & PML4AddressMask);
+		uint64_t page = snapshot->ChangedPages[changed].VirtualAddress;
+		bool reserved = IsReservedEntry(FindPageTableEntry(page));
 
-		// Access PT
-		uint64_t PTEntry = PT->Entries[ptIndex];
-		if (!(PTEntry & PRESENT))
+		if (page == runEnd && reserved == runReserved)
 		{
-			return INVALID_ADDRESS;
+			runEnd += PAGE_SIZE;
+			continue;
 		}
 
-		// Get the physical address
-		uint64_t physicalAddress = PTEntry & PML4AddressMask;
+		RetagRestoredRange(runStart, runEnd, runReserved);
 
-		// Add the offset within the page
-		physicalAddress += (virtualAddress & (PAGE_SIZE-1));
+		runStart = page;
+		runEnd = page + PAGE_SIZE;
+		runReserved = reserved;
+	}
+	RetagRestoredRange(runStart, runEnd, runReserved);
 
-		return physicalAddress;
+	EndTlbFlushBatch();
+	ReleaseMemoryStateLock();
+
+	RestoreFileMappings(snapshot->SavedFileMappings);
+
+	if (snapshot->SharedPages != nullptr)
+	{
+		rpfree(snapshot->SharedPages);
 	}
+	if (snapshot->ChangedPages != nullptr)
+	{
+		rpfree(snapshot->ChangedPages);
+	}
+	rpfree(snapshot);
 }
 
-void MapPages(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel, MemoryState::RangeState newState, PageFlags pageFlags)
+bool IsUnmapDeferred(uint64_t virtualAddress, uint64_t size)
 {
-    uint64_t originalVirtualAddress = virtualAddress;
-    uint64_t originalPhysicalAddress = physicalAddress;
+	if (ActiveSnapshot == nullptr)
+	{
+		return false;
+	}
 
-	_ASSERTF((size & (PAGE_SIZE-1)) == 0, "Misaligned page size");
+	AcquireMemoryStateLock();
 
-    uint64_t endVirtualAddress = virtualAddress + size;
+	bool result = false;
+	for(uint64_t page = virtualAddress & PAGE_MASK; page < virtualAddress + size && !result; page += PAGE_SIZE)
+	{
+		result = (FindMappingEntry(page) & USER_CPL) != 0;
+	}
 
-    virtualAddress &= PAGE_MASK;
-    physicalAddress &= PAGE_MASK;
+	ReleaseMemoryStateLock();
+
+	return result;
+}
 
-	_ASSERTF(originalVirtualAddress == virtualAddress, "Virtual address mismatch.");
-	_ASSERTF(originalPhysicalAddress == physicalAddress, "Physical address mismatch.");
+bool HandleCopyOnWriteFault(uint64_t virtualAddress)
+{
+	uint64_t page = virtualAddress & PAGE_MASK;
 
-    uint64_t pageAlignedSize = (size + (PAGE_SIZE-1)) & PAGE_MASK;
+	AcquireMemoryStateLock();
 
-    uint64_t physicalAddressEnd = physicalAddress + pageAlignedSize;
+	uint64_t* Entry = FindPageTableEntry(page);
+	if (Entry == nullptr || !(*Entry & PRESENT))
+	{
+		ReleaseMemoryStateLock();
+		return false;
+	}
 
-    PhysicalMemoryState.TagRange(physicalAddress, physicalAddressEnd, newState);
-	VirtualMemoryState.TagRange(virtualAddress, endVirtualAddress, newState);
+	//Another core may have copied the page while we were waiting for the lock
+	if (*Entry & WRITABLE)
+	{
+		ReleaseMemoryStateLock();
+		return true;
+	}
+
+	if (!(*Entry & PAGE_COPY_ON_WRITE) || ActiveSnapshot == nullptr)
+	{
+		ReleaseMemoryStateLock();
+		return false;
+	}
+
+	uint64_t frame = AllocatePhysicalFrame();
+	if (frame == 0)
+	{
+		ReleaseMemoryStateLock();
+		return false;
+	}
+
+	uint64_t OldEntry = *Entry;
 
+	//Fill the copy through the physmap before anything can see it
+	memcpy(PhysToVirt(frame), (void*)page, PAGE_SIZE);
+
+	*Entry = frame | (OldEntry & ~PML4AddressMask & ~PAGE_COPY_ON_WRITE) | WRITABLE;
+	FlushTlbPage(page, (OldEntry & PAGE_GLOBAL) != 0);
+
+	RecordSnapshotEntry(page, OldEntry, *Entry);
+
+	ReleaseMemoryStateLock();
+
+	return true;
+}
+
+void MapFileBackedPages(uint64_t virtualAddress, uint64_t size, bool writable, bool executable, PrivilegeLevel privilegeLevel)
+{
+	_ASSERTF((virtualAddress & (PAGE_SIZE-1)) == 0 && (size & (PAGE_SIZE-1)) == 0, "Misaligned file mapping");
+	uint64_t endVirtualAddress = virtualAddress + size;
+
+	AcquireMemoryStateLock();
+
+	VirtualMemoryState.TagRange(virtualAddress, endVirtualAddress, MemoryState::RangeState::Used);
+
+	//Always 4KiB entries, each page is backed by its own page cache frame
 	while (virtualAddress < endVirtualAddress)
-    {
-		// Calculate indices
+	{
 		uint64_t pml4Index = (virtualAddress >> 39) & 0x1FF;
 		uint64_t pdptIndex = (virtualAddress >> 30) & 0x1FF;
 		uint64_t pdIndex = (virtualAddress >> 21) & 0x1FF;
-        uint64_t ptIndex = (virtualAddress >> 12) & 0x1FF;
+		uint64_t ptIndex = (virtualAddress >> 12) & 0x1FF;
 
-        SPagingStructurePage* PDPT = nullptr;
-        SPagingStructurePage* PD = nullptr;
-        SPagingStructurePage* PT = nullptr;
+		SPagingStructurePage* PDPT = GetOrCreatePDPT(pml4Index);
 
-		// Set up PML4
-        if (PML4.Entries[pml4Index] & PRESENT)
-        {
-            PDPT = (SPagingStructurePage*)(PML4.Entries[pml4Index] & PML4AddressMask);
-        }
-        else
-        {
-            PDPT = GetPML4FreePage();
-			PML4.Entries[pml4Index] = ((uint64_t)PDPT) | PRESENT | WRITABLE | USER_CPL;
-			CHECK_PML4_RESERVED_BITS(PML4.Entries[pml4Index], PML4_RESERVED_MASK);
-		}
+		uint64_t* PDPTEntry = &PDPT->Entries[pdptIndex];
+		_ASSERTF(!(*PDPTEntry & PRESENT) || !(*PDPTEntry & PAGE_1GB), "File mapping overlaps a mapped page");
+		SPagingStructurePage* PD = GetOrSplitTable(PDPTEntry, virtualAddress, PAGE_SIZE_2MB);
 
-		// Set up PDPT
-		if (PDPT->Entries[pdptIndex] & PRESENT)
-        {
-            PD = (SPagingStructurePage*)(PDPT->Entries[pdptIndex] & PML4AddressMask);
-        }
-        else
-        {
-            PD = GetPML4FreePage();
-            PDPT->Entries[pdptIndex] = ((uint64_t)PD) | PRESENT | WRITABLE | USER_CPL;
-			CHECK_PML4_RESERVED_BITS(PDPT->Entries[pdptIndex], PM_RESERVED_MASK);
-        }
+		uint64_t* PDEntry = &PD->Entries[pdIndex];
+		_ASSERTF(!(*PDEntry & PRESENT) || !(*PDEntry & PAGE_2MB), "File mapping overlaps a mapped page");
+		SPagingStructurePage* PT = GetOrSplitTable(PDEntry, virtualAddress, PAGE_SIZE);
 
-		// Set up the PD
-        if (PD->Entries[pdIndex] & PRESENT)
-        {
-			PT = (SPagingStructurePage*)(PD->Entries[pdIndex] & PML4AddressMask);
+		//Untouched demand zero pages can be taken over, they have nothing in them yet
+		uint64_t OldEntry = PT->Entries[ptIndex];
+		_ASSERTF(!(OldEntry & PRESENT), "File mapping overlaps a mapped page");
+		PT->Entries[ptIndex] = (MakeDemandZeroEntry(OldEntry, /*writable*/false, executable, privilegeLevel) & ~PAGE_DEMAND_ZERO) | PAGE_FILE_BACKED | (writable ? PAGE_FILE_WRITABLE : 0);
+		RecordSnapshotEntry(virtualAddress, OldEntry, PT->Entries[ptIndex]);
+
+		virtualAddress += PAGE_SIZE;
+	}
+
+	ReleaseMemoryStateLock();
+}
+
+void ClearFileBackedPages(uint64_t virtualAddress, uint64_t size)
+{
+	uint64_t endVirtualAddress = virtualAddress + size;
+
+	AcquireMemoryStateLock();
+
+	for(uint64_t page = virtualAddress & PAGE_MASK; page < endVirtualAddress; page += PAGE_SIZE)
+	{
+		uint64_t* Entry = FindPageTableEntry(page);
+		if (Entry == nullptr || !(*Entry & PAGE_FILE_BACKED))
+		{
+			continue;
 		}
-        else
-        {
-			PT = GetPML4FreePage();
-			PD->Entries[pdIndex] = ((uint64_t)PT) | PRESENT | WRITABLE | USER_CPL;
-			CHECK_PML4_RESERVED_BITS(PD->Entries[pdIndex], PM_RESERVED_MASK);
+
+		//The frame stays in the page cache, only this mapping of it goes
+		uint64_t OldEntry = *Entry;
+		*Entry = 0;
+
+		if (OldEntry & PRESENT)
+		{
+			FlushTlbPage(page, (OldEntry & PAGE_GLOBAL) != 0);
 		}
 
-        if(newState == MemoryState::RangeState::Free)
-        {
-            PT->Entries[ptIndex] = (physicalAddress & PAGE_MASK);
-        }
-        else
-        {
-			bool wasPresent = (PT->Entries[ptIndex] & PRESENT) != 0;
+		RecordSnapshotEntry(page, OldEntry, 0);
+	}
 
-			uint64_t userModeFlag = (privilegeLevel == PrivilegeLevel::User || (wasPresent && privilegeLevel == PrivilegeLevel::Keep && ((PT->Entries[ptIndex] & USER_CPL) == USER_CPL))) ? USER_CPL : 0;
+	ReleaseMemoryStateLock();
+}
 
-			
+bool IsFileBackedPage(uint64_t virtualAddress)
+{
+	AcquireMemoryStateLock();
+	uint64_t* Entry = FindPageTableEntry(virtualAddress & PAGE_MASK);
+	bool result = Entry != nullptr && (*Entry & PAGE_FILE_BACKED);
+	ReleaseMemoryStateLock();
 
-			//We're about to yoink the memory away, flush the cache
-			if(wasPresent)
-			{
-				asm volatile("clflush (%0)" ::"r"(virtualAddress) : "memory");
-			}
+	return result;
+}
 
-            PT->Entries[ptIndex] = (physicalAddress & PAGE_MASK) | PRESENT | userModeFlag;
-            if (writable)
-            {
-                PT->Entries[ptIndex] |= WRITABLE;
-            }
-            if (!executable)
-            {
-#if ENABLE_NX
-                PT->Entries[ptIndex] |= NOT_EXECUTABLE;
-#endif
-            }
+bool HandleFileBackedFault(uint64_t virtualAddress, bool write)
+{
+	uint64_t page = virtualAddress & PAGE_MASK;
 
-			if(pageFlags == PageFlags_Cache_Disable)
-			{
-				PT->Entries[ptIndex] |= CACHE_DISABLE;
-			}
+	AcquireMemoryStateLock();
 
-			if(pageFlags == PageFlags_Cache_WriteThrough)
-			{
-				PT->Entries[ptIndex] |= WRITE_THROUGH;
-			}
+	uint64_t* Entry = FindPageTableEntry(page);
+	if (Entry == nullptr || !(*Entry & PAGE_FILE_BACKED))
+	{
+		ReleaseMemoryStateLock();
+		return false;
+	}
 
-			CHECK_PML4_RESERVED_BITS(PT->Entries[ptIndex], PM_RESERVED_MASK);
+	uint64_t OldEntry = *Entry;
 
-            uint64_t newPhysicalAddress = GetPhysicalAddress(virtualAddress, false);
-            _ASSERTF(physicalAddress == newPhysicalAddress, "Physical address mismatch.");
+	ReleaseMemoryStateLock();
 
-			_ASSERTF(originalVirtualAddress == virtualAddress, "Virtual address mismatch.");
-			_ASSERTF(originalPhysicalAddress == physicalAddress, "Physical address mismatch.");
+	//Another core may have mapped the page in while we were waiting for the lock
+	if ((OldEntry & PRESENT) && !write)
+	{
+		return true;
+	}
 
-			originalVirtualAddress += PAGE_SIZE;
-			originalPhysicalAddress += PAGE_SIZE;
-        }
+	//Cache frames are mapped read-only whatever the mapping allows, so a write to one that's
+	//already been read lands here too and is told apart by the software bit
+	if (write && !(OldEntry & PAGE_FILE_WRITABLE))
+	{
+		return false;
+	}
 
-		//Tell the CPU we've just invalidated that address.
-        //TODO: Revisit this once we're looking at running user code.
-		if(PML4Set)
-        {
-            asm volatile("invlpg (%0)" ::"r"(virtualAddress) : "memory");
-        }
+	//A miss reads from the volume, so this happens without the lock
+	uint64_t frame = (OldEntry & PRESENT) ? (OldEntry & PML4AddressMask) : GetFileMappingFrame(page);
+	if (frame == 0)
+	{
+		return false;
+	}
 
-		// Move to the next page
-		virtualAddress += PAGE_SIZE;
-		physicalAddress += PAGE_SIZE;
+	uint64_t NewEntry = PRESENT | (OldEntry & (USER_CPL | NOT_EXECUTABLE));
+	if (write)
+	{
+		//Writes are never seen by the file or its other mappings, so this mapping gets its own copy
+		uint64_t copy = AllocatePhysicalFrame();
+		if (copy == 0)
+		{
+			return false;
+		}
+
+		memcpy(PhysToVirt(copy), PhysToVirt(frame), PAGE_SIZE);
+		NewEntry |= copy | WRITABLE;
+	}
+	else
+	{
+		NewEntry |= frame | PAGE_FILE_BACKED | (OldEntry & PAGE_FILE_WRITABLE);
+	}
+
+	AcquireMemoryStateLock();
+
+	//The CPU may have set the accessed and dirty bits since, they don't count as a change
+	const uint64_t IgnoredBits = PAGE_WAS_ACCESSED | PAGE_IS_DIRTY;
+	Entry = FindPageTableEntry(page);
+	if (Entry == nullptr || (*Entry & ~IgnoredBits) != (OldEntry & ~IgnoredBits))
+	{
+		ReleaseMemoryStateLock();
+
+		if (write)
+		{
+			FreePhysicalFrame(NewEntry & PML4AddressMask);
+		}
+
+		//Whatever changed it, the access gets retried against the new entry
+		return true;
+	}
+
+	*Entry = NewEntry;
+	if (OldEntry & PRESENT)
+	{
+		FlushTlbPage(page, (OldEntry & PAGE_GLOBAL) != 0);
 	}
+
+	//The page goes back to how it was when the snapshot closes
+	RecordSnapshotEntry(page, OldEntry, NewEntry);
+
+	ReleaseMemoryStateLock();
+
+	return true;
 }
 
 const char16_t* MemoryMapTypeToString(EFI_MEMORY_TYPE Type)
@@ -400,16 +1618,100 @@ const char16_t* MemoryMapTypeToString(EFI_MEMORY_TYPE Type)
 	}
 }
 
+uint64_t MemoryMapIngestCycles = 0;
+
+static EFI_MEMORY_DESCRIPTOR& GetMemoryDescriptor(KernelMemoryLayout& memoryLayout, uint32_t entry)
+{
+	return *((EFI_MEMORY_DESCRIPTOR*)((UINT8*)memoryLayout.Map + (entry * memoryLayout.DescriptorSize)));
+}
+
+static uint64_t GetSortedStart(KernelMemoryLayout& memoryLayout, uint32_t slot)
+{
+	return GetMemoryDescriptor(memoryLayout, memoryLayout.SortedEntries[slot]).PhysicalStart;
+}
+
+// Moves slot down the heap in [0, count) until neither child starts after it
+static void SiftMemoryMapEntry(KernelMemoryLayout& memoryLayout, uint32_t slot, uint32_t count)
+{
+	uint32_t* Sorted = memoryLayout.SortedEntries;
+
+	for (;;)
+	{
+		uint32_t Largest = slot;
+		uint32_t Left = slot * 2 + 1;
+		uint32_t Right = Left + 1;
+
+		if (Left < count && GetSortedStart(memoryLayout, Left) > GetSortedStart(memoryLayout, Largest))
+		{
+			Largest = Left;
+		}
+		if (Right < count && GetSortedStart(memoryLayout, Right) > GetSortedStart(memoryLayout, Largest))
+		{
+			Largest = Right;
+		}
+		if (Largest == slot)
+		{
+			return;
+		}
+
+		uint32_t Swap = Sorted[slot];
+		Sorted[slot] = Sorted[Largest];
+		Sorted[Largest] = Swap;
+		slot = Largest;
+	}
+}
+
+// Fills SortedEntries with the map's indices in physical address order, the map itself stays
+// as the firmware gave it. Firmware almost always hands it over sorted, which is found in one
+// pass, anything else is heap sorted as there's nothing to allocate from yet.
+static void SortMemoryMap(KernelMemoryLayout& memoryLayout)
+{
+	uint32_t* Sorted = memoryLayout.SortedEntries;
+	uint32_t Count = memoryLayout.Entries;
+
+	bool IsSorted = true;
+	for (uint32_t entry = 0; entry < Count; entry++)
+	{
+		Sorted[entry] = entry;
+		if (entry > 0 && GetSortedStart(memoryLayout, entry - 1) > GetSortedStart(memoryLayout, entry))
+		{
+			IsSorted = false;
+		}
+	}
+
+	if (IsSorted)
+	{
+		return;
+	}
+
+	for (uint32_t slot = Count / 2; slot-- > 0;)
+	{
+		SiftMemoryMapEntry(memoryLayout, slot, Count);
+	}
+
+	for (uint32_t end = Count - 1; end > 0; end--)
+	{
+		uint32_t Swap = Sorted[0];
+		Sorted[0] = Sorted[end];
+		Sorted[end] = Swap;
+		SiftMemoryMapEntry(memoryLayout, 0, end);
+	}
+}
+
 void BuildPML4(KernelBootData* bootData)
 {
     char16_t Buffer[32];
 
     KernelMemoryLayout& memoryLayout = bootData->MemoryLayout;
 
+	uint64_t StartCycles = _rdtsc();
+
+	SortMemoryMap(memoryLayout);
+
     uintptr_t HighestAddress = 0;
     for (uint32_t entry = 0; entry < memoryLayout.Entries; entry++)
     {
-        const EFI_MEMORY_DESCRIPTOR& Desc = *((EFI_MEMORY_DESCRIPTOR*)((UINT8*)memoryLayout.Map + (entry * memoryLayout.DescriptorSize)));
+        const EFI_MEMORY_DESCRIPTOR& Desc = GetMemoryDescriptor(memoryLayout, entry);
 
         uintptr_t End = Desc.PhysicalStart + Desc.NumberOfPages * EFI_PAGE_SIZE;
         if (End > HighestAddress)
@@ -439,11 +1741,14 @@ void BuildPML4(KernelBootData* bootData)
 	PRINT_RANGE(tables);
 #endif
 
-	uint64_t HighestAddressUntrimmmed = HighestAddress;
-
 	//Chop off any straggling bits so we get full pages only
 	HighestAddress &= PAGE_MASK;
 
+	Use1GBPages = CpuIdHasLeaf(CPUID_LEAF_EXTENDED_FEATURES) && (CpuId(CPUID_LEAF_EXTENDED_FEATURES).Edx & CPUID_EXTENDED_EDX_PAGE_1GB) != 0;
+
+	//The SRAT has to be read before the physical state is split into nodes
+	InitNumaTopology(bootData);
+
 	PhysicalMemoryState.Init(0, HighestAddress);
 	VirtualMemoryState.Init(1, PAGE_MASK); //Limit set by x86-64 architecture.
 
@@ -454,9 +1759,29 @@ void BuildPML4(KernelBootData* bootData)
 
 	uint64_t freeMemory = 0;
 
-    for (uint32_t entry = 0; entry < memoryLayout.Entries; entry++)
+	//Neighbouring descriptors that map the same way are mapped by a single MapPages call
+	uint64_t RunStart = 0;
+	uint64_t RunVirtualStart = 0;
+	uint64_t RunSize = 0;
+	bool RunWritable = false;
+	bool RunExecutable = false;
+	bool RunReserved = false;
+
+	auto MapRun = [&]()
+	{
+		if (RunSize != 0)
+		{
+			MapPages(RunVirtualStart, RunStart, RunSize, RunWritable, RunExecutable, PrivilegeLevel::User, RunReserved ? MemoryState::RangeState::Reserved : MemoryState::RangeState::Used);
+		}
+		RunSize = 0;
+	};
+
+	//Everything below this has been covered by a descriptor, anything we skip over is unaddressable
+	uint64_t CoveredTo = 0;
+
+    for (uint32_t sorted = 0; sorted < memoryLayout.Entries; sorted++)
     {
-        EFI_MEMORY_DESCRIPTOR& Desc = *((EFI_MEMORY_DESCRIPTOR*)((UINT8*)memoryLayout.Map + (entry * memoryLayout.DescriptorSize)));
+        EFI_MEMORY_DESCRIPTOR& Desc = GetMemoryDescriptor(memoryLayout, memoryLayout.SortedEntries[sorted]);
 	
 		bool IsFree =  Desc.Type == EfiConventionalMemory
 					|| Desc.Type == EfiBootServicesCode
@@ -543,95 +1868,87 @@ void BuildPML4(KernelBootData* bootData)
 		bool IsReadOnly = Desc.Type == EfiACPIReclaimMemory || Desc.Type == EfiACPIMemoryNVS || Desc.Type == EfiUnusableMemory || Desc.Attribute & EFI_MEMORY_RO;
 		bool IsExecutable = Desc.Type == EfiRuntimeServicesCode || Desc.Type == EfiMemoryMapType_Kernel;
 
-        if (!IsFree)
-        {
-            MapPages(VirtualStart, Start, Size, !IsReadOnly, IsExecutable, PrivilegeLevel::User, IsReserved ? MemoryState::RangeState::Reserved : MemoryState::RangeState::Used);
-        }
-
-		if(!IsReserved && IsFree)
-		{
-			freeMemory += Size;
-		}
-    }
-
-	//Now we've built the map we need to find any gaps in the mapping.
-	//Any gaps will be unaddressable.
-	uint64_t StartP = 0x0;
-	while(StartP != HighestAddressUntrimmmed)
-    {
-		bool found = false;
-		for (uint32_t entry = 0; entry < memoryLayout.Entries; entry++)
-    	{
-			EFI_MEMORY_DESCRIPTOR& Desc = *((EFI_MEMORY_DESCRIPTOR*)((UINT8*)memoryLayout.Map + (entry * memoryLayout.DescriptorSize)));
-			if(StartP == Desc.PhysicalStart)
-			{
-				StartP = Desc.PhysicalStart + (Desc.NumberOfPages * EFI_PAGE_SIZE);
-				found = true;
-				break;
-			}
-		}
-
-		if(!found)
+		if(Start > CoveredTo)
 		{
-			uint64_t lowest = ~0ULL;
-
-			EFI_MEMORY_DESCRIPTOR* EntryDesc = nullptr;
-
-			for (uint32_t entry = 0; entry < memoryLayout.Entries; entry++)
-			{
-				EFI_MEMORY_DESCRIPTOR& Desc = *((EFI_MEMORY_DESCRIPTOR*)((UINT8*)memoryLayout.Map + (entry * memoryLayout.DescriptorSize)));
-				if(Desc.PhysicalStart > StartP && Desc.PhysicalStart < lowest)
-				{
-					lowest = Desc.PhysicalStart;
-					EntryDesc = &Desc;
-				}
-			}
-
-			if(lowest == ~0ULL)
-			{
-				_ASSERTF(false, "Unexpected memory map mismatch");
-			}
-
-			PhysicalMemoryState.TagRange(StartP, lowest, MemoryState::RangeState::Reserved);
+			PhysicalMemoryState.TagRange(CoveredTo, Start, MemoryState::RangeState::Reserved);
 
 #if PRINT_MEMORY_MAP
-			LogPrintNumeric(u"Unmapped range from: ", StartP, u"");
-			LogPrintNumeric(u" to: ", lowest, u"");
+			LogPrintNumeric(u"Unmapped range from: ", CoveredTo, u"");
+			LogPrintNumeric(u" to: ", Start, u"");
 
-			LogPrintNumeric(u" (", (lowest-StartP), u" bytes)");
+			LogPrintNumeric(u" (", (Start-CoveredTo), u" bytes)");
 
-			if(EntryDesc->PhysicalStart == stack.PhysicalStart)
+			if(Desc.PhysicalStart == stack.PhysicalStart)
 			{
 				SerialPrint(u" STACK");
 			}
-			else if(EntryDesc->PhysicalStart == tables.PhysicalStart)
+			else if(Desc.PhysicalStart == tables.PhysicalStart)
 			{
 				SerialPrint(u" TABLES");
 			}
-			else if(EntryDesc->PhysicalStart == bootstrap.PhysicalStart)
+			else if(Desc.PhysicalStart == bootstrap.PhysicalStart)
 			{
 				SerialPrint(u" BOOTSTRAP");
 			}
-			else if(EntryDesc->PhysicalStart == (binary.PhysicalStart & PAGE_MASK))
+			else if(Desc.PhysicalStart == (binary.PhysicalStart & PAGE_MASK))
 			{
 				SerialPrint(u" BINARY");
 			}
-			else if((framebuffer.PhysicalStart & PAGE_MASK) >= EntryDesc->PhysicalStart && (framebuffer.PhysicalStart & PAGE_MASK) <= (EntryDesc->PhysicalStart + (EntryDesc->NumberOfPages * EFI_PAGE_SIZE)))
+			else if((framebuffer.PhysicalStart & PAGE_MASK) >= Desc.PhysicalStart && (framebuffer.PhysicalStart & PAGE_MASK) <= (Desc.PhysicalStart + (Desc.NumberOfPages * EFI_PAGE_SIZE)))
 			{
 				SerialPrint(u" FRAMEBUFFER");
 			}
 
 			SerialPrint(u"\n");
 #endif
-			
-			StartP = lowest;
+		}
+
+		if(Start + Size > CoveredTo)
+		{
+			CoveredTo = Start + Size;
+		}
+
+        if (!IsFree)
+        {
+			bool ExtendsRun = RunSize != 0
+				&& Start == RunStart + RunSize
+				&& VirtualStart == RunVirtualStart + RunSize
+				&& RunWritable == !IsReadOnly
+				&& RunExecutable == IsExecutable
+				&& RunReserved == IsReserved;
+
+			if (!ExtendsRun)
+			{
+				MapRun();
+
+				RunStart = Start;
+				RunVirtualStart = VirtualStart;
+				RunWritable = !IsReadOnly;
+				RunExecutable = IsExecutable;
+				RunReserved = IsReserved;
+			}
+
+			RunSize += Size;
+        }
+
+		if(!IsReserved && IsFree)
+		{
+			freeMemory += Size;
 		}
     }
 
+	MapRun();
+
+	MemoryMapIngestCycles = _rdtsc() - StartCycles;
+
 	uint64_t allocatedFrameBufferSize = (framebuffer.ByteSize + (PAGE_SIZE-1)) & PAGE_MASK;
 
-    MapPages(framebuffer.VirtualStart, PhysicalFramebuffer, allocatedFrameBufferSize, true, false /*executable*/, PrivilegeLevel::User, MemoryState::RangeState::Reserved);
+	//Pixels are only ever streamed out, write-combining turns them into full line bursts
+    MapPages(framebuffer.VirtualStart, PhysicalFramebuffer, allocatedFrameBufferSize, true, false /*executable*/, PrivilegeLevel::User, MemoryState::RangeState::Reserved, PageFlags_WriteCombining);
 	freeMemory -= allocatedFrameBufferSize;
+	TotalUsableMemory = freeMemory;
+
+	InitPhysmap(bootData);
 
 #if VERBOSE_LOGGING
 	VerboseLog(u"Memory available: ");
@@ -700,6 +2017,8 @@ void BuildPML4(KernelBootData* bootData)
 
 	VerboseLog(MemoryAvailableUnit);
 	VerboseLog(u"\n");
+
+	LogPrintNumeric(u"Memory map ingested in ", MemoryMapIngestCycles, u" cycles\n", 10);
 #endif
 }
 
@@ -752,7 +2071,7 @@ void MemCheck(KernelBootData* bootData)
 
 	//Point it somewhere because our last free has meant we're not pointing to a physical page
 	MapPages(TargetVirtualPage, 0, PAGE_SIZE, true, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Used);
-	VirtualFree((void*)TargetVirtualPage, PAGE_SIZE);
+	PhysicalFree((void*)TargetVirtualPage, PAGE_SIZE);
 
 	LogPrintNumeric(u"Highest memcheck: ", HighestAddressWritten, u"\n");
 }
@@ -767,7 +2086,6 @@ void BuildAndLoadPML4(KernelBootData* bootData)
 	SetSerialTargetBuffer(PML4Output);
 #endif
 
-    PML4Set = false;
     BuildPML4(bootData);
 
 #if PRINT_PML4
@@ -778,7 +2096,12 @@ void BuildAndLoadPML4(KernelBootData* bootData)
 
 	VerboseLog(u"Loading PML4...\n");
     LoadPageMapLevel4((uint64_t)&PML4);
-    PML4Set = true;
+    EnableStaticKey(STATIC_KEY_PML4_SET);
+
+	InitTlbFeatures();
+
+	//Kernel writes have to fault on read-only pages too, copy on write relies on it
+	SetCR0(GetCR0() | CR0_WRITE_PROTECT);
 
 	VerboseLog(u"Now in long mode!...\n");
 }
@@ -0,0 +1,541 @@
+#include "kernel/memory/slab.h"
+#include "kernel/memory/frame_cache.h"
+#include "kernel/memory/physmap.h"
+#include "kernel/init/apic.h"
+#include "kernel/scheduling/spinlock.h"
+#include "memory/memory.h"
+#include "memory/virtual.h"
+#include "utilities/termination.h"
+
+//Summary of the system
+//---------------------
+// A slab starts with its header and is followed by its objects. Slabs are SlabSize
+// aligned: single page slabs are frames seen through the physmap, bigger ones are
+// reserved aligned and committed.
+//
+// Free objects are linked through their first word. With a constructor that word is
+// part of the constructed object, so a link word is added after the object instead.
+//
+// The cache keeps its slabs on two lists, slabs with free objects and full slabs.
+// Magazines sit in front of them, one per core, only ever touched by their own core
+// with interrupts disabled. The cache lock covers the lists and counts, and is never
+// held while slab memory is being allocated or freed.
+//
+// The cache header and magazines are one on demand allocation, so a core's magazine
+// only costs memory once that core uses the cache.
+
+struct SlabObject
+{
+	SlabObject* Next;
+};
+
+struct Slab
+{
+	SlabCache* Cache;
+	Slab* Next;
+	Slab* Previous;
+	SlabObject* FreeObjects;
+	uint64_t InUse;
+};
+
+struct SlabMagazine
+{
+	void* Objects[SLAB_MAGAZINE_SIZE];
+	uint64_t Count;
+
+	uint64_t AllocHits;
+	uint64_t AllocMisses;
+	uint64_t FreeHits;
+	uint64_t FreeMisses;
+} __attribute__((aligned(64))); //Keep each core on its own cache lines
+
+struct SlabCache
+{
+	const char* Name;
+	uint64_t ObjectSize;
+	uint64_t Stride;
+	uint64_t LinkOffset;
+	uint64_t SlabSize;
+	uint64_t FirstObject;
+	uint64_t ObjectsPerSlab;
+	uint64_t MaxFree;
+	SlabConstructor Constructor;
+
+	SpinLock Lock;
+	Slab* PartialSlabs;
+	Slab* FullSlabs;
+	uint64_t SlabCount;
+	uint64_t FreeCount; //In slabs, not counting magazines
+
+	SlabCache* Next;
+
+	SlabMagazine Magazines[MaxProcessors];
+};
+
+#define SLAB_OBJECT_ALIGNMENT 16
+
+extern unsigned int ProcessorCount;
+
+SpinLock SlabCacheListLock;
+SlabCache* SlabCaches = nullptr;
+
+// Only the magazines of cores that exist, so walking them doesn't back the rest
+static unsigned int GetMagazineCount()
+{
+	return ProcessorCount > 0 ? ProcessorCount : 1;
+}
+
+static uint64_t AlignUp(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static SlabObject* GetLink(SlabCache* cache, void* object)
+{
+	return (SlabObject*)((uint8_t*)object + cache->LinkOffset);
+}
+
+static void* GetObject(SlabCache* cache, SlabObject* link)
+{
+	return (uint8_t*)link - cache->LinkOffset;
+}
+
+static Slab* GetSlab(SlabCache* cache, void* object)
+{
+	return (Slab*)((uint64_t)object & ~(cache->SlabSize - 1));
+}
+
+static void LinkSlab(Slab*& list, Slab* slab)
+{
+	slab->Previous = nullptr;
+	slab->Next = list;
+	if(list)
+	{
+		list->Previous = slab;
+	}
+	list = slab;
+}
+
+static void UnlinkSlab(Slab*& list, Slab* slab)
+{
+	if(slab->Previous)
+	{
+		slab->Previous->Next = slab->Next;
+	}
+	else
+	{
+		list = slab->Next;
+	}
+
+	if(slab->Next)
+	{
+		slab->Next->Previous = slab->Previous;
+	}
+}
+
+// Called unlocked, the slab isn't visible to anyone else until it's linked in
+static Slab* CreateSlab(SlabCache* cache)
+{
+	void* memory = nullptr;
+	if(cache->SlabSize == PAGE_SIZE)
+	{
+		uint64_t frame = AllocatePhysicalFrame();
+		memory = frame ? PhysToVirt(frame) : nullptr;
+	}
+	else
+	{
+		memory = VirtualReserve(cache->SlabSize, cache->SlabSize);
+		if(memory && !VirtualCommit(memory, cache->SlabSize, PrivilegeLevel::Kernel))
+		{
+			VirtualFree(memory, cache->SlabSize);
+			memory = nullptr;
+		}
+	}
+
+	if(memory == nullptr)
+	{
+		return nullptr;
+	}
+
+	Slab* slab = (Slab*)memory;
+	slab->Cache = cache;
+	slab->InUse = 0;
+	slab->FreeObjects = nullptr;
+
+	//Linked in reverse so the lowest address is handed out first
+	for(uint64_t index = cache->ObjectsPerSlab; index > 0; index--)
+	{
+		void* object = (uint8_t*)memory + cache->FirstObject + ((index - 1) * cache->Stride);
+		if(cache->Constructor)
+		{
+			cache->Constructor(object);
+		}
+
+		SlabObject* link = GetLink(cache, object);
+		link->Next = slab->FreeObjects;
+		slab->FreeObjects = link;
+	}
+
+	return slab;
+}
+
+static void DestroySlab(SlabCache* cache, Slab* slab)
+{
+	if(cache->SlabSize == PAGE_SIZE)
+	{
+		FreePhysicalFrame(VirtToPhys(slab));
+	}
+	else
+	{
+		VirtualFree(slab, cache->SlabSize);
+	}
+}
+
+// Lock must be held. Queues the slab up for DestroySlab if it's empty and the cache has enough spare.
+static void ReturnObject(SlabCache* cache, void* object, Slab*& released, bool keepNone)
+{
+	Slab* slab = GetSlab(cache, object);
+	_ASSERTF(slab->Cache == cache, "Object freed to the wrong slab cache");
+	_ASSERTF(slab->InUse > 0, "Slab object freed twice");
+
+	if(slab->FreeObjects == nullptr)
+	{
+		UnlinkSlab(cache->FullSlabs, slab);
+		LinkSlab(cache->PartialSlabs, slab);
+	}
+
+	SlabObject* link = GetLink(cache, object);
+	link->Next = slab->FreeObjects;
+	slab->FreeObjects = link;
+	slab->InUse--;
+	cache->FreeCount++;
+
+	if(slab->InUse == 0 && (keepNone || cache->FreeCount - cache->ObjectsPerSlab >= cache->MaxFree))
+	{
+		UnlinkSlab(cache->PartialSlabs, slab);
+		cache->FreeCount -= cache->ObjectsPerSlab;
+		cache->SlabCount--;
+
+		slab->Next = released;
+		released = slab;
+	}
+}
+
+static void DestroySlabs(SlabCache* cache, Slab* released)
+{
+	while(released)
+	{
+		Slab* next = released->Next;
+		DestroySlab(cache, released);
+		released = next;
+	}
+}
+
+// Interrupts must be disabled
+static void RefillMagazine(SlabCache* cache, SlabMagazine& magazine)
+{
+	cache->Lock.Lock();
+
+	while(magazine.Count < SLAB_MAGAZINE_BATCH)
+	{
+		Slab* slab = cache->PartialSlabs;
+		if(slab == nullptr)
+		{
+			cache->Lock.Unlock();
+			slab = CreateSlab(cache);
+			cache->Lock.Lock();
+
+			if(slab == nullptr)
+			{
+				break;
+			}
+
+			LinkSlab(cache->PartialSlabs, slab);
+			cache->SlabCount++;
+			cache->FreeCount += cache->ObjectsPerSlab;
+		}
+
+		SlabObject* link = slab->FreeObjects;
+		slab->FreeObjects = link->Next;
+		slab->InUse++;
+		cache->FreeCount--;
+
+		if(slab->FreeObjects == nullptr)
+		{
+			UnlinkSlab(cache->PartialSlabs, slab);
+			LinkSlab(cache->FullSlabs, slab);
+		}
+
+		magazine.Objects[magazine.Count++] = GetObject(cache, link);
+	}
+
+	cache->Lock.Unlock();
+}
+
+// Interrupts must be disabled. Returns the bottom (coldest) count objects to their slabs.
+static void FlushMagazine(SlabCache* cache, SlabMagazine& magazine, uint64_t count, bool keepNone)
+{
+	if(count > magazine.Count)
+	{
+		count = magazine.Count;
+	}
+
+	Slab* released = nullptr;
+
+	cache->Lock.Lock();
+
+	for(uint64_t index = 0; index < count; index++)
+	{
+		ReturnObject(cache, magazine.Objects[index], released, keepNone);
+	}
+
+	cache->Lock.Unlock();
+
+	memmove(magazine.Objects, magazine.Objects + count, (magazine.Count - count) * sizeof(void*));
+	magazine.Count -= count;
+
+	DestroySlabs(cache, released);
+}
+
+SlabCache* CreateSlabCache(const char* name, uint64_t objectSize, SlabConstructor constructor, uint64_t maxFree)
+{
+	_ASSERTF(objectSize > 0, "Empty slab objects");
+
+	SlabCache* cache = (SlabCache*)VirtualAllocOnDemand(AlignUp(sizeof(SlabCache), PAGE_SIZE), PrivilegeLevel::Kernel);
+	if(cache == nullptr)
+	{
+		return nullptr;
+	}
+
+	cache->Name = name;
+	cache->ObjectSize = objectSize;
+	cache->Constructor = constructor;
+
+	if(constructor)
+	{
+		cache->LinkOffset = AlignUp(objectSize, sizeof(SlabObject*));
+		cache->Stride = AlignUp(cache->LinkOffset + sizeof(SlabObject*), SLAB_OBJECT_ALIGNMENT);
+	}
+	else
+	{
+		cache->LinkOffset = 0;
+		cache->Stride = AlignUp(objectSize < sizeof(SlabObject*) ? sizeof(SlabObject*) : objectSize, SLAB_OBJECT_ALIGNMENT);
+	}
+
+	cache->FirstObject = AlignUp(sizeof(Slab), SLAB_OBJECT_ALIGNMENT);
+
+	cache->SlabSize = PAGE_SIZE;
+	while(cache->SlabSize < SLAB_MAX_SIZE && (cache->SlabSize - cache->FirstObject) / cache->Stride < SLAB_MIN_OBJECTS)
+	{
+		cache->SlabSize *= 2;
+	}
+
+	cache->ObjectsPerSlab = (cache->SlabSize - cache->FirstObject) / cache->Stride;
+	_ASSERTF(cache->ObjectsPerSlab > 0, "Slab object too large");
+
+	cache->MaxFree = maxFree ? maxFree : cache->ObjectsPerSlab;
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	SlabCacheListLock.Lock();
+
+	cache->Next = SlabCaches;
+	SlabCaches = cache;
+
+	SlabCacheListLock.Unlock();
+	RestoreInterrupts(flags);
+
+	return cache;
+}
+
+SlabCache* GetOrCreateSlabCache(SlabCache*& cacheSlot, const char* name, uint64_t objectSize, SlabConstructor constructor)
+{
+	SlabCache* cache = CreateSlabCache(name, objectSize, constructor);
+
+	SlabCache* expected = nullptr;
+	if(__atomic_compare_exchange_n(&cacheSlot, &expected, cache, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		return cache;
+	}
+
+	//Another core created it first
+	DestroySlabCache(cache);
+	return expected;
+}
+
+void DestroySlabCache(SlabCache* cache)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	SlabCacheListLock.Lock();
+	for(SlabCache** link = &SlabCaches; *link; link = &(*link)->Next)
+	{
+		if(*link == cache)
+		{
+			*link = cache->Next;
+			break;
+		}
+	}
+	SlabCacheListLock.Unlock();
+
+	for(unsigned int cpu = 0; cpu < GetMagazineCount(); cpu++)
+	{
+		SlabMagazine& magazine = cache->Magazines[cpu];
+		if(magazine.Count > 0)
+		{
+			FlushMagazine(cache, magazine, magazine.Count, /*keepNone*/ true);
+		}
+	}
+
+	RestoreInterrupts(flags);
+
+	//Checked before anything is freed, a partial slab can still hold live objects too
+	_ASSERTF(cache->FullSlabs == nullptr, "Slab cache destroyed with objects still in use");
+	for(Slab* slab = cache->PartialSlabs; slab; slab = slab->Next)
+	{
+		_ASSERTF(slab->InUse == 0, "Slab cache destroyed with objects still in use");
+	}
+
+	DestroySlabs(cache, cache->PartialSlabs);
+	VirtualFree(cache, AlignUp(sizeof(SlabCache), PAGE_SIZE));
+}
+
+uint64_t GetSlabObjectSize(SlabCache* cache)
+{
+	return cache->ObjectSize;
+}
+
+void* SlabAlloc(SlabCache* cache)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	SlabMagazine& magazine = cache->Magazines[GetCurrentCpuIndex()];
+
+	if(magazine.Count == 0)
+	{
+		magazine.AllocMisses++;
+		RefillMagazine(cache, magazine);
+
+		if(magazine.Count == 0)
+		{
+			RestoreInterrupts(flags);
+			return nullptr;
+		}
+	}
+	else
+	{
+		magazine.AllocHits++;
+	}
+
+	void* object = magazine.Objects[--magazine.Count];
+
+	RestoreInterrupts(flags);
+
+	return object;
+}
+
+void SlabFree(SlabCache* cache, void* object)
+{
+	if(object == nullptr)
+	{
+		return;
+	}
+
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	SlabMagazine& magazine = cache->Magazines[GetCurrentCpuIndex()];
+
+	if(magazine.Count == SLAB_MAGAZINE_SIZE)
+	{
+		magazine.FreeMisses++;
+		FlushMagazine(cache, magazine, SLAB_MAGAZINE_BATCH, /*keepNone*/ false);
+	}
+	else
+	{
+		magazine.FreeHits++;
+	}
+
+	magazine.Objects[magazine.Count++] = object;
+
+	RestoreInterrupts(flags);
+}
+
+void PurgeSlabCache(SlabCache* cache)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+
+	SlabMagazine& magazine = cache->Magazines[GetCurrentCpuIndex()];
+	FlushMagazine(cache, magazine, magazine.Count, /*keepNone*/ true);
+
+	//Empty slabs kept back by MaxFree
+	Slab* released = nullptr;
+
+	cache->Lock.Lock();
+
+	for(Slab* slab = cache->PartialSlabs; slab;)
+	{
+		Slab* next = slab->Next;
+		if(slab->InUse == 0)
+		{
+			UnlinkSlab(cache->PartialSlabs, slab);
+			cache->FreeCount -= cache->ObjectsPerSlab;
+			cache->SlabCount--;
+
+			slab->Next = released;
+			released = slab;
+		}
+		slab = next;
+	}
+
+	cache->Lock.Unlock();
+
+	RestoreInterrupts(flags);
+
+	DestroySlabs(cache, released);
+}
+
+uint32_t GetSlabCacheStats(SlabCacheStats* stats, uint32_t maxCaches)
+{
+	uint32_t count = 0;
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	SlabCacheListLock.Lock();
+
+	for(SlabCache* cache = SlabCaches; cache; cache = cache->Next, count++)
+	{
+		if(count >= maxCaches)
+		{
+			continue;
+		}
+
+		SlabCacheStats& cacheStats = stats[count];
+		memset(&cacheStats, 0, sizeof(cacheStats));
+
+		cacheStats.Name = cache->Name;
+		cacheStats.ObjectSize = cache->ObjectSize;
+		cacheStats.SlabSize = cache->SlabSize;
+
+		cache->Lock.Lock();
+		cacheStats.Slabs = cache->SlabCount;
+		cacheStats.TotalObjects = cache->SlabCount * cache->ObjectsPerSlab;
+		uint64_t freeObjects = cache->FreeCount;
+		cache->Lock.Unlock();
+
+		for(unsigned int cpu = 0; cpu < GetMagazineCount(); cpu++)
+		{
+			const SlabMagazine& magazine = cache->Magazines[cpu];
+
+			cacheStats.AllocHits += magazine.AllocHits;
+			cacheStats.AllocMisses += magazine.AllocMisses;
+			cacheStats.FreeHits += magazine.FreeHits;
+			cacheStats.FreeMisses += magazine.FreeMisses;
+			freeObjects += magazine.Count;
+		}
+
+		cacheStats.ActiveObjects = cacheStats.TotalObjects > freeObjects ? cacheStats.TotalObjects - freeObjects : 0;
+	}
+
+	SlabCacheListLock.Unlock();
+	RestoreInterrupts(flags);
+
+	return count;
+}
@@ -4,12 +4,20 @@
 #include "kernel/console/console.h"
 #include "memory/memory.h"
 #include "kernel/memory/state.h"
+#include "kernel/init/apic.h"
+#include "kernel/init/alternatives.h"
+#include "kernel/scheduling/spinlock.h"
 #include "common/string.h"
 #include "rpmalloc.h"
 
-MemoryState PhysicalMemoryState;
+PhysicalMemoryStateType PhysicalMemoryState;
 MemoryState VirtualMemoryState;
 
+SpinLock MemoryStateLock;
+volatile int MemoryStateLockOwner = -1;
+unsigned int MemoryStateLockDepth = 0;
+uint64_t MemoryStateLockFlags = 0;
+
 //Summary of the system
 //---------------------
 // We track memory with a tree structure. This tree structure is made
@@ -26,15 +34,72 @@ MemoryState VirtualMemoryState;
 //
 // If you encounter a leaf node (ie anything except a branch), the Address pointer
 // now contains the upper bound of the allocation from the parent's lower bound.
+//
+// The tree is kept AVL balanced by rotating branches. A rotation keeps every branch's
+// mid point so leaves never move. Neighbouring leaves never share a state, so a free
+// leaf is always a whole free run and a branch's Largest is the larger of its children's.
+// None of the walks recurse, they keep an explicit path instead.
+
+void AcquireMemoryStateLock()
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+	int cpu = (int)GetCurrentCpuIndex();
+
+	if(MemoryStateLockOwner == cpu)
+	{
+		//Nested, interrupts were already disabled by the outer acquire
+		MemoryStateLockDepth++;
+		return;
+	}
+
+	MemoryStateLock.Lock();
+	MemoryStateLockOwner = cpu;
+	MemoryStateLockDepth = 1;
+	MemoryStateLockFlags = flags;
+}
+
+void ReleaseMemoryStateLock()
+{
+	_ASSERTF(MemoryStateLockOwner == (int)GetCurrentCpuIndex(), "Memory state lock released by non-owner");
+	_ASSERTF(MemoryStateLockDepth > 0, "Memory state lock not held");
+
+	if(--MemoryStateLockDepth > 0)
+	{
+		return;
+	}
+
+	uint64_t flags = MemoryStateLockFlags;
+	MemoryStateLockOwner = -1;
+	MemoryStateLock.Unlock();
+
+	RestoreInterrupts(flags);
+}
+
+bool IsMemoryStateLockHeld()
+{
+	//Only this core can set the owner to its own index, so no lock is needed to read it
+	return MemoryStateLockOwner == (int)GetCurrentCpuIndex();
+}
 
 void MemoryState::Init(int systemIndex, const uint64_t highestAddress)
 {
+#if ENABLE_MEMORY_STATE_TRACE
+	if(systemIndex == 0)
+	{
+		RecordMemoryStateInit(highestAddress);
+	}
+#endif
+
 	StateRoot = nullptr;
 	StateLeafFreeHead = nullptr;
 	StateBranchFreeHead = nullptr;
 	HighestAddress = highestAddress;
 	UsedBranches = 0;
 	UsedLeaves = 0;
+	FreeBranches = InitialBranchTableEntries;
+	FreeLeaves = InitialLeafTableEntries;
+	DynamicNodes = false;
+	AllocatingNodes = false;
 	SystemIndex = systemIndex;
 
 	NextStateLeafFreeHead = nullptr;
@@ -58,8 +123,8 @@ void MemoryState::Init(int systemIndex, const uint64_t highestAddress)
         StateBranchFreeHead = &InitialBranchEntries[i];
     }
 
-   // Set the root to the first entry
-    StateRoot = GetFreeBranchState();
+   // Set the root to a single free leaf covering everything
+    StateRoot = GetFreeLeafState();
     StateRoot->SetAddress(highestAddress);
     StateRoot->State.State = RangeState::Free;
 }
@@ -68,6 +133,8 @@ void MemoryState::InitDynamic()
 {
 	AllocateNewLeafPage();
 	AllocateNewBranchPage();
+
+	DynamicNodes = true;
 }
 
 void MemoryState::AllocateNewLeafPage()
@@ -80,215 +147,568 @@ void MemoryState::AllocateNewBranchPage()
 	NextStateBranchFreeHead = (BranchStateNode*)rpmalloc(sizeof(BranchStateNode) * InitialBranchTableEntries);
 }
 
-MemoryState::StateNode* MemoryState::TagRangeInternal(StateNode* CurrentState, const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
+// Called before the tree is touched so that the allocation (which can land back in
+// a TagRange on this same state) always sees a consistent tree.
+void MemoryState::EnsureNodeReserve()
 {
-	_ASSERTFV(OuterHighAddress - OuterLowAddress > 0, "About to create an empty block", OuterHighAddress, OuterLowAddress, SystemIndex);
+	if(!DynamicNodes || AllocatingNodes)
+	{
+		return;
+	}
 
-    _ASSERTFV(OuterLowAddress <= LowAddress, "Requested address is out of range", OuterLowAddress, LowAddress, SystemIndex);
-    _ASSERTFV(HighAddress <= OuterHighAddress, "Requested address is out of range", HighAddress, OuterHighAddress, SystemIndex);
+	AllocatingNodes = true;
 
-	uintptr_t Address = CurrentState->GetAddress();
+	if(FreeLeaves < NodeReserveLowWater && NextStateLeafFreeHead != nullptr)
+	{
+		StateNode* Block = NextStateLeafFreeHead;
+		NextStateLeafFreeHead = nullptr;
+
+		memset(Block, 0, sizeof(StateNode) * InitialLeafTableEntries);
+		for (int i = InitialLeafTableEntries - 1; i >= 0; i--)
+		{
+			Block[i].Address = (uintptr_t)StateLeafFreeHead;
+			StateLeafFreeHead = &Block[i];
+		}
+		FreeLeaves += InitialLeafTableEntries;
+	}
+
+	if(FreeBranches < NodeReserveLowWater && NextStateBranchFreeHead != nullptr)
+	{
+		BranchStateNode* Block = NextStateBranchFreeHead;
+		NextStateBranchFreeHead = nullptr;
+
+		memset(Block, 0, sizeof(BranchStateNode) * InitialBranchTableEntries);
+		for (int i = InitialBranchTableEntries - 1; i >= 0; i--)
+		{
+			Block[i].Address = (uintptr_t)StateBranchFreeHead;
+			StateBranchFreeHead = &Block[i];
+		}
+		FreeBranches += InitialBranchTableEntries;
+	}
+
+	if(NextStateLeafFreeHead == nullptr)
+	{
+		AllocateNewLeafPage();
+	}
+
+	if(NextStateBranchFreeHead == nullptr)
+	{
+		AllocateNewBranchPage();
+	}
+
+	AllocatingNodes = false;
+}
+
+MemoryState::StateNode* MemoryState::FindLeaf(const uintptr_t Address, PathEntry* Path, int& Depth, uintptr_t& LeafLow, uintptr_t& LeafHigh)
+{
+	StateNode* CurrentState = StateRoot;
+	uintptr_t OuterLowAddress = 0;
+	uintptr_t OuterHighAddress = HighestAddress;
+
+	Depth = 0;
+	while (CurrentState->State.State == RangeState::Branch)
+	{
+		_ASSERTFV(Depth < MaxTreeDepth, "Memory state tree too deep", Depth, Address, SystemIndex);
 
-    if (CurrentState->State.State == RangeState::Branch)
-    {
 		BranchStateNode* BranchState = (BranchStateNode*)CurrentState;
+		uintptr_t Mid = BranchState->GetAddress();
 
-        _ASSERTFV(OuterLowAddress <= Address, "Requested address is out of range", OuterLowAddress, Address, SystemIndex);
-        _ASSERTFV(Address < OuterHighAddress, "Requested address is out of range", Address, OuterHighAddress, SystemIndex);
-
-        if (LowAddress < Address && HighAddress <= Address)
-        {
-            //Take the left branch
-            BranchState->Left = TagRangeInternal(BranchState->Left, LowAddress, HighAddress, State, OuterLowAddress, Address);
-        }
-        else if (LowAddress >= Address)
-        {
-            //Take the right branch
-            BranchState->Right = TagRangeInternal(BranchState->Right, LowAddress, HighAddress, State, Address, OuterHighAddress);
-        }
-        else
-        {
-            //Do both
-            BranchState->Left = TagRangeInternal(BranchState->Left, LowAddress, Address, State, OuterLowAddress, Address);
-            BranchState->Right = TagRangeInternal(BranchState->Right, Address, HighAddress, State, Address, OuterHighAddress);
-        }
-
-		//We may no longer actually be a branch state now if one of the nodes above merged back to a leaf
-		if (CurrentState->State.State == RangeState::Branch)
-    	{
-			StateNode* NewNode = UpdateNode(BranchState, OuterLowAddress, OuterHighAddress);
-			if(CurrentState != NewNode)
-			{
-				CurrentState = NewNode;
-			}
+		PathEntry& Entry = Path[Depth++];
+		Entry.Node = BranchState;
+		Entry.LowAddress = OuterLowAddress;
+		Entry.HighAddress = OuterHighAddress;
+		Entry.WentLeft = Address < Mid;
+
+		if(Entry.WentLeft)
+		{
+			CurrentState = BranchState->Left;
+			OuterHighAddress = Mid;
 		}
-    }
-    else
-    {
-		_ASSERTFV(Address >= LowAddress, "Address out of bounds", Address, LowAddress, SystemIndex);
-		_ASSERTFV(Address >= HighAddress, "Address out of bounds", Address, HighAddress, SystemIndex);
+		else
+		{
+			CurrentState = BranchState->Right;
+			OuterLowAddress = Mid;
+		}
+	}
+
+	LeafLow = OuterLowAddress;
+	LeafHigh = OuterHighAddress;
+
+	return CurrentState;
+}
 
-		RangeState TargetState = CurrentState->State.State;
-		if(CurrentState->State.State != RangeState::Reserved)
+MemoryState::StateNode** MemoryState::GetChildSlot(PathEntry* Path, int Depth)
+{
+	if(Depth == 0)
+	{
+		return &StateRoot;
+	}
+
+	BranchStateNode* Parent = Path[Depth - 1].Node;
+	return Path[Depth - 1].WentLeft ? &Parent->Left : &Parent->Right;
+}
+
+MemoryState::BranchStateNode* MemoryState::RotateLeft(BranchStateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
+{
+	BranchStateNode* Right = (BranchStateNode*)Node->Right;
+	_ASSERTFV(Right->State.State == RangeState::Branch, "Rotating a leaf", (uint64_t)Right, 0, SystemIndex);
+
+	Node->Right = Right->Left;
+	Right->Left = Node;
+
+	UpdateNode(Node, OuterLowAddress, Right->GetAddress());
+	UpdateNode(Right, OuterLowAddress, OuterHighAddress);
+
+	return Right;
+}
+
+MemoryState::BranchStateNode* MemoryState::RotateRight(BranchStateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
+{
+	BranchStateNode* Left = (BranchStateNode*)Node->Left;
+	_ASSERTFV(Left->State.State == RangeState::Branch, "Rotating a leaf", (uint64_t)Left, 0, SystemIndex);
+
+	Node->Left = Left->Right;
+	Left->Right = Node;
+
+	UpdateNode(Node, Left->GetAddress(), OuterHighAddress);
+	UpdateNode(Left, OuterLowAddress, OuterHighAddress);
+
+	return Left;
+}
+
+// Expects Node to already be up to date, returns whatever should now sit in its slot
+MemoryState::StateNode* MemoryState::Rebalance(BranchStateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
+{
+	int64_t Balance = (int64_t)GetHeight(Node->Left) - (int64_t)GetHeight(Node->Right);
+	uintptr_t Mid = Node->GetAddress();
+
+	if(Balance > 1)
+	{
+		BranchStateNode* Left = (BranchStateNode*)Node->Left;
+		if(GetHeight(Left->Left) < GetHeight(Left->Right))
+		{
+			Node->Left = RotateLeft(Left, OuterLowAddress, Mid);
+		}
+		return RotateRight(Node, OuterLowAddress, OuterHighAddress);
+	}
+	else if(Balance < -1)
+	{
+		BranchStateNode* Right = (BranchStateNode*)Node->Right;
+		if(GetHeight(Right->Right) < GetHeight(Right->Left))
 		{
-			TargetState = State;
+			Node->Right = RotateRight(Right, Mid, OuterHighAddress);
 		}
+		return RotateLeft(Node, OuterLowAddress, OuterHighAddress);
+	}
 
-        // We're on a leaf node. Check if we need to split it.
-        if (!(LowAddress == OuterLowAddress && HighAddress == Address))
-        {
-			//If the range we want is the same as what's already tagged
-			// and is wholly contained in our current block, we can just do nothing.
-			if(LowAddress >= OuterLowAddress && HighAddress <= Address && CurrentState->State.State == TargetState)
-			{
-				return CurrentState;
-			}
+	return Node;
+}
+
+// Walks back up a path from FindLeaf fixing up the cached values and balance
+void MemoryState::Retrace(PathEntry* Path, int Depth)
+{
+	for(int i = Depth - 1; i >= 0; i--)
+	{
+		PathEntry& Entry = Path[i];
+
+		UpdateNode(Entry.Node, Entry.LowAddress, Entry.HighAddress);
+		*GetChildSlot(Path, i) = Rebalance(Entry.Node, Entry.LowAddress, Entry.HighAddress);
+	}
+}
 
-            //If our lower bound doesn't touch the outer lower bound, then we treat the new low address as the mid point.
-            //However if that's not true then our high address is the mid point
-            uint64_t MidPoint = LowAddress == OuterLowAddress ? HighAddress : LowAddress;
+// Makes sure a leaf starts at Address
+void MemoryState::SplitAt(const uintptr_t Address)
+{
+	if(Address == 0 || Address >= HighestAddress)
+	{
+		return;
+	}
 
-            // Split the node into a branch with two children
-            BranchStateNode* NewBranch = GetFreeBranchState();
-            NewBranch->SetAddress(MidPoint); //Address in this scenario is the mid point
-            NewBranch->State.State = RangeState::Branch;
+	PathEntry Path[MaxTreeDepth];
+	int Depth;
+	uintptr_t LeafLow, LeafHigh;
+	StateNode* Leaf = FindLeaf(Address, Path, Depth, LeafLow, LeafHigh);
 
-			_ASSERTF(OuterLowAddress < MidPoint, "About to create zero block");
-			StateNode* NewLeft = GetFreeLeafState();
-            NewBranch->Left = NewLeft;
-            NewLeft->SetAddress(MidPoint);
-            NewLeft->State.State = CurrentState->State.State;
+	if(LeafLow == Address)
+	{
+		return;
+	}
 
-			if(MidPoint != NewLeft->GetAddress())
-			{
-				char16_t buffer[16];
-				ConsolePrint(u"MidPoint: ");
-				witoabuf(buffer, MidPoint, 16);
-				ConsolePrint(buffer);
+	// The existing leaf keeps the upper part, its upper bound doesn't change
+	StateNode* NewLeft = GetFreeLeafState();
+	NewLeft->SetAddress(Address);
+	NewLeft->State.State = Leaf->State.State;
 
-				ConsolePrint(u"\nNewLeft Address: ");
-				witoabuf(buffer, NewLeft->GetAddress(), 16);
-				ConsolePrint(buffer);
+	_ASSERTFV(Address == NewLeft->GetAddress(), "Mismatch on expected block bounds", Address, NewLeft->GetAddress(), SystemIndex);
 
-				ConsolePrint(u"\n");
-			}
+	BranchStateNode* NewBranch = GetFreeBranchState();
+	NewBranch->SetAddress(Address); //Address in this scenario is the mid point
+	NewBranch->State.State = RangeState::Branch;
+	NewBranch->Left = NewLeft;
+	NewBranch->Right = Leaf;
+	UpdateNode(NewBranch, LeafLow, LeafHigh);
 
-			_ASSERTFV(MidPoint == NewLeft->GetAddress(), "Mismatch on expected block bounds", MidPoint, NewLeft->GetAddress(), SystemIndex);
-
-			_ASSERTFV(Address == OuterHighAddress || (OuterHighAddress & PAGE_MASK) == (~0ULL & PAGE_MASK), "Right block should touch the outer bound", Address, OuterHighAddress, SystemIndex);
-			StateNode* NewRight = GetFreeLeafState();
-            NewBranch->Right = NewRight;
-            NewRight->SetAddress(Address);
-            NewRight->State.State = CurrentState->State.State;
-
-			//Free the old node
-			FreeLeafState(CurrentState);
-
-			CurrentState = NewBranch;
-
-			_ASSERTFV(MidPoint == NewBranch->Left->GetAddress(), "Mismatch on expected block bounds", MidPoint, NewBranch->Left->GetAddress(), SystemIndex);
-
-            // Now that the node is split, recurse on the appropriate child node
-            if (LowAddress < MidPoint && HighAddress <= MidPoint)
-            {
-				_ASSERTFV(OuterLowAddress < MidPoint, "About to create zero block", OuterLowAddress, MidPoint, SystemIndex);
-				_ASSERTFV(MidPoint == NewBranch->Left->GetAddress(), "Mismatch on expected block bounds", MidPoint, NewBranch->Left->GetAddress(), SystemIndex);
-                NewBranch->Left = TagRangeInternal(NewBranch->Left, LowAddress, HighAddress, TargetState, OuterLowAddress, MidPoint);
-            }
-            else if (LowAddress >= MidPoint && HighAddress > MidPoint)
-            {
-				_ASSERTFV(MidPoint < Address, "About to create zero block", MidPoint, Address, SystemIndex);
-                NewBranch->Right = TagRangeInternal(NewBranch->Right, LowAddress, HighAddress, TargetState, MidPoint, Address);
-            }
-            else
-            {
-                _ASSERTFV(false, "Incorrect branch state", 0, 0, SystemIndex);
-            }
-
-			_ASSERTF(!(NewBranch->Right->State.State != RangeState::Branch && NewBranch->Left->State.State == NewBranch->Right->State.State), "About to perform unexpected state merge");
-
-			StateNode* NewNode = UpdateNode(NewBranch, OuterLowAddress, OuterHighAddress);
-			_ASSERTFV(NewNode == NewBranch, "Unexpected node merge", (uint64_t)NewNode, (uint64_t)NewBranch, SystemIndex);
-        }
-        else
-        {
-            _ASSERTFV(LowAddress == OuterLowAddress || HighAddress == OuterHighAddress, "Expected ranges to match.", LowAddress, HighAddress, SystemIndex);
-            //_ASSERTF(CurrentState->State.State != RangeState::Reserved || State == RangeState::Reserved, "Cannot modify reserved ranges once created.");
-
-			CurrentState->State.State = TargetState;
-        }
-    }
+	*GetChildSlot(Path, Depth) = NewBranch;
 
-	return CurrentState;
+	Retrace(Path, Depth);
 }
 
-uintptr_t MemoryState::FindMinimumSizeFreeBlockInternal(StateNode* CurrentState, uint64_t MinSize, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress)
+// Sets every non reserved leaf in the range, the range must already be split on its bounds
+void MemoryState::SetRangeState(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State)
 {
-	uintptr_t Address = CurrentState->GetAddress();
+	PathEntry Path[MaxTreeDepth];
+	int Depth;
+	uintptr_t LeafLow, LeafHigh;
 
-    if (CurrentState->State.State == MemoryState::RangeState::Branch)
-    {
-		BranchStateNode* BranchState = (BranchStateNode*)CurrentState;
+	uintptr_t Address = LowAddress;
+	while(Address < HighAddress)
+	{
+		StateNode* Leaf = FindLeaf(Address, Path, Depth, LeafLow, LeafHigh);
+		_HOT_ASSERTFV(LeafHigh <= HighAddress, "Leaf crosses the tagged range", LeafHigh, HighAddress, SystemIndex);
+
+		if(Leaf->State.State != RangeState::Reserved && Leaf->State.State != State)
+		{
+			Leaf->State.State = State;
+			Retrace(Path, Depth);
+		}
+
+		Address = LeafHigh;
+	}
+}
+
+// Folds the leaf ending at Address into the leaf starting there if they share a state.
+// Returns true if they were merged.
+bool MemoryState::MergeAt(const uintptr_t Address)
+{
+	if(Address == 0 || Address >= HighestAddress)
+	{
+		return false;
+	}
+
+	PathEntry Path[MaxTreeDepth];
+	int Depth;
+	uintptr_t LeafLow, LeafHigh;
+
+	StateNode* Upper = FindLeaf(Address, Path, Depth, LeafLow, LeafHigh);
+	if(LeafLow != Address)
+	{
+		return false;
+	}
+
+	RangeState UpperState = Upper->State.State;
+
+	StateNode* Lower = FindLeaf(Address - 1, Path, Depth, LeafLow, LeafHigh);
+	if(Lower->State.State != UpperState)
+	{
+		return false;
+	}
+
+	_ASSERTFV(Depth > 0, "Mergeable leaf without a parent", Address, 0, SystemIndex);
 
+	// Drop the lower leaf and its parent, the sibling takes the parent's slot
+	PathEntry& ParentEntry = Path[Depth - 1];
+	BranchStateNode* Parent = ParentEntry.Node;
+	StateNode* Sibling = ParentEntry.WentLeft ? Parent->Right : Parent->Left;
+
+	if(!ParentEntry.WentLeft)
+	{
+		// The lower leaf sat at the end of the parent, so the upper leaf lives under the
+		// closest ancestor we went left at. Moving that split down hands it our range.
+		int Ancestor = Depth - 2;
+		while(Ancestor >= 0 && !Path[Ancestor].WentLeft)
+		{
+			Ancestor--;
+		}
+
+		_ASSERTFV(Ancestor >= 0, "Upper leaf not found", Address, 0, SystemIndex);
+		_ASSERTFV(Path[Ancestor].Node->GetAddress() == Address, "Unexpected split point", Path[Ancestor].Node->GetAddress(), Address, SystemIndex);
+
+		Path[Ancestor].Node->UpdateAddress(LeafLow);
+	}
+
+	*GetChildSlot(Path, Depth - 1) = Sibling;
+
+	FreeLeafState(Lower);
+	FreeStateBranch(Parent);
+
+	// A split point may have moved, refresh the bounds of what's left of the path
+	for(int i = 1; i < Depth - 1; i++)
+	{
+		PathEntry& Above = Path[i - 1];
+		uintptr_t Mid = Above.Node->GetAddress();
+
+		Path[i].LowAddress = Above.WentLeft ? Above.LowAddress : Mid;
+		Path[i].HighAddress = Above.WentLeft ? Mid : Above.HighAddress;
+	}
+
+	Retrace(Path, Depth - 1);
+
+	// The upper leaf grew, everything above it needs its sizes refreshed
+	FindLeaf(Address - 1, Path, Depth, LeafLow, LeafHigh);
+	Retrace(Path, Depth);
+
+	return true;
+}
+
+void MemoryState::TagRange(const uintptr_t LowAddress, const uintptr_t HighAddress, const RangeState State)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(SystemIndex == 0)
+	{
+		RecordMemoryStateTag(LowAddress, HighAddress, (uint8_t)State);
+	}
+#endif
+
+	_HOT_ASSERTFV(LowAddress < HighAddress, "About to create an empty block", LowAddress, HighAddress, SystemIndex);
+	_HOT_ASSERTFV(HighAddress <= HighestAddress, "Requested address is out of range", HighAddress, HighestAddress, SystemIndex);
+	_HOT_ASSERTFV((LowAddress & ~PAGE_MASK) == 0 && (HighAddress & ~PAGE_MASK) == 0, "Unaligned range", LowAddress, HighAddress, SystemIndex);
+
+	EnsureNodeReserve();
+
+	{
+		PathEntry Path[MaxTreeDepth];
+		int Depth;
+		uintptr_t LeafLow, LeafHigh;
+
+		//If the range is wholly contained in a block that already has the state we want
+		// (or can't change) we can just do nothing.
+		StateNode* Leaf = FindLeaf(LowAddress, Path, Depth, LeafLow, LeafHigh);
+		if(HighAddress <= LeafHigh && (Leaf->State.State == State || Leaf->State.State == RangeState::Reserved))
+		{
+			return;
+		}
+	}
+
+	SplitAt(LowAddress);
+	SplitAt(HighAddress);
+
+	SetRangeState(LowAddress, HighAddress, State);
+
+	//Only the boundaries inside and at the edges of the range can have gained a matching neighbour
+	PathEntry Path[MaxTreeDepth];
+	int Depth;
+	uintptr_t LeafLow, LeafHigh;
+
+	uintptr_t Address = LowAddress;
+	for(;;)
+	{
+		MergeAt(Address);
+
+		if(Address >= HighAddress)
+		{
+			break;
+		}
+
+		FindLeaf(Address, Path, Depth, LeafLow, LeafHigh);
+		Address = LeafHigh;
+	}
+}
+
+uintptr_t MemoryState::FindMinimumSizeFreeBlock(uint64_t MinSize)
+{
+#if ENABLE_MEMORY_STATE_TRACE
+	if(SystemIndex == 0)
+	{
+		RecordMemoryStateFind(MinSize);
+	}
+#endif
+
+	if(MinSize == 0)
+	{
+		MinSize = 1;
+	}
+
+	StateNode* CurrentState = StateRoot;
+	uintptr_t OuterLowAddress = 0;
+	uintptr_t OuterHighAddress = HighestAddress;
+
+	if(GetLargestFree(CurrentState, OuterLowAddress, OuterHighAddress) < MinSize)
+	{
+		return 0;
+	}
+
+	//Every free leaf is a whole free run, so whichever child holds a big enough one
+	// really does have it and we never need to back out of a branch
+	while (CurrentState->State.State == RangeState::Branch)
+	{
+		BranchStateNode* BranchState = (BranchStateNode*)CurrentState;
 		uintptr_t Mid = BranchState->GetAddress();
-		uint64_t LargestLeft = GetLargestFree(BranchState->Left, OuterLowAddress, Mid);
-		uint64_t LargestRight = GetLargestFree(BranchState->Right, Mid, OuterHighAddress);
 
-		if(LargestLeft >= MinSize)
+		if(GetLargestFree(BranchState->Left, OuterLowAddress, Mid) >= MinSize)
 		{
-			uintptr_t Candidate = FindMinimumSizeFreeBlockInternal(BranchState->Left, MinSize, OuterLowAddress, Mid);
-			if(Candidate != 0)
-			{
-				return Candidate;
-			}
+			CurrentState = BranchState->Left;
+			OuterHighAddress = Mid;
+		}
+		else
+		{
+			CurrentState = BranchState->Right;
+			OuterLowAddress = Mid;
+		}
+	}
+
+	_ASSERTFV(CurrentState->State.State == RangeState::Free, "Size search ended on a used block", OuterLowAddress, MinSize, SystemIndex);
+
+	return OuterLowAddress;
+}
+
+uintptr_t MemoryState::FindBestFitFreeBlock(uint64_t MinSize)
+{
+	if(MinSize == 0)
+	{
+		MinSize = 1;
+	}
+
+	uintptr_t BestAddress = 0;
+	uint64_t BestSize = ~0ULL;
+
+	//Depth first, left before right, the stack never holds more than one entry per level
+	PathEntry Stack[MaxTreeDepth + 1];
+	int StackSize = 0;
+
+	Stack[StackSize++] = { (BranchStateNode*)StateRoot, 0ULL, HighestAddress, false };
+
+	while(StackSize > 0)
+	{
+		PathEntry Entry = Stack[--StackSize];
+		StateNode* CurrentState = Entry.Node;
+
+		uint64_t Largest = GetLargestFree(CurrentState, Entry.LowAddress, Entry.HighAddress);
+		if(Largest < MinSize)
+		{
+			continue;
 		}
 
-		if(LargestRight >= MinSize)
+		if (CurrentState->State.State == RangeState::Branch)
+		{
+			BranchStateNode* BranchState = (BranchStateNode*)CurrentState;
+			uintptr_t Mid = BranchState->GetAddress();
+
+			_ASSERTFV(StackSize + 2 <= MaxTreeDepth + 1, "Memory state tree too deep", StackSize, 0, SystemIndex);
+
+			Stack[StackSize++] = { (BranchStateNode*)BranchState->Right, Mid, Entry.HighAddress, false };
+			Stack[StackSize++] = { (BranchStateNode*)BranchState->Left, Entry.LowAddress, Mid, true };
+		}
+		else if(Largest < BestSize)
 		{
-			uintptr_t Candidate = FindMinimumSizeFreeBlockInternal(BranchState->Right, MinSize, Mid, OuterHighAddress);
-			if(Candidate != 0)
+			BestAddress = Entry.LowAddress;
+			BestSize = Largest;
+
+			if(BestSize == MinSize)
 			{
-				return Candidate;
+				break;
 			}
 		}
+	}
 
-		return 0;
-    }
-	else if (CurrentState->State.State == MemoryState::RangeState::Free)
-    {
-		uint64_t Largest = GetLargestFree(CurrentState, OuterLowAddress, Address);
-		if(Largest >= MinSize)
+	return BestAddress;
+}
+
+uintptr_t MemoryState::FindAlignedFreeBlock(uint64_t MinSize, uint64_t Alignment)
+{
+	_ASSERTFV((Alignment & (Alignment - 1)) == 0, "Alignment must be a power of two", Alignment, 0, SystemIndex);
+
+	if(MinSize == 0)
+	{
+		MinSize = 1;
+	}
+
+	PathEntry Stack[MaxTreeDepth + 1];
+	int StackSize = 0;
+
+	Stack[StackSize++] = { (BranchStateNode*)StateRoot, 0ULL, HighestAddress, false };
+
+	while(StackSize > 0)
+	{
+		PathEntry Entry = Stack[--StackSize];
+		StateNode* CurrentState = Entry.Node;
+
+		if(GetLargestFree(CurrentState, Entry.LowAddress, Entry.HighAddress) < MinSize)
+		{
+			continue;
+		}
+
+		if (CurrentState->State.State == RangeState::Branch)
 		{
-			return OuterLowAddress;
+			BranchStateNode* BranchState = (BranchStateNode*)CurrentState;
+			uintptr_t Mid = BranchState->GetAddress();
+
+			_ASSERTFV(StackSize + 2 <= MaxTreeDepth + 1, "Memory state tree too deep", StackSize, 0, SystemIndex);
+
+			Stack[StackSize++] = { (BranchStateNode*)BranchState->Right, Mid, Entry.HighAddress, false };
+			Stack[StackSize++] = { (BranchStateNode*)BranchState->Left, Entry.LowAddress, Mid, true };
+		}
+		else
+		{
+			uintptr_t AlignedAddress = (Entry.LowAddress + Alignment - 1) & ~(Alignment - 1);
+			if(AlignedAddress >= Entry.LowAddress && AlignedAddress < Entry.HighAddress && Entry.HighAddress - AlignedAddress >= MinSize)
+			{
+				return AlignedAddress;
+			}
 		}
 	}
-    
+
 	return 0;
 }
 
 MemoryState::RangeState MemoryState::GetPageState(const uint64_t Address)
 {
-	return GetPageStateInternal(StateRoot, Address);
-}
+	StateNode* CurrentState = StateRoot;
 
-MemoryState::RangeState MemoryState::GetPageStateInternal(StateNode* CurrentState, const uint64_t Address)
-{
-	if (CurrentState->State.State == RangeState::Branch)
-    {
+	while (CurrentState->State.State == RangeState::Branch)
+	{
 		BranchStateNode* BranchState = (BranchStateNode*)CurrentState;
 
 		uintptr_t Mid = BranchState->GetAddress();
 		if(Address < Mid)
 		{
-			return GetPageStateInternal(BranchState->Left, Address);
+			CurrentState = BranchState->Left;
 		}
 		else
 		{
-			return GetPageStateInternal(BranchState->Right, Address);
+			CurrentState = BranchState->Right;
 		}
 	}
-	else
+
+	return CurrentState->State.State;
+}
+
+void MemoryState::CountFreeRuns(StateNode* Node, const uintptr_t OuterLowAddress, const uintptr_t OuterHighAddress, uint64_t* Buckets, int BucketCount)
+{
+	if (Node->State.State == RangeState::Branch)
 	{
-		return CurrentState->State.State;
+		BranchStateNode* BranchState = (BranchStateNode*)Node;
+
+		//Nothing free anywhere below, don't bother walking it
+		if(BranchState->Remaining == 0)
+		{
+			return;
+		}
+
+		uintptr_t Mid = BranchState->GetAddress();
+		CountFreeRuns(BranchState->Left, OuterLowAddress, Mid, Buckets, BucketCount);
+		CountFreeRuns(BranchState->Right, Mid, OuterHighAddress, Buckets, BucketCount);
+		return;
+	}
+
+	if (Node->State.State != RangeState::Free)
+	{
+		return;
 	}
+
+	//Neighbouring leaves never share a state, so every free leaf is a whole run
+	uint64_t pages = (OuterHighAddress - OuterLowAddress) >> PAGE_BITS;
+	int bucket = 63 - __builtin_clzll(pages);
+	if(bucket >= BucketCount)
+	{
+		bucket = BucketCount - 1;
+	}
+
+	Buckets[bucket]++;
+}
+
+void MemoryState::GetFreeRunHistogram(uint64_t* Buckets, int BucketCount)
+{
+	memset(Buckets, 0, BucketCount * sizeof(uint64_t));
+
+	CountFreeRuns(StateRoot, 0ULL, HighestAddress, Buckets, BucketCount);
 }
@@ -0,0 +1,149 @@
+#if ENABLE_MEMORY_STATE_TRACE
+
+#include "kernel/memory/state.h"
+#include "kernel/memory/buddy_state.h"
+#include "kernel/memory/state_trace.h"
+#include "kernel/console/console.h"
+#include "kernel/scheduling/time.h"
+#include "memory/virtual.h"
+
+enum class MemoryStateTraceOp : uint8_t
+{
+	Tag,
+	Find,
+};
+
+struct MemoryStateTraceEntry
+{
+	uint64_t Low;
+	uint64_t High;
+	MemoryStateTraceOp Op;
+	uint8_t State;
+};
+
+const static uint64_t MaxTraceEntries = 64 * 1024;
+
+MemoryStateTraceEntry TraceEntries[MaxTraceEntries];
+uint64_t TraceEntryCount = 0;
+uint64_t TraceEntriesDropped = 0;
+uint64_t TraceHighestAddress = 0;
+bool TraceReplaying = false;
+
+static void AddTraceEntry(MemoryStateTraceOp op, uint64_t low, uint64_t high, uint8_t state)
+{
+	if(TraceReplaying)
+	{
+		return;
+	}
+
+	if(TraceEntryCount == MaxTraceEntries)
+	{
+		TraceEntriesDropped++;
+		return;
+	}
+
+	MemoryStateTraceEntry& entry = TraceEntries[TraceEntryCount++];
+	entry.Op = op;
+	entry.Low = low;
+	entry.High = high;
+	entry.State = state;
+}
+
+void RecordMemoryStateInit(uint64_t highestAddress)
+{
+	TraceHighestAddress = highestAddress;
+	TraceEntryCount = 0;
+	TraceEntriesDropped = 0;
+}
+
+void RecordMemoryStateTag(uint64_t lowAddress, uint64_t highAddress, uint8_t state)
+{
+	AddTraceEntry(MemoryStateTraceOp::Tag, lowAddress, highAddress, state);
+}
+
+void RecordMemoryStateFind(uint64_t minSize)
+{
+	AddTraceEntry(MemoryStateTraceOp::Find, minSize, 0, 0);
+}
+
+template<typename Backend>
+static void ReplayAgainst(Backend* backend, int systemIndex, const char16_t* name)
+{
+	backend->Init(systemIndex, TraceHighestAddress);
+	backend->InitDynamic();
+
+	uint64_t tags = 0;
+	uint64_t finds = 0;
+	uint64_t failedFinds = 0;
+
+	uint64_t start = HpetGetNanoseconds();
+
+	for(uint64_t index = 0; index < TraceEntryCount; index++)
+	{
+		const MemoryStateTraceEntry& entry = TraceEntries[index];
+		if(entry.Op == MemoryStateTraceOp::Tag)
+		{
+			backend->TagRange(entry.Low, entry.High, (MemoryState::RangeState)entry.State);
+			tags++;
+		}
+		else
+		{
+			if(backend->FindMinimumSizeFreeBlock(entry.Low) == 0)
+			{
+				failedFinds++;
+			}
+			finds++;
+		}
+	}
+
+	uint64_t elapsed = HpetGetNanoseconds() - start;
+
+	uint64_t freeBytes = backend->GetFreeBytes();
+	uint64_t largest = backend->GetLargestFreeBlock();
+	uint64_t fragmentation = freeBytes == 0 ? 0 : 100 - ((largest * 100) / freeBytes);
+
+	SerialPrint(name);
+	SerialPrint(u":\n");
+	LogPrintNumeric(u"  ns/op: ", (tags + finds) == 0 ? 0 : elapsed / (tags + finds), u"\n", 10);
+	LogPrintNumeric(u"  tags: ", tags, u"\n", 10);
+	LogPrintNumeric(u"  finds: ", finds, u"", 10);
+	LogPrintNumeric(u" (failed ", failedFinds, u")\n", 10);
+	LogPrintNumeric(u"  free: ", freeBytes / 1024, u"KB\n", 10);
+	LogPrintNumeric(u"  largest free block: ", largest / 1024, u"KB\n", 10);
+	LogPrintNumeric(u"  fragmentation: ", fragmentation, u"%\n", 10);
+}
+
+// The buddy backend is ~17MB, so backends come straight from VirtualAlloc rather than the heap
+template<typename Backend>
+static void ReplayWithFreshBackend(int systemIndex, const char16_t* name)
+{
+	uint64_t size = AlignSize(sizeof(Backend), PAGE_SIZE);
+
+	Backend* backend = (Backend*)VirtualAlloc(size, PrivilegeLevel::Kernel);
+	if(backend == nullptr)
+	{
+		SerialPrint(name);
+		SerialPrint(u": not enough memory to replay against\n");
+		return;
+	}
+
+	ReplayAgainst(backend, systemIndex, name);
+
+	VirtualFree(backend, size);
+}
+
+void ReplayMemoryStateTrace()
+{
+	LogPrintNumeric(u"Replaying memory state trace, entries: ", TraceEntryCount, u"", 10);
+	LogPrintNumeric(u" dropped: ", TraceEntriesDropped, u"\n", 10);
+
+	//Also keeps the backends' own allocations out of the trace
+	TraceReplaying = true;
+
+	ReplayWithFreshBackend<MemoryState>(2, u"Range tree");
+	ReplayWithFreshBackend<BuddyMemoryState>(3, u"Buddy");
+
+	TraceReplaying = false;
+}
+
+#endif
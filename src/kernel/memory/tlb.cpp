@@ -0,0 +1,200 @@
+#include "kernel/memory/tlb.h"
+#include "kernel/memory/state.h"
+#include "kernel/init/apic.h"
+#include "kernel/init/long_mode.h"
+#include "utilities/termination.h"
+
+#define CR4_GLOBAL_PAGES (1ULL << 7)
+
+struct TlbFlushRange
+{
+	uint64_t VirtualAddress;
+	uint64_t Pages;
+};
+
+struct TlbFlushBatch
+{
+	uint64_t Depth;
+	uint64_t RangeCount;
+	uint64_t PageCount;
+	bool FlushAll;
+	bool FlushGlobal;
+
+	TlbFlushRange Ranges[TLB_FLUSH_BATCH_RANGES];
+
+	TlbFlushStats Stats;
+} __attribute__((aligned(64)));
+
+TlbFlushBatch TlbFlushBatches[MaxProcessors];
+
+bool GlobalPagesEnabled = false;
+
+// Only valid while the memory state lock is held, it keeps us on this core
+static TlbFlushBatch& GetLocalBatch()
+{
+	return TlbFlushBatches[GetCurrentCpuIndex()];
+}
+
+static void FlushLocalTlb(TlbFlushBatch& batch, bool global)
+{
+	if(global && GlobalPagesEnabled)
+	{
+		//Reloading CR3 keeps global entries, toggling PGE drops everything
+		uint64_t cr4 = GetCR4();
+		SetCR4(cr4 & ~CR4_GLOBAL_PAGES);
+		SetCR4(cr4);
+
+		batch.Stats.GlobalFlushes++;
+	}
+	else
+	{
+		SetCR3(GetCR3());
+
+		batch.Stats.FullFlushes++;
+	}
+}
+
+static void AddFlushRange(uint64_t virtualAddress, uint64_t pages, bool global)
+{
+	TlbFlushBatch& batch = GetLocalBatch();
+
+	_ASSERTF(batch.Depth > 0, "TLB flush queued outside a batch");
+
+	batch.FlushGlobal |= global;
+
+	if(batch.FlushAll)
+	{
+		return;
+	}
+
+	batch.PageCount += pages;
+	if(batch.PageCount > TLB_FLUSH_FULL_THRESHOLD)
+	{
+		batch.FlushAll = true;
+		return;
+	}
+
+	//Most edits walk forward a page at a time, so extend the last range where we can
+	if(batch.RangeCount > 0)
+	{
+		TlbFlushRange& last = batch.Ranges[batch.RangeCount - 1];
+		if(last.VirtualAddress + (last.Pages * PAGE_SIZE) == virtualAddress)
+		{
+			last.Pages += pages;
+			return;
+		}
+	}
+
+	if(batch.RangeCount == TLB_FLUSH_BATCH_RANGES)
+	{
+		batch.FlushAll = true;
+		return;
+	}
+
+	batch.Ranges[batch.RangeCount++] = { virtualAddress, pages };
+}
+
+void BeginTlbFlushBatch()
+{
+	AcquireMemoryStateLock();
+
+	TlbFlushBatch& batch = GetLocalBatch();
+	if(batch.Depth++ == 0)
+	{
+		batch.RangeCount = 0;
+		batch.PageCount = 0;
+		batch.FlushAll = false;
+		batch.FlushGlobal = false;
+	}
+}
+
+void EndTlbFlushBatch()
+{
+	TlbFlushBatch& batch = GetLocalBatch();
+
+	_ASSERTF(batch.Depth > 0, "Unbalanced TLB flush batch");
+
+	if(--batch.Depth == 0 && (batch.FlushAll || batch.PageCount > 0))
+	{
+		batch.Stats.Batches++;
+
+		if(batch.FlushAll)
+		{
+			FlushLocalTlb(batch, batch.FlushGlobal);
+		}
+		else
+		{
+			//invlpg drops global entries too
+			for(uint64_t range = 0; range < batch.RangeCount; range++)
+			{
+				uint64_t virtualAddress = batch.Ranges[range].VirtualAddress;
+				for(uint64_t page = 0; page < batch.Ranges[range].Pages; page++)
+				{
+					asm volatile("invlpg (%0)" ::"r"(virtualAddress) : "memory");
+					virtualAddress += PAGE_SIZE;
+				}
+			}
+
+			batch.Stats.PageFlushes += batch.PageCount;
+		}
+
+		//Only the BSP runs on these page tables so far, the APs park in hlt straight after startup.
+		//Once they pick up work this is where the other cores get sent the batch to flush too.
+	}
+
+	ReleaseMemoryStateLock();
+}
+
+void FlushTlbPage(uint64_t virtualAddress, bool global)
+{
+	BeginTlbFlushBatch();
+	AddFlushRange(virtualAddress & ~(uint64_t)(PAGE_SIZE-1), 1, global);
+	EndTlbFlushBatch();
+}
+
+void FlushTlbRange(uint64_t virtualAddress, uint64_t size, bool global)
+{
+	uint64_t start = virtualAddress & ~(uint64_t)(PAGE_SIZE-1);
+	uint64_t end = (virtualAddress + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE-1);
+
+	BeginTlbFlushBatch();
+	AddFlushRange(start, (end - start) / PAGE_SIZE, global);
+	EndTlbFlushBatch();
+}
+
+void FlushTlbAll()
+{
+	AcquireMemoryStateLock();
+
+	TlbFlushBatch& batch = GetLocalBatch();
+
+	FlushLocalTlb(batch, true);
+
+	batch.RangeCount = 0;
+	batch.PageCount = 0;
+	batch.FlushAll = false;
+	batch.FlushGlobal = false;
+
+	ReleaseMemoryStateLock();
+}
+
+void InitTlbFeatures()
+{
+	SetCR4(GetCR4() | CR4_GLOBAL_PAGES);
+	GlobalPagesEnabled = true;
+}
+
+void GetTlbFlushStats(TlbFlushStats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	for(unsigned int cpu = 0; cpu < MaxProcessors; cpu++)
+	{
+		const TlbFlushBatch& batch = TlbFlushBatches[cpu];
+
+		stats.Batches += batch.Stats.Batches;
+		stats.PageFlushes += batch.Stats.PageFlushes;
+		stats.FullFlushes += batch.Stats.FullFlushes;
+		stats.GlobalFlushes += batch.Stats.GlobalFlushes;
+	}
+}
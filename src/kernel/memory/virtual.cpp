@@ -1,48 +1,346 @@
 #include "memory/physical.h"
 #include "kernel/memory/state.h"
 #include "kernel/memory/pml4.h"
+#include "kernel/memory/frame_cache.h"
+#include "kernel/memory/tlb.h"
+#include "kernel/memory/page_cache.h"
 #include "utilities/termination.h"
 
-extern MemoryState PhysicalMemoryState;
+extern PhysicalMemoryStateType PhysicalMemoryState;
 extern MemoryState VirtualMemoryState;
 
+// Calls callback(virtualStart, physicalStart, size) for every physically contiguous run in the range.
+// Unmapped holes are reported with a physical address of INVALID_ADDRESS.
+template<typename Callback>
+static void ForEachPhysicalRun(uint64_t virtualAddress, uint64_t byteSize, Callback callback)
+{
+	uint64_t endAddress = virtualAddress + byteSize;
+
+	uint64_t runVirtual = virtualAddress;
+	uint64_t runPhysical = GetPhysicalAddress(virtualAddress);
+	uint64_t runSize = PAGE_SIZE;
+
+	for(uint64_t page = virtualAddress + PAGE_SIZE; page < endAddress; page += PAGE_SIZE)
+	{
+		uint64_t physical = GetPhysicalAddress(page);
+
+		bool extendsRun = runPhysical == INVALID_ADDRESS ? physical == INVALID_ADDRESS : physical == runPhysical + runSize;
+		if(extendsRun)
+		{
+			runSize += PAGE_SIZE;
+			continue;
+		}
+
+		callback(runVirtual, runPhysical, runSize);
+
+		runVirtual = page;
+		runPhysical = physical;
+		runSize = PAGE_SIZE;
+	}
+
+	callback(runVirtual, runPhysical, runSize);
+}
+
+static void UnmapRange(uint64_t virtualAddress, uint64_t byteSize)
+{
+	//Asked before the file backed entries go, they count
+	bool deferred = IsUnmapDeferred(virtualAddress, byteSize);
+
+	//Page cache frames aren't ours to free, so file mappings let go of them first
+	if(ReleaseFileMappings(virtualAddress, byteSize))
+	{
+		ClearFileBackedPages(virtualAddress, byteSize);
+	}
+
+	//An open snapshot will put these pages back, so nothing can be freed or handed out again before then
+	if(deferred)
+	{
+		uint64_t alignedSize = AlignSize(byteSize, PAGE_SIZE);
+		MapPages(virtualAddress, 0, alignedSize, false, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Free, PageFlags_None, /*tagPhysical*/ false);
+		VirtualMemoryState.TagRange(virtualAddress, virtualAddress + alignedSize, MemoryState::RangeState::Used);
+		return;
+	}
+
+	//One flush for the whole range rather than one per run
+	BeginTlbFlushBatch();
+
+	ForEachPhysicalRun(virtualAddress, byteSize,
+		[](uint64_t runVirtual, uint64_t runPhysical, uint64_t runSize)
+		{
+			if(runPhysical == INVALID_ADDRESS)
+			{
+				//Clears any demand zero entries that were never touched along with the virtual range
+				MapPages(runVirtual, 0, runSize, false, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Free, PageFlags_None, /*tagPhysical*/ false);
+			}
+			else if(runSize == PAGE_SIZE)
+			{
+				MapPages(runVirtual, runPhysical, runSize, false, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Free, PageFlags_None, /*tagPhysical*/ false);
+				FreePhysicalFrame(runPhysical);
+			}
+			else
+			{
+				MapPages(runVirtual, runPhysical, runSize, false, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Free);
+			}
+		});
+
+	EndTlbFlushBatch();
+}
+
+// Large requests get a 2MiB aligned range so they can be mapped with large pages
+static uint64_t FindFreeVirtualRange(uint64_t ByteSize, uint64_t Alignment = PAGE_SIZE)
+{
+	_ASSERTF((Alignment & (Alignment - 1)) == 0, "Alignment must be a power of two");
+
+	uint64_t VirtualAddress = 0;
+	if(ByteSize >= PAGE_SIZE_2MB && Alignment < PAGE_SIZE_2MB)
+	{
+		VirtualAddress = VirtualMemoryState.FindAlignedFreeBlock(ByteSize, PAGE_SIZE_2MB);
+	}
+
+	if(VirtualAddress == 0)
+	{
+		VirtualAddress = Alignment > PAGE_SIZE ? VirtualMemoryState.FindAlignedFreeBlock(ByteSize, Alignment) : VirtualMemoryState.FindMinimumSizeFreeBlock(ByteSize);
+	}
+
+	return VirtualAddress;
+}
+
+// Backs an already reserved virtual range with whatever physical memory is available.
+// Takes the largest contiguous runs the physical tree can offer and falls back to
+// single frames from the frame cache, so only fragmentation of the total matters.
+static bool MapScatteredPages(uint64_t virtualAddress, uint64_t byteSize, bool writable, bool executable, PrivilegeLevel privilegeLevel, PageFlags pageFlags)
+{
+	uint64_t mapped = 0;
+	uint64_t chunkSize = byteSize;
+
+	while(mapped < byteSize)
+	{
+		uint64_t remaining = byteSize - mapped;
+		if(chunkSize > remaining)
+		{
+			chunkSize = remaining;
+		}
+
+		uint64_t PhysicalAddress = 0;
+
+		//Where the virtual side is 2MiB aligned, look for physical memory that is too so MapPages can use large pages
+		if(((virtualAddress + mapped) & (PAGE_SIZE_2MB-1)) == 0)
+		{
+			uint64_t largeSize = chunkSize & ~(uint64_t)(PAGE_SIZE_2MB-1);
+			while(largeSize >= PAGE_SIZE_2MB)
+			{
+				PhysicalAddress = PhysicalMemoryState.FindAlignedFreeBlock(largeSize, PAGE_SIZE_2MB);
+				if(PhysicalAddress != 0)
+				{
+					chunkSize = largeSize;
+					break;
+				}
+
+				largeSize = (largeSize / 2) & ~(uint64_t)(PAGE_SIZE_2MB-1);
+			}
+		}
+
+		while(PhysicalAddress == 0 && chunkSize > PAGE_SIZE)
+		{
+			PhysicalAddress = PhysicalMemoryState.FindMinimumSizeFreeBlock(chunkSize);
+			if(PhysicalAddress != 0)
+			{
+				break;
+			}
+
+			chunkSize = (chunkSize / 2) & PAGE_MASK;
+		}
+
+		bool fromFrameCache = chunkSize <= PAGE_SIZE;
+		if(fromFrameCache)
+		{
+			chunkSize = PAGE_SIZE;
+			PhysicalAddress = AllocatePhysicalFrame();
+		}
+
+		if(PhysicalAddress == 0)
+		{
+			//Out of memory, give back what we took
+			if(mapped > 0)
+			{
+				UnmapRange(virtualAddress, mapped);
+			}
+			return false;
+		}
+
+		MapPages(virtualAddress + mapped, PhysicalAddress, chunkSize, writable, executable, privilegeLevel, MemoryState::RangeState::Used, pageFlags, /*tagPhysical*/ !fromFrameCache);
+
+		mapped += chunkSize;
+	}
+
+	return true;
+}
+
 void* VirtualAlloc(uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags)
 {
-	//TODO: We don't actually need a contiguous block of physical for this!
-    uint64_t PhysicalAddress = PhysicalMemoryState.FindMinimumSizeFreeBlock(ByteSize);
+	AcquireMemoryStateLock();
+
+	uint64_t VirtualAddress = FindFreeVirtualRange(ByteSize);
+
+	//Reserve the whole range up front, mapping can recurse back in here for page tables
+	VirtualMemoryState.TagRange(VirtualAddress, VirtualAddress + ByteSize, MemoryState::RangeState::Used);
+
+	if(!MapScatteredPages(VirtualAddress, ByteSize, true, false, privilegeLevel, pageFlags))
+	{
+		VirtualMemoryState.TagRange(VirtualAddress, VirtualAddress + ByteSize, MemoryState::RangeState::Free);
+		ReleaseMemoryStateLock();
+
+		return 0;
+	}
+
+	ReleaseMemoryStateLock();
+
+	//This should always succeed as we're setting the page as writable
+	*(volatile uint64_t*)VirtualAddress = 0x0;
+	_ASSERTF(*(volatile uint64_t*)VirtualAddress == 0x0, "Write to address failed");
+
+    return (void*)VirtualAddress;
+}
+
+void* VirtualAllocContiguous(uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags)
+{
+	AcquireMemoryStateLock();
+
+    uint64_t PhysicalAddress = ByteSize >= PAGE_SIZE_2MB ? PhysicalMemoryState.FindAlignedFreeBlock(ByteSize, PAGE_SIZE_2MB) : 0;
 
 	if(PhysicalAddress == 0)
 	{
+		PhysicalAddress = PhysicalMemoryState.FindMinimumSizeFreeBlock(ByteSize);
+	}
+
+	if(PhysicalAddress == 0)
+	{
+		//The frame cache may be sitting on the pages we need
+		DrainPhysicalFrameCache();
+		PhysicalAddress = PhysicalMemoryState.FindMinimumSizeFreeBlock(ByteSize);
+	}
+
+	if(PhysicalAddress == 0)
+	{
+		ReleaseMemoryStateLock();
 		_ASSERTF(PhysicalAddress == 0, "Failed to allocate");
 		return 0;
 	}
 
-    uint64_t VirtualAddress = VirtualMemoryState.FindMinimumSizeFreeBlock(ByteSize);
+    uint64_t VirtualAddress = FindFreeVirtualRange(ByteSize);
 
     MapPages(VirtualAddress, PhysicalAddress, ByteSize, true, false, privilegeLevel, MemoryState::RangeState::Used, pageFlags);
 
-	//This should always succeed as we're setting the page as writable
-	*(volatile uint64_t*)VirtualAddress = 0x0;
-	_ASSERTF(*(volatile uint64_t*)VirtualAddress == 0x0, "Write to address failed");
+	ReleaseMemoryStateLock();
 
     return (void*)VirtualAddress;
 }
 
+bool VirtualAllocAt(void* Address, uint64_t ByteSize, bool executable, PrivilegeLevel privilegeLevel, PageFlags pageFlags)
+{
+	uint64_t VirtualAddress = (uint64_t)Address;
+
+	AcquireMemoryStateLock();
+
+	VirtualMemoryState.TagRange(VirtualAddress, VirtualAddress + ByteSize, MemoryState::RangeState::Used);
+
+	bool success = MapScatteredPages(VirtualAddress, ByteSize, true, executable, privilegeLevel, pageFlags);
+	if(!success)
+	{
+		VirtualMemoryState.TagRange(VirtualAddress, VirtualAddress + ByteSize, MemoryState::RangeState::Free);
+	}
+
+	ReleaseMemoryStateLock();
+
+	return success;
+}
+
+void* VirtualAllocOnDemand(uint64_t ByteSize, PrivilegeLevel privilegeLevel)
+{
+	AcquireMemoryStateLock();
+
+	uint64_t VirtualAddress = FindFreeVirtualRange(ByteSize);
+	if(VirtualAddress != 0)
+	{
+		MapDemandZeroPages(VirtualAddress, ByteSize, true, false, privilegeLevel);
+	}
+
+	ReleaseMemoryStateLock();
+
+	return (void*)VirtualAddress;
+}
+
+void VirtualAllocOnDemandAt(void* Address, uint64_t ByteSize, bool executable, PrivilegeLevel privilegeLevel)
+{
+	uint64_t VirtualAddress = (uint64_t)Address;
+
+	AcquireMemoryStateLock();
+
+	UnmapRange(VirtualAddress, ByteSize);
+	MapDemandZeroPages(VirtualAddress, ByteSize, true, executable, privilegeLevel);
+
+	ReleaseMemoryStateLock();
+}
+
+void* VirtualReserve(uint64_t ByteSize, uint64_t Alignment)
+{
+	AcquireMemoryStateLock();
+
+	uint64_t VirtualAddress = FindFreeVirtualRange(ByteSize, Alignment);
+	if(VirtualAddress != 0)
+	{
+		VirtualMemoryState.TagRange(VirtualAddress, VirtualAddress + ByteSize, MemoryState::RangeState::Used);
+	}
+
+	ReleaseMemoryStateLock();
+
+	return (void*)VirtualAddress;
+}
+
+bool VirtualCommit(void* Address, uint64_t ByteSize, PrivilegeLevel privilegeLevel, PageFlags pageFlags)
+{
+	uint64_t VirtualAddress = (uint64_t)Address;
+
+	AcquireMemoryStateLock();
+
+	bool success = MapScatteredPages(VirtualAddress, ByteSize, true, false, privilegeLevel, pageFlags);
+	if(!success)
+	{
+		//Giving back a partial commit frees the virtual range too, but it's still the caller's
+		VirtualMemoryState.TagRange(VirtualAddress, VirtualAddress + ByteSize, MemoryState::RangeState::Used);
+	}
+
+	ReleaseMemoryStateLock();
+
+	return success;
+}
+
+void VirtualDecommit(void* Address, uint64_t ByteSize)
+{
+	uint64_t VirtualAddress = (uint64_t)Address;
+
+	AcquireMemoryStateLock();
+
+	UnmapRange(VirtualAddress, ByteSize);
+	VirtualMemoryState.TagRange(VirtualAddress, VirtualAddress + ByteSize, MemoryState::RangeState::Used);
+
+	ReleaseMemoryStateLock();
+}
+
 bool VirtualFree(void* Address, uint64_t ByteSize)
 {
-    uint64_t PhysicalAddress = GetPhysicalAddress((uint64_t)Address);
-    uint64_t VirtualAddress = (uint64_t)Address;
+	//Pages may be backed by unrelated frames so walk the page tables rather than trusting the first one
+	AcquireMemoryStateLock();
 
-    MapPages(VirtualAddress, PhysicalAddress, ByteSize, false, false, PrivilegeLevel::Kernel, MemoryState::RangeState::Free);
+	UnmapRange((uint64_t)Address, ByteSize);
+
+	ReleaseMemoryStateLock();
 
 	return true;
 }
 
 void VirtualProtect(void* Address, uint64_t ByteSize, MemoryProtection ProtectFlags, PageFlags pageFlags, PrivilegeLevel privilegeLevel)
 {
-	uint64_t PhysicalAddress = GetPhysicalAddress((uint64_t)Address);
-    uint64_t VirtualAddress = (uint64_t)Address;
-
 	bool writable = false;
 	bool executable = false;
 
@@ -59,5 +357,22 @@ void VirtualProtect(void* Address, uint64_t ByteSize, MemoryProtection ProtectFl
 			executable = true;
 	}
 
-    MapPages(VirtualAddress, PhysicalAddress, ByteSize, writable, executable, privilegeLevel, MemoryState::RangeState::Used, pageFlags);
+	BeginTlbFlushBatch();
+
+	ForEachPhysicalRun((uint64_t)Address, ByteSize,
+		[=](uint64_t runVirtual, uint64_t runPhysical, uint64_t runSize)
+		{
+			if(runPhysical == INVALID_ADDRESS)
+			{
+				_ASSERTF(IsDemandZeroPage(runVirtual), "Changing protection of unmapped memory");
+
+				//Untouched pages just pick up the new protection when they're backed
+				MapDemandZeroPages(runVirtual, runSize, writable, executable, privilegeLevel);
+				return;
+			}
+
+			MapPages(runVirtual, runPhysical, runSize, writable, executable, privilegeLevel, MemoryState::RangeState::Used, pageFlags);
+		});
+
+	EndTlbFlushBatch();
 }
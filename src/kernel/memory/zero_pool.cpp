@@ -0,0 +1,239 @@
+#include "kernel/memory/zero_pool.h"
+#include "kernel/memory/frame_cache.h"
+#include "kernel/memory/physmap.h"
+#include "kernel/memory/state.h"
+#include "kernel/init/apic.h"
+#include "kernel/init/cpuid.h"
+#include "kernel/init/interrupts.h"
+#include "kernel/scheduling/spinlock.h"
+
+//Summary of the system
+//---------------------
+// APs don't have TLS or an rpmalloc heap, so the worker never allocates anything.
+// Frames move Dirty -> Zeroed -> handed out:
+//  - Dirty: allocated by a core taking frames out of the pool, not cleared yet.
+//  - Zeroed: cleared by the worker, ready to hand out.
+// Once a batch worth has been handed out the core that notices allocates the
+// replacements, so the pool never holds more than ZERO_POOL_SIZE frames.
+//
+// With nothing to clear the worker sleeps. Where the CPU has MONITOR/MWAIT it waits on
+// DirtyCount's cache line and the next write to it wakes it. Otherwise it halts with
+// interrupts on, and whoever adds dirty frames sends it an IPI if it says it's asleep.
+
+SpinLock ZeroPoolLock;
+
+uint64_t DirtyFrames[ZERO_POOL_SIZE];
+uint64_t ZeroedFrames[ZERO_POOL_SIZE];
+alignas(64) uint64_t DirtyCount = 0; //Own cache line, the worker monitors it
+alignas(64) uint64_t ZeroedCount = 0;
+uint64_t HandedOutCount = 0; //Frames that need replacing
+
+volatile bool ZeroPoolReady = false;
+
+#define ZERO_POOL_WAKE_VECTOR 0x40
+
+bool UseMonitorWait = false;
+unsigned int ZeroPoolWorkerCpu = 0;
+bool ZeroPoolWorkerSleeping = false; //Only used without MONITOR/MWAIT
+
+ZeroPoolStats ZeroPoolCounters;
+
+// Caches are bypassed so clearing a page doesn't push the page's next user's data out of them
+static void ZeroPageNonTemporal(void* page)
+{
+	uint64_t* words = (uint64_t*)page;
+	for(uint64_t word = 0; word < PAGE_SIZE / sizeof(uint64_t); word += 4)
+	{
+		asm volatile(
+			"movnti %1, 0(%0)\n\t"
+			"movnti %1, 8(%0)\n\t"
+			"movnti %1, 16(%0)\n\t"
+			"movnti %1, 24(%0)"
+			:: "r"(words + word), "r"(0ULL) : "memory");
+	}
+}
+
+// Allocates count frames and hands them to the worker
+static void AddDirtyFrames(uint64_t count)
+{
+	uint64_t frames[ZERO_POOL_SIZE];
+
+	uint64_t allocated = 0;
+	for(; allocated < count; allocated++)
+	{
+		frames[allocated] = AllocatePhysicalFrame();
+		if(frames[allocated] == 0)
+		{
+			break;
+		}
+	}
+
+	ZeroPoolLock.Lock();
+
+	for(uint64_t frame = 0; frame < allocated; frame++)
+	{
+		DirtyFrames[DirtyCount++] = frames[frame];
+	}
+
+	//Out of memory, try again on the next refill
+	HandedOutCount += count - allocated;
+
+	ZeroPoolLock.Unlock();
+
+	//Pairs with the worker setting ZeroPoolWorkerSleeping before its last look at DirtyCount
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(allocated != 0 && __atomic_load_n(&ZeroPoolWorkerSleeping, __ATOMIC_RELAXED))
+	{
+		SendIpi(ZeroPoolWorkerCpu, ZERO_POOL_WAKE_VECTOR);
+	}
+}
+
+static uint32_t ZeroPoolWake(void* context)
+{
+	EndOfInterrupt();
+	return 0;
+}
+
+// Returns once DirtyCount might not be 0, which can be early
+static void WaitForDirtyFrames()
+{
+	if(UseMonitorWait)
+	{
+		asm volatile("monitor" :: "a"(&DirtyCount), "c"(0), "d"(0));
+
+		//Anything added before the monitor was armed wouldn't wake us
+		if(__atomic_load_n(&DirtyCount, __ATOMIC_RELAXED) == 0)
+		{
+			asm volatile("mwait" :: "a"(0), "c"(0));
+		}
+		return;
+	}
+
+	__atomic_store_n(&ZeroPoolWorkerSleeping, true, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&DirtyCount, __ATOMIC_SEQ_CST) == 0)
+	{
+		//STI holds interrupts off for one more instruction, so a wake up can't land before the HLT
+		asm volatile("sti; hlt; cli" ::: "memory");
+	}
+
+	__atomic_store_n(&ZeroPoolWorkerSleeping, false, __ATOMIC_RELAXED);
+}
+
+void InitZeroPool()
+{
+	UseMonitorWait = (CpuId(CPUID_LEAF_FEATURES).Ecx & CPUID_FEATURES_ECX_MONITOR) != 0;
+	if(!UseMonitorWait)
+	{
+		SetInterruptHandler(ZERO_POOL_WAKE_VECTOR, ZeroPoolWake, nullptr);
+	}
+
+	AddDirtyFrames(ZERO_POOL_SIZE);
+
+	ZeroPoolReady = true;
+}
+
+void RunZeroPoolWorker()
+{
+	while(!ZeroPoolReady)
+	{
+		asm volatile("pause");
+	}
+
+	ZeroPoolWorkerCpu = GetCurrentCpuIndex();
+	if(!UseMonitorWait)
+	{
+		EnableLocalApic();
+	}
+
+	while(true)
+	{
+		if(__atomic_load_n(&DirtyCount, __ATOMIC_RELAXED) == 0)
+		{
+			WaitForDirtyFrames();
+			continue;
+		}
+
+		ZeroPoolLock.Lock();
+
+		if(DirtyCount == 0)
+		{
+			ZeroPoolLock.Unlock();
+			continue;
+		}
+
+		uint64_t frame = DirtyFrames[--DirtyCount];
+
+		ZeroPoolLock.Unlock();
+
+		ZeroPageNonTemporal(PhysToVirt(frame));
+
+		//Non-temporal stores aren't ordered with the unlock, they must be visible before the frame is
+		asm volatile("sfence" ::: "memory");
+
+		ZeroPoolLock.Lock();
+
+		ZeroedFrames[ZeroedCount++] = frame;
+		ZeroPoolCounters.FramesZeroed++;
+
+		ZeroPoolLock.Unlock();
+	}
+}
+
+uint64_t AllocateZeroedFrame()
+{
+	if(!ZeroPoolReady)
+	{
+		return 0;
+	}
+
+	uint64_t flags = SaveAndDisableInterrupts();
+	ZeroPoolLock.Lock();
+
+	if(ZeroedCount == 0)
+	{
+		ZeroPoolCounters.Misses++;
+
+		ZeroPoolLock.Unlock();
+		RestoreInterrupts(flags);
+		return 0;
+	}
+
+	uint64_t frame = ZeroedFrames[--ZeroedCount];
+
+	HandedOutCount++;
+	ZeroPoolCounters.Hits++;
+
+	//Claim the batch while we hold the lock so only one core refills it
+	uint64_t refillCount = 0;
+	if(HandedOutCount >= ZERO_POOL_REFILL_BATCH)
+	{
+		refillCount = HandedOutCount;
+		HandedOutCount = 0;
+
+		ZeroPoolCounters.Refills++;
+	}
+
+	ZeroPoolLock.Unlock();
+
+	if(refillCount != 0)
+	{
+		AddDirtyFrames(refillCount);
+	}
+
+	RestoreInterrupts(flags);
+
+	return frame;
+}
+
+void GetZeroPoolStats(ZeroPoolStats& stats)
+{
+	uint64_t flags = SaveAndDisableInterrupts();
+	ZeroPoolLock.Lock();
+
+	stats = ZeroPoolCounters;
+	stats.ZeroedFrames = ZeroedCount;
+
+	ZeroPoolLock.Unlock();
+	RestoreInterrupts(flags);
+}
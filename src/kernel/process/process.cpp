@@ -1,13 +1,19 @@
 #include "memory/memory.h"
 #include "utilities/termination.h"
 #include "kernel/init/gdt.h"
+#include "kernel/init/cpuid.h"
+#include "kernel/init/fpu.h"
 #include "kernel/init/tls.h"
 #include "kernel/memory/state.h"
+#include "kernel/memory/pml4.h"
 #include "memory/virtual.h"
 #include "common/string.h"
 #include <rpmalloc.h>
+#include "kernel/memory/slab.h"
 #include "kernel/user_mode/elf.h"
+#include "kernel/user_mode/syscall.h"
 #include "elf.h"
+#include "errno.h"
 
 extern EnvironmentKernel* GKernelEnvironment;
 
@@ -15,6 +21,17 @@ int GELFBinaryCount = 0;
 ElfBinary** GELFBinaries = nullptr;
 
 Process* GCurrentProcess = nullptr;
+uint64_t NextPid = 1;
+
+// Everything that has to be put back when a process run from inside another one exits
+struct UserModeContext
+{
+	Process* PreviousProcess;
+	uint64_t KernelRBP;
+	uint64_t KernelRSP;
+	uint64_t SyscallStack;
+	uint64_t UserFSBase;
+};
 
 void InitializeUserMode()
 {
@@ -25,26 +42,119 @@ void InitializeUserMode()
 //TODO: Digest https://gist.github.com/x0nu11byt3/bcb35c3de461e5fb66173071a2379779
 
 extern "C" void SwitchToUserMode(uint64_t stackPointer, uint64_t entry, uint16_t userModeCS, uint16_t userModeDS);
+extern "C" void ResumeUserModeFromSyscall(SyscallFrame* frame, uint64_t rip, uint64_t stackPointer);
 
-void ScheduleProcess(Process* process)
+// resetRegisters starts the process with clean vector registers, a forked child keeps its parent's
+static void EnterProcess(Process* process, UserModeContext& context, bool resetRegisters)
 {
-	const uint16_t userModeCodeSelector = ((uint16_t)GDTEntryIndex::UserCode * sizeof(GDTEntry)) | 0x3; // Selector | Ring 3
-	const uint16_t userModeDataSelector = ((uint16_t)GDTEntryIndex::UserData * sizeof(GDTEntry)) | 0x3;
+	if (GCurrentProcess)
+	{
+		SaveExtendedState(GCurrentProcess->ExtendedState);
+	}
+
+	if (resetRegisters)
+	{
+		ResetExtendedState();
+	}
+
+	context.PreviousProcess = GCurrentProcess;
+	context.KernelRBP = GKernelEnvironment->KernelRBP;
+	context.KernelRSP = GKernelEnvironment->KernelRSP;
+	context.SyscallStack = GKernelEnvironment->SyscallStack;
+	context.UserFSBase = GetUserFSBase();
 
 	GCurrentProcess = process;
 
+	//A process started from a syscall mustn't reuse the stack that syscall is still running on
+	GKernelEnvironment->SyscallStack = process->SyscallStackBase + SYSCALL_STACK_SIZE;
+
 	SetUserFSBase((uint64_t)process->TLS->FSBase);
 	SetUserGS();
-	
-	SwitchToUserMode((uint64_t)process->DefaultThreadStackStart, process->Binary->Entry, userModeCodeSelector, userModeDataSelector);
+}
+
+static void LeaveProcess(const UserModeContext& context)
+{
+	Process* previous = context.PreviousProcess;
+
+	if (previous)
+	{
+		RestoreExtendedState(previous->ExtendedState);
+	}
+
+	GKernelEnvironment->KernelRBP = context.KernelRBP;
+	GKernelEnvironment->KernelRSP = context.KernelRSP;
+	GKernelEnvironment->SyscallStack = context.SyscallStack;
+	SetUserFSBase(context.UserFSBase);
 
 	ReloadDataSegments();
 	SetKernelGSBase((uint64_t)GKernelEnvironment);
 	SetFSBase(GKernelEnvironment->FSBase);
 
-	GCurrentProcess = nullptr;
+	GCurrentProcess = previous;
 }
 
+void ScheduleProcess(Process* process)
+{
+	const uint16_t userModeCodeSelector = ((uint16_t)GDTEntryIndex::UserCode * sizeof(GDTEntry)) | 0x3; // Selector | Ring 3
+	const uint16_t userModeDataSelector = ((uint16_t)GDTEntryIndex::UserData * sizeof(GDTEntry)) | 0x3;
+
+	UserModeContext context;
+	EnterProcess(process, context, true);
+	
+	SwitchToUserMode((uint64_t)process->DefaultThreadStackStart, process->Binary->Entry, userModeCodeSelector, userModeDataSelector);
+
+	LeaveProcess(context);
+}
+
+static void RecordExitedChild(Process* parent, Process* child)
+{
+	if (parent == nullptr)
+	{
+		return;
+	}
+
+	//Nobody's waiting on the oldest, make room
+	if (parent->ExitedChildCount == MAX_UNREAPED_CHILDREN)
+	{
+		memmove(parent->ExitedChildPids, parent->ExitedChildPids + 1, (MAX_UNREAPED_CHILDREN - 1) * sizeof(uint64_t));
+		memmove(parent->ExitedChildCodes, parent->ExitedChildCodes + 1, (MAX_UNREAPED_CHILDREN - 1) * sizeof(int64_t));
+		parent->ExitedChildCount--;
+	}
+
+	parent->ExitedChildPids[parent->ExitedChildCount] = child->Pid;
+	parent->ExitedChildCodes[parent->ExitedChildCount] = child->ExitCode;
+	parent->ExitedChildCount++;
+}
+
+bool ReapExitedChild(Process* process, int64_t pid, uint64_t& childPid, int64_t& exitCode)
+{
+	for (uint32_t child = 0; child < process->ExitedChildCount; child++)
+	{
+		if (pid != -1 && process->ExitedChildPids[child] != (uint64_t)pid)
+		{
+			continue;
+		}
+
+		childPid = process->ExitedChildPids[child];
+		exitCode = process->ExitedChildCodes[child];
+
+		process->ExitedChildCount--;
+		memmove(process->ExitedChildPids + child, process->ExitedChildPids + child + 1, (process->ExitedChildCount - child) * sizeof(uint64_t));
+		memmove(process->ExitedChildCodes + child, process->ExitedChildCodes + child + 1, (process->ExitedChildCount - child) * sizeof(int64_t));
+
+		return true;
+	}
+
+	return false;
+}
+
+#ifndef AT_MINSIGSTKSZ
+#define AT_MINSIGSTKSZ 51
+#endif
+
+// A signal frame's siginfo, ucontext and alignment, on top of the XSAVE area it carries
+#define SIGNAL_FRAME_OVERHEAD 1024
+
 uint64_t* WriteAuxEntry(uint64_t* stackPointer, uint64_t auxEntry, uint64_t auxValue, bool dryRun)
 {
 	stackPointer -= 2;
@@ -65,6 +175,11 @@ uint64_t* WriteProcessAuxVectors(Process* process, uint64_t* stackPointer, bool
 
 	stackPointer = WriteAuxEntry(stackPointer, AT_RANDOM, (uint64_t)stackCookie, dryRun); //TODO make actually random
 
+	//As Linux reports them on x86-64. HWCAP2 only has ring 3 MWAIT and FSGSBASE, neither of which are enabled
+	stackPointer = WriteAuxEntry(stackPointer, AT_HWCAP, CpuId(CPUID_LEAF_FEATURES).Edx, dryRun);
+	stackPointer = WriteAuxEntry(stackPointer, AT_HWCAP2, 0, dryRun);
+	stackPointer = WriteAuxEntry(stackPointer, AT_MINSIGSTKSZ, GetExtendedStateSize() + SIGNAL_FRAME_OVERHEAD, dryRun);
+
 	if (process->SubBinary)
 	{
 		stackPointer = WriteAuxEntry(stackPointer, AT_ENTRY, process->SubBinary->Entry, dryRun);
@@ -86,15 +201,20 @@ uint64_t* WriteProcessAuxVectors(Process* process, uint64_t* stackPointer, bool
 	return stackPointer;
 }
 
+TypedSlabCache<Process> ProcessCache("Process");
+
 Process* CreateProcess(const char16_t* programName, const char16_t** argv, const char16_t** envp)
 {
-	Process* process = (Process*)rpmalloc(sizeof(Process));
+	Process* process = ProcessCache.Alloc();
 	memset(process, 0, sizeof(Process));
 
-	process->DefaultThreadStackSize = 128 * 1024;
-	process->DefaultThreadStackBase = (uint64_t)VirtualAlloc(process->DefaultThreadStackSize, PrivilegeLevel::User);
+	process->Pid = NextPid++;
+	process->Parent = GCurrentProcess;
+	process->SyscallStackBase = (uint64_t)VirtualAlloc(SYSCALL_STACK_SIZE, PrivilegeLevel::Kernel);
+	process->ExtendedState = AllocateExtendedState();
 
-	FillUnique((void*)process->DefaultThreadStackBase, 0x57a0000000000000, process->DefaultThreadStackSize);
+	process->DefaultThreadStackSize = 128 * 1024;
+	process->DefaultThreadStackBase = (uint64_t)VirtualAllocOnDemand(process->DefaultThreadStackSize, PrivilegeLevel::User);
 	
 	process->Binary = LoadElf(programName);
 
@@ -222,6 +342,19 @@ Process* CreateProcess(const char16_t* programName, const char16_t** argv, const
 
 void DestroyProcess(Process* process)
 {
+	VirtualFree((void*)process->SyscallStackBase, SYSCALL_STACK_SIZE);
+	process->SyscallStackBase = 0;
+
+	FreeExtendedState(process->ExtendedState);
+	process->ExtendedState = nullptr;
+
+	//Everything else belongs to the parent
+	if (process->SharesParentMemory)
+	{
+		ProcessCache.Free(process);
+		return;
+	}
+
 	VirtualFree((void*)process->DefaultThreadStackBase, process->DefaultThreadStackSize);
 	process->DefaultThreadStackBase = 0;
 
@@ -231,7 +364,7 @@ void DestroyProcess(Process* process)
 	UnloadElf(process->Binary);
 	process->Binary = nullptr;
 
-	rpfree(process);
+	ProcessCache.Free(process);
 }
 
 int RunProgram(const char16_t* programName, const char16_t** argv, const char16_t** envp)
@@ -240,8 +373,67 @@ int RunProgram(const char16_t* programName, const char16_t** argv, const char16_
 
 	if (process)
 	{
+		RecordExitedChild(process->Parent, process);
 		DestroyProcess(process);
 	}
 
 	return 0; //TODO
 }
+
+int64_t ForkProcess(bool copyOnWrite, uint64_t childStackPointer, int* parentTid, int* childTid)
+{
+	Process* parent = GCurrentProcess;
+
+	//Has to be found before the child's syscall stack replaces the parent's
+	SyscallFrame frame = *(SyscallFrame*)((GKernelEnvironment->SyscallStack & ~0xFULL) - sizeof(SyscallFrame));
+
+	//SyscallDispatcher pushed the return address onto the user stack
+	uint64_t rip = *(uint64_t*)frame.Rsp;
+	if (childStackPointer == 0)
+	{
+		childStackPointer = frame.Rsp + sizeof(uint64_t);
+	}
+
+	Process* child = ProcessCache.Alloc();
+	memcpy(child, parent, sizeof(Process));
+
+	child->Pid = NextPid++;
+	child->ExitCode = 0;
+	child->Parent = parent;
+	child->SharesParentMemory = true;
+	child->ExitedChildCount = 0;
+	child->SyscallStackBase = (uint64_t)VirtualAlloc(SYSCALL_STACK_SIZE, PrivilegeLevel::Kernel);
+	child->ExtendedState = AllocateExtendedState();
+
+	if (parentTid)
+	{
+		*parentTid = (int)child->Pid;
+	}
+
+	//Only page tables are touched here, pages are copied as the child writes to them
+	CopyOnWriteSnapshot* snapshot = copyOnWrite ? BeginCopyOnWriteSnapshot() : nullptr;
+
+	if (childTid)
+	{
+		*childTid = (int)child->Pid;
+	}
+
+	UserModeContext context;
+	EnterProcess(child, context, false);
+
+	ResumeUserModeFromSyscall(&frame, rip, childStackPointer);
+
+	LeaveProcess(context);
+
+	if (snapshot)
+	{
+		EndCopyOnWriteSnapshot(snapshot);
+	}
+
+	uint64_t pid = child->Pid;
+
+	RecordExitedChild(parent, child);
+	DestroyProcess(child);
+
+	return pid;
+}
@@ -1,6 +0,0 @@
-section .text
-global _rdtsc
-
-_rdtsc:
-    rdtsc
-    ret
@@ -1,5 +1,6 @@
 #include "kernel/scheduling/time.h"
 #include "kernel/init/msr.h"
+#include "kernel/init/alternatives.h"
 #include "kernel/init/interrupts.h"
 #include "kernel/console/console.h"
 #include "common/string.h"
@@ -14,6 +15,17 @@ uint64_t HpetTicksPerNanosecond;
 
 extern void WaitForPIT(uint64_t microseconds);
 
+extern "C" KERNEL_API uint64_t _rdtsc()
+{
+	uint32_t low;
+	uint32_t high;
+
+	//Either way the count isn't taken until the instructions before it are done
+	asm volatile(ALTERNATIVE("lfence\n\trdtsc", "rdtscp", STATIC_KEY_RDTSCP) : "=a"(low), "=d"(high) :: "rcx", "memory");
+
+	return ((uint64_t)high << 32) | low;
+}
+
 uint64_t GetCalibrationHPETSampleNS(bool warmUp)
 {
 	uint64_t DelayInMS = warmUp ? 1 : 50;
@@ -114,6 +126,17 @@ void InitHPET(EFI_ACPI_HIGH_PRECISION_EVENT_TIMER_TABLE_HEADER* Header)
 	//ConsolePrint(u"\n");
 }
 
+uint64_t HpetGetNanoseconds()
+{
+	uint64_t Ticks = *HpetCounter;
+
+	//Split to avoid overflowing the multiply
+	uint64_t Seconds = Ticks / HpetTicksPerNanosecond;
+	uint64_t Remainder = Ticks % HpetTicksPerNanosecond;
+
+	return (Seconds * 1000000000ULL) + ((Remainder * 1000000000ULL) / HpetTicksPerNanosecond);
+}
+
 void HpetSleepNS(uint64_t nanoseconds)
 {
 	uint64_t Start = *HpetCounter;
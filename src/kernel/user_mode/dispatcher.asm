@@ -36,6 +36,8 @@ SyscallDispatcher:
     push r12
     push r14
     push r15
+    push rbx
+    push r13
 
 	; Prepare the ABI for Sys-V and make registers align with calling convention
 	mov rcx, r10
@@ -53,6 +55,8 @@ SyscallDispatcher:
 .dispatch:
 	call [r12]
 	
+	pop r13
+	pop rbx
 	pop r15
 	pop r14
 	pop r12
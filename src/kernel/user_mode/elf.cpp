@@ -9,6 +9,7 @@
 #include "kernel/user_mode/elf.h"
 #include "kernel/user_mode/ehframe.h"
 #include <rpmalloc.h>
+#include "kernel/memory/slab.h"
 
 #include "fs/volume.h"
 
@@ -29,6 +30,8 @@
 extern int GELFBinaryCount;
 extern ElfBinary** GELFBinaries;
 
+TypedSlabCache<ElfBinary> ElfBinaryCache("ElfBinary");
+
 //TODO: Digest https://gist.github.com/x0nu11byt3/bcb35c3de461e5fb66173071a2379779
 
 // NOTE: These look a bit weird, but we need to access the parameters from the debugger
@@ -212,7 +215,7 @@ ElfBinary* LoadElfFromMemory(const char16_t* programName, const uint8_t* elfStar
 		}
 	}
 
-	ElfBinary* elfBinary = (ElfBinary*)rpmalloc(sizeof(ElfBinary));
+	ElfBinary* elfBinary = ElfBinaryCache.Alloc();
 	memset(elfBinary, 0, sizeof(ElfBinary));
 
 	strcpy(elfBinary->Name, programName);
@@ -335,7 +338,8 @@ ElfBinary* LoadElfFromMemory(const char16_t* programName, const uint8_t* elfStar
 
 	_ASSERTF(allocatedSize != 0, "No loadable segments in ELF file");
 	
-	uint64_t programStart = (uint64_t)VirtualAlloc(allocatedSize, PrivilegeLevel::User);
+	//Only the pages the segments are copied into get backed up front, bss and the program break fill in as they're used
+	uint64_t programStart = (uint64_t)VirtualAllocOnDemand(allocatedSize, PrivilegeLevel::User);
 
 	elfBinary->ProgramHeaderCount = elfHeader->e_phnum;
 	elfBinary->ProgramHeaderEntrySize = sizeof(Elf64_Phdr);
@@ -379,8 +383,8 @@ ElfBinary* LoadElfFromMemory(const char16_t* programName, const uint8_t* elfStar
 			text_section = vaddr;
 		}
 
+		//The rest of p_memsz is already zero
 		memcpy((void*)vaddr, elfStart + segment.p_offset, segment.p_filesz);
-		memset((uint8_t*)vaddr + segment.p_filesz, 0, segment.p_memsz - segment.p_filesz);
 	}
 
 #if 0
@@ -706,6 +710,6 @@ void UnloadElf(ElfBinary* elfBinary)
 
 		VirtualFree((void*)elfBinary->BaseAddress, elfBinary->AllocatedSize);
 
-		rpfree(elfBinary);
+		ElfBinaryCache.Free(elfBinary);
 	}
 }
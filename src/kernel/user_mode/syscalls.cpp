@@ -24,6 +24,7 @@
 #include <sys/time.h>
 
 #include "kernel/memory/pml4.h"
+#include "kernel/memory/page_cache.h"
 #include "kernel/process/process.h"
 
 #include "kernel/framebuffer/framebuffer.h"
@@ -40,9 +41,19 @@ extern KernelBootData GBootData;
 
 #define ARCH_CET_STATUS 0x3001
 
+#define PROT_WRITE	0x2
+#define PROT_EXEC	0x4
+
+#define CLONE_VM	0x00000100
+#define CLONE_VFORK	0x00004000
+#define CLONE_THREAD	0x00010000
+#define CLONE_SETTLS	0x00080000
+#define CLONE_PARENT_SETTID	0x00100000
+#define CLONE_CHILD_SETTID	0x01000000
+
 extern Process* GCurrentProcess;
 
-extern MemoryState PhysicalMemoryState;
+extern PhysicalMemoryStateType PhysicalMemoryState;
 
 extern EnvironmentKernel* GKernelEnvironment;
 
@@ -239,6 +250,8 @@ void sys_exit(int64_t exitCode)
 	ConsolePrint(u"\n");
 //#endif
 
+	GCurrentProcess->ExitCode = exitCode;
+
 	ReturnToKernel();
 }
 
@@ -273,7 +286,7 @@ void* sys_memory_map(void *address,size_t length,int prot,int flags,int fd, uint
 
 		while (next_address < end_address)
 		{
-			if (GetPhysicalAddress((uint64_t)next_address) != INVALID_ADDRESS)
+			if (GetPhysicalAddress((uint64_t)next_address) != INVALID_ADDRESS || IsDemandZeroPage((uint64_t)next_address) || IsFileBackedPage((uint64_t)next_address))
 			{
 				next_address += PAGE_SIZE;
 			}
@@ -285,12 +298,7 @@ void* sys_memory_map(void *address,size_t length,int prot,int flags,int fd, uint
 
 		//All available
 		
-		//TODO: We don't actually need a contiguous block of physical for this!
-		uint64_t PhysicalAddress = PhysicalMemoryState.FindMinimumSizeFreeBlock(alignedSize);
-
-		//TODO
-		MapPages((uint64_t)address, PhysicalAddress, alignedSize, /*writable*/true, /*executable*/true, PrivilegeLevel::User, MemoryState::RangeState::Used);
-		FillUnique((void*)address, 0x7FFFFFFF0000, alignedSize);
+		VirtualAllocOnDemandAt(address, alignedSize, /*executable*/true, PrivilegeLevel::User);
 	}
 
 	//EPIC BODGE
@@ -304,16 +312,19 @@ void* sys_memory_map(void *address,size_t length,int prot,int flags,int fd, uint
 
 	if (fd == -1)
 	{
-		void* memory = address != nullptr ? address : VirtualAlloc(alignedSize, PrivilegeLevel::User);
-		memset(memory, 0, alignedSize);
-		return memory;
+		//Pages are zeroed as they're first touched
+		return address != nullptr ? address : VirtualAllocOnDemand(alignedSize, PrivilegeLevel::User);
 	}
 
 	if (fd > 0)
 	{
-		void* memory = address != nullptr ? address : VirtualAlloc(AlignSize(length, PAGE_SIZE), PrivilegeLevel::User);
+		void* memory = address != nullptr ? address : VirtualAllocOnDemand(alignedSize, PrivilegeLevel::User);
 
-		VolumeRead(fd, offset, memory, length);
+		//Pages are read in as they're first touched, unless the volume can't share them
+		if (!MapFileLazily(fd, memory, alignedSize, offset, (prot & PROT_WRITE) != 0, (prot & PROT_EXEC) != 0))
+		{
+			VolumeRead(fd, offset, memory, length);
+		}
 
 		return memory;
 	}
@@ -558,8 +569,49 @@ int sys_set_tid_address(int* tidptr)
 
 int sys_getpid()
 {
-	//TODO
-	return 1;
+	return (int)GCurrentProcess->Pid;
+}
+
+int64_t sys_clone(uint64_t flags, uint64_t newStack, int* parentTid, int* childTid, uint64_t tls)
+{
+	//Threads need a scheduler to run alongside the rest of the process
+	if ((flags & (CLONE_THREAD | CLONE_SETTLS)) || ((flags & CLONE_VM) && !(flags & CLONE_VFORK)))
+	{
+		return -ENOSYS;
+	}
+
+	return ForkProcess((flags & CLONE_VM) == 0, newStack,
+		(flags & CLONE_PARENT_SETTID) ? parentTid : nullptr,
+		(flags & CLONE_CHILD_SETTID) ? childTid : nullptr);
+}
+
+int64_t sys_fork()
+{
+	return ForkProcess(true, 0, nullptr, nullptr);
+}
+
+int64_t sys_vfork()
+{
+	//The parent stays suspended until the child exits, so there's nothing to protect it from
+	return ForkProcess(false, 0, nullptr, nullptr);
+}
+
+int64_t sys_wait4(int64_t pid, int* status, int options, void* rusage)
+{
+	//Children run to completion before fork returns, so they've always exited by now
+	uint64_t childPid = 0;
+	int64_t exitCode = 0;
+	if (!ReapExitedChild(GCurrentProcess, pid, childPid, exitCode))
+	{
+		return -ECHILD;
+	}
+
+	if (status)
+	{
+		*status = (int)((exitCode & 0xFF) << 8);
+	}
+
+	return (int64_t)childPid;
 }
 
 int sys_clock_nanosleep(const clockid_t which_clock, int flags, const struct timespec* rqtp, struct timespec* rmtp)
@@ -639,13 +691,13 @@ void* SyscallTable[SYSCALL_MAX] =
 	(void*)sys_not_implemented, // NotImplemented53,
 	(void*)sys_not_implemented, // NotImplemented54,
 	(void*)sys_not_implemented, // NotImplemented55,
-	(void*)sys_not_implemented, // NotImplemented56,
-	(void*)sys_not_implemented, // NotImplemented57,
-	(void*)sys_not_implemented, // NotImplemented58,
+	(void*)sys_clone, // 56,
+	(void*)sys_fork, // 57,
+	(void*)sys_vfork, // 58,
 	(void*)sys_execve, // 59,
 	
 	(void*)sys_exit,			// 60,
-	(void*)sys_not_implemented, // NotImplemented61,
+	(void*)sys_wait4, // 61,
 	(void*)sys_not_implemented, // NotImplemented62,
 	(void*)sys_uname,			// 63,
 	(void*)sys_not_implemented, // NotImplemented64,
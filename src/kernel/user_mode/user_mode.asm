@@ -4,6 +4,7 @@ extern GKernelEnvironment
 extern GetGS
 
 global SwitchToUserMode
+global ResumeUserModeFromSyscall
 global ReturnToKernel
 global LoadFS
 global MaybeSwapGS
@@ -90,7 +91,7 @@ SwitchToUserMode:
 	mov r13, 0
 	mov r14, 0
 	mov r15, 0
-	; TODO XMM registers
+	; Vector registers were reset by EnterProcess
 
 	swapgs
 
@@ -100,6 +101,68 @@ SwitchToUserMode:
     ; Switch to user mode by performing a far return
     iretq
 
+ResumeUserModeFromSyscall:
+	;   rdi - SyscallFrame* frame (user registers saved by SyscallDispatcher)
+	;   rsi - uint64_t rip (user mode address to return to)
+	;	rdx - uint64_t stackPointer (user mode stack pointer)
+
+	; Same as SwitchToUserMode, ReturnToKernel comes back here
+	push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+	push r15
+    pushfq
+
+	mov [gs:24], rbp ; KernelRBP
+	mov [gs:32], rsp ; KernelRSP
+
+    ; Clear the direction flag
+    cld
+
+	; Nothing can interrupt us while we're on the user stack with the kernel GS
+	cli
+
+	mov rax, rdi
+	mov rcx, rsi ; sysret takes RIP from rcx
+	mov r10, rdx
+
+	; Layout matches the pushes in SyscallDispatcher
+	mov r13, [rax + 0]
+	mov rbx, [rax + 8]
+	mov r15, [rax + 16]
+	mov r14, [rax + 24]
+	mov r12, [rax + 32]
+	mov r9, [rax + 48]
+	mov r8, [rax + 56]
+	mov rdi, [rax + 64]
+	mov rsi, [rax + 72]
+	mov rdx, [rax + 80]
+	mov rbp, [rax + 88]
+	mov r11, [rax + 96] ; RFLAGS, sysret takes them from r11
+
+	mov rsp, r10
+	mov r10, 0
+
+	; The syscall returns 0 in the new process
+	mov rax, 0
+
+	swapgs
+
+	; Reload FSBase
+	call LoadFS
+
+	o64 sysret
+
 ReturnToKernel:
 
 	mov rbp, [gs:24]
@@ -81,6 +81,60 @@ void __attribute__((used, noinline)) PrintStackTrace(int maxFrames, uint64_t sta
 	}
 }
 
+int __attribute__((noinline)) CaptureStackTrace(uint64_t* frames, int maxFrames, int skipFrames)
+{
+	StackFrame* Top = GetCurrentStackFrame();
+
+	//Only look the page up when the walk crosses into a new one, this runs on every allocation when profiling
+	uint64_t checkedPage = 0;
+
+	int count = 0;
+	while(count < maxFrames)
+	{
+		if(		Top == nullptr
+			||	((uint64_t)Top & (sizeof(uint64_t) - 1)) != 0)
+		{
+			break;
+		}
+
+		uint64_t page = (uint64_t)Top & ~(uint64_t)(PAGE_SIZE - 1);
+		uint64_t lastPage = ((uint64_t)Top + sizeof(StackFrame) - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+		if(page != checkedPage || lastPage != checkedPage)
+		{
+			if(		(uint64_t)GetPhysicalAddress(page) == INVALID_ADDRESS
+				||	(uint64_t)GetPhysicalAddress(lastPage) == INVALID_ADDRESS)
+			{
+				break;
+			}
+			checkedPage = lastPage;
+		}
+
+		if(Top->RIP == 0)
+		{
+			break;
+		}
+
+		if(skipFrames > 0)
+		{
+			skipFrames--;
+		}
+		else
+		{
+			frames[count++] = Top->RIP;
+		}
+
+		//Stacks grow down, so anything else is a corrupt or foreign chain
+		if(Top->RBP <= Top)
+		{
+			break;
+		}
+
+		Top = Top->RBP;
+	}
+
+	return count;
+}
+
 void KERNEL_NORETURN AssertionFailed(const char* expression, const char* message, const char* filename, size_t lineNumber, uint64_t v1, uint64_t v2, uint64_t v3)
 {
     char16_t messageBuffer[2048];